@@ -18,6 +18,27 @@ AC_DEFUN([CC_ATTRIBUTE_PRINTF], [
     fi
 ])
 
+AC_DEFUN([CC_ATTRIBUTE_DESTRUCTOR], [
+    AC_CACHE_CHECK([whether compiler supports __attribute__((destructor))],
+                ph_cv_attribute_destructor,
+                [AC_COMPILE_IFELSE(
+                        [AC_LANG_SOURCE(
+                            [static void fini(void) __attribute__ ((destructor));
+                             static void fini(void) { }]
+                        )],
+                        [ph_cv_attribute_destructor=yes],
+                        [
+                            AC_MSG_RESULT([no])
+                            AC_MSG_WARN([compiler does NOT support __attribute__((destructor))])
+                        ])
+                ])
+
+    if test x"$ph_cv_attribute_destructor" = xyes ; then
+    AC_DEFINE(HAVE_FUNCTION_ATTRIBUTE_DESTRUCTOR, 1,
+                [whether compiler supports __attribute__((destructor))])
+    fi
+])
+
 AC_DEFUN([CC_THREAD_KW], [
     AC_CACHE_CHECK([whether compiler supports __thread],
                    ph_cv_thread_kw,
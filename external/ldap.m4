@@ -50,6 +50,7 @@ AC_DEFUN([AM_CHECK_OPENLDAP],
 
     LIBS="$LIBS $OPENLDAP_LIBS"
     AC_CHECK_FUNCS([ldap_initialize ldap_start_tls ldap_str2dn ldap_dnfree ldapssl_client_init])
+    AC_CHECK_FUNCS([ldap_get_attribute_ber])
 
     CFLAGS=$SAVE_CFLAGS
     LIBS=$SAVE_LIBS
@@ -69,8 +69,10 @@ rm -f $RPM_BUILD_ROOT/%{security_parent_dir}/security/*.la
 %defattr(-,root,root,-)
 %doc README* COPYING* ChangeLog NEWS
 %{security_parent_dir}/security/pam_hbac.so
+%{_sbindir}/pam_hbac_cachectl
 %{_mandir}/man5/pam_hbac.conf.5*
 %{_mandir}/man8/pam_hbac.8*
+%{_mandir}/man8/pam_hbac_cachectl.8*
 %dir %{_datadir}/doc/pam_hbac
 %{_datadir}/doc/pam_hbac/COPYING
 %{_datadir}/doc/pam_hbac/README.AIX
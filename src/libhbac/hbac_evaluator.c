@@ -356,6 +356,873 @@ static errno_t hbac_evaluate_element(struct hbac_rule_element *rule_el,
     return EOK;
 }
 
+/* Case folded keys
+ *
+ * The compiled rules fold every member once into a struct hbac_key that
+ * carries the length and hash of the folded form. Two members whose keys
+ * are both valid compare equal exactly when sss_utf8_case_eq() would
+ * report a match, so the keys can be compared with memcmp().
+ */
+
+struct hbac_key {
+    /* NUL-terminated case folded name or NULL if the name is not UTF-8 */
+    uint8_t *folded;
+    size_t len;
+    uint64_t hash;
+};
+
+#define HBAC_FNV64_OFFSET 0xcbf29ce484222325ULL
+#define HBAC_FNV64_PRIME  0x100000001b3ULL
+
+static uint64_t hbac_key_hash(const uint8_t *key, size_t len)
+{
+    uint64_t h = HBAC_FNV64_OFFSET;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= key[i];
+        h *= HBAC_FNV64_PRIME;
+    }
+
+    return h;
+}
+
+static errno_t hbac_key_init(struct hbac_key *key, const char *name)
+{
+    errno = 0;
+    key->folded = sss_utf8_casefold((const uint8_t *) name, strlen(name),
+                                    &key->len);
+    if (key->folded == NULL) {
+        if (errno == ENOMEM) return ENOMEM;
+        /* Not valid UTF-8, comparisons will report the error */
+        key->len = 0;
+        key->hash = 0;
+        return EOK;
+    }
+
+    key->hash = hbac_key_hash(key->folded, key->len);
+    return EOK;
+}
+
+/* Symbol tables
+ *
+ * A compiled rule set gives every distinct case folded member of its
+ * rules a dense 32-bit ID. The symbols are kept in parallel arrays of
+ * hashes, offsets and lengths by ID into a single table of case folded
+ * strings, and an open addressing table of IDs finds them by hash. The
+ * indexes of the rule elements are arrays of sorted rule ID lists by
+ * symbol ID, so every member of a request is looked up by hash once and
+ * its rules are found with an array access.
+ */
+
+struct hbac_symtab {
+    /* Per symbol ID */
+    uint64_t *hashes;
+    uint32_t *offs;
+    uint32_t *lens;
+    uint32_t count;
+    uint32_t alloc;
+
+    uint8_t *strings;
+    size_t strings_len;
+    size_t strings_size;
+
+    /* ID + 1 of the symbol in each slot, 0 for an empty slot */
+    uint32_t *slots;
+    size_t size;
+};
+
+static void hbac_symtab_clear(struct hbac_symtab *symtab)
+{
+    free(symtab->hashes);
+    free(symtab->offs);
+    free(symtab->lens);
+    free(symtab->strings);
+    free(symtab->slots);
+    memset(symtab, 0, sizeof(struct hbac_symtab));
+}
+
+static uint32_t *hbac_symtab_slot(const struct hbac_symtab *symtab,
+                                  uint32_t *slots,
+                                  size_t size,
+                                  const struct hbac_key *key)
+{
+    uint32_t id;
+    size_t i;
+
+    for (i = key->hash & (size - 1); ; i = (i + 1) & (size - 1)) {
+        if (slots[i] == 0) return &slots[i];
+
+        id = slots[i] - 1;
+        if (symtab->hashes[id] == key->hash
+                && symtab->lens[id] == key->len
+                && memcmp(symtab->strings + symtab->offs[id],
+                          key->folded, key->len) == 0) {
+            return &slots[i];
+        }
+    }
+}
+
+static bool hbac_symtab_find(const struct hbac_symtab *symtab,
+                             const struct hbac_key *key,
+                             uint32_t *_id)
+{
+    uint32_t *slot;
+
+    if (symtab->size == 0) return false;
+
+    slot = hbac_symtab_slot(symtab, symtab->slots, symtab->size, key);
+    if (*slot == 0) return false;
+
+    *_id = *slot - 1;
+    return true;
+}
+
+static errno_t hbac_symtab_grow(struct hbac_symtab *symtab)
+{
+    struct hbac_key key;
+    uint32_t *slots;
+    size_t size;
+    uint32_t id;
+
+    size = symtab->size ? symtab->size * 2 : 64;
+    slots = calloc(size, sizeof(uint32_t));
+    if (!slots) return ENOMEM;
+
+    for (id = 0; id < symtab->count; id++) {
+        key.folded = symtab->strings + symtab->offs[id];
+        key.len = symtab->lens[id];
+        key.hash = symtab->hashes[id];
+        *hbac_symtab_slot(symtab, slots, size, &key) = id + 1;
+    }
+
+    free(symtab->slots);
+    symtab->slots = slots;
+    symtab->size = size;
+    return EOK;
+}
+
+static errno_t hbac_symtab_reserve(struct hbac_symtab *symtab, size_t len)
+{
+    uint64_t *hashes;
+    uint32_t *offs;
+    uint32_t *lens;
+    uint8_t *strings;
+    uint32_t alloc;
+    size_t size;
+
+    if (symtab->count == symtab->alloc) {
+        alloc = symtab->alloc ? symtab->alloc * 2 : 64;
+
+        hashes = realloc(symtab->hashes, alloc * sizeof(uint64_t));
+        if (!hashes) return ENOMEM;
+        symtab->hashes = hashes;
+
+        offs = realloc(symtab->offs, alloc * sizeof(uint32_t));
+        if (!offs) return ENOMEM;
+        symtab->offs = offs;
+
+        lens = realloc(symtab->lens, alloc * sizeof(uint32_t));
+        if (!lens) return ENOMEM;
+        symtab->lens = lens;
+
+        symtab->alloc = alloc;
+    }
+
+    if (symtab->strings_len + len + 1 > symtab->strings_size) {
+        size = symtab->strings_size ? symtab->strings_size : 1024;
+        while (size < symtab->strings_len + len + 1) size *= 2;
+
+        strings = realloc(symtab->strings, size);
+        if (!strings) return ENOMEM;
+
+        symtab->strings = strings;
+        symtab->strings_size = size;
+    }
+
+    return EOK;
+}
+
+/* Returns the ID of key, adding it to the table if needed */
+static errno_t hbac_symtab_intern(struct hbac_symtab *symtab,
+                                  const struct hbac_key *key,
+                                  uint32_t *_id)
+{
+    uint32_t id;
+    errno_t ret;
+
+    if (hbac_symtab_find(symtab, key, _id)) return EOK;
+
+    if (symtab->count == UINT32_MAX - 1
+            || symtab->strings_len + key->len + 1 > UINT32_MAX) {
+        return ERANGE;
+    }
+
+    if (((size_t) symtab->count + 1) * 2 > symtab->size) {
+        ret = hbac_symtab_grow(symtab);
+        if (ret != EOK) return ret;
+    }
+
+    ret = hbac_symtab_reserve(symtab, key->len);
+    if (ret != EOK) return ret;
+
+    id = symtab->count++;
+    symtab->hashes[id] = key->hash;
+    symtab->offs[id] = symtab->strings_len;
+    symtab->lens[id] = key->len;
+    memcpy(symtab->strings + symtab->strings_len, key->folded, key->len + 1);
+    symtab->strings_len += key->len + 1;
+
+    *hbac_symtab_slot(symtab, symtab->slots, symtab->size, key) = id + 1;
+    *_id = id;
+    return EOK;
+}
+
+/* Compiled rule sets
+ *
+ * hbac_compile_rules() interns the members of all rules into the symbol
+ * table of the compiled rules and builds, for the names and the groups of
+ * each element, the sorted list of the IDs of the rules that list each
+ * symbol. The lists only hold the memberships the rules have, not a set
+ * over all rules per symbol. A request is then evaluated with one symbol
+ * lookup per member, a merge of the lists of the members of each request
+ * element and an intersection of the four merged lists, instead of
+ * comparing every rule member with every request member.
+ *
+ * Rules the index cannot represent exactly, because an element is missing
+ * or a member is not valid UTF-8, are flagged and evaluated with
+ * hbac_evaluate_rule() when they come up in rule order. A request with
+ * invalid UTF-8 is handed to hbac_evaluate() as a whole. The result is
+ * therefore always the same as that of hbac_evaluate().
+ */
+
+/* Rule IDs in ascending order */
+struct hbac_rule_list {
+    uint32_t *ids;
+    uint32_t count;
+    uint32_t alloc;
+};
+
+/* Rule lists by symbol ID, empty for symbols no rule lists here */
+struct hbac_index {
+    struct hbac_rule_list *lists;
+    size_t num_ids;
+};
+
+struct hbac_element_index {
+    struct hbac_index names;
+    struct hbac_index groups;
+    /* Rules with the category all */
+    struct hbac_rule_list all;
+};
+
+struct hbac_compiled_rules {
+    struct hbac_rule **rules;
+    size_t num_rules;
+
+    /* Enabled rules that must be evaluated with hbac_evaluate_rule() */
+    struct hbac_rule_list fallback;
+
+    struct hbac_symtab symtab;
+
+    struct hbac_element_index users;
+    struct hbac_element_index services;
+    struct hbac_element_index targethosts;
+    struct hbac_element_index srchosts;
+};
+
+/* The rules are compiled in order, so appending keeps the list sorted */
+static errno_t hbac_list_add(struct hbac_rule_list *list, uint32_t rule)
+{
+    uint32_t *ids;
+    uint32_t alloc;
+
+    /* A rule that lists a member twice */
+    if (list->count > 0 && list->ids[list->count - 1] == rule) return EOK;
+
+    if (list->count == list->alloc) {
+        alloc = list->alloc ? list->alloc * 2 : 4;
+
+        ids = realloc(list->ids, alloc * sizeof(uint32_t));
+        if (!ids) return ENOMEM;
+
+        list->ids = ids;
+        list->alloc = alloc;
+    }
+
+    list->ids[list->count++] = rule;
+    return EOK;
+}
+
+static errno_t hbac_index_add(struct hbac_index *idx,
+                              uint32_t id,
+                              uint32_t rule)
+{
+    struct hbac_rule_list *lists;
+    size_t num_ids;
+
+    if (id >= idx->num_ids) {
+        num_ids = idx->num_ids ? idx->num_ids : 16;
+        while (num_ids <= id) num_ids *= 2;
+
+        lists = realloc(idx->lists, num_ids * sizeof(struct hbac_rule_list));
+        if (!lists) return ENOMEM;
+
+        memset(lists + idx->num_ids, 0,
+               (num_ids - idx->num_ids) * sizeof(struct hbac_rule_list));
+        idx->lists = lists;
+        idx->num_ids = num_ids;
+    }
+
+    return hbac_list_add(&idx->lists[id], rule);
+}
+
+static void hbac_index_free(struct hbac_index *idx)
+{
+    size_t i;
+
+    for (i = 0; i < idx->num_ids; i++) {
+        free(idx->lists[i].ids);
+    }
+    free(idx->lists);
+}
+
+static errno_t hbac_index_strings(struct hbac_compiled_rules *c,
+                                  struct hbac_index *idx,
+                                  const char **strings,
+                                  uint32_t rule,
+                                  bool *_fallback)
+{
+    struct hbac_key key;
+    uint32_t id;
+    size_t i;
+    errno_t ret;
+
+    if (!strings) return EOK;
+
+    for (i = 0; strings[i]; i++) {
+        ret = hbac_key_init(&key, strings[i]);
+        if (ret != EOK) return ret;
+
+        if (!key.folded) {
+            /* Let the reference evaluator report the error if the
+             * member is ever compared */
+            *_fallback = true;
+            continue;
+        }
+
+        ret = hbac_symtab_intern(&c->symtab, &key, &id);
+        sss_utf8_free(key.folded);
+        if (ret != EOK) return ret;
+
+        ret = hbac_index_add(idx, id, rule);
+        if (ret != EOK) return ret;
+    }
+
+    return EOK;
+}
+
+static errno_t hbac_index_element(struct hbac_compiled_rules *c,
+                                  struct hbac_element_index *idx,
+                                  struct hbac_rule_element *el,
+                                  uint32_t rule,
+                                  bool *_fallback)
+{
+    errno_t ret;
+
+    if (el->category & HBAC_CATEGORY_ALL) {
+        /* The members are never looked at */
+        return hbac_list_add(&idx->all, rule);
+    }
+
+    ret = hbac_index_strings(c, &idx->names, el->names, rule, _fallback);
+    if (ret != EOK) return ret;
+
+    return hbac_index_strings(c, &idx->groups, el->groups, rule, _fallback);
+}
+
+static void hbac_element_index_free(struct hbac_element_index *idx)
+{
+    hbac_index_free(&idx->names);
+    hbac_index_free(&idx->groups);
+    free(idx->all.ids);
+}
+
+void hbac_free_compiled_rules(struct hbac_compiled_rules *compiled)
+{
+    if (compiled == NULL) return;
+
+    hbac_element_index_free(&compiled->users);
+    hbac_element_index_free(&compiled->services);
+    hbac_element_index_free(&compiled->targethosts);
+    hbac_element_index_free(&compiled->srchosts);
+    hbac_symtab_clear(&compiled->symtab);
+    free(compiled->fallback.ids);
+    free(compiled);
+}
+
+static errno_t hbac_compile_rule(struct hbac_compiled_rules *c, uint32_t i)
+{
+    struct hbac_rule *rule = c->rules[i];
+    bool fallback = false;
+    errno_t ret;
+
+    /* Disabled rules never match, not even when they are broken. They
+     * are in no list and never become candidates. */
+    if (!rule->enabled) return EOK;
+
+    if (!rule->users || !rule->services
+            || !rule->targethosts || !rule->srchosts) {
+        return hbac_list_add(&c->fallback, i);
+    }
+
+    ret = hbac_index_element(c, &c->users, rule->users, i, &fallback);
+    if (ret != EOK) return ret;
+
+    ret = hbac_index_element(c, &c->services, rule->services, i, &fallback);
+    if (ret != EOK) return ret;
+
+    ret = hbac_index_element(c, &c->targethosts, rule->targethosts, i,
+                             &fallback);
+    if (ret != EOK) return ret;
+
+    ret = hbac_index_element(c, &c->srchosts, rule->srchosts, i, &fallback);
+    if (ret != EOK) return ret;
+
+    if (fallback) {
+        HBAC_DEBUG(HBAC_DBG_TRACE,
+                   "Rule [%s] will be evaluated without the index\n",
+                   rule->name);
+        return hbac_list_add(&c->fallback, i);
+    }
+
+    return EOK;
+}
+
+
+enum hbac_error_code hbac_compile_rules(struct hbac_rule **rules,
+                                        struct hbac_compiled_rules **compiled)
+{
+    struct hbac_compiled_rules *c;
+    size_t i;
+    errno_t ret;
+
+    if (!rules || !compiled) return HBAC_ERROR_UNKNOWN;
+
+    c = calloc(1, sizeof(struct hbac_compiled_rules));
+    if (!c) return HBAC_ERROR_OUT_OF_MEMORY;
+
+    c->rules = rules;
+    for (c->num_rules = 0; rules[c->num_rules]; c->num_rules++);
+    if (c->num_rules > UINT32_MAX) {
+        hbac_free_compiled_rules(c);
+        return HBAC_ERROR_OUT_OF_MEMORY;
+    }
+
+    for (i = 0; i < c->num_rules; i++) {
+        ret = hbac_compile_rule(c, i);
+        if (ret != EOK) {
+            HBAC_DEBUG(HBAC_DBG_ERROR,
+                       "Cannot compile rule [%s]: %d\n", rules[i]->name, ret);
+            hbac_free_compiled_rules(c);
+            return HBAC_ERROR_OUT_OF_MEMORY;
+        }
+    }
+
+    HBAC_DEBUG(HBAC_DBG_TRACE, "Compiled %zu rules with %u symbols\n",
+               c->num_rules, c->symtab.count);
+    *compiled = c;
+    return HBAC_SUCCESS;
+}
+
+/* The rules that match a request element, either a list of the index or
+ * the merged lists in buf
+ */
+struct hbac_match {
+    const uint32_t *ids;
+    size_t count;
+    uint32_t *buf;
+};
+
+/* The next rule ID of a list being merged */
+struct hbac_cursor {
+    const uint32_t *next;
+    const uint32_t *end;
+};
+
+static void hbac_heap_sift(struct hbac_cursor *heap, size_t n, size_t i)
+{
+    struct hbac_cursor tmp;
+    size_t min, l, r;
+
+    while (true) {
+        min = i;
+        l = 2 * i + 1;
+        r = l + 1;
+        if (l < n && *heap[l].next < *heap[min].next) min = l;
+        if (r < n && *heap[r].next < *heap[min].next) min = r;
+        if (min == i) return;
+
+        tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+/* Merges n non-empty sorted lists into out without duplicates and returns
+ * the number of rule IDs in out
+ */
+static size_t hbac_merge(struct hbac_cursor *heap, size_t n, uint32_t *out)
+{
+    size_t count = 0;
+    size_t i;
+
+    for (i = n / 2; i-- > 0; ) {
+        hbac_heap_sift(heap, n, i);
+    }
+
+    while (n > 0) {
+        if (count == 0 || out[count - 1] != *heap[0].next) {
+            out[count++] = *heap[0].next;
+        }
+
+        if (++heap[0].next == heap[0].end) {
+            heap[0] = heap[--n];
+        }
+        hbac_heap_sift(heap, n, 0);
+    }
+
+    return count;
+}
+
+/* Returns the position of the first rule ID at or after pos that is not
+ * below id. Probes 1, 2, 4, ... IDs ahead first, so that skipping over a
+ * long list for the few IDs of a short one stays cheap.
+ */
+static size_t hbac_gallop(const uint32_t *ids, size_t count,
+                          size_t pos, uint32_t id)
+{
+    size_t lo = pos;
+    size_t hi = pos;
+    size_t step = 1;
+    size_t mid;
+
+    while (hi < count && ids[hi] < id) {
+        lo = hi + 1;
+        hi += step;
+        step *= 2;
+    }
+    if (hi > count) hi = count;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (ids[mid] < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/* Writes the rule IDs in both a and b to out, which may be a. a should be
+ * the shorter list. Returns the number of rule IDs in out.
+ */
+static size_t hbac_intersect(const uint32_t *a, size_t na,
+                             const uint32_t *b, size_t nb,
+                             uint32_t *out)
+{
+    size_t count = 0;
+    size_t i;
+    size_t j = 0;
+
+    for (i = 0; i < na && j < nb; i++) {
+        j = hbac_gallop(b, nb, j, a[i]);
+        if (j < nb && b[j] == a[i]) {
+            out[count++] = a[i];
+        }
+    }
+
+    return count;
+}
+
+/* Adds the rules that list the request member to the lists to merge.
+ * Returns EILSEQ if the member is not valid UTF-8.
+ */
+static errno_t hbac_lookup(struct hbac_compiled_rules *c,
+                           struct hbac_index *idx,
+                           const char *name,
+                           struct hbac_cursor *lists,
+                           size_t *_n)
+{
+    struct hbac_rule_list *list;
+    struct hbac_key key;
+    uint32_t id;
+    bool found;
+    errno_t ret;
+
+    ret = hbac_key_init(&key, name);
+    if (ret != EOK) return ret;
+
+    if (!key.folded) return EILSEQ;
+
+    found = hbac_symtab_find(&c->symtab, &key, &id);
+    sss_utf8_free(key.folded);
+
+    /* Names that no rule lists here match nothing */
+    if (!found || id >= idx->num_ids || idx->lists[id].count == 0) {
+        return EOK;
+    }
+
+    list = &idx->lists[id];
+    lists[*_n].next = list->ids;
+    lists[*_n].end = list->ids + list->count;
+    (*_n)++;
+    return EOK;
+}
+
+/* Finds the rules whose element matches req_el. Returns EILSEQ if the
+ * request cannot be looked up in the index.
+ */
+static errno_t hbac_match_element(struct hbac_compiled_rules *c,
+                                  struct hbac_element_index *idx,
+                                  struct hbac_request_element *req_el,
+                                  struct hbac_match *out)
+{
+    struct hbac_cursor *lists;
+    size_t num_groups = 0;
+    size_t total = 0;
+    size_t n = 0;
+    size_t i;
+    errno_t ret;
+
+    out->ids = idx->all.ids;
+    out->count = idx->all.count;
+    out->buf = NULL;
+    if (!req_el) return EOK;
+
+    while (req_el->groups && req_el->groups[num_groups]) num_groups++;
+
+    lists = malloc((num_groups + 2) * sizeof(struct hbac_cursor));
+    if (!lists) return ENOMEM;
+
+    if (idx->all.count > 0) {
+        lists[n].next = idx->all.ids;
+        lists[n].end = idx->all.ids + idx->all.count;
+        n++;
+    }
+
+    if (req_el->name) {
+        ret = hbac_lookup(c, &idx->names, req_el->name, lists, &n);
+        if (ret != EOK) goto done;
+    }
+
+    for (i = 0; i < num_groups; i++) {
+        ret = hbac_lookup(c, &idx->groups, req_el->groups[i], lists, &n);
+        if (ret != EOK) goto done;
+    }
+
+    if (n == 0) {
+        out->count = 0;
+        ret = EOK;
+        goto done;
+    } else if (n == 1) {
+        /* Usually the rules of the name only, no need to copy them */
+        out->ids = lists[0].next;
+        out->count = lists[0].end - lists[0].next;
+        ret = EOK;
+        goto done;
+    }
+
+    for (i = 0; i < n; i++) {
+        total += lists[i].end - lists[i].next;
+    }
+
+    out->buf = malloc(total * sizeof(uint32_t));
+    if (!out->buf) {
+        ret = ENOMEM;
+        goto done;
+    }
+
+    out->count = hbac_merge(lists, n, out->buf);
+    out->ids = out->buf;
+    ret = EOK;
+done:
+    free(lists);
+    return ret;
+}
+
+/* Finds the rules that match all elements of the request, in rule order.
+ * *_cand must be freed.
+ */
+static errno_t hbac_match_request(struct hbac_compiled_rules *c,
+                                  struct hbac_eval_req *req,
+                                  uint32_t **_cand,
+                                  size_t *_num_cand)
+{
+    struct {
+        struct hbac_element_index *idx;
+        struct hbac_request_element *req_el;
+    } elements[] = {
+        { &c->users, req->user },
+        { &c->services, req->service },
+        { &c->targethosts, req->targethost },
+        { &c->srchosts, req->srchost },
+    };
+    struct hbac_match matches[sizeof(elements) / sizeof(elements[0])];
+    const size_t num_elements = sizeof(elements) / sizeof(elements[0]);
+    struct hbac_match tmp;
+    uint32_t *cand = NULL;
+    size_t num_cand;
+    size_t i, j;
+    errno_t ret;
+
+    memset(matches, 0, sizeof(matches));
+
+    for (i = 0; i < num_elements; i++) {
+        ret = hbac_match_element(c, elements[i].idx, elements[i].req_el,
+                                 &matches[i]);
+        if (ret != EOK) goto done;
+    }
+
+    /* Start with the shortest list, every intersection only gets shorter */
+    for (i = 1; i < num_elements; i++) {
+        for (j = i; j > 0 && matches[j].count < matches[j - 1].count; j--) {
+            tmp = matches[j];
+            matches[j] = matches[j - 1];
+            matches[j - 1] = tmp;
+        }
+    }
+
+    /* Keep at least one slot so that an empty result is not NULL */
+    cand = malloc((matches[0].count + 1) * sizeof(uint32_t));
+    if (!cand) {
+        ret = ENOMEM;
+        goto done;
+    }
+
+    num_cand = matches[0].count;
+    if (num_cand > 0) {
+        memcpy(cand, matches[0].ids, num_cand * sizeof(uint32_t));
+    }
+    for (i = 1; i < num_elements && num_cand > 0; i++) {
+        num_cand = hbac_intersect(cand, num_cand,
+                                  matches[i].ids, matches[i].count, cand);
+    }
+
+    *_cand = cand;
+    *_num_cand = num_cand;
+    cand = NULL;
+    ret = EOK;
+done:
+    for (i = 0; i < num_elements; i++) {
+        free(matches[i].buf);
+    }
+    free(cand);
+    return ret;
+}
+
+enum hbac_eval_result hbac_evaluate_compiled(struct hbac_compiled_rules *compiled,
+                                             struct hbac_eval_req *hbac_req,
+                                             struct hbac_info **info)
+{
+    struct hbac_rule *rule;
+    const struct hbac_rule_list *fallback = &compiled->fallback;
+    uint32_t *cand = NULL;
+    size_t num_cand = 0;
+    size_t c = 0;
+    size_t f = 0;
+    size_t i;
+    bool use_fallback;
+    enum hbac_error_code code = HBAC_ERROR_UNKNOWN;
+    enum hbac_eval_result result = HBAC_EVAL_DENY;
+    enum hbac_eval_result_int rule_result;
+    errno_t ret;
+
+    HBAC_DEBUG(HBAC_DBG_INFO, "[< hbac_evaluate_compiled()\n");
+    hbac_req_debug_print(hbac_req);
+
+    if (info) {
+        *info = malloc(sizeof(struct hbac_info));
+        if (!*info) {
+            HBAC_DEBUG(HBAC_DBG_ERROR, "Out of memory.\n");
+            return HBAC_EVAL_OOM;
+        }
+        (*info)->code = HBAC_ERROR_UNKNOWN;
+        (*info)->rule_name = NULL;
+    }
+
+    ret = hbac_match_request(compiled, hbac_req, &cand, &num_cand);
+    if (ret == EILSEQ) {
+        HBAC_DEBUG(HBAC_DBG_INFO,
+                   "The request is not valid UTF-8, not using the index\n");
+        if (info) {
+            hbac_free_info(*info);
+            *info = NULL;
+        }
+        return hbac_evaluate(compiled->rules, hbac_req, info);
+    } else if (ret != EOK) {
+        HBAC_DEBUG(HBAC_DBG_ERROR, "Out of memory.\n");
+        result = HBAC_EVAL_ERROR;
+        if (info) (*info)->code = HBAC_ERROR_OUT_OF_MEMORY;
+        goto done;
+    }
+
+    /* The candidates and the fallback rules are merged in rule order, so
+     * the first rule that matches or fails is the same one hbac_evaluate()
+     * would stop at */
+    while (c < num_cand || f < fallback->count) {
+        use_fallback = f < fallback->count
+                && (c == num_cand || fallback->ids[f] <= cand[c]);
+        if (use_fallback) {
+            i = fallback->ids[f++];
+            if (c < num_cand && cand[c] == i) c++;
+        } else {
+            i = cand[c++];
+        }
+        rule = compiled->rules[i];
+
+        if (use_fallback) {
+            rule_result = hbac_evaluate_rule(rule, hbac_req, &code);
+            if (rule_result == HBAC_EVAL_UNMATCHED) {
+                HBAC_DEBUG(HBAC_DBG_INFO, "The rule [%s] did not match.\n",
+                           rule->name);
+                continue;
+            } else if (rule_result != HBAC_EVAL_MATCHED) {
+                HBAC_DEBUG(HBAC_DBG_ERROR,
+                           "Error %d occurred during evaluating of rule [%s].\n",
+                           code, rule->name);
+                result = HBAC_EVAL_ERROR;
+                if (info) {
+                    (*info)->code = code;
+                    (*info)->rule_name = strdup(rule->name);
+                }
+                goto done;
+            }
+        }
+
+        HBAC_DEBUG(HBAC_DBG_INFO, "ALLOWED by rule [%s].\n", rule->name);
+        result = HBAC_EVAL_ALLOW;
+        if (info) {
+            (*info)->code = HBAC_SUCCESS;
+            (*info)->rule_name = strdup(rule->name);
+            if (!(*info)->rule_name) {
+                HBAC_DEBUG(HBAC_DBG_ERROR, "Out of memory.\n");
+                result = HBAC_EVAL_ERROR;
+                (*info)->code = HBAC_ERROR_OUT_OF_MEMORY;
+            }
+        }
+        goto done;
+    }
+
+done:
+    free(cand);
+    HBAC_DEBUG(HBAC_DBG_INFO, "hbac_evaluate_compiled() >]\n");
+    return result;
+}
+
 const char *hbac_result_string(enum hbac_eval_result result)
 {
     switch(result) {
@@ -293,6 +293,51 @@ enum hbac_eval_result hbac_evaluate(struct hbac_rule **rules,
                                     struct hbac_eval_req *hbac_req,
                                     struct hbac_info **info);
 
+/**
+ * Opaque type contained in hbac_evaluator.c
+ */
+struct hbac_compiled_rules;
+
+/**
+ * @brief Prepare a set of HBAC rules for repeated or large evaluations
+ *
+ * Builds case-insensitive indexes over the members of all rule elements.
+ * The rules are referenced, not copied, and must not be modified or freed
+ * before the compiled rules are freed.
+ *
+ * @param[in] rules     A NULL-terminated list of rules
+ * @param[out] compiled The compiled rules, free with
+ *                      #hbac_free_compiled_rules
+ * @return
+ *  - #HBAC_SUCCESS:              The rules were compiled
+ *  - #HBAC_ERROR_OUT_OF_MEMORY:  Insufficient memory
+ *  - #HBAC_ERROR_UNKNOWN:        Invalid arguments
+ */
+enum hbac_error_code hbac_compile_rules(struct hbac_rule **rules,
+                                        struct hbac_compiled_rules **compiled);
+
+/**
+ * @brief Evaluate an authorization request against compiled HBAC rules
+ *
+ * Returns the same result and extended information as #hbac_evaluate
+ * would for the rules that were compiled.
+ *
+ * @param[in] compiled Rules prepared with #hbac_compile_rules
+ * @param[in] hbac_req A user authorization request
+ * @param[out] info    Extended information, see #hbac_evaluate
+ * @return See #hbac_evaluate
+ */
+enum hbac_eval_result
+hbac_evaluate_compiled(struct hbac_compiled_rules *compiled,
+                       struct hbac_eval_req *hbac_req,
+                       struct hbac_info **info);
+
+/**
+ * @brief Free rules compiled with #hbac_compile_rules
+ * @param[in] compiled The compiled rules, may be NULL
+ */
+void hbac_free_compiled_rules(struct hbac_compiled_rules *compiled);
+
 /**
  * @brief Display result of hbac evaluation in human-readable form
  * @param[in] result Return value of #hbac_evaluate
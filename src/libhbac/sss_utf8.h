@@ -40,6 +40,12 @@ void sss_utf8_free(void *ptr);
 /* The result must be freed with sss_utf8_free() */
 uint8_t *sss_utf8_tolower(const uint8_t *s, size_t len, size_t *nlen);
 
+/* The result is NUL-terminated and must be freed with sss_utf8_free().
+ * Two strings compare equal with sss_utf8_case_eq() if their case folded
+ * forms are byte-for-byte identical.
+ */
+uint8_t *sss_utf8_casefold(const uint8_t *s, size_t len, size_t *nlen);
+
 bool sss_utf8_check(const uint8_t *s, size_t n);
 
 errno_t sss_utf8_case_eq(const uint8_t *s1, const uint8_t *s2);
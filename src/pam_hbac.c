@@ -30,6 +30,11 @@
 #include "pam_hbac.h"
 #include "pam_hbac_obj.h"
 #include "pam_hbac_ldap.h"
+#include "pam_hbac_snapshot.h"
+#include "pam_hbac_dcache.h"
+#include "pam_hbac_scoreboard.h"
+#include "pam_hbac_breaker.h"
+#include "pam_hbac_arena.h"
 
 #define CHECK_AND_RETURN_PI_STRING(s) ((s != NULL && *s != '\0')? s : "(not available)")
 
@@ -246,6 +251,16 @@ ph_init(pam_handle_t *pamh,
         return NULL;
     }
 
+    /* Everything the rules and the request are made of is released at
+     * once when the call returns
+     */
+    ctx->arena = ph_arena_new();
+    if (ctx->arena == NULL) {
+        ph_cleanup_config(ctx->pc);
+        free(ctx);
+        return NULL;
+    }
+
     ctx->pamh = pamh;
     return ctx;
 }
@@ -257,6 +272,7 @@ ph_cleanup(struct pam_hbac_ctx *ctx)
         return;
     }
 
+    ph_arena_free(ctx->arena);
     ph_cleanup_config(ctx->pc);
     free(ctx);
 }
@@ -274,6 +290,195 @@ ph_destroy_secret(struct pam_hbac_ctx *ctx)
     ctx->pc->bind_pw = NULL;
 }
 
+static int
+ph_unavail(int flags)
+{
+    if (flags & PAM_IGNORE_AUTHINFO_UNAVAIL) {
+        return PAM_IGNORE;
+    }
+    return PAM_AUTHINFO_UNAVAIL;
+}
+
+/* A stage that ran out of the TIMEOUT budget is reported like a server
+ * that cannot be reached
+ */
+static int
+ph_timed_out(struct pam_hbac_ctx *ctx, int flags)
+{
+    logger(ctx->pamh, LOG_ERR,
+           "Timeout of %d seconds exhausted while %s\n",
+           ctx->pc->timeout, ctx->stage ? ctx->stage : "talking to LDAP");
+
+    /* Replies to the timed out requests might still arrive */
+    ctx->ld_broken = true;
+
+    return ph_unavail(flags);
+}
+
+enum ph_fetch_stage {
+    PH_FETCH_HOST,
+    PH_FETCH_SVC,
+    PH_FETCH_RULES,
+};
+
+/* Downloads the target host and the rules that apply to the host over a
+ * single connection. The service is only searched for if the rules can
+ * match some services but not others, otherwise *_service is NULL. With
+ * NARROW_RULES_BY_SERVICE the service is searched for together with the
+ * host instead and the rules search only returns rules that can match it,
+ * with a non-NULL user only rules that can match the user. On failure,
+ * _stage says which of the objects could not be read.
+ */
+static int
+ph_fetch_ldap_data(struct pam_hbac_ctx *ctx,
+                   const char *svcname,
+                   struct ph_user *user,
+                   struct ph_entry **_targethost,
+                   struct ph_entry **_service,
+                   struct hbac_rule ***_rules,
+                   enum ph_fetch_stage *_stage)
+{
+    int ret;
+    int host_msgid = -1;
+    int svc_msgid = -1;
+    int rules_msgid = -1;
+    bool svc_searched = false;
+    struct ph_rules_scope scope = { NULL, NULL, user };
+    struct ph_entry *targethost = NULL;
+    struct ph_entry *service = NULL;
+    struct hbac_rule **rules = NULL;
+
+    *_stage = PH_FETCH_HOST;
+    ret = ph_get_host_send(ctx, ctx->pc->hostname, &host_msgid);
+    if (ret != 0) {
+        goto fail;
+    }
+
+    if (ctx->pc->narrow_rules_by_service) {
+        *_stage = PH_FETCH_SVC;
+        ret = ph_get_svc_send(ctx, svcname, &svc_msgid);
+        if (ret != 0) {
+            goto fail;
+        }
+    }
+
+    /* The rules filter is built from the host's hostgroups */
+    *_stage = PH_FETCH_HOST;
+    ret = ph_get_host_recv(ctx, ctx->pc->hostname, host_msgid, &targethost);
+    host_msgid = -1;
+    if (ret != 0) {
+        goto fail;
+    }
+
+    if (svc_msgid != -1) {
+        *_stage = PH_FETCH_SVC;
+        ret = ph_get_svc_recv(ctx, svcname, svc_msgid, &service);
+        svc_msgid = -1;
+        /* Rules for all services still apply to a missing service */
+        if (ret != 0 && ret != ENOENT) {
+            goto fail;
+        }
+        svc_searched = true;
+        scope.svcname = svcname;
+        scope.service = service;
+    }
+
+    *_stage = PH_FETCH_RULES;
+    ret = ph_get_hbac_rules_send(ctx, targethost, &scope, &rules_msgid);
+    if (ret != 0) {
+        goto fail;
+    }
+
+    ret = ph_get_hbac_rules_recv(ctx, targethost, rules_msgid, &rules);
+    rules_msgid = -1;
+    if (ret != 0) {
+        goto fail;
+    }
+
+    if (!ph_hbac_rules_need_service(rules)) {
+        logger(ctx->pamh, LOG_DEBUG,
+               "No enabled rule depends on the service, not searching "
+               "for %s\n", svcname);
+    } else if (svc_searched && service == NULL) {
+        *_stage = PH_FETCH_SVC;
+        ret = ENOENT;
+        goto fail;
+    } else if (!svc_searched) {
+        *_stage = PH_FETCH_SVC;
+        ret = ph_get_svc_send(ctx, svcname, &svc_msgid);
+        if (ret != 0) {
+            goto fail;
+        }
+
+        ret = ph_get_svc_recv(ctx, svcname, svc_msgid, &service);
+        svc_msgid = -1;
+        if (ret != 0) {
+            goto fail;
+        }
+    }
+
+    *_targethost = targethost;
+    *_service = service;
+    *_rules = rules;
+    return 0;
+
+fail:
+    ph_search_abandon(ctx->pamh, ctx->ld, host_msgid);
+    ph_search_abandon(ctx->pamh, ctx->ld, svc_msgid);
+    ph_search_abandon(ctx->pamh, ctx->ld, rules_msgid);
+    ph_free_hbac_rules(rules);
+    ph_entry_free(targethost);
+    ph_entry_free(service);
+    return ret;
+}
+
+/* Resolves the names of the user's groups if the rules can match any of
+ * them. If all the rules apply to all users or only list users by name,
+ * no group is looked up at all.
+ */
+static int
+ph_resolve_user_groups(struct pam_hbac_ctx *ctx,
+                       struct ph_user *user,
+                       const char **rule_groups)
+{
+    if (rule_groups[0] == NULL) {
+        logger(ctx->pamh, LOG_DEBUG,
+               "No enabled rule references a user group, "
+               "not resolving the groups of the user\n");
+        return 0;
+    }
+
+    if (ctx->pc->match_groups_by_gid) {
+        return ph_user_match_groups(ctx->pamh, ctx->arena,
+                                    user, rule_groups);
+    }
+
+    return ph_user_resolve_groups(ctx->pamh, ctx->arena, user);
+}
+
+/* Evaluates rules read from LDAP or from a snapshot */
+static enum hbac_eval_result
+ph_evaluate(pam_handle_t *pamh,
+            struct hbac_rule **rules,
+            struct hbac_eval_req *eval_req,
+            struct hbac_info **_info)
+{
+    struct hbac_compiled_rules *compiled = NULL;
+    enum hbac_eval_result hbac_eval_result;
+    enum hbac_error_code ret;
+
+    ret = hbac_compile_rules(rules, &compiled);
+    if (ret != HBAC_SUCCESS) {
+        logger(pamh, LOG_NOTICE,
+               "hbac_compile_rules failed [%d], using hbac_evaluate\n", ret);
+        return hbac_evaluate(rules, eval_req, _info);
+    }
+
+    hbac_eval_result = hbac_evaluate_compiled(compiled, eval_req, _info);
+    hbac_free_compiled_rules(compiled);
+    return hbac_eval_result;
+}
+
 /* FIXME - return more sensible return codes */
 static int
 pam_hbac(enum pam_hbac_actions action, pam_handle_t *pamh,
@@ -287,13 +492,20 @@ pam_hbac(enum pam_hbac_actions action, pam_handle_t *pamh,
     const char *config_file = NULL;
 
     struct ph_user *user = NULL;
+    /* The user the rules search is narrowed down to, if any */
+    struct ph_user *scope_user = NULL;
     struct ph_entry *service = NULL;
     struct ph_entry *targethost = NULL;
 
     struct hbac_eval_req *eval_req = NULL;
     struct hbac_rule **rules = NULL;
+    const char **rule_groups = NULL;
     enum hbac_eval_result hbac_eval_result;
     struct hbac_info *info = NULL;
+    struct ph_snapshot *snap = NULL;
+    struct ph_dcache *dcache = NULL;
+    enum ph_fetch_stage stage;
+    struct timespec fetch_started;
 
     (void) pam_flags; /* unused */
 
@@ -338,27 +550,13 @@ pam_hbac(enum pam_hbac_actions action, pam_handle_t *pamh,
     logger(pamh, LOG_DEBUG, "ph_init: OK");
     ph_dump_config(pamh, ctx->pc);
 
-    ret = ph_connect(ctx);
-    /* Destroy secret as soon as possible */
-    ph_destroy_secret(ctx);
-    if (ret != 0) {
-        logger(pamh, LOG_NOTICE,
-               "ph_connect returned error: %s", strerror(ret));
-        if (flags & PAM_IGNORE_AUTHINFO_UNAVAIL) {
-            pam_ret = PAM_IGNORE;
-        } else {
-            pam_ret = PAM_AUTHINFO_UNAVAIL;
-        }
-        goto done;
-    }
-    logger(pamh, LOG_DEBUG, "ph_connect: OK");
-
     print_pam_items(pamh, &pi, flags);
 
     /* Run info on the user from NSS, otherwise we can't support AD users since
-     * they are not in IPA LDAP.
+     * they are not in IPA LDAP. Only the GIDs are read here, the group names
+     * are resolved once the rules show that they matter.
      */
-    user = ph_get_user(pamh, pi.pam_user);
+    user = ph_get_user_gids(pamh, pi.pam_user);
     if (user == NULL) {
         logger(pamh, LOG_NOTICE,
                "Did not find user %s\n", pi.pam_user);
@@ -371,70 +569,195 @@ pam_hbac(enum pam_hbac_actions action, pam_handle_t *pamh,
     }
     logger(pamh, LOG_DEBUG, "ph_get_user: OK");
 
-    /* Search hosts for fqdn = hostname (automatic or set from config file) */
-    ret = ph_get_host(ctx, ctx->pc->hostname, &targethost);
-    if (ret == ENOENT) {
-        logger(pamh, LOG_NOTICE,
-               "Did not find host %s denying access\n", ctx->pc->hostname);
-        pam_ret = PAM_PERM_DENIED;
-        goto done;
-    } else if (ret != 0) {
-        logger(pamh, LOG_ERR,
-               "ph_get_host error: %s", strerror(ret));
-        pam_ret = PAM_ABORT;
-        goto done;
+    /* The user is resolved before connecting so that a recent decision
+     * for the same user, groups and service can be reused right away
+     */
+    dcache = ph_dcache_open(pamh, ctx->pc, user, pi.pam_service);
+    if (ph_dcache_lookup(dcache, &hbac_eval_result) == 0) {
+        ph_destroy_secret(ctx);
+        goto decided;
     }
-    logger(pamh, LOG_DEBUG, "ph_get_host: OK");
 
-    /* Search for the service */
-    ret = ph_get_svc(ctx, pi.pam_service, &service);
-    if (ret == ENOENT) {
-        logger(pamh, LOG_NOTICE,
-               "Did not find service %s denying access\n", pi.pam_service);
-        pam_ret = PAM_PERM_DENIED;
+    /* A fresh snapshot of the rules lets us skip LDAP altogether */
+    snap = ph_snapshot_open(pamh, ctx->pc, pi.pam_service);
+    if (snap != NULL) {
+        ph_destroy_secret(ctx);
+        ret = 0;
+    } else if (!ph_breaker_allow(ctx)) {
+        /* The servers were unreachable for the previous logins, don't
+         * make this one wait for the timeout as well
+         */
+        ph_destroy_secret(ctx);
+        pam_ret = ph_unavail(flags);
+        goto done;
+    } else {
+        ph_deadline_start(ctx);
+        ret = ph_connect(ctx);
+        ph_breaker_report(ctx, ret);
+        /* Destroy secret as soon as possible. A pooled handle might turn out
+         * to be dead during the first search, keep the secret until the
+         * rules are downloaded so that ph_reconnect() can replace it.
+         */
+        if (!ctx->ld_reused) {
+            ph_destroy_secret(ctx);
+        }
+    }
+    if (ret == ETIMEDOUT) {
+        pam_ret = ph_timed_out(ctx, flags);
         goto done;
     } else if (ret != 0) {
-        logger(pamh, LOG_ERR,
-               "ph_get_svc error: %s", strerror(ret));
-        pam_ret = PAM_ABORT;
+        logger(pamh, LOG_NOTICE,
+               "ph_connect returned error: %s", strerror(ret));
+        pam_ret = ph_unavail(flags);
         goto done;
     }
-    logger(pamh, LOG_DEBUG, "ph_get_svc: OK");
+    logger(pamh, LOG_DEBUG, "ph_connect: OK");
+
+    if (snap != NULL) {
+        ret = ph_hbac_rules_user_groups(ph_snapshot_rules(snap),
+                                        &rule_groups);
+        if (ret == 0) {
+            ret = ph_resolve_user_groups(ctx, user, rule_groups);
+        }
+        if (ret != 0) {
+            logger(pamh, LOG_ERR,
+                   "Cannot resolve the groups of user %s [%d]: %s\n",
+                   pi.pam_user, ret, strerror(ret));
+            pam_ret = PAM_SYSTEM_ERR;
+            goto done;
+        }
 
-    /* Download all enabled rules that apply to this host or any of its hostgroups.
+        hbac_eval_result = ph_evaluate(pamh, ph_snapshot_rules(snap),
+                                       ph_snapshot_eval_req(snap, user),
+                                       &info);
+        goto evaluated;
+    }
+
+    /* Search hosts for fqdn = hostname (automatic or set from config file),
+     * the rules that apply to the host and, if the rules depend on it, the
+     * service.
+     *
+     * Download all enabled rules that apply to this host or any of its hostgroups.
      * Iterate over the rules. For each rule:
      *  - Allocate hbac_rule
      *  - check its memberUser attributes. Parse either a username or a groupname
      *    from the DN. Put it into hbac_rule_element
      *  - check its memberService attribtue. Parse either a svcname or a svcgroupname
      *    from the DN. Put into hbac_rule_element
-     *
-     * Get data for eval request by matching the PAM service name with a downloaded
-     * service. Not matching it is not an error, it can still match /all/.
      */
+    if (ctx->pc->narrow_rules_by_user) {
+        /* The rules search lists the user's groups */
+        ret = ph_user_resolve_groups(pamh, ctx->arena, user);
+        if (ret != 0) {
+            logger(pamh, LOG_ERR,
+                   "Cannot resolve the groups of user %s [%d]: %s\n",
+                   pi.pam_user, ret, strerror(ret));
+            pam_ret = PAM_SYSTEM_ERR;
+            goto done;
+        }
+        scope_user = user;
+    }
 
-    ret = ph_create_hbac_eval_req(user, targethost, service,
-                                  ctx->pc->search_base, &eval_req);
+    ph_scoreboard_clock(&fetch_started);
+    ret = ph_fetch_ldap_data(ctx, pi.pam_service, scope_user,
+                             &targethost, &service, &rules, &stage);
+    if (ret == ENOTCONN && ph_reconnect(ctx) == 0) {
+        ph_scoreboard_clock(&fetch_started);
+        ret = ph_fetch_ldap_data(ctx, pi.pam_service, scope_user,
+                                 &targethost, &service, &rules, &stage);
+    }
+    /* ENOENT and friends are answers, only count the server's own faults */
+    ph_scoreboard_report(ctx, ctx->server, PH_SERVER_SEARCH,
+                         ph_scoreboard_elapsed(&fetch_started),
+                         ret != ETIMEDOUT && ret != ENOTCONN && ret != EIO);
+    ph_destroy_secret(ctx);
+    if (ret == ETIMEDOUT) {
+        pam_ret = ph_timed_out(ctx, flags);
+        goto done;
+    } else if (ret != 0) {
+        switch (stage) {
+        case PH_FETCH_HOST:
+            if (ret == ENOENT) {
+                logger(pamh, LOG_NOTICE,
+                       "Did not find host %s denying access\n",
+                       ctx->pc->hostname);
+                pam_ret = PAM_PERM_DENIED;
+            } else {
+                logger(pamh, LOG_ERR,
+                       "ph_get_host error: %s", strerror(ret));
+                pam_ret = PAM_ABORT;
+            }
+            break;
+        case PH_FETCH_SVC:
+            if (ret == ENOENT) {
+                logger(pamh, LOG_NOTICE,
+                       "Did not find service %s denying access\n",
+                       pi.pam_service);
+                pam_ret = PAM_PERM_DENIED;
+            } else {
+                logger(pamh, LOG_ERR,
+                       "ph_get_svc error: %s", strerror(ret));
+                pam_ret = PAM_ABORT;
+            }
+            break;
+        case PH_FETCH_RULES:
+        default:
+            logger(pamh, LOG_ERR,
+                   "ph_get_hbac_rules returned error [%d]: %s",
+                   ret, strerror(ret));
+            pam_ret = PAM_SYSTEM_ERR;
+            break;
+        }
+        goto done;
+    }
+    logger(pamh, LOG_DEBUG, "ph_get_host: OK");
+    logger(pamh, LOG_DEBUG, "ph_get_hbac_rules: OK");
+
+    ret = ph_hbac_rules_user_groups(rules, &rule_groups);
+    if (ret == 0) {
+        ret = ph_resolve_user_groups(ctx, user, rule_groups);
+    }
     if (ret != 0) {
         logger(pamh, LOG_ERR,
-               "ph_create_eval_req returned error [%d]: %s",
-               ret, strerror(ret));
+               "Cannot resolve the groups of user %s [%d]: %s\n",
+               pi.pam_user, ret, strerror(ret));
         pam_ret = PAM_SYSTEM_ERR;
         goto done;
     }
-    logger(pamh, LOG_DEBUG, "ph_create_hbac_eval_req: OK");
 
-    ret = ph_get_hbac_rules(ctx, targethost, &rules);
+    /* Get data for eval request by matching the PAM service name with a downloaded
+     * service. Not matching it is not an error, it can still match /all/.
+     */
+    ret = ph_create_hbac_eval_req(ctx->arena, user, targethost, service,
+                                  pi.pam_service, ctx->pc->search_base,
+                                  &eval_req);
     if (ret != 0) {
         logger(pamh, LOG_ERR,
-               "ph_get_hbac_rules returned error [%d]: %s",
+               "ph_create_eval_req returned error [%d]: %s",
                ret, strerror(ret));
         pam_ret = PAM_SYSTEM_ERR;
         goto done;
     }
-    logger(pamh, LOG_DEBUG, "ph_get_hbac_rules: OK");
+    logger(pamh, LOG_DEBUG, "ph_create_hbac_eval_req: OK");
+
+    /* Failing to write the snapshot only means the next login goes to
+     * LDAP again. Rules narrowed down to this user must not be reused for
+     * other users.
+     */
+    if (scope_user == NULL) {
+        ret = ph_snapshot_write(pamh, ctx->pc, pi.pam_service,
+                                rules, eval_req);
+        if (ret != 0) {
+            logger(pamh, LOG_NOTICE,
+                   "ph_snapshot_write returned error [%d]: %s",
+                   ret, strerror(ret));
+        }
+    }
 
-    hbac_eval_result = hbac_evaluate(rules, eval_req, &info);
+    hbac_eval_result = ph_evaluate(pamh, rules, eval_req, &info);
+evaluated:
+    ph_dcache_store(dcache, hbac_eval_result);
+decided:
     switch (hbac_eval_result) {
     case HBAC_EVAL_ALLOW:
         logger(pamh, LOG_DEBUG, "Allowing access\n");
@@ -463,9 +786,13 @@ done:
     hbac_free_info(info);
     ph_free_hbac_rules(rules);
     ph_free_hbac_eval_req(eval_req);
+    free(rule_groups);
     ph_free_user(user);
     ph_entry_free(service);
     ph_entry_free(targethost);
+    ph_snapshot_close(snap);
+    ph_dcache_close(dcache);
+    ph_destroy_secret(ctx);
     ph_disconnect(ctx);
     ph_cleanup(ctx);
     return pam_ret;
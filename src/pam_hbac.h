@@ -26,6 +26,7 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <syslog.h>
+#include <time.h>
 
 #include <ldap.h>
 
@@ -46,8 +47,37 @@
 
 #define PAM_HBAC_CONFIG                PAM_HBAC_CONF_DIR"/"PAM_HBAC_CONFIG_FILE_NAME
 
+/* rule snapshots */
+#ifndef PAM_HBAC_CACHE_DIR
+#define PAM_HBAC_CACHE_DIR             "/var/cache/pam_hbac"
+#endif  /* PAM_HBAC_CACHE_DIR */
+
+/* decision cache */
+#ifndef PAM_HBAC_RUN_DIR
+#define PAM_HBAC_RUN_DIR               "/var/run/pam_hbac"
+#endif  /* PAM_HBAC_RUN_DIR */
+
+#define PAM_HBAC_DECISION_CACHE        PAM_HBAC_RUN_DIR"/decisions"
+
+/* server health scoreboard */
+#define PAM_HBAC_SERVER_SCOREBOARD     PAM_HBAC_RUN_DIR"/servers"
+
+/* circuit breaker */
+#define PAM_HBAC_BREAKER               PAM_HBAC_RUN_DIR"/breaker"
+
+/* group membership index for platforms without getgrouplist() */
+#define PAM_HBAC_GROUP_DB              "/etc/group"
+#define PAM_HBAC_NSSWITCH_CONF         "/etc/nsswitch.conf"
+#define PAM_HBAC_GROUP_INDEX           PAM_HBAC_RUN_DIR"/groups"
+
 /* config defaults */
 #define PAM_HBAC_DEFAULT_TIMEOUT        5
+#define PAM_HBAC_DEFAULT_RULES_CACHE_TTL    0   /* disabled */
+#define PAM_HBAC_DEFAULT_DECISION_CACHE_TTL 0   /* disabled */
+#define PAM_HBAC_DEFAULT_POOL_IDLE_TIMEOUT  0   /* disabled */
+#define PAM_HBAC_DEFAULT_HEDGE_DELAY        200 /* milliseconds */
+#define PAM_HBAC_DEFAULT_BREAKER_THRESHOLD  0   /* disabled */
+#define PAM_HBAC_DEFAULT_BREAKER_BACKOFF    10  /* seconds */
 
 /* default attributes */
 #define PAM_HBAC_ATTR_OC                "objectClass"
@@ -64,16 +94,51 @@
 #define PAM_HBAC_CONFIG_BIND_PW         "BIND_PW"
 #define PAM_HBAC_CONFIG_SSL_PATH        "SSL_PATH"
 #define PAM_HBAC_CONFIG_SECURE          "SECURE"
+#define PAM_HBAC_CONFIG_RULES_CACHE_TTL "RULES_CACHE_TTL"
+#define PAM_HBAC_CONFIG_RULES_CACHE_DIR "RULES_CACHE_DIR"
+#define PAM_HBAC_CONFIG_DECISION_CACHE_TTL  "DECISION_CACHE_TTL"
+#define PAM_HBAC_CONFIG_DECISION_CACHE_PATH "DECISION_CACHE_PATH"
+#define PAM_HBAC_CONFIG_POOL_IDLE_TIMEOUT   "CONNECTION_POOL_IDLE_TIMEOUT"
+#define PAM_HBAC_CONFIG_TIMEOUT         "TIMEOUT"
+#define PAM_HBAC_CONFIG_HEDGE_DELAY     "HEDGE_DELAY"
+#define PAM_HBAC_CONFIG_SCOREBOARD_PATH "SERVER_SCOREBOARD_PATH"
+#define PAM_HBAC_CONFIG_BREAKER_THRESHOLD   "CIRCUIT_BREAKER_THRESHOLD"
+#define PAM_HBAC_CONFIG_BREAKER_BACKOFF     "CIRCUIT_BREAKER_BACKOFF"
+#define PAM_HBAC_CONFIG_BREAKER_PATH        "CIRCUIT_BREAKER_PATH"
+#define PAM_HBAC_CONFIG_MATCH_GROUPS_BY_GID "MATCH_GROUPS_BY_GID"
+#define PAM_HBAC_CONFIG_NARROW_RULES_BY_SERVICE "NARROW_RULES_BY_SERVICE"
+#define PAM_HBAC_CONFIG_NARROW_RULES_BY_USER    "NARROW_RULES_BY_USER"
+#define PAM_HBAC_CONFIG_HOSTGROUP_FILTER_LIMIT  "HOSTGROUP_FILTER_LIMIT"
+
+struct ph_arena;
 
 struct pam_hbac_ctx {
     pam_handle_t *pamh;
     struct pam_hbac_config *pc;
     LDAP *ld;
+    /* ld was taken from the connection pool */
+    bool ld_reused;
+    /* ld has requests that timed out, never return it to the pool */
+    bool ld_broken;
+    /* CLOCK_MONOTONIC time all LDAP work must be done by, zero if unset */
+    struct timespec deadline;
+    /* The LDAP stage that was last started, for logging */
+    const char *stage;
+    /* The server ld is connected to, NULL if unknown */
+    const char *server;
+    /* Holds the rules, the request and the group names until the call
+     * returns. NULL allocates them from the heap.
+     */
+    struct ph_arena *arena;
 };
 
 /* pam_hbac_config.c */
 struct pam_hbac_config {
+    /* As configured, possibly a list */
     const char *uri;
+    /* The individual servers of the URI option */
+    char **uris;
+    size_t num_uris;
     const char *search_base;
     const char *bind_dn;
     const char *bind_pw;
@@ -81,6 +146,39 @@ struct pam_hbac_config {
     char *hostname;
     int timeout;
     bool secure;
+    /* 0 disables the rule snapshot */
+    int rules_cache_ttl;
+    /* NULL means PAM_HBAC_CACHE_DIR */
+    const char *rules_cache_dir;
+    /* 0 disables the decision cache */
+    int decision_cache_ttl;
+    /* NULL means PAM_HBAC_DECISION_CACHE */
+    const char *decision_cache_path;
+    /* 0 disables the connection pool */
+    int pool_idle_timeout;
+    /* Milliseconds to wait for a server before trying another one in
+     * parallel, 0 tries the servers one by one
+     */
+    int hedge_delay;
+    /* NULL means PAM_HBAC_SERVER_SCOREBOARD */
+    const char *scoreboard_path;
+    /* Consecutive connection failures that open the circuit breaker,
+     * 0 disables the breaker
+     */
+    int breaker_threshold;
+    /* Seconds the breaker stays open the first time */
+    int breaker_backoff;
+    /* NULL means PAM_HBAC_BREAKER */
+    const char *breaker_path;
+    /* Only look up the groups the rules reference, by GID */
+    bool match_groups_by_gid;
+    /* Only download the rules that can match the service or the user */
+    bool narrow_rules_by_service;
+    bool narrow_rules_by_user;
+    /* Hosts in more hostgroups have their rules matched locally, 0 always
+     * lists the hostgroups in the search filter
+     */
+    int hostgroup_filter_limit;
 };
 
 int
@@ -92,6 +190,8 @@ void ph_cleanup_config(struct pam_hbac_config *conf);
 void ph_dump_config(pam_handle_t *pamh, struct pam_hbac_config *conf);
 
 /* pam_hbac_util.c */
+struct stat;
+
 void free_string_clist(const char **list);
 void free_string_list(char **list);
 size_t null_string_array_size(char *arr[]);
@@ -99,5 +199,41 @@ size_t null_cstring_array_size(const char *arr[]);
 void logger(pam_handle_t *pamh, int level, const char *fmt, ...);
 void va_logger(pam_handle_t *pamh, int level, const char *fmt, va_list ap);
 void set_debug_mode(bool v);
+bool ph_file_trusted(pam_handle_t *pamh, const char *path,
+                     const struct stat *st);
+/* Creates the directory path is in with mode 0700 */
+int ph_mkdir_parent(const char *path);
+/* Locks the whole file with a lock of type F_RDLCK or F_WRLCK. A held
+ * lock is retried for a short while, but never past deadline, which may
+ * be NULL or zero if there is none. Returns EWOULDBLOCK if the lock could
+ * not be taken in time.
+ */
+int ph_lock_file(int fd, short type, const struct timespec *deadline);
+
+/* State files are small files shared by all processes that load pam_hbac.
+ * They start with a 64-bit magic number and a 32-bit version.
+ *
+ * ph_state_open() opens path with flags, creating its directory first if
+ * flags has O_CREAT, checks that the file can be trusted and locks it
+ * with ph_lock_file() unless lock_type is F_UNLCK. what names the file in
+ * log messages. Returns EPERM for an untrusted file.
+ */
+int ph_state_open(pam_handle_t *pamh,
+                  const char *what,
+                  const char *path,
+                  int flags,
+                  short lock_type,
+                  const struct timespec *deadline,
+                  int *_fd);
+
+/* Reads size bytes of state from the start of fd. Returns ENOENT if the
+ * file is empty and EINVAL if it is too short or has a different magic
+ * number or version.
+ */
+int ph_state_read(int fd,
+                  void *state,
+                  size_t size,
+                  uint64_t magic,
+                  uint32_t version);
 
 #endif /* __PAM_HBAC_H__ */
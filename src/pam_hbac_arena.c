@@ -0,0 +1,218 @@
+/*
+    Copyright (C) 2026 Jakub Hrozek <jakub.hrozek@posteo.se>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "pam_hbac_arena.h"
+
+/* The first chunk fits a small rule set, later ones double up to the
+ * maximum size
+ */
+#define PH_ARENA_MIN_CHUNK  (4 * 1024)
+#define PH_ARENA_MAX_CHUNK  (64 * 1024)
+
+/* Strictest alignment of the objects allocated from the arena */
+#define PH_ARENA_ALIGN      16
+
+#define PH_ARENA_ROUND(n)   (((n) + PH_ARENA_ALIGN - 1) \
+                             & ~((size_t) PH_ARENA_ALIGN - 1))
+
+struct ph_arena_chunk {
+    struct ph_arena_chunk *next;
+    size_t size;
+    size_t used;
+};
+
+#define PH_ARENA_CHUNK_HDR  PH_ARENA_ROUND(sizeof(struct ph_arena_chunk))
+
+struct ph_arena_cleanup {
+    struct ph_arena_cleanup *next;
+    ph_arena_cleanup_fn fn;
+    void *ptr;
+};
+
+struct ph_arena {
+    /* The chunk allocations are carved from is always the first one */
+    struct ph_arena_chunk *chunks;
+    struct ph_arena_cleanup *cleanups;
+    size_t next_size;
+};
+
+static struct ph_arena_chunk *
+chunk_new(size_t size)
+{
+    struct ph_arena_chunk *chunk;
+
+    chunk = malloc(PH_ARENA_CHUNK_HDR + size);
+    if (chunk == NULL) {
+        return NULL;
+    }
+
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+struct ph_arena *
+ph_arena_new(void)
+{
+    struct ph_arena *arena;
+
+    arena = calloc(1, sizeof(struct ph_arena));
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    arena->next_size = PH_ARENA_MIN_CHUNK;
+    return arena;
+}
+
+void
+ph_arena_free(struct ph_arena *arena)
+{
+    struct ph_arena_cleanup *c;
+    struct ph_arena_chunk *chunk;
+
+    if (arena == NULL) {
+        return;
+    }
+
+    /* The cleanup records live in the chunks themselves */
+    for (c = arena->cleanups; c != NULL; c = c->next) {
+        c->fn(c->ptr);
+    }
+
+    while (arena->chunks != NULL) {
+        chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        free(chunk);
+    }
+
+    free(arena);
+}
+
+static void *
+arena_alloc(struct ph_arena *arena, size_t size)
+{
+    struct ph_arena_chunk *chunk = arena->chunks;
+    void *p;
+
+    size = PH_ARENA_ROUND(size ? size : 1);
+
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        if (size > arena->next_size / 4) {
+            /* A large object gets a chunk of its own, behind the current
+             * one so that the rest of that is not wasted
+             */
+            chunk = chunk_new(size);
+            if (chunk == NULL) {
+                return NULL;
+            }
+            chunk->used = size;
+            if (arena->chunks != NULL) {
+                chunk->next = arena->chunks->next;
+                arena->chunks->next = chunk;
+            } else {
+                arena->chunks = chunk;
+            }
+            return (char *) chunk + PH_ARENA_CHUNK_HDR;
+        }
+
+        chunk = chunk_new(arena->next_size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        if (arena->next_size < PH_ARENA_MAX_CHUNK) {
+            arena->next_size *= 2;
+        }
+    }
+
+    p = (char *) chunk + PH_ARENA_CHUNK_HDR + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+void *
+ph_arena_calloc(struct ph_arena *arena, size_t nmemb, size_t size)
+{
+    void *p;
+
+    if (arena == NULL) {
+        return calloc(nmemb, size);
+    }
+
+    if (size != 0 && nmemb > (SIZE_MAX - PH_ARENA_ALIGN) / size) {
+        return NULL;
+    }
+
+    p = arena_alloc(arena, nmemb * size);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    memset(p, 0, nmemb * size);
+    return p;
+}
+
+char *
+ph_arena_strdup(struct ph_arena *arena, const char *s)
+{
+    size_t len;
+    char *p;
+
+    if (arena == NULL) {
+        return strdup(s);
+    }
+
+    len = strlen(s) + 1;
+    p = arena_alloc(arena, len);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    memcpy(p, s, len);
+    return p;
+}
+
+int
+ph_arena_defer(struct ph_arena *arena, ph_arena_cleanup_fn fn, void *ptr)
+{
+    struct ph_arena_cleanup *c;
+
+    if (arena == NULL || fn == NULL) {
+        return EINVAL;
+    }
+
+    c = arena_alloc(arena, sizeof(struct ph_arena_cleanup));
+    if (c == NULL) {
+        return ENOMEM;
+    }
+
+    c->fn = fn;
+    c->ptr = ptr;
+    c->next = arena->cleanups;
+    arena->cleanups = c;
+    return 0;
+}
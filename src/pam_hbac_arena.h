@@ -0,0 +1,55 @@
+/*
+    Copyright (C) 2026 Jakub Hrozek <jakub.hrozek@posteo.se>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __PAM_HBAC_ARENA_H__
+#define __PAM_HBAC_ARENA_H__
+
+#include <stdlib.h>
+
+/* A bump allocator for the objects of a single pam_hbac() call. The rules,
+ * the evaluation request and the user's group names are carved out of
+ * large chunks and all released at once by ph_arena_free().
+ *
+ * The memory is not wiped when the arena is released, secrets such as the
+ * bind password must never be allocated from it.
+ */
+struct ph_arena;
+
+typedef void (*ph_arena_cleanup_fn)(void *ptr);
+
+struct ph_arena *ph_arena_new(void);
+
+/* Runs the cleanups in the reverse order they were added and releases
+ * all the memory of the arena
+ */
+void ph_arena_free(struct ph_arena *arena);
+
+/* The allocation functions return zeroed memory aligned for any type.
+ * With a NULL arena they allocate from the heap instead, so that callers
+ * only have to tell the two apart when freeing.
+ */
+void *ph_arena_calloc(struct ph_arena *arena, size_t nmemb, size_t size);
+char *ph_arena_strdup(struct ph_arena *arena, const char *s);
+
+/* Calls fn(ptr) when the arena is released. Used for what objects in the
+ * arena still hold outside of it, such as the references rule elements
+ * hold on the shared, refcounted member names and the group names a
+ * request element owns.
+ */
+int ph_arena_defer(struct ph_arena *arena, ph_arena_cleanup_fn fn, void *ptr);
+
+#endif /* __PAM_HBAC_ARENA_H__ */
@@ -0,0 +1,289 @@
+/*
+    Copyright (C) 2026 Jakub Hrozek <jakub.hrozek@posteo.se>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "pam_hbac.h"
+#include "pam_hbac_breaker.h"
+
+#define PH_BREAKER_MAGIC        0x5048425245414b52ULL   /* "PHBREAKR" */
+#define PH_BREAKER_VERSION      1
+
+/* The backoff doubles with every failed probe up to this many seconds */
+#define PH_BREAKER_BACKOFF_MAX  600
+
+/* How long a probe may take if TIMEOUT does not limit it */
+#define PH_BREAKER_PROBE_WINDOW 60
+
+#define FNV64_OFFSET            0xcbf29ce484222325ULL
+#define FNV64_PRIME             0x100000001b3ULL
+
+struct ph_breaker_state {
+    uint64_t magic;
+    uint32_t version;
+    /* Consecutive connection failures */
+    uint32_t failures;
+    /* Hash of the URI option, the state is discarded if it changes */
+    uint64_t key;
+    /* Time the breaker opened, 0 if it is closed */
+    int64_t opened;
+    /* A probe is in flight until this time */
+    int64_t probe;
+    /* Number of times the breaker opened without a success in between */
+    uint32_t trips;
+    uint32_t reserved;
+};
+
+static const char *
+breaker_path(struct pam_hbac_config *pc)
+{
+    return pc->breaker_path ? pc->breaker_path : PAM_HBAC_BREAKER;
+}
+
+static uint64_t
+breaker_key(struct pam_hbac_config *pc)
+{
+    uint64_t h = FNV64_OFFSET;
+    const char *p;
+
+    for (p = pc->uri ? pc->uri : ""; *p != '\0'; p++) {
+        h ^= (uint8_t) *p;
+        h *= FNV64_PRIME;
+    }
+
+    return h;
+}
+
+static void
+breaker_reset(struct pam_hbac_config *pc, struct ph_breaker_state *st)
+{
+    memset(st, 0, sizeof(struct ph_breaker_state));
+    st->magic = PH_BREAKER_MAGIC;
+    st->version = PH_BREAKER_VERSION;
+    st->key = breaker_key(pc);
+}
+
+static int64_t
+breaker_backoff(struct pam_hbac_config *pc, uint32_t trips)
+{
+    int64_t backoff = pc->breaker_backoff > 0 ? pc->breaker_backoff : 1;
+    int64_t max = backoff > PH_BREAKER_BACKOFF_MAX ? backoff
+                                                   : PH_BREAKER_BACKOFF_MAX;
+
+    while (trips > 1 && backoff < max) {
+        backoff *= 2;
+        trips--;
+    }
+
+    return backoff < max ? backoff : max;
+}
+
+/* Opens, locks and reads the breaker file. A missing, foreign or
+ * unreadable state is returned as a closed breaker. A breaker that stays
+ * locked is treated like a missing one. Returns the locked descriptor
+ * or -1.
+ */
+static int
+breaker_open(struct pam_hbac_ctx *ctx,
+             bool create,
+             bool *_writable,
+             struct ph_breaker_state *st)
+{
+    struct pam_hbac_config *pc = ctx->pc;
+    bool writable = true;
+    int fd;
+    int ret;
+
+    ret = ph_state_open(ctx->pamh, "circuit breaker", breaker_path(pc),
+                        O_RDWR | (create ? O_CREAT : 0), F_WRLCK,
+                        &ctx->deadline, &fd);
+    if (ret == EACCES && !create) {
+        /* Unprivileged processes can still honour an open breaker */
+        ret = ph_state_open(ctx->pamh, "circuit breaker", breaker_path(pc),
+                            O_RDONLY, F_RDLCK, &ctx->deadline, &fd);
+        writable = false;
+    }
+    if (ret != 0) {
+        return -1;
+    }
+
+    ret = ph_state_read(fd, st, sizeof(struct ph_breaker_state),
+                        PH_BREAKER_MAGIC, PH_BREAKER_VERSION);
+    if (ret != 0 || st->key != breaker_key(pc)) {
+        breaker_reset(pc, st);
+    }
+
+    *_writable = writable;
+    return fd;
+}
+
+static void
+breaker_write(pam_handle_t *pamh,
+              struct pam_hbac_config *pc,
+              int fd,
+              struct ph_breaker_state *st)
+{
+    ssize_t n;
+
+    n = pwrite(fd, st, sizeof(struct ph_breaker_state), 0);
+    if (n != sizeof(struct ph_breaker_state)) {
+        logger(pamh, LOG_NOTICE,
+               "Cannot update circuit breaker %s\n", breaker_path(pc));
+    }
+}
+
+bool
+ph_breaker_allow(struct pam_hbac_ctx *ctx)
+{
+    pam_handle_t *pamh;
+    struct pam_hbac_config *pc;
+    struct ph_breaker_state st;
+    bool writable;
+    int64_t reopen;
+    time_t now;
+    bool allow = true;
+    int fd;
+
+    if (ctx == NULL || ctx->pc == NULL || ctx->pc->breaker_threshold <= 0) {
+        return true;
+    }
+    pamh = ctx->pamh;
+    pc = ctx->pc;
+
+    fd = breaker_open(ctx, false, &writable, &st);
+    if (fd == -1) {
+        return true;
+    }
+
+    if (st.opened == 0) {
+        goto done;
+    }
+
+    now = time(NULL);
+    reopen = st.opened + breaker_backoff(pc, st.trips);
+    if (now < reopen) {
+        logger(pamh, LOG_NOTICE,
+               "The LDAP server could not be reached %u times in a row, "
+               "not connecting for another %lld seconds\n",
+               st.failures, (long long) (reopen - now));
+        allow = false;
+        goto done;
+    }
+
+    if (now < st.probe) {
+        logger(pamh, LOG_NOTICE,
+               "Another process is checking if the LDAP server is "
+               "reachable again, not connecting\n");
+        allow = false;
+        goto done;
+    }
+
+    /* Half-open, this call is the probe */
+    if (writable) {
+        st.probe = now + (pc->timeout > 0 ? pc->timeout + 1
+                                          : PH_BREAKER_PROBE_WINDOW);
+        breaker_write(pamh, pc, fd, &st);
+    }
+    logger(pamh, LOG_NOTICE,
+           "Checking if the LDAP server is reachable again\n");
+
+done:
+    close(fd);
+    return allow;
+}
+
+void
+ph_breaker_report(struct pam_hbac_ctx *ctx, int connect_ret)
+{
+    pam_handle_t *pamh;
+    struct pam_hbac_config *pc;
+    struct ph_breaker_state st;
+    bool writable;
+    bool failed;
+    int fd;
+
+    if (ctx == NULL || ctx->pc == NULL || ctx->pc->breaker_threshold <= 0) {
+        return;
+    }
+    pamh = ctx->pamh;
+    pc = ctx->pc;
+
+    /* A rejected bind still means that the server is up */
+    if (connect_ret == 0 || connect_ret == EACCES) {
+        failed = false;
+    } else if (connect_ret == EIO || connect_ret == ETIMEDOUT) {
+        failed = true;
+    } else {
+        return;
+    }
+
+    fd = breaker_open(ctx, failed, &writable, &st);
+    if (fd == -1) {
+        return;
+    }
+
+    if (!writable) {
+        goto done;
+    }
+
+    if (!failed) {
+        if (st.failures == 0 && st.opened == 0) {
+            /* The common case, nothing to write */
+            goto done;
+        }
+
+        if (st.opened != 0) {
+            logger(pamh, LOG_NOTICE,
+                   "The LDAP server is reachable again, "
+                   "closing the circuit breaker\n");
+        }
+        breaker_reset(pc, &st);
+        breaker_write(pamh, pc, fd, &st);
+        goto done;
+    }
+
+    st.failures++;
+    /* Open the breaker, or open it again if the probe failed. Failures of
+     * logins that started before the breaker opened do not count.
+     */
+    if ((st.opened == 0 && st.failures >= (uint32_t) pc->breaker_threshold)
+            || (st.opened != 0 && st.probe != 0)) {
+        st.trips++;
+        st.opened = time(NULL);
+        st.probe = 0;
+        logger(pamh, LOG_ERR,
+               "The LDAP server could not be reached %u times in a row, "
+               "not connecting for %lld seconds\n",
+               st.failures, (long long) breaker_backoff(pc, st.trips));
+    }
+    breaker_write(pamh, pc, fd, &st);
+
+done:
+    close(fd);
+}
@@ -0,0 +1,42 @@
+/*
+    Copyright (C) 2026 Jakub Hrozek <jakub.hrozek@posteo.se>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __PAM_HBAC_BREAKER_H__
+#define __PAM_HBAC_BREAKER_H__
+
+#include "pam_hbac.h"
+
+/* The circuit breaker remembers across processes that the LDAP servers
+ * could not be reached. After CIRCUIT_BREAKER_THRESHOLD consecutive
+ * connection failures it opens and logins stop connecting at all. Once
+ * the backoff expires, a single login is let through as a probe; the
+ * breaker closes if the probe connects and opens again with twice the
+ * backoff if it does not.
+ */
+
+/* Returns false if the breaker is open and no connection should be
+ * attempted. Returns true if the caller may connect, possibly as the
+ * probe of a half-open breaker.
+ */
+bool ph_breaker_allow(struct pam_hbac_ctx *ctx);
+
+/* Records the result of ph_connect(). Only errors that mean that the
+ * servers cannot be reached count as failures.
+ */
+void ph_breaker_report(struct pam_hbac_ctx *ctx, int connect_ret);
+
+#endif /* __PAM_HBAC_BREAKER_H__ */
@@ -0,0 +1,79 @@
+/*
+    Copyright (C) 2026 Jakub Hrozek <jakub.hrozek@posteo.se>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pam_hbac.h"
+#include "pam_hbac_dcache.h"
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-c config_file] flush\n", prog);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *config_file = PAM_HBAC_CONFIG;
+    struct pam_hbac_config *pc = NULL;
+    int opt;
+    int ret;
+
+    while ((opt = getopt(argc, argv, "c:h")) != -1) {
+        switch (opt) {
+        case 'c':
+            config_file = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1 || strcmp(argv[optind], "flush") != 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    set_debug_mode(false);
+
+    ret = ph_read_config(NULL, config_file, &pc);
+    if (ret != 0) {
+        fprintf(stderr, "Cannot read %s: %s\n", config_file, strerror(ret));
+        return 1;
+    }
+
+    ret = ph_dcache_flush(NULL, pc);
+    if (ret != 0) {
+        fprintf(stderr, "Cannot flush the decision cache %s: %s\n",
+                pc->decision_cache_path ? pc->decision_cache_path
+                                        : PAM_HBAC_DECISION_CACHE,
+                strerror(ret));
+    }
+
+    ph_cleanup_config(pc);
+    return ret == 0 ? 0 : 1;
+}
@@ -37,11 +37,16 @@ ph_cleanup_config(struct pam_hbac_config *conf)
     }
 
     free_const(conf->uri);
+    free_string_list(conf->uris);
     free_const(conf->search_base);
     free_const(conf->bind_dn);
     free_const(conf->bind_pw);
     free_const(conf->ca_cert);
     free(conf->hostname);
+    free_const(conf->rules_cache_dir);
+    free_const(conf->decision_cache_path);
+    free_const(conf->scoreboard_path);
+    free_const(conf->breaker_path);
 
     free(conf);
 }
@@ -56,6 +61,56 @@ int check_mandatory_opt(pam_handle_t *pamh, const char *name, const char *value)
     return 0;
 }
 
+/* The URI option may list several servers separated by whitespace or
+ * commas, like ldap.conf does
+ */
+static int
+split_uris(pam_handle_t *pamh, struct pam_hbac_config *conf)
+{
+    char *copy;
+    char *tok;
+    char *saveptr = NULL;
+    char **uris;
+    size_t num_uris = 0;
+
+    copy = strdup(conf->uri);
+    if (copy == NULL) {
+        return ENOMEM;
+    }
+
+    /* Can't have more tokens than bytes */
+    uris = calloc(strlen(conf->uri) + 1, sizeof(char *));
+    if (uris == NULL) {
+        free(copy);
+        return ENOMEM;
+    }
+
+    for (tok = strtok_r(copy, " \t,", &saveptr);
+         tok != NULL;
+         tok = strtok_r(NULL, " \t,", &saveptr)) {
+        uris[num_uris] = strdup(tok);
+        if (uris[num_uris] == NULL) {
+            free(copy);
+            free_string_list(uris);
+            return ENOMEM;
+        }
+        logger(pamh, LOG_DEBUG, "server %zu: %s\n", num_uris, tok);
+        num_uris++;
+    }
+    free(copy);
+
+    if (num_uris == 0) {
+        logger(pamh, LOG_ERR, "The %s option is empty\n",
+               PAM_HBAC_CONFIG_URI);
+        free(uris);
+        return EINVAL;
+    }
+
+    conf->uris = uris;
+    conf->num_uris = num_uris;
+    return 0;
+}
+
 static int
 check_config(pam_handle_t *pamh, struct pam_hbac_config *conf)
 {
@@ -71,7 +126,7 @@ check_config(pam_handle_t *pamh, struct pam_hbac_config *conf)
         return EINVAL;
     }
 
-    return 0;
+    return split_uris(pamh, conf);
 }
 
 static int
@@ -149,6 +204,12 @@ default_config(pam_handle_t *pamh, struct pam_hbac_config *conf)
 
     conf->timeout = PAM_HBAC_DEFAULT_TIMEOUT;
     conf->secure = true;
+    conf->rules_cache_ttl = PAM_HBAC_DEFAULT_RULES_CACHE_TTL;
+    conf->decision_cache_ttl = PAM_HBAC_DEFAULT_DECISION_CACHE_TTL;
+    conf->pool_idle_timeout = PAM_HBAC_DEFAULT_POOL_IDLE_TIMEOUT;
+    conf->hedge_delay = PAM_HBAC_DEFAULT_HEDGE_DELAY;
+    conf->breaker_threshold = PAM_HBAC_DEFAULT_BREAKER_THRESHOLD;
+    conf->breaker_backoff = PAM_HBAC_DEFAULT_BREAKER_BACKOFF;
     return 0;
 }
 
@@ -218,6 +279,28 @@ static bool get_bool(const char *value, bool dfl)
     return dfl;
 }
 
+static int get_int(const char *value, int dfl)
+{
+    char *endptr;
+    long l;
+
+    if (value == NULL) {
+        return dfl;
+    }
+
+    errno = 0;
+    l = strtol(value, &endptr, 10);
+    if (errno != 0 || endptr == value || *endptr != '\0') {
+        return dfl;
+    }
+
+    if (l < 0 || l > INT_MAX) {
+        return dfl;
+    }
+
+    return (int) l;
+}
+
 static int
 read_config_line(pam_handle_t *pamh,
                  const char *line,
@@ -273,6 +356,80 @@ read_config_line(pam_handle_t *pamh,
         logger(pamh, LOG_DEBUG,
                "use TLS/SSL: %s", conf->secure ? "yes" : "no");
         free_const(value);
+    } else if (strcasecmp(key, PAM_HBAC_CONFIG_RULES_CACHE_TTL) == 0) {
+        conf->rules_cache_ttl = get_int(value, conf->rules_cache_ttl);
+        logger(pamh, LOG_DEBUG,
+               "rules cache TTL: %d\n", conf->rules_cache_ttl);
+        free_const(value);
+    } else if (strcasecmp(key, PAM_HBAC_CONFIG_RULES_CACHE_DIR) == 0) {
+        conf->rules_cache_dir = value;
+        logger(pamh, LOG_DEBUG,
+               "rules cache directory: %s", conf->rules_cache_dir);
+    } else if (strcasecmp(key, PAM_HBAC_CONFIG_DECISION_CACHE_TTL) == 0) {
+        conf->decision_cache_ttl = get_int(value, conf->decision_cache_ttl);
+        logger(pamh, LOG_DEBUG,
+               "decision cache TTL: %d\n", conf->decision_cache_ttl);
+        free_const(value);
+    } else if (strcasecmp(key, PAM_HBAC_CONFIG_DECISION_CACHE_PATH) == 0) {
+        conf->decision_cache_path = value;
+        logger(pamh, LOG_DEBUG,
+               "decision cache path: %s", conf->decision_cache_path);
+    } else if (strcasecmp(key, PAM_HBAC_CONFIG_TIMEOUT) == 0) {
+        conf->timeout = get_int(value, conf->timeout);
+        logger(pamh, LOG_DEBUG, "timeout: %d\n", conf->timeout);
+        free_const(value);
+    } else if (strcasecmp(key, PAM_HBAC_CONFIG_HEDGE_DELAY) == 0) {
+        conf->hedge_delay = get_int(value, conf->hedge_delay);
+        logger(pamh, LOG_DEBUG, "hedge delay: %d\n", conf->hedge_delay);
+        free_const(value);
+    } else if (strcasecmp(key, PAM_HBAC_CONFIG_SCOREBOARD_PATH) == 0) {
+        conf->scoreboard_path = value;
+        logger(pamh, LOG_DEBUG,
+               "server scoreboard path: %s", conf->scoreboard_path);
+    } else if (strcasecmp(key, PAM_HBAC_CONFIG_BREAKER_THRESHOLD) == 0) {
+        conf->breaker_threshold = get_int(value, conf->breaker_threshold);
+        logger(pamh, LOG_DEBUG,
+               "circuit breaker threshold: %d\n", conf->breaker_threshold);
+        free_const(value);
+    } else if (strcasecmp(key, PAM_HBAC_CONFIG_BREAKER_BACKOFF) == 0) {
+        conf->breaker_backoff = get_int(value, conf->breaker_backoff);
+        logger(pamh, LOG_DEBUG,
+               "circuit breaker backoff: %d\n", conf->breaker_backoff);
+        free_const(value);
+    } else if (strcasecmp(key, PAM_HBAC_CONFIG_BREAKER_PATH) == 0) {
+        conf->breaker_path = value;
+        logger(pamh, LOG_DEBUG,
+               "circuit breaker path: %s", conf->breaker_path);
+    } else if (strcasecmp(key, PAM_HBAC_CONFIG_MATCH_GROUPS_BY_GID) == 0) {
+        conf->match_groups_by_gid = get_bool(value,
+                                             conf->match_groups_by_gid);
+        logger(pamh, LOG_DEBUG, "match groups by GID: %s",
+               conf->match_groups_by_gid ? "yes" : "no");
+        free_const(value);
+    } else if (strcasecmp(key,
+                          PAM_HBAC_CONFIG_NARROW_RULES_BY_SERVICE) == 0) {
+        conf->narrow_rules_by_service = get_bool(value,
+                                            conf->narrow_rules_by_service);
+        logger(pamh, LOG_DEBUG, "narrow rules by service: %s",
+               conf->narrow_rules_by_service ? "yes" : "no");
+        free_const(value);
+    } else if (strcasecmp(key, PAM_HBAC_CONFIG_NARROW_RULES_BY_USER) == 0) {
+        conf->narrow_rules_by_user = get_bool(value,
+                                              conf->narrow_rules_by_user);
+        logger(pamh, LOG_DEBUG, "narrow rules by user: %s",
+               conf->narrow_rules_by_user ? "yes" : "no");
+        free_const(value);
+    } else if (strcasecmp(key, PAM_HBAC_CONFIG_HOSTGROUP_FILTER_LIMIT) == 0) {
+        conf->hostgroup_filter_limit = get_int(value,
+                                               conf->hostgroup_filter_limit);
+        logger(pamh, LOG_DEBUG,
+               "hostgroup filter limit: %d\n", conf->hostgroup_filter_limit);
+        free_const(value);
+    } else if (strcasecmp(key, PAM_HBAC_CONFIG_POOL_IDLE_TIMEOUT) == 0) {
+        conf->pool_idle_timeout = get_int(value, conf->pool_idle_timeout);
+        logger(pamh, LOG_DEBUG,
+               "connection pool idle timeout: %d\n", conf->pool_idle_timeout);
+        free_const(value);
     } else {
         /* Skip unknown key/values */
         free_const(value);
@@ -388,4 +545,34 @@ ph_dump_config(pam_handle_t *pamh, struct pam_hbac_config *conf)
     log_string_opt(pamh, "client hostname", conf->hostname);
     log_string_opt(pamh, "cert", conf->ca_cert);
     logger(pamh, LOG_DEBUG, "timeout %d\n", conf->timeout);
+    logger(pamh, LOG_DEBUG, "rules cache TTL %d\n", conf->rules_cache_ttl);
+    log_string_opt(pamh, "rules cache directory",
+                   conf->rules_cache_dir ? conf->rules_cache_dir
+                                         : PAM_HBAC_CACHE_DIR);
+    logger(pamh, LOG_DEBUG,
+           "decision cache TTL %d\n", conf->decision_cache_ttl);
+    log_string_opt(pamh, "decision cache path",
+                   conf->decision_cache_path ? conf->decision_cache_path
+                                             : PAM_HBAC_DECISION_CACHE);
+    logger(pamh, LOG_DEBUG,
+           "connection pool idle timeout %d\n", conf->pool_idle_timeout);
+    logger(pamh, LOG_DEBUG, "hedge delay %d\n", conf->hedge_delay);
+    log_string_opt(pamh, "server scoreboard path",
+                   conf->scoreboard_path ? conf->scoreboard_path
+                                         : PAM_HBAC_SERVER_SCOREBOARD);
+    logger(pamh, LOG_DEBUG,
+           "circuit breaker threshold %d\n", conf->breaker_threshold);
+    logger(pamh, LOG_DEBUG,
+           "circuit breaker backoff %d\n", conf->breaker_backoff);
+    log_string_opt(pamh, "circuit breaker path",
+                   conf->breaker_path ? conf->breaker_path
+                                      : PAM_HBAC_BREAKER);
+    logger(pamh, LOG_DEBUG, "match groups by GID: %s\n",
+           conf->match_groups_by_gid ? "yes" : "no");
+    logger(pamh, LOG_DEBUG, "narrow rules by service: %s\n",
+           conf->narrow_rules_by_service ? "yes" : "no");
+    logger(pamh, LOG_DEBUG, "narrow rules by user: %s\n",
+           conf->narrow_rules_by_user ? "yes" : "no");
+    logger(pamh, LOG_DEBUG,
+           "hostgroup filter limit %d\n", conf->hostgroup_filter_limit);
 }
@@ -0,0 +1,707 @@
+/*
+    Copyright (C) 2026 Jakub Hrozek <jakub.hrozek@posteo.se>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "pam_hbac.h"
+#include "pam_hbac_obj_int.h"
+#include "pam_hbac_dcache.h"
+
+#ifndef MAP_FAILED
+#define MAP_FAILED ((void *) -1)
+#endif
+
+#define PH_DCACHE_MAGIC         0x5048444341434845ULL   /* "PHDCACHE" */
+#define PH_DCACHE_VERSION       1
+#define PH_DCACHE_SLOTS         4096
+/* How many consecutive slots a key may be stored in */
+#define PH_DCACHE_PROBES        8
+
+#define FNV64_OFFSET            0xcbf29ce484222325ULL
+#define FNV64_PRIME             0x100000001b3ULL
+
+struct ph_dcache_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t num_slots;
+    /* Random per-file salt, makes it impractical to precompute keys
+     * that collide
+     */
+    uint64_t salt[2];
+};
+
+struct ph_dcache_slot {
+    /* Odd while a writer is updating the slot. Writers also hold a lock on
+     * the slot's byte range, an odd slot that nobody has locked was left
+     * behind by a writer that died mid-update.
+     */
+    uint32_t seq;
+    uint32_t result;
+    uint64_t key_lo;
+    uint64_t key_hi;
+    int64_t expires;
+};
+
+struct ph_dcache {
+    pam_handle_t *pamh;
+    int ttl;
+    int fd;
+
+    void *map;
+    size_t map_size;
+    const struct ph_dcache_header *hdr;
+    volatile struct ph_dcache_slot *slots;
+
+    uint64_t key_lo;
+    uint64_t key_hi;
+};
+
+#ifdef HAVE_SYNC_BUILTINS
+
+static size_t
+dcache_size(uint32_t num_slots)
+{
+    return sizeof(struct ph_dcache_header)
+            + num_slots * sizeof(struct ph_dcache_slot);
+}
+
+static const char *
+dcache_path(struct pam_hbac_config *pc)
+{
+    return pc->decision_cache_path ? pc->decision_cache_path
+                                   : PAM_HBAC_DECISION_CACHE;
+}
+
+static int
+read_salt(uint64_t salt[2])
+{
+    ssize_t n;
+    int fd;
+    int ret;
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd == -1) {
+        return errno;
+    }
+
+    n = read(fd, salt, 2 * sizeof(uint64_t));
+    ret = (n == 2 * sizeof(uint64_t)) ? 0 : EIO;
+    close(fd);
+    return ret;
+}
+
+/* Prepare an empty cache in a temporary file and move it into place. With
+ * replace == false, an existing cache is left alone, which makes creating
+ * the cache safe against concurrent logins doing the same.
+ */
+static int
+dcache_create(pam_handle_t *pamh, const char *path, bool replace)
+{
+    struct ph_dcache_header hdr;
+    char *tmp_path = NULL;
+    size_t size;
+    ssize_t n;
+    int fd = -1;
+    int ret;
+
+    ret = ph_mkdir_parent(path);
+    if (ret != 0) {
+        logger(pamh, LOG_NOTICE,
+               "Cannot create the directory of %s [%d]: %s\n",
+               path, ret, strerror(ret));
+        return ret;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = PH_DCACHE_MAGIC;
+    hdr.version = PH_DCACHE_VERSION;
+    hdr.num_slots = PH_DCACHE_SLOTS;
+    ret = read_salt(hdr.salt);
+    if (ret != 0) {
+        logger(pamh, LOG_ERR,
+               "Cannot read random data [%d]: %s\n", ret, strerror(ret));
+        return ret;
+    }
+
+    if (asprintf(&tmp_path, "%s.XXXXXX", path) < 0) {
+        return ENOMEM;
+    }
+
+    fd = mkstemp(tmp_path);
+    if (fd == -1) {
+        ret = errno;
+        logger(pamh, LOG_NOTICE,
+               "Cannot create %s [%d]: %s\n", tmp_path, ret, strerror(ret));
+        goto done;
+    }
+
+    /* The slots are zero-filled by ftruncate, which marks them empty */
+    size = dcache_size(hdr.num_slots);
+    if (ftruncate(fd, size) == -1) {
+        ret = errno;
+        goto done;
+    }
+
+    n = pwrite(fd, &hdr, sizeof(hdr), 0);
+    if (n != sizeof(hdr)) {
+        ret = n == -1 ? errno : EIO;
+        goto done;
+    }
+
+    if (replace) {
+        if (rename(tmp_path, path) == -1) {
+            ret = errno;
+            goto done;
+        }
+    } else {
+        if (link(tmp_path, path) == -1 && errno != EEXIST) {
+            ret = errno;
+            goto done;
+        }
+    }
+
+    ret = 0;
+done:
+    if (ret != 0) {
+        logger(pamh, LOG_ERR,
+               "Cannot create decision cache %s [%d]: %s\n",
+               path, ret, strerror(ret));
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    unlink(tmp_path);
+    free(tmp_path);
+    return ret;
+}
+
+static int
+dcache_map(pam_handle_t *pamh, const char *path, struct ph_dcache *dc)
+{
+    struct ph_dcache_header hdr;
+    struct stat st;
+    void *map;
+    int fd;
+    int ret;
+
+    dc->fd = -1;
+
+    ret = ph_state_open(pamh, "decision cache", path, O_RDWR, F_UNLCK,
+                        NULL, &fd);
+    if (ret == ENOENT) {
+        ret = dcache_create(pamh, path, false);
+        if (ret != 0) {
+            return ret;
+        }
+        ret = ph_state_open(pamh, "decision cache", path, O_RDWR, F_UNLCK,
+                            NULL, &fd);
+    }
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret = ph_state_read(fd, &hdr, sizeof(hdr),
+                        PH_DCACHE_MAGIC, PH_DCACHE_VERSION);
+    if (ret != 0 || hdr.num_slots != PH_DCACHE_SLOTS) {
+        logger(pamh, LOG_NOTICE,
+               "Decision cache %s has an unknown format\n", path);
+        ret = EINVAL;
+        goto done;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        ret = errno;
+        goto done;
+    }
+
+    if ((size_t) st.st_size != dcache_size(PH_DCACHE_SLOTS)) {
+        logger(pamh, LOG_NOTICE,
+               "Decision cache %s has an unexpected size\n", path);
+        ret = EINVAL;
+        goto done;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        ret = errno;
+        logger(pamh, LOG_ERR,
+               "Cannot map decision cache %s [%d]: %s\n",
+               path, ret, strerror(ret));
+        goto done;
+    }
+
+    dc->map = map;
+    dc->map_size = st.st_size;
+    dc->hdr = map;
+    dc->slots = (volatile struct ph_dcache_slot *)
+                    ((uint8_t *) map + sizeof(struct ph_dcache_header));
+    /* Kept open for the slot locks */
+    dc->fd = fd;
+    fd = -1;
+
+    ret = 0;
+done:
+    if (fd != -1) {
+        close(fd);
+    }
+    return ret;
+}
+
+static void
+hash_bytes(uint64_t h[2], const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    size_t i;
+
+    /* Two unrelated 64-bit hashes, together used as a 128-bit key */
+    for (i = 0; i < len; i++) {
+        h[0] ^= p[i];
+        h[0] *= FNV64_PRIME;
+
+        h[1] = ((h[1] << 5) | (h[1] >> 59)) ^ p[i];
+        h[1] *= 0x9e3779b97f4a7c15ULL;
+    }
+}
+
+static void
+hash_str(uint64_t h[2], const char *s)
+{
+    /* Including the terminator keeps "ab","c" apart from "a","bc" */
+    hash_bytes(h, s ? s : "", s ? strlen(s) + 1 : 1);
+}
+
+static uint64_t
+mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static int
+cmp_group_names(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static int
+cmp_gids(const void *a, const void *b)
+{
+    gid_t ga = *(const gid_t *) a;
+    gid_t gb = *(const gid_t *) b;
+
+    return ga < gb ? -1 : (ga > gb);
+}
+
+/* The group names are only resolved once the rules are known, which is
+ * after the cache is opened, the key covers the GIDs instead
+ */
+static int
+hash_gids(uint64_t h[2], struct ph_user *user)
+{
+    uint64_t num_gids = user->num_gids;
+    gid_t *gids = NULL;
+
+    if (num_gids > 0) {
+        gids = malloc(num_gids * sizeof(gid_t));
+        if (gids == NULL) {
+            return ENOMEM;
+        }
+        memcpy(gids, user->gids, num_gids * sizeof(gid_t));
+        qsort(gids, num_gids, sizeof(gid_t), cmp_gids);
+    }
+
+    hash_str(h, "gids");
+    hash_bytes(h, &num_gids, sizeof(num_gids));
+    if (num_gids > 0) {
+        hash_bytes(h, gids, num_gids * sizeof(gid_t));
+    }
+    free(gids);
+    return 0;
+}
+
+static int
+dcache_key(struct ph_dcache *dc,
+           struct pam_hbac_config *pc,
+           struct ph_user *user,
+           const char *service)
+{
+    uint64_t h[2];
+    uint64_t num_groups;
+    char **groups = NULL;
+    size_t i;
+    int ret;
+
+    num_groups = null_string_array_size(user->group_names);
+    if (num_groups > 0) {
+        /* The key must not depend on the order NSS returns groups in */
+        groups = malloc(num_groups * sizeof(char *));
+        if (groups == NULL) {
+            return ENOMEM;
+        }
+        memcpy(groups, user->group_names, num_groups * sizeof(char *));
+        qsort(groups, num_groups, sizeof(char *), cmp_group_names);
+    }
+
+    h[0] = FNV64_OFFSET ^ dc->hdr->salt[0];
+    h[1] = dc->hdr->salt[1];
+
+    /* Decisions are only valid for the server and host they were made
+     * against
+     */
+    hash_str(h, pc->uri);
+    hash_str(h, pc->search_base);
+    hash_str(h, pc->hostname);
+    hash_str(h, service);
+    hash_str(h, user->name);
+    if (user->group_names == NULL) {
+        ret = hash_gids(h, user);
+        if (ret != 0) {
+            return ret;
+        }
+    } else {
+        hash_bytes(h, &num_groups, sizeof(num_groups));
+        for (i = 0; i < num_groups; i++) {
+            hash_str(h, groups[i]);
+        }
+        free(groups);
+    }
+
+    dc->key_lo = mix64(h[0]);
+    dc->key_hi = mix64(h[1]);
+    if (dc->key_lo == 0 && dc->key_hi == 0) {
+        /* reserved for empty slots */
+        dc->key_lo = 1;
+    }
+
+    return 0;
+}
+
+struct ph_dcache *
+ph_dcache_open(pam_handle_t *pamh,
+               struct pam_hbac_config *pc,
+               struct ph_user *user,
+               const char *service)
+{
+    struct ph_dcache *dc;
+    int ret;
+
+    if (pc == NULL || user == NULL || service == NULL
+            || pc->decision_cache_ttl <= 0) {
+        return NULL;
+    }
+
+    dc = calloc(1, sizeof(struct ph_dcache));
+    if (dc == NULL) {
+        return NULL;
+    }
+    dc->pamh = pamh;
+    dc->ttl = pc->decision_cache_ttl;
+
+    ret = dcache_map(pamh, dcache_path(pc), dc);
+    if (ret != 0) {
+        free(dc);
+        return NULL;
+    }
+
+    ret = dcache_key(dc, pc, user, service);
+    if (ret != 0) {
+        ph_dcache_close(dc);
+        return NULL;
+    }
+
+    return dc;
+}
+
+void
+ph_dcache_close(struct ph_dcache *dc)
+{
+    if (dc == NULL) {
+        return;
+    }
+
+    if (dc->map != NULL) {
+        munmap(dc->map, dc->map_size);
+    }
+    if (dc->fd != -1) {
+        close(dc->fd);
+    }
+    free(dc);
+}
+
+/* Copies a consistent snapshot of a slot or returns false if a writer
+ * was active
+ */
+static bool
+slot_read(volatile struct ph_dcache_slot *slot, struct ph_dcache_slot *out)
+{
+    uint32_t seq;
+
+    seq = slot->seq;
+    if (seq & 1) {
+        return false;
+    }
+    __sync_synchronize();
+
+    out->result = slot->result;
+    out->key_lo = slot->key_lo;
+    out->key_hi = slot->key_hi;
+    out->expires = slot->expires;
+
+    __sync_synchronize();
+    return slot->seq == seq;
+}
+
+static volatile struct ph_dcache_slot *
+probe_slot(struct ph_dcache *dc, unsigned int probe)
+{
+    return &dc->slots[(dc->key_lo + probe) % dc->hdr->num_slots];
+}
+
+/* Never waits, returns EWOULDBLOCK if another writer holds the slot. The
+ * kernel drops the lock of a process that dies, unlike the odd sequence
+ * counter.
+ */
+static int
+slot_lock(struct ph_dcache *dc,
+          volatile struct ph_dcache_slot *slot,
+          short type)
+{
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = (const volatile uint8_t *) slot
+                    - (const volatile uint8_t *) dc->map;
+    fl.l_len = sizeof(struct ph_dcache_slot);
+
+    if (fcntl(dc->fd, F_SETLK, &fl) == -1) {
+        return (errno == EACCES || errno == EAGAIN) ? EWOULDBLOCK : errno;
+    }
+    return 0;
+}
+
+int
+ph_dcache_lookup(struct ph_dcache *dc,
+                 enum hbac_eval_result *_result)
+{
+    struct ph_dcache_slot copy;
+    time_t now;
+    unsigned int i;
+
+    if (dc == NULL || _result == NULL) {
+        return EINVAL;
+    }
+
+    now = time(NULL);
+
+    for (i = 0; i < PH_DCACHE_PROBES; i++) {
+        if (!slot_read(probe_slot(dc, i), &copy)) {
+            continue;
+        }
+
+        if (copy.key_lo == 0 && copy.key_hi == 0) {
+            /* Keys are never removed, so an empty slot ends the chain */
+            break;
+        }
+
+        if (copy.key_lo != dc->key_lo || copy.key_hi != dc->key_hi) {
+            continue;
+        }
+
+        /* Also distrust entries from the future, the clock may have
+         * been stepped back since they were stored
+         */
+        if (copy.expires <= (int64_t) now
+                || copy.expires - (int64_t) now > dc->ttl) {
+            break;
+        }
+
+        if (copy.result != HBAC_EVAL_ALLOW && copy.result != HBAC_EVAL_DENY) {
+            break;
+        }
+
+        logger(dc->pamh, LOG_DEBUG, "Decision cache hit\n");
+        *_result = copy.result;
+        return 0;
+    }
+
+    logger(dc->pamh, LOG_DEBUG, "Decision cache miss\n");
+    return ENOENT;
+}
+
+void
+ph_dcache_store(struct ph_dcache *dc,
+                enum hbac_eval_result result)
+{
+    volatile struct ph_dcache_slot *slot;
+    volatile struct ph_dcache_slot *victim = NULL;
+    volatile struct ph_dcache_slot *busy = NULL;
+    struct ph_dcache_slot copy;
+    int64_t victim_expires = INT64_MAX;
+    bool ours = false;
+    uint32_t seq;
+    time_t now;
+    unsigned int i;
+
+    /* Errors are never cached */
+    if (dc == NULL
+            || (result != HBAC_EVAL_ALLOW && result != HBAC_EVAL_DENY)) {
+        return;
+    }
+
+    now = time(NULL);
+
+    /* Prefer the slot that already holds our key, then one abandoned by
+     * a writer, then an empty one and finally the one closest to expiring
+     */
+    for (i = 0; i < PH_DCACHE_PROBES; i++) {
+        slot = probe_slot(dc, i);
+        if (!slot_read(slot, &copy)) {
+            if (busy == NULL) {
+                busy = slot;
+            }
+            continue;
+        }
+
+        if (copy.key_lo == dc->key_lo && copy.key_hi == dc->key_hi) {
+            victim = slot;
+            ours = true;
+            break;
+        }
+
+        if (copy.key_lo == 0 && copy.key_hi == 0) {
+            victim = slot;
+            break;
+        }
+
+        if (copy.expires < victim_expires) {
+            victim = slot;
+            victim_expires = copy.expires;
+        }
+    }
+
+    if (!ours && busy != NULL && slot_lock(dc, busy, F_WRLCK) == 0) {
+        if (busy->seq & 1) {
+            logger(dc->pamh, LOG_NOTICE,
+                   "Recovering a decision cache slot left behind by "
+                   "an interrupted update\n");
+            victim = busy;
+            goto write;
+        }
+        slot_lock(dc, busy, F_UNLCK);
+    }
+
+    if (victim == NULL) {
+        return;
+    }
+
+    if (slot_lock(dc, victim, F_WRLCK) != 0) {
+        /* Somebody else is writing, let them win */
+        return;
+    }
+
+write:
+    /* Holding the slot lock, no other writer can touch the counter */
+    seq = victim->seq;
+    if ((seq & 1) == 0) {
+        __sync_fetch_and_add(&victim->seq, 1);
+    }
+
+    victim->result = result;
+    victim->key_lo = dc->key_lo;
+    victim->key_hi = dc->key_hi;
+    victim->expires = (int64_t) now + dc->ttl;
+
+    /* full barrier, publishes the slot */
+    __sync_fetch_and_add(&victim->seq, 1);
+
+    slot_lock(dc, victim, F_UNLCK);
+}
+
+int
+ph_dcache_flush(pam_handle_t *pamh, struct pam_hbac_config *pc)
+{
+    if (pc == NULL) {
+        return EINVAL;
+    }
+
+    /* Processes that already mapped the old file keep using it until
+     * they finish the current login, new ones see the empty cache
+     */
+    return dcache_create(pamh, dcache_path(pc), true);
+}
+
+#else /* HAVE_SYNC_BUILTINS */
+
+struct ph_dcache *
+ph_dcache_open(pam_handle_t *pamh,
+               struct pam_hbac_config *pc,
+               struct ph_user *user,
+               const char *service)
+{
+    if (pc != NULL && pc->decision_cache_ttl > 0) {
+        logger(pamh, LOG_NOTICE,
+               "The decision cache is not supported on this platform\n");
+    }
+    return NULL;
+}
+
+void
+ph_dcache_close(struct ph_dcache *dc)
+{
+    return;
+}
+
+int
+ph_dcache_lookup(struct ph_dcache *dc,
+                 enum hbac_eval_result *_result)
+{
+    return ENOENT;
+}
+
+void
+ph_dcache_store(struct ph_dcache *dc,
+                enum hbac_eval_result result)
+{
+    return;
+}
+
+int
+ph_dcache_flush(pam_handle_t *pamh, struct pam_hbac_config *pc)
+{
+    return ENOSYS;
+}
+
+#endif /* HAVE_SYNC_BUILTINS */
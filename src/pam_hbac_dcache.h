@@ -0,0 +1,50 @@
+/*
+    Copyright (C) 2026 Jakub Hrozek <jakub.hrozek@posteo.se>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __PAM_HBAC_DCACHE_H__
+#define __PAM_HBAC_DCACHE_H__
+
+#include "pam_hbac.h"
+
+/* The decision cache remembers the result of recent HBAC evaluations in a
+ * file that is shared by all processes that load pam_hbac. It is a fixed
+ * size open-addressing hash table, each slot is guarded by a sequence
+ * counter so that readers never block and a writer that loses a race
+ * simply does not store its result. Writers lock the slot they update, so
+ * a slot left half-written by a process that died can be reclaimed.
+ *
+ * A handle is bound to a single (user, groups, service) tuple.
+ */
+struct ph_dcache;
+struct ph_user;
+
+struct ph_dcache *ph_dcache_open(pam_handle_t *pamh,
+                                 struct pam_hbac_config *pc,
+                                 struct ph_user *user,
+                                 const char *service);
+void ph_dcache_close(struct ph_dcache *dc);
+
+/* Returns 0 on a hit, ENOENT on a miss */
+int ph_dcache_lookup(struct ph_dcache *dc,
+                     enum hbac_eval_result *_result);
+void ph_dcache_store(struct ph_dcache *dc,
+                     enum hbac_eval_result result);
+
+/* Atomically replaces the cache file with an empty one */
+int ph_dcache_flush(pam_handle_t *pamh, struct pam_hbac_config *pc);
+
+#endif /* __PAM_HBAC_DCACHE_H__ */
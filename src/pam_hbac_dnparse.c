@@ -17,333 +17,852 @@
 
 #define _GNU_SOURCE     /* strndup() */
 
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <ldap.h>
 
+#include "pam_hbac.h"
 #include "pam_hbac_dnparse.h"
 #include "pam_hbac_compat.h"
 
-/* if val is NULL, only key is checked */
+#define PH_STR_LEN(s)   (sizeof(s) - 1)
+
+/* The containers of the objects HBAC rules refer to, relative to the
+ * base DN, e.g. uid=<name>,cn=users,cn=accounts,<base DN>
+ */
+struct ph_dn_template {
+    const char *rdn_key;
+    size_t rdn_key_len;
+    const char *container;
+    size_t container_len;
+    const char *parent;
+    size_t parent_len;
+    enum ph_dn_class dn_class;
+};
+
+#define PH_DN_TEMPLATE(key, container, parent, dn_class) \
+    { key, PH_STR_LEN(key), container, PH_STR_LEN(container), \
+      parent, PH_STR_LEN(parent), dn_class }
+
+static const struct ph_dn_template dn_templates[] = {
+    PH_DN_TEMPLATE("uid", "users", "accounts", PH_DN_USER),
+    PH_DN_TEMPLATE("cn", "groups", "accounts", PH_DN_USERGROUP),
+    PH_DN_TEMPLATE("fqdn", "computers", "accounts", PH_DN_HOST),
+    PH_DN_TEMPLATE("cn", "hostgroups", "accounts", PH_DN_HOSTGROUP),
+    PH_DN_TEMPLATE("cn", "hbacservices", "hbac", PH_DN_SVC),
+    PH_DN_TEMPLATE("cn", "hbacservicegroups", "hbac", PH_DN_SVCGROUP),
+};
+
+#define PH_NUM_DN_TEMPLATES \
+    (sizeof(dn_templates) / sizeof(dn_templates[0]))
+
+/* RDNs between the object's RDN and the base DN */
+#define PH_DN_CONTAINER_DEPTH   2
+
+struct ph_dn_classifier {
+    LDAPDN basedn;
+    size_t basedn_len;
+    /* The base DN as "attr=value,..." for the string level matcher, NULL
+     * if it cannot be written without escapes
+     */
+    char *basedn_str;
+    size_t basedn_str_len;
+};
+
 static bool
-rdn_keyval_matches(LDAPAVA **rdn, const char *key, const char *val)
-{
-    bool matches = false;
-
-    if (rdn != NULL && rdn[0] != NULL && rdn[1] == NULL) {
-        /* Exactly one value */
-        if (strncasecmp(rdn[0]->la_attr.bv_val, key,
-                        rdn[0]->la_attr.bv_len) == 0) {
-            /* The key matches */
-            if (val == NULL ||
-                strncasecmp(rdn[0]->la_value.bv_val, val,
-                            rdn[0]->la_value.bv_len) == 0) {
-                /* The value matches */
-                matches = true;
-            }
-        }
+bv_equals(const struct berval *bv, const char *s, size_t len)
+{
+    return bv->bv_len == len && strncasecmp(bv->bv_val, s, len) == 0;
+}
+
+/* Returns the only AVA of rdn or NULL for multi-valued RDNs */
+static LDAPAVA *
+single_ava(LDAPRDN rdn)
+{
+    if (rdn == NULL || rdn[0] == NULL || rdn[1] != NULL) {
+        return NULL;
     }
 
-    return matches;
+    return rdn[0];
 }
 
 static bool
-dn_matches(LDAPAVA *dn, LDAPAVA *dn2)
+ava_matches(LDAPAVA *ava, LDAPAVA *ava2)
 {
-    if (dn == NULL || dn2 == NULL) {
+    if (ava == NULL || ava2 == NULL) {
         return false;
     }
 
-    if (dn->la_attr.bv_len != dn2->la_attr.bv_len) {
+    return bv_equals(&ava->la_attr, ava2->la_attr.bv_val, ava2->la_attr.bv_len)
+        && bv_equals(&ava->la_value,
+                     ava2->la_value.bv_val, ava2->la_value.bv_len);
+}
+
+static bool
+rdn_is_cn(const struct berval *attr,
+          const struct berval *value,
+          const char *val,
+          size_t val_len)
+{
+    return bv_equals(attr, "cn", PH_STR_LEN("cn"))
+        && bv_equals(value, val, val_len);
+}
+
+/* Characters of an attribute type the string level matcher handles */
+static bool
+simple_attr_char(unsigned char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+        || (c >= '0' && c <= '9') || c == '-' || c == '.';
+}
+
+/* Characters of a value that never need escaping or special treatment.
+ * Whitespace is excluded because the full parser trims it.
+ */
+static bool
+simple_value_char(unsigned char c)
+{
+    if (c <= ' ' || c == 0x7f) {
         return false;
     }
 
-    if (dn->la_value.bv_len != dn2->la_value.bv_len) {
+    switch (c) {
+    case ',':
+    case '=':
+    case '+':
+    case '\\':
+    case '"':
+    case '<':
+    case '>':
+    case ';':
+    case '#':
         return false;
+    default:
+        break;
     }
 
-    if (strncasecmp(dn->la_attr.bv_val,
-                    dn2->la_attr.bv_val,
-                    dn->la_attr.bv_len) != 0) {
-        return false;
+    return true;
+}
+
+/* Splits off the RDN at *_p. Returns EAGAIN if the RDN is anything but
+ * a plain single-valued attr=value pair.
+ */
+static int
+simple_rdn(const char **_p,
+           const char *end,
+           struct berval *attr,
+           struct berval *value)
+{
+    const char *p = *_p;
+
+    attr->bv_val = discard_const(p);
+    while (p < end && simple_attr_char(*p)) {
+        p++;
+    }
+    attr->bv_len = p - attr->bv_val;
+    if (attr->bv_len == 0 || p == end || *p != '=') {
+        return EAGAIN;
     }
+    p++;
 
-    if (strncasecmp(dn->la_value.bv_val,
-                    dn2->la_value.bv_val,
-                    dn->la_value.bv_len) != 0) {
-        return false;
+    value->bv_val = discard_const(p);
+    while (p < end && simple_value_char(*p)) {
+        p++;
+    }
+    value->bv_len = p - value->bv_val;
+    if (value->bv_len == 0) {
+        return EAGAIN;
+    }
+
+    if (p < end) {
+        if (*p != ',') {
+            return EAGAIN;
+        }
+        p++;
+        if (p == end) {
+            /* Trailing separator */
+            return EAGAIN;
+        }
+    }
+
+    *_p = p;
+    return 0;
+}
+
+/* Returns true if the rest of the DN only consists of plain RDNs */
+static bool
+simple_dn(const char *p, const char *end)
+{
+    struct berval attr;
+    struct berval value;
+
+    while (p < end) {
+        if (simple_rdn(&p, end, &attr, &value) != 0) {
+            return false;
+        }
     }
 
     return true;
 }
 
-static char *
-rdn_check_and_getval(LDAPAVA **rdn, const char *key)
+static int
+basedn_to_str(struct ph_dn_classifier *dc)
 {
-    char *rdn_val = NULL;
+    LDAPAVA *ava;
+    size_t len = 0;
+    size_t i;
+    char *p;
+
+    for (i = 0; i < dc->basedn_len; i++) {
+        ava = dc->basedn[i][0];
+        len += ava->la_attr.bv_len + ava->la_value.bv_len + 2;
+    }
+
+    dc->basedn_str = malloc(len + 1);
+    if (dc->basedn_str == NULL) {
+        return ENOMEM;
+    }
 
-    if (rdn != NULL && rdn[0] != NULL && rdn[1] == NULL) {
-        /* Exactly one value */
-        if (strncasecmp(rdn[0]->la_attr.bv_val, key,
-                        rdn[0]->la_attr.bv_len) == 0) {
-            /* The key matches */
-            rdn_val = strndup(rdn[0]->la_value.bv_val,
-                              rdn[0]->la_value.bv_len);
+    p = dc->basedn_str;
+    for (i = 0; i < dc->basedn_len; i++) {
+        ava = dc->basedn[i][0];
+        if (i > 0) {
+            *p++ = ',';
         }
+        memcpy(p, ava->la_attr.bv_val, ava->la_attr.bv_len);
+        p += ava->la_attr.bv_len;
+        *p++ = '=';
+        memcpy(p, ava->la_value.bv_val, ava->la_value.bv_len);
+        p += ava->la_value.bv_len;
+    }
+    *p = '\0';
+    dc->basedn_str_len = p - dc->basedn_str;
+
+    /* Only usable if the string reads back as the same DN */
+    if (dc->basedn_str_len == 0 || !simple_dn(dc->basedn_str, p)) {
+        free(dc->basedn_str);
+        dc->basedn_str = NULL;
+        dc->basedn_str_len = 0;
     }
 
-    /* NULL check should be done by the caller anyway */
-    return rdn_val;
+    return 0;
 }
 
-static bool
-basedn_matches(const char *basedn, LDAPDN dn_parts)
+static size_t
+dn_len(LDAPDN dn)
+{
+    size_t n;
+
+    for (n = 0; dn[n] != NULL; n++);
+    return n;
+}
+
+int
+ph_dn_classifier_new(const char *basedn, struct ph_dn_classifier **_dc)
 {
-    LDAPDN basedn_parts = NULL;
-    size_t i = 0;
+    struct ph_dn_classifier *dc;
+    size_t i;
     int ret;
 
-    ret = ph_str2dn(basedn, &basedn_parts);
-    if (ret != 0) {
-        goto fail;
+    if (basedn == NULL || _dc == NULL) {
+        return EINVAL;
     }
 
-    for (i=0; dn_parts[i] != NULL; i++) {
+    dc = calloc(1, sizeof(struct ph_dn_classifier));
+    if (dc == NULL) {
+        return ENOMEM;
+    }
 
-        if (basedn_parts[i] == NULL) {
-            goto fail;
-        }
+    ret = ph_str2dn(basedn, &dc->basedn);
+    if (ret != 0 || dc->basedn == NULL) {
+        free(dc);
+        return EINVAL;
+    }
 
-        if (!dn_matches(*dn_parts[i], *basedn_parts[i])) {
-            goto fail;
+    dc->basedn_len = dn_len(dc->basedn);
+    for (i = 0; i < dc->basedn_len; i++) {
+        if (single_ava(dc->basedn[i]) == NULL) {
+            ph_dn_classifier_free(dc);
+            return EINVAL;
         }
     }
 
-    /* Base DN must have be matched completely. */
-    if (basedn_parts[i] != NULL) {
-        goto fail;
+    ret = basedn_to_str(dc);
+    if (ret != 0) {
+        ph_dn_classifier_free(dc);
+        return ret;
     }
 
-    ph_ldap_dnfree(basedn_parts);
-    return true;
+    *_dc = dc;
+    return 0;
+}
+
+void
+ph_dn_classifier_free(struct ph_dn_classifier *dc)
+{
+    if (dc == NULL) {
+        return;
+    }
 
-fail:
-    ph_ldap_dnfree(basedn_parts);
-    return false;
+    ph_ldap_dnfree(dc->basedn);
+    free(dc->basedn_str);
+    free(dc);
 }
 
-static bool
-container_matches(LDAPDN dn_parts, const char *basedn, const char ***kvs)
+static const struct ph_dn_template *
+match_template(const struct berval *container_attr,
+               const struct berval *container,
+               const struct berval *parent_attr,
+               const struct berval *parent)
 {
-    size_t idx;
-    bool match;
+    const struct ph_dn_template *t;
+    size_t i;
+
+    for (i = 0; i < PH_NUM_DN_TEMPLATES; i++) {
+        t = &dn_templates[i];
+        if (rdn_is_cn(container_attr, container,
+                      t->container, t->container_len)
+                && rdn_is_cn(parent_attr, parent,
+                             t->parent, t->parent_len)) {
+            return t;
+        }
+    }
 
-    if (dn_parts == NULL || basedn == NULL || kvs == NULL) {
-        return false;
+    return NULL;
+}
+
+int
+ph_classify_dn_fast(const struct ph_dn_classifier *dc,
+                    const struct berval *dn,
+                    enum ph_dn_class *_dn_class,
+                    struct berval *_name)
+{
+    const struct ph_dn_template *t;
+    struct berval attr[PH_DN_CONTAINER_DEPTH + 1];
+    struct berval value[PH_DN_CONTAINER_DEPTH + 1];
+    const char *p;
+    const char *end;
+    size_t i;
+
+    if (dc == NULL || dn == NULL || dn->bv_val == NULL
+            || _dn_class == NULL || _name == NULL) {
+        return EINVAL;
     }
 
-    for (idx = 0; kvs[idx]; idx++) {
-        /* +1 because we don't care about RDN value, only the remainder */
-        if (dn_parts[idx+1] == NULL) {
-            /* Short DN.. */
-            return false;
+    if (dc->basedn_str == NULL) {
+        return EAGAIN;
+    }
+
+    p = dn->bv_val;
+    end = p + dn->bv_len;
+    for (i = 0; i <= PH_DN_CONTAINER_DEPTH; i++) {
+        if (p == end) {
+            /* Too short to be under the base DN */
+            return EINVAL;
         }
 
-        match = rdn_keyval_matches(dn_parts[idx+1], kvs[idx][0], kvs[idx][1]);
-        if (match == false) {
-            return false;
+        if (simple_rdn(&p, end, &attr[i], &value[i]) != 0) {
+            return EAGAIN;
         }
     }
 
-    if (!basedn_matches(basedn, &dn_parts[idx + 1])) {
-        return false;
+    if ((size_t) (end - p) != dc->basedn_str_len
+            || strncasecmp(p, dc->basedn_str, dc->basedn_str_len) != 0) {
+        /* Only a mismatch of a plain DN is conclusive */
+        return simple_dn(p, end) ? EINVAL : EAGAIN;
     }
 
-    return true;
+    t = match_template(&attr[1], &value[1], &attr[2], &value[2]);
+    if (t == NULL) {
+        return EINVAL;
+    }
+
+    if (!bv_equals(&attr[0], t->rdn_key, t->rdn_key_len)) {
+        return EINVAL;
+    }
+
+    *_dn_class = t->dn_class;
+    *_name = value[0];
+    return 0;
 }
 
 static int
-container_check_and_get_rdn(LDAPDN dn_parts,
-                            const char *basedn,
-                            const char ***container_kvs,
-                            const char *rdn_key,
-                            const char **_rdn_val)
+classify_parts(const struct ph_dn_classifier *dc,
+               LDAPDN dn_parts,
+               const struct ph_dn_template **_t,
+               LDAPAVA **_rdn)
 {
-    bool ok;
+    const struct ph_dn_template *t;
+    LDAPAVA *rdn;
+    LDAPAVA *container;
+    LDAPAVA *parent;
+    size_t i;
+
+    if (dn_parts == NULL) {
+        return EINVAL;
+    }
 
-    ok = container_matches(dn_parts, basedn, container_kvs);
-    if (!ok) {
-        /* FIXME - This return code sucks */
+    if (dn_len(dn_parts) != dc->basedn_len + PH_DN_CONTAINER_DEPTH + 1) {
         return EINVAL;
     }
 
-    if (dn_parts[0] == NULL) {
-        return ERANGE;
+    /* The base DN must match completely */
+    for (i = 0; i < dc->basedn_len; i++) {
+        if (!ava_matches(single_ava(dn_parts[PH_DN_CONTAINER_DEPTH + 1 + i]),
+                         dc->basedn[i][0])) {
+            return EINVAL;
+        }
     }
-    *_rdn_val = rdn_check_and_getval(dn_parts[0], rdn_key);
-    if (*_rdn_val == NULL) {
+
+    rdn = single_ava(dn_parts[0]);
+    container = single_ava(dn_parts[1]);
+    parent = single_ava(dn_parts[2]);
+    if (rdn == NULL || container == NULL || parent == NULL) {
         return EINVAL;
     }
 
+    t = match_template(&container->la_attr, &container->la_value,
+                       &parent->la_attr, &parent->la_value);
+    if (t == NULL) {
+        return EINVAL;
+    }
+
+    if (!bv_equals(&rdn->la_attr, t->rdn_key, t->rdn_key_len)) {
+        return EINVAL;
+    }
+
+    *_t = t;
+    *_rdn = rdn;
     return 0;
 }
 
-static int
-user_container_rdn(LDAPDN dn_parts,
-                   const char *basedn,
-                   const char **_rdn_val)
+int
+ph_classify_dn(const struct ph_dn_classifier *dc,
+               const char *dn,
+               enum ph_dn_class *_dn_class,
+               const char **_name)
 {
-    const char *cn1[] = { "cn", "users" };
-    const char *cn2[] = { "cn", "accounts" };
-    const char **group_container[] = {
-        cn1, cn2, NULL
-    };
+    const struct ph_dn_template *t;
+    LDAPDN dn_parts = NULL;
+    LDAPAVA *rdn;
+    struct berval dn_bv;
+    struct berval name_bv;
+    enum ph_dn_class dn_class;
+    char *name;
+    int ret;
+
+    if (dc == NULL || dn == NULL || _dn_class == NULL || _name == NULL) {
+        return EINVAL;
+    }
+
+    dn_bv.bv_val = discard_const(dn);
+    dn_bv.bv_len = strlen(dn);
+    ret = ph_classify_dn_fast(dc, &dn_bv, &dn_class, &name_bv);
+    if (ret == 0) {
+        name = strndup(name_bv.bv_val, name_bv.bv_len);
+        if (name == NULL) {
+            return ENOMEM;
+        }
+
+        *_dn_class = dn_class;
+        *_name = name;
+        return 0;
+    } else if (ret != EAGAIN) {
+        return ret;
+    }
+
+    /* Escapes, multi-valued RDNs or odd spacing need the full parser */
+    ret = ph_str2dn(dn, &dn_parts);
+    if (ret != 0) {
+        return EINVAL;
+    }
+
+    ret = classify_parts(dc, dn_parts, &t, &rdn);
+    if (ret != 0) {
+        goto done;
+    }
+
+    name = strndup(rdn->la_value.bv_val, rdn->la_value.bv_len);
+    if (name == NULL) {
+        ret = ENOMEM;
+        goto done;
+    }
+
+    *_dn_class = t->dn_class;
+    *_name = name;
+    ret = 0;
 
-   return container_check_and_get_rdn(dn_parts, basedn, group_container,
-                                       "uid", _rdn_val);
+done:
+    ph_ldap_dnfree(dn_parts);
+    return ret;
 }
 
-static int
-usergroup_container_rdn(LDAPDN dn_parts,
-                        const char *basedn,
-                        const char **_rdn_val)
+/* A name shared by all the rule elements that refer to the same DN */
+struct ph_dn_name {
+    size_t refs;
+    char name[];
+};
+
+struct ph_dn_memo_entry {
+    /* A copy of the caller's DN, NULL marks an empty slot */
+    struct berval dn;
+    uint64_t hash;
+    enum ph_dn_class dn_class;
+    /* NULL if the DN could not be classified */
+    struct ph_dn_name *name;
+};
+
+struct ph_dn_memo {
+    const struct ph_dn_classifier *dc;
+    struct ph_dn_memo_entry *slots;
+    /* Always a power of two */
+    size_t size;
+    size_t used;
+};
+
+#define PH_DN_MEMO_INITIAL_SIZE     64
+
+#define FNV64_OFFSET                0xcbf29ce484222325ULL
+#define FNV64_PRIME                 0x100000001b3ULL
+
+static uint64_t
+memo_hash(const struct berval *dn)
 {
-    const char *cn1[] = { "cn", "groups" };
-    const char *cn2[] = { "cn", "accounts" };
-    const char **group_container[] = {
-        cn1, cn2, NULL
-    };
+    uint64_t h = FNV64_OFFSET;
+    size_t i;
+
+    for (i = 0; i < dn->bv_len; i++) {
+        h ^= (uint8_t) dn->bv_val[i];
+        h *= FNV64_PRIME;
+    }
 
-    return container_check_and_get_rdn(dn_parts, basedn, group_container,
-                                       "cn",_rdn_val);
+    return h;
 }
 
-static int
-svc_container_rdn(LDAPDN dn_parts,
-                  const char *basedn,
-                  const char **_rdn_val)
+static struct ph_dn_name *
+dn_name_new(const char *val, size_t len)
 {
-    const char *cn1[] = { "cn", "hbacservices" };
-    const char *cn2[] = { "cn", "hbac" };
-    const char **svc_container[] = {
-        cn1, cn2, NULL
-    };
+    struct ph_dn_name *n;
 
-    return container_check_and_get_rdn(dn_parts, basedn, svc_container,
-                                       "cn", _rdn_val);
+    n = malloc(sizeof(struct ph_dn_name) + len + 1);
+    if (n == NULL) {
+        return NULL;
+    }
+
+    n->refs = 1;
+    memcpy(n->name, val, len);
+    n->name[len] = '\0';
+    return n;
 }
 
-static int
-svcgroup_container_rdn(LDAPDN dn_parts,
-                       const char *basedn,
-                       const char **_rdn_val)
+static struct ph_dn_name *
+dn_name_of(const char *name)
 {
-    const char *cn1[] = { "cn", "hbacservicegroups" };
-    const char *cn2[] = { "cn", "hbac" };
-    const char **svc_container[] = {
-        cn1, cn2, NULL
-    };
+    char *p = discard_const(name);
+
+    return (struct ph_dn_name *) (void *)
+                (p - offsetof(struct ph_dn_name, name));
+}
+
+void
+ph_dn_name_unref(const char *name)
+{
+    struct ph_dn_name *n;
+
+    if (name == NULL) {
+        return;
+    }
 
-    return container_check_and_get_rdn(dn_parts, basedn, svc_container,
-                                       "cn", _rdn_val);
+    n = dn_name_of(name);
+    n->refs--;
+    if (n->refs == 0) {
+        free(n);
+    }
+}
+
+void
+ph_dn_name_list_free(const char **list)
+{
+    size_t i;
+
+    if (list == NULL) {
+        return;
+    }
+
+    for (i = 0; list[i] != NULL; i++) {
+        ph_dn_name_unref(list[i]);
+    }
+    free(list);
+}
+
+int
+ph_dn_memo_new(const struct ph_dn_classifier *dc, struct ph_dn_memo **_memo)
+{
+    struct ph_dn_memo *memo;
+
+    if (dc == NULL || _memo == NULL) {
+        return EINVAL;
+    }
+
+    memo = calloc(1, sizeof(struct ph_dn_memo));
+    if (memo == NULL) {
+        return ENOMEM;
+    }
+
+    memo->slots = calloc(PH_DN_MEMO_INITIAL_SIZE,
+                         sizeof(struct ph_dn_memo_entry));
+    if (memo->slots == NULL) {
+        free(memo);
+        return ENOMEM;
+    }
+    memo->size = PH_DN_MEMO_INITIAL_SIZE;
+    memo->dc = dc;
+
+    *_memo = memo;
+    return 0;
+}
+
+void
+ph_dn_memo_free(struct ph_dn_memo *memo)
+{
+    size_t i;
+
+    if (memo == NULL) {
+        return;
+    }
+
+    for (i = 0; i < memo->size; i++) {
+        if (memo->slots[i].name != NULL) {
+            ph_dn_name_unref(memo->slots[i].name->name);
+        }
+        free(memo->slots[i].dn.bv_val);
+    }
+    free(memo->slots);
+    free(memo);
+}
+
+static struct ph_dn_memo_entry *
+memo_slot(struct ph_dn_memo_entry *slots,
+          size_t size,
+          const struct berval *dn,
+          uint64_t hash)
+{
+    struct ph_dn_memo_entry *e;
+    size_t i;
+
+    for (i = hash & (size - 1); ; i = (i + 1) & (size - 1)) {
+        e = &slots[i];
+        if (e->dn.bv_val == NULL) {
+            return e;
+        }
+
+        if (e->hash == hash
+                && e->dn.bv_len == dn->bv_len
+                && memcmp(e->dn.bv_val, dn->bv_val, dn->bv_len) == 0) {
+            return e;
+        }
+    }
 }
 
 static int
-host_container_rdn(LDAPDN dn_parts,
-                   const char *basedn,
-                   const char **_rdn_val)
+memo_grow(struct ph_dn_memo *memo)
 {
-    const char *cn1[] = { "cn", "computers" };
-    const char *cn2[] = { "cn", "accounts" };
-    const char **host_container[] = {
-        cn1, cn2, NULL
-    };
+    struct ph_dn_memo_entry *slots;
+    struct ph_dn_memo_entry *e;
+    size_t size;
+    size_t i;
+
+    size = memo->size * 2;
+    slots = calloc(size, sizeof(struct ph_dn_memo_entry));
+    if (slots == NULL) {
+        return ENOMEM;
+    }
+
+    for (i = 0; i < memo->size; i++) {
+        if (memo->slots[i].dn.bv_val == NULL) {
+            continue;
+        }
 
-    return container_check_and_get_rdn(dn_parts, basedn, host_container,
-                                       "fqdn", _rdn_val);
+        e = memo_slot(slots, size, &memo->slots[i].dn, memo->slots[i].hash);
+        *e = memo->slots[i];
+    }
+
+    free(memo->slots);
+    memo->slots = slots;
+    memo->size = size;
+    return 0;
 }
 
 static int
-hostgroup_container_rdn(LDAPDN dn_parts,
-                        const char *basedn,
-                        const char **_rdn_val)
+memo_classify(const struct ph_dn_classifier *dc,
+              const struct berval *dn,
+              enum ph_dn_class *_dn_class,
+              struct ph_dn_name **_name)
 {
-    const char *cn1[] = { "cn", "hostgroups" };
-    const char *cn2[] = { "cn", "accounts" };
-    const char **host_container[] = {
-        cn1, cn2, NULL
-    };
+    struct berval name_bv;
+    const char *name;
+    int ret;
+
+    ret = ph_classify_dn_fast(dc, dn, _dn_class, &name_bv);
+    if (ret == 0) {
+        *_name = dn_name_new(name_bv.bv_val, name_bv.bv_len);
+        return *_name ? 0 : ENOMEM;
+    } else if (ret != EAGAIN) {
+        return ret;
+    }
+
+    ret = ph_classify_dn(dc, dn->bv_val, _dn_class, &name);
+    if (ret != 0) {
+        return ret;
+    }
 
-    return container_check_and_get_rdn(dn_parts, basedn, host_container,
-                                       "cn", _rdn_val);
+    *_name = dn_name_new(name, strlen(name));
+    free_const(name);
+    return *_name ? 0 : ENOMEM;
 }
 
 int
-ph_group_name_from_dn(const char *dn,
-                      enum member_el_type el_type,
-                      const char *basedn,
-                      const char **_group_name)
+ph_dn_memo_classify(struct ph_dn_memo *memo,
+                    const struct berval *dn,
+                    enum ph_dn_class *_dn_class,
+                    const char **_name)
 {
-    LDAPDN dn_parts;
+    struct ph_dn_memo_entry *e;
+    struct ph_dn_name *name = NULL;
+    enum ph_dn_class dn_class = PH_DN_UNKNOWN;
+    char *dn_copy;
+    uint64_t hash;
     int ret;
 
-    ret = ph_str2dn(dn, &dn_parts);
-    if (ret != 0) {
+    if (memo == NULL || dn == NULL || dn->bv_val == NULL
+            || _dn_class == NULL || _name == NULL) {
+        return EINVAL;
+    }
+
+    hash = memo_hash(dn);
+    e = memo_slot(memo->slots, memo->size, dn, hash);
+    if (e->dn.bv_val == NULL) {
+        ret = memo_classify(memo->dc, dn, &dn_class, &name);
+        if (ret == ENOMEM) {
+            return ENOMEM;
+        }
+
+        /* Keep the load factor under 3/4 */
+        if ((memo->used + 1) * 4 > memo->size * 3) {
+            ret = memo_grow(memo);
+            if (ret != 0) {
+                if (name != NULL) {
+                    ph_dn_name_unref(name->name);
+                }
+                return ret;
+            }
+            e = memo_slot(memo->slots, memo->size, dn, hash);
+        }
+
+        dn_copy = malloc(dn->bv_len + 1);
+        if (dn_copy == NULL) {
+            if (name != NULL) {
+                ph_dn_name_unref(name->name);
+            }
+            return ENOMEM;
+        }
+        memcpy(dn_copy, dn->bv_val, dn->bv_len);
+        dn_copy[dn->bv_len] = '\0';
+
+        /* DNs that cannot be classified are remembered as well */
+        e->dn.bv_val = dn_copy;
+        e->dn.bv_len = dn->bv_len;
+        e->hash = hash;
+        e->dn_class = dn_class;
+        e->name = name;
+        memo->used++;
+    }
+
+    if (e->name == NULL) {
         return EINVAL;
     }
 
+    e->name->refs++;
+    *_dn_class = e->dn_class;
+    *_name = e->name->name;
+    return 0;
+}
+
+enum ph_dn_class
+ph_dn_class_of(enum member_el_type el_type, bool group)
+{
     switch (el_type) {
     case DN_TYPE_USER:
-        ret = usergroup_container_rdn(dn_parts, basedn, _group_name);
-        break;
-    case DN_TYPE_SVC:
-        ret = svcgroup_container_rdn(dn_parts, basedn, _group_name);
-        break;
+        return group ? PH_DN_USERGROUP : PH_DN_USER;
     case DN_TYPE_HOST:
-        ret = hostgroup_container_rdn(dn_parts, basedn, _group_name);
-        break;
+        return group ? PH_DN_HOSTGROUP : PH_DN_HOST;
+    case DN_TYPE_SVC:
+        return group ? PH_DN_SVCGROUP : PH_DN_SVC;
     default:
-        ret = EINVAL;
         break;
     }
 
-    ph_ldap_dnfree(dn_parts);
-    return ret;
+    return PH_DN_UNKNOWN;
 }
 
-int
-ph_name_from_dn(const char *dn,
-                enum member_el_type el_type,
-                const char *basedn,
-                const char **_name)
+static int
+name_of_class(const char *dn,
+              enum ph_dn_class expected,
+              const char *basedn,
+              const char **_name)
 {
-    LDAPDN dn_parts;
+    struct ph_dn_classifier *dc;
+    enum ph_dn_class dn_class;
+    const char *name;
     int ret;
 
-    ret = ph_str2dn(dn, &dn_parts);
-    if (ret != 0) {
+    if (expected == PH_DN_UNKNOWN) {
         return EINVAL;
     }
 
-    switch (el_type) {
-    case DN_TYPE_USER:
-        ret = user_container_rdn(dn_parts, basedn, _name);
-        break;
-    case DN_TYPE_SVC:
-        ret = svc_container_rdn(dn_parts, basedn, _name);
-        break;
-    case DN_TYPE_HOST:
-        ret = host_container_rdn(dn_parts, basedn, _name);
-        break;
-    default:
-        ret = EINVAL;
-        break;
+    ret = ph_dn_classifier_new(basedn, &dc);
+    if (ret != 0) {
+        return ret;
     }
 
-    ph_ldap_dnfree(dn_parts);
-    return ret;
+    ret = ph_classify_dn(dc, dn, &dn_class, &name);
+    ph_dn_classifier_free(dc);
+    if (ret != 0) {
+        return ret;
+    }
+
+    if (dn_class != expected) {
+        free_const(name);
+        return EINVAL;
+    }
+
+    *_name = name;
+    return 0;
+}
+
+int
+ph_group_name_from_dn(const char *dn,
+                      enum member_el_type el_type,
+                      const char *basedn,
+                      const char **_group_name)
+{
+    return name_of_class(dn, ph_dn_class_of(el_type, true),
+                         basedn, _group_name);
+}
+
+int
+ph_name_from_dn(const char *dn,
+                enum member_el_type el_type,
+                const char *basedn,
+                const char **_name)
+{
+    return name_of_class(dn, ph_dn_class_of(el_type, false),
+                         basedn, _name);
 }
 
 const char *
@@ -18,12 +18,78 @@
 #ifndef __PAM_HBAC_DNPARSE_H__
 #define __PAM_HBAC_DNPARSE_H__
 
+#include <stdbool.h>
+#include <lber.h>
+
 enum member_el_type {
     DN_TYPE_USER,
     DN_TYPE_HOST,
     DN_TYPE_SVC,
 };
 
+/* The kinds of objects an HBAC rule can refer to */
+enum ph_dn_class {
+    PH_DN_UNKNOWN,
+    PH_DN_USER,
+    PH_DN_USERGROUP,
+    PH_DN_HOST,
+    PH_DN_HOSTGROUP,
+    PH_DN_SVC,
+    PH_DN_SVCGROUP,
+};
+
+/* A base DN parsed once, so that member DNs can be classified with a
+ * single parse each
+ */
+struct ph_dn_classifier;
+
+int ph_dn_classifier_new(const char *basedn, struct ph_dn_classifier **_dc);
+void ph_dn_classifier_free(struct ph_dn_classifier *dc);
+
+/* Returns the class of dn and a copy of its RDN value, or EINVAL if dn
+ * is not an object under any of the known containers of the base DN
+ */
+int ph_classify_dn(const struct ph_dn_classifier *dc,
+                   const char *dn,
+                   enum ph_dn_class *_dn_class,
+                   const char **_name);
+
+/* Like ph_classify_dn() but works on the string directly and returns the
+ * RDN value as a pointer into dn without allocating anything. Returns
+ * EAGAIN if dn contains escapes, quotes, multi-valued RDNs or whitespace
+ * and has to be classified with ph_classify_dn().
+ */
+int ph_classify_dn_fast(const struct ph_dn_classifier *dc,
+                        const struct berval *dn,
+                        enum ph_dn_class *_dn_class,
+                        struct berval *_name);
+
+/* Remembers the classification of every member DN seen during a fetch,
+ * so that a DN referenced by many rules is parsed once and all the rules
+ * share one copy of its name. The memo keeps its own copy of each DN, so
+ * the entries the DNs come from can be freed while it is in use.
+ */
+struct ph_dn_memo;
+
+int ph_dn_memo_new(const struct ph_dn_classifier *dc,
+                   struct ph_dn_memo **_memo);
+void ph_dn_memo_free(struct ph_dn_memo *memo);
+
+/* Like ph_classify_dn(), but the name is a shared reference that must be
+ * released with ph_dn_name_unref() instead of free()
+ */
+int ph_dn_memo_classify(struct ph_dn_memo *memo,
+                        const struct berval *dn,
+                        enum ph_dn_class *_dn_class,
+                        const char **_name);
+
+void ph_dn_name_unref(const char *name);
+
+/* Releases all names of a NULL-terminated list and the list itself */
+void ph_dn_name_list_free(const char **list);
+
+enum ph_dn_class ph_dn_class_of(enum member_el_type el_type, bool group);
+
 int ph_group_name_from_dn(const char *dn,
                           enum member_el_type el_type,
                           const char *basedn,
@@ -40,6 +40,39 @@ ph_attr_new(char *name, struct berval **vals)
     a->name = name;
     a->vals = vals;
     a->nvals = ldap_count_values_len(a->vals);
+    a->borrowed_vals = NULL;
+
+    return a;
+}
+
+struct ph_attr *
+ph_attr_new_borrowed(struct berval *name, struct berval *vals)
+{
+    struct ph_attr *a;
+    size_t nvals;
+    size_t i;
+
+    if (name == NULL || name->bv_val == NULL || vals == NULL) {
+        return NULL;
+    }
+
+    for (nvals = 0; vals[nvals].bv_val != NULL; nvals++) ;
+
+    /* The pointers to the values follow the attribute in one block */
+    a = malloc(sizeof(struct ph_attr)
+               + (nvals + 1) * sizeof(struct berval *));
+    if (a == NULL) {
+        return NULL;
+    }
+
+    a->name = name->bv_val;
+    a->vals = (struct berval **) (a + 1);
+    for (i = 0; i < nvals; i++) {
+        a->vals[i] = &vals[i];
+    }
+    a->vals[nvals] = NULL;
+    a->nvals = nvals;
+    a->borrowed_vals = vals;
 
     return a;
 }
@@ -51,6 +84,12 @@ ph_attr_free(struct ph_attr *a)
         return;
     }
 
+    if (a->borrowed_vals != NULL) {
+        ber_memfree(a->borrowed_vals);
+        free(a);
+        return;
+    }
+
     ldap_value_free_len(a->vals);
     ldap_memfree(a->name);
     free(a);
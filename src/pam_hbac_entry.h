@@ -29,9 +29,19 @@ struct ph_attr {
     char *name;
     struct berval **vals;
     size_t nvals;
+    /* Non-NULL if the attribute was created with ph_attr_new_borrowed() */
+    struct berval *borrowed_vals;
 };
 
 struct ph_attr *ph_attr_new(char *name, struct berval **vals);
+
+/* Creates an attribute whose name and values point into the LDAPMessage
+ * they were parsed from instead of being copied. They are only valid as
+ * long as the message is. The attribute owns nothing but the value array
+ * vals, which is released with ber_memfree().
+ */
+struct ph_attr *ph_attr_new_borrowed(struct berval *name,
+                                     struct berval *vals);
 void ph_attr_free(struct ph_attr *a);
 
 /* The order of attrs in ph_entry is always the same as ph_search_ctx
@@ -16,6 +16,7 @@
 */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <errno.h>
 
@@ -25,43 +26,80 @@
 #include "pam_hbac_entry.h"
 #include "pam_hbac_dnparse.h"
 #include "pam_hbac_obj_int.h"
+#include "pam_hbac_arena.h"
 
 #include "libhbac/ipa_hbac.h"
 
+/* The request remembers the arena it was allocated from,
+ * ph_free_hbac_eval_req() leaves such a request to the arena
+ */
+struct ph_eval_req {
+    struct hbac_eval_req req;
+    struct ph_arena *arena;
+};
+
 static void
-free_request_element(struct hbac_request_element *el,
-                     bool free_group_ptrs)
+free_group_ptrs(struct hbac_request_element *el)
 {
     size_t i;
 
-    if (el == NULL) {
-        return;
-    }
-
-    if (el->groups != NULL && free_group_ptrs) {
+    if (el->groups != NULL) {
         for (i=0; el->groups[i]; i++) {
             free_const(el->groups[i]);
         }
     }
+}
+
+static void
+free_request_element(struct ph_arena *arena,
+                     struct hbac_request_element *el,
+                     bool owns_groups)
+{
+    if (el == NULL || arena != NULL) {
+        return;
+    }
+
+    if (owns_groups) {
+        free_group_ptrs(el);
+    }
 
     free(el->groups);
     free(el);
 }
 
+/* Elements in an arena keep the group names they own until the arena is
+ * released
+ */
+static void
+release_request_element_groups(void *ptr)
+{
+    free_group_ptrs(ptr);
+}
+
 static struct hbac_request_element *
-alloc_sized_request_element(size_t ngroups)
+alloc_sized_request_element(struct ph_arena *arena,
+                            size_t ngroups,
+                            bool owns_groups)
 {
     struct hbac_request_element *el;
+    int ret;
 
-    el = malloc(sizeof(struct hbac_request_element));
+    el = ph_arena_calloc(arena, 1, sizeof(struct hbac_request_element));
     if (el == NULL) {
         return NULL;
     }
 
+    if (arena != NULL && owns_groups) {
+        ret = ph_arena_defer(arena, release_request_element_groups, el);
+        if (ret != 0) {
+            return NULL;
+        }
+    }
+
     /* Add sentinel. This also handles objects with no memberships */
-    el->groups = calloc(ngroups + 1, sizeof(const char *));
+    el->groups = ph_arena_calloc(arena, ngroups + 1, sizeof(const char *));
     if (el->groups == NULL) {
-        free(el);
+        free_request_element(arena, el, owns_groups);
         return NULL;
     }
 
@@ -69,14 +107,16 @@ alloc_sized_request_element(size_t ngroups)
 }
 
 static struct hbac_request_element *
-entry_to_eval_req_el(struct ph_attr *name,
+entry_to_eval_req_el(struct ph_arena *arena,
+                     struct ph_attr *name,
                      struct ph_attr *memberof,
                      enum member_el_type el_type,
-                     const char *basedn)
+                     const struct ph_dn_classifier *dc)
 {
     struct hbac_request_element *el;
     size_t i, gi;
     size_t n_memberof = 0;
+    enum ph_dn_class dn_class;
     int ret;
 
     /* Name can only have one value */
@@ -88,7 +128,7 @@ entry_to_eval_req_el(struct ph_attr *name,
         n_memberof = memberof->nvals;
     }
 
-    el = alloc_sized_request_element(n_memberof);
+    el = alloc_sized_request_element(arena, n_memberof, true);
     if (el == NULL) {
         return NULL;
     }
@@ -98,12 +138,17 @@ entry_to_eval_req_el(struct ph_attr *name,
      * groupname */
     gi = 0;
     for (i=0; i < n_memberof; i++) {
-        ret = ph_group_name_from_dn((const char *) memberof->vals[i]->bv_val,
-                                    el_type,
-                                    basedn,
-                                    &el->groups[gi]);
+        ret = ph_classify_dn(dc,
+                             (const char *) memberof->vals[i]->bv_val,
+                             &dn_class,
+                             &el->groups[gi]);
         switch (ret) {
             case 0:
+                if (dn_class != ph_dn_class_of(el_type, true)) {
+                    free_const(el->groups[gi]);
+                    el->groups[gi] = NULL;
+                    continue;
+                }
                 break;
             /* Unexpected DN, skip these.. */
             case ERANGE:
@@ -111,7 +156,7 @@ entry_to_eval_req_el(struct ph_attr *name,
                 continue;
             default:
                 /* ENOMEMs and such */
-                free_request_element(el, true);
+                free_request_element(arena, el, true);
                 return NULL;
         }
 
@@ -122,7 +167,7 @@ entry_to_eval_req_el(struct ph_attr *name,
 }
 
 static struct hbac_request_element *
-user_to_eval_req_el(struct ph_user *user, const char *basedn)
+user_to_eval_req_el(struct ph_arena *arena, struct ph_user *user)
 {
     struct hbac_request_element *el;
     size_t ngroups;
@@ -130,7 +175,7 @@ user_to_eval_req_el(struct ph_user *user, const char *basedn)
 
     ngroups = null_string_array_size(user->group_names);
 
-    el = alloc_sized_request_element(ngroups);
+    el = alloc_sized_request_element(arena, ngroups, false);
     if (el == NULL) {
         return NULL;
     }
@@ -138,7 +183,8 @@ user_to_eval_req_el(struct ph_user *user, const char *basedn)
     /* No need to copy username */
     el->name = user->name;
 
-    for (i=0; user->group_names[i]; i++) {
+    /* The groups are not resolved if no rule references them */
+    for (i=0; i < ngroups; i++) {
         el->groups[i] = user->group_names[i];
     }
 
@@ -146,19 +192,36 @@ user_to_eval_req_el(struct ph_user *user, const char *basedn)
 }
 
 static struct hbac_request_element *
-svc_to_eval_req_el(struct ph_entry *svc, const char *basedn)
+svc_to_eval_req_el(struct ph_arena *arena,
+                   struct ph_entry *svc,
+                   const char *name,
+                   const struct ph_dn_classifier *dc)
 {
+    struct hbac_request_element *el;
     struct ph_attr *svcname;
     struct ph_attr *svcgroups;
 
+    if (svc == NULL) {
+        el = alloc_sized_request_element(arena, 0, true);
+        if (el == NULL) {
+            return NULL;
+        }
+
+        /* No need to copy the PAM service name */
+        el->name = name;
+        return el;
+    }
+
     svcname = ph_entry_get_attr(svc, PH_MAP_SVC_NAME);
     svcgroups = ph_entry_get_attr(svc, PH_MAP_SVC_MEMBEROF);
 
-    return entry_to_eval_req_el(svcname, svcgroups, DN_TYPE_SVC, basedn);
+    return entry_to_eval_req_el(arena, svcname, svcgroups, DN_TYPE_SVC, dc);
 }
 
 static struct hbac_request_element *
-tgt_host_to_eval_req_el(struct ph_entry *host, const char *basedn)
+tgt_host_to_eval_req_el(struct ph_arena *arena,
+                        struct ph_entry *host,
+                        const struct ph_dn_classifier *dc)
 {
     struct ph_attr *fqdn;
     struct ph_attr *hostgroups;
@@ -166,55 +229,76 @@ tgt_host_to_eval_req_el(struct ph_entry *host, const char *basedn)
     fqdn = ph_entry_get_attr(host, PH_MAP_HOST_FQDN);
     hostgroups = ph_entry_get_attr(host, PH_MAP_HOST_MEMBEROF);
 
-    return entry_to_eval_req_el(fqdn, hostgroups, DN_TYPE_HOST, basedn);
+    return entry_to_eval_req_el(arena, fqdn, hostgroups, DN_TYPE_HOST, dc);
 }
 
 void
 ph_free_hbac_eval_req(struct hbac_eval_req *req)
 {
+    struct ph_eval_req *r;
+
     if (req == NULL) {
         return;
     }
 
-    free_request_element(req->user, false);
-    free_request_element(req->service, true);
-    free_request_element(req->targethost, true);
-    free(req);
+    r = (struct ph_eval_req *) ((char *) req - offsetof(struct ph_eval_req,
+                                                        req));
+    if (r->arena != NULL) {
+        return;
+    }
+
+    free_request_element(NULL, req->user, false);
+    free_request_element(NULL, req->service, true);
+    free_request_element(NULL, req->targethost, true);
+    free(r);
 }
 
 int
-ph_create_hbac_eval_req(struct ph_user *user,
+ph_create_hbac_eval_req(struct ph_arena *arena,
+                        struct ph_user *user,
                         struct ph_entry *targethost,
                         struct ph_entry *service,
+                        const char *svcname,
                         const char *basedn,
                         struct hbac_eval_req **_req)
 {
     int ret;
-    struct hbac_eval_req *req;
+    struct ph_eval_req *r;
+    struct hbac_eval_req *req = NULL;
+    struct ph_dn_classifier *dc = NULL;
 
-    if (user == NULL || targethost == NULL || service == NULL
-            || _req == NULL) {
+    if (user == NULL || targethost == NULL
+            || (service == NULL && svcname == NULL) || _req == NULL) {
         return EINVAL;
     }
 
-    req = calloc(1, sizeof(struct hbac_eval_req));
-    if (req == NULL) {
+    /* Without a usable base DN no group DN matches, like before */
+    ret = ph_dn_classifier_new(basedn, &dc);
+    if (ret == ENOMEM) {
         return ENOMEM;
     }
 
-    req->user = user_to_eval_req_el(user, basedn);
+    r = ph_arena_calloc(arena, 1, sizeof(struct ph_eval_req));
+    if (r == NULL) {
+        ret = ENOMEM;
+        goto fail;
+    }
+    r->arena = arena;
+    req = &r->req;
+
+    req->user = user_to_eval_req_el(arena, user);
     if (req->user == NULL) {
         ret = ENOMEM;
         goto fail;
     }
 
-    req->service = svc_to_eval_req_el(service, basedn);
+    req->service = svc_to_eval_req_el(arena, service, svcname, dc);
     if (req->service == NULL) {
         ret = ENOMEM;
         goto fail;
     }
 
-    req->targethost = tgt_host_to_eval_req_el(targethost, basedn);
+    req->targethost = tgt_host_to_eval_req_el(arena, targethost, dc);
     if (req->targethost == NULL) {
         ret = ENOMEM;
         goto fail;
@@ -222,10 +306,12 @@ ph_create_hbac_eval_req(struct ph_user *user,
 
     req->request_time = time(NULL);
 
+    ph_dn_classifier_free(dc);
     *_req = req;
     return 0;
 
 fail:
+    ph_dn_classifier_free(dc);
     ph_free_hbac_eval_req(req);
     return ret;
 }
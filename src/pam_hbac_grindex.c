@@ -0,0 +1,653 @@
+/*
+    Copyright (C) 2026 Jakub Hrozek <jakub.hrozek@posteo.se>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <grp.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "pam_hbac.h"
+#include "pam_hbac_grindex.h"
+
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
+
+#define PH_GRINDEX_MAGIC        0x5048475249445831ULL   /* "PHGRIDX1" */
+#define PH_GRINDEX_VERSION      1
+
+/* The file is laid out as the header, the members sorted by name, the
+ * GID lists of the members and the member names
+ */
+struct ph_grindex_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t num_members;
+    /* The group database the index was built from */
+    int64_t db_mtime;
+    uint64_t db_size;
+    uint64_t db_ino;
+    uint64_t size;
+    uint32_t members_off;
+    uint32_t gids_off;
+    uint32_t num_gids;
+    uint32_t strtab_off;
+};
+
+struct ph_grindex_member {
+    uint32_t name;          /* offset into the string table */
+    uint32_t first_gid;     /* index into the GID array */
+    uint32_t num_gids;
+    uint32_t reserved;
+};
+
+/* A mapped index file or one that was just built in memory */
+struct ph_grindex {
+    const uint8_t *base;
+    size_t size;
+    bool mapped;
+
+    const struct ph_grindex_header *hdr;
+    const struct ph_grindex_member *members;
+    const uint32_t *gids;
+    const char *strtab;
+    size_t strtab_size;
+};
+
+/* One group membership found while walking the groups */
+struct grindex_pair {
+    char *name;
+    gid_t gid;
+};
+
+static int
+cmp_pairs(const void *a, const void *b)
+{
+    const struct grindex_pair *pa = a;
+    const struct grindex_pair *pb = b;
+    int ret;
+
+    ret = strcmp(pa->name, pb->name);
+    if (ret != 0) {
+        return ret;
+    }
+
+    return pa->gid < pb->gid ? -1 : (pa->gid > pb->gid);
+}
+
+static void
+free_pairs(struct grindex_pair *pairs, size_t num_pairs)
+{
+    size_t i;
+
+    for (i = 0; i < num_pairs; i++) {
+        free(pairs[i].name);
+    }
+    free(pairs);
+}
+
+static bool
+grindex_db_matches(const struct ph_grindex_header *hdr,
+                   const struct stat *db_st)
+{
+    /* The modification time only has a resolution of a second, the size
+     * and the inode catch most edits within the same second. Tools like
+     * vigr replace the file and always change the inode.
+     */
+    return hdr->db_mtime == (int64_t) db_st->st_mtime
+            && hdr->db_size == (uint64_t) db_st->st_size
+            && hdr->db_ino == (uint64_t) db_st->st_ino;
+}
+
+/* Returns true if the group: line of nss_conf lists the files source only,
+ * so that group_db holds every group the system knows. An unreadable
+ * file or a missing line might mean any default, which is not trusted.
+ */
+static bool
+grindex_files_only(const char *nss_conf)
+{
+    char line[1024];
+    bool files_only = false;
+    bool found = false;
+    char *p;
+    char *src;
+    size_t len;
+    FILE *f;
+
+    f = fopen(nss_conf, "r");
+    if (f == NULL) {
+        return false;
+    }
+
+    while (!found && fgets(line, sizeof(line), f) != NULL) {
+        p = strchr(line, '#');
+        if (p != NULL) {
+            *p = '\0';
+        }
+
+        p = line + strspn(line, " \t");
+        if (strncmp(p, "group", 5) != 0) {
+            continue;
+        }
+        p += 5;
+        p += strspn(p, " \t");
+        if (*p != ':') {
+            continue;
+        }
+        p++;
+
+        found = true;
+        while (*p != '\0') {
+            p += strspn(p, " \t\n");
+            if (*p == '\0') {
+                break;
+            }
+
+            /* [STATUS=action] only changes how the sources are combined */
+            if (*p == '[') {
+                p = strchr(p, ']');
+                if (p == NULL) {
+                    files_only = false;
+                    break;
+                }
+                p++;
+                continue;
+            }
+
+            src = p;
+            len = strcspn(p, " \t\n[");
+            p += len;
+            if (len != 5 || strncmp(src, "files", 5) != 0) {
+                files_only = false;
+                break;
+            }
+            files_only = true;
+        }
+    }
+
+    fclose(f);
+    return files_only;
+}
+
+#ifdef HAVE_FGETGRENT
+/* Reads group_db once and collects the sorted, unique memberships. Only
+ * the file is read and not the other NSS sources, the index must not
+ * contain anything that can change without group_db changing.
+ */
+static int
+grindex_collect(const char *group_db,
+                struct grindex_pair **_pairs,
+                size_t *_num_pairs)
+{
+    struct grindex_pair *pairs = NULL;
+    struct grindex_pair *npairs;
+    size_t num_pairs = 0;
+    size_t alloc_pairs = 0;
+    struct group *gr;
+    size_t i, n;
+    int ret = 0;
+    FILE *f;
+
+    f = fopen(group_db, "r");
+    if (f == NULL) {
+        return errno;
+    }
+
+    while ((gr = fgetgrent(f)) != NULL) {
+        /* NIS compat entries, only meaningful to the compat source */
+        if (gr->gr_name[0] == '+' || gr->gr_name[0] == '-') {
+            continue;
+        }
+
+        for (i = 0; gr->gr_mem != NULL && gr->gr_mem[i] != NULL; i++) {
+            if (num_pairs == alloc_pairs) {
+                alloc_pairs = alloc_pairs ? alloc_pairs * 2 : 256;
+                npairs = realloc(pairs,
+                                 alloc_pairs * sizeof(struct grindex_pair));
+                if (npairs == NULL) {
+                    ret = ENOMEM;
+                    goto done;
+                }
+                pairs = npairs;
+            }
+
+            pairs[num_pairs].name = strdup(gr->gr_mem[i]);
+            if (pairs[num_pairs].name == NULL) {
+                ret = ENOMEM;
+                goto done;
+            }
+            pairs[num_pairs].gid = gr->gr_gid;
+            num_pairs++;
+        }
+    }
+
+    qsort(pairs, num_pairs, sizeof(struct grindex_pair), cmp_pairs);
+    for (i = 1, n = num_pairs ? 1 : 0; i < num_pairs; i++) {
+        if (cmp_pairs(&pairs[i], &pairs[n - 1]) == 0) {
+            free(pairs[i].name);
+            continue;
+        }
+        pairs[n++] = pairs[i];
+    }
+    num_pairs = n;
+
+done:
+    fclose(f);
+    if (ret != 0) {
+        free_pairs(pairs, num_pairs);
+        return ret;
+    }
+
+    *_pairs = pairs;
+    *_num_pairs = num_pairs;
+    return 0;
+}
+#else
+static int
+grindex_collect(const char *group_db,
+                struct grindex_pair **_pairs,
+                size_t *_num_pairs)
+{
+    /* The file cannot be read without reading the other sources */
+    return ENOSYS;
+}
+#endif /* HAVE_FGETGRENT */
+
+static size_t
+align8(size_t n)
+{
+    return (n + 7) & ~(size_t) 7;
+}
+
+static void
+grindex_set_sections(struct ph_grindex *idx)
+{
+    idx->hdr = (const struct ph_grindex_header *) (const void *) idx->base;
+    idx->members = (const struct ph_grindex_member *) (const void *)
+                        (idx->base + idx->hdr->members_off);
+    idx->gids = (const uint32_t *) (const void *)
+                        (idx->base + idx->hdr->gids_off);
+    idx->strtab = (const char *) idx->base + idx->hdr->strtab_off;
+    idx->strtab_size = idx->size - idx->hdr->strtab_off;
+}
+
+/* Builds the index in memory from the current group database */
+static int
+grindex_build(const char *group_db,
+              const struct stat *db_st,
+              struct ph_grindex *idx)
+{
+    struct grindex_pair *pairs = NULL;
+    size_t num_pairs = 0;
+    struct ph_grindex_header *hdr;
+    struct ph_grindex_member *members;
+    uint32_t *gids;
+    char *strtab;
+    size_t num_members = 0;
+    size_t strtab_len = 0;
+    size_t members_off, gids_off, strtab_off, size;
+    size_t m, i, len;
+    uint8_t *base;
+    int ret;
+
+    ret = grindex_collect(group_db, &pairs, &num_pairs);
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < num_pairs; i++) {
+        if (i == 0 || strcmp(pairs[i].name, pairs[i - 1].name) != 0) {
+            num_members++;
+            strtab_len += strlen(pairs[i].name) + 1;
+        }
+    }
+
+    members_off = align8(sizeof(struct ph_grindex_header));
+    gids_off = members_off + num_members * sizeof(struct ph_grindex_member);
+    strtab_off = gids_off + num_pairs * sizeof(uint32_t);
+    size = strtab_off + strtab_len;
+    if (size > UINT32_MAX) {
+        free_pairs(pairs, num_pairs);
+        return E2BIG;
+    }
+
+    base = calloc(1, size ? size : 1);
+    if (base == NULL) {
+        free_pairs(pairs, num_pairs);
+        return ENOMEM;
+    }
+
+    hdr = (struct ph_grindex_header *) (void *) base;
+    hdr->magic = PH_GRINDEX_MAGIC;
+    hdr->version = PH_GRINDEX_VERSION;
+    hdr->num_members = num_members;
+    hdr->db_mtime = db_st->st_mtime;
+    hdr->db_size = db_st->st_size;
+    hdr->db_ino = db_st->st_ino;
+    hdr->size = size;
+    hdr->members_off = members_off;
+    hdr->gids_off = gids_off;
+    hdr->num_gids = num_pairs;
+    hdr->strtab_off = strtab_off;
+
+    members = (struct ph_grindex_member *) (void *) (base + members_off);
+    gids = (uint32_t *) (void *) (base + gids_off);
+    strtab = (char *) base + strtab_off;
+
+    strtab_len = 0;
+    for (i = 0, m = 0; i < num_pairs; i++) {
+        if (i == 0 || strcmp(pairs[i].name, pairs[i - 1].name) != 0) {
+            if (i > 0) {
+                m++;
+            }
+            len = strlen(pairs[i].name) + 1;
+            memcpy(strtab + strtab_len, pairs[i].name, len);
+            members[m].name = strtab_len;
+            members[m].first_gid = i;
+            strtab_len += len;
+        }
+        members[m].num_gids++;
+        gids[i] = pairs[i].gid;
+    }
+
+    free_pairs(pairs, num_pairs);
+
+    idx->base = base;
+    idx->size = size;
+    idx->mapped = false;
+    grindex_set_sections(idx);
+    return 0;
+}
+
+static void
+grindex_close(struct ph_grindex *idx)
+{
+    if (idx->base == NULL) {
+        return;
+    }
+
+    if (idx->mapped) {
+        munmap(discard_const(idx->base), idx->size);
+    } else {
+        free(discard_const(idx->base));
+    }
+    idx->base = NULL;
+}
+
+/* Maps the index if it exists and was built from the current database */
+static int
+grindex_open(pam_handle_t *pamh,
+             const char *path,
+             const struct stat *db_st,
+             struct ph_grindex *idx)
+{
+    const struct ph_grindex_header *hdr;
+    struct stat st;
+    void *map;
+    int fd;
+    int ret;
+
+    fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd == -1) {
+        return errno;
+    }
+
+    if (fstat(fd, &st) == -1 || !ph_file_trusted(pamh, path, &st)) {
+        close(fd);
+        return EPERM;
+    }
+
+    if ((size_t) st.st_size < sizeof(struct ph_grindex_header)
+            || (uint64_t) st.st_size > UINT32_MAX) {
+        close(fd);
+        return EINVAL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        ret = errno;
+        logger(pamh, LOG_NOTICE,
+               "Cannot map group index %s [%d]: %s\n",
+               path, ret, strerror(ret));
+        return ret;
+    }
+
+    hdr = map;
+    if (hdr->magic != PH_GRINDEX_MAGIC
+            || hdr->version != PH_GRINDEX_VERSION
+            || hdr->size != (uint64_t) st.st_size
+            || hdr->members_off < sizeof(struct ph_grindex_header)
+            || hdr->members_off % 8 != 0
+            || hdr->gids_off % sizeof(uint32_t) != 0
+            || hdr->members_off + (uint64_t) hdr->num_members
+                    * sizeof(struct ph_grindex_member) > hdr->gids_off
+            || hdr->gids_off + (uint64_t) hdr->num_gids
+                    * sizeof(uint32_t) > hdr->strtab_off
+            || hdr->strtab_off > hdr->size) {
+        logger(pamh, LOG_NOTICE,
+               "Group index %s has an unknown format, rebuilding\n", path);
+        munmap(map, st.st_size);
+        return EINVAL;
+    }
+
+    if (!grindex_db_matches(hdr, db_st)) {
+        logger(pamh, LOG_DEBUG,
+               "The group database changed, rebuilding %s\n", path);
+        munmap(map, st.st_size);
+        return ESTALE;
+    }
+
+    idx->base = map;
+    idx->size = st.st_size;
+    idx->mapped = true;
+    grindex_set_sections(idx);
+    return 0;
+}
+
+static int
+write_all(int fd, const uint8_t *data, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* Replaces the index file atomically, readers never see a partial one */
+static int
+grindex_write(pam_handle_t *pamh,
+              const char *path,
+              const struct ph_grindex *idx)
+{
+    char *tmp_path = NULL;
+    int fd;
+    int ret;
+
+    ret = ph_mkdir_parent(path);
+    if (ret != 0) {
+        return ret;
+    }
+
+    if (asprintf(&tmp_path, "%s.XXXXXX", path) < 0) {
+        return ENOMEM;
+    }
+
+    fd = mkstemp(tmp_path);
+    if (fd == -1) {
+        ret = errno;
+        goto done;
+    }
+
+    ret = write_all(fd, idx->base, idx->size);
+    if (close(fd) == -1 && ret == 0) {
+        ret = errno;
+    }
+    if (ret != 0) {
+        goto done;
+    }
+
+    if (rename(tmp_path, path) == -1) {
+        ret = errno;
+        goto done;
+    }
+
+    logger(pamh, LOG_DEBUG,
+           "Wrote group index %s with %u members\n",
+           path, idx->hdr->num_members);
+    ret = 0;
+done:
+    if (ret != 0) {
+        logger(pamh, LOG_NOTICE,
+               "Cannot write group index %s [%d]: %s\n",
+               path, ret, strerror(ret));
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    return ret;
+}
+
+/* Returns the member entry of name or NULL. The entries that are looked
+ * at are checked against the bounds of the file.
+ */
+static const struct ph_grindex_member *
+grindex_find(const struct ph_grindex *idx, const char *name)
+{
+    const struct ph_grindex_member *member;
+    const char *member_name;
+    uint32_t lo = 0;
+    uint32_t hi = idx->hdr->num_members;
+    uint32_t mid;
+    int cmp;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        member = &idx->members[mid];
+
+        if (member->name >= idx->strtab_size
+                || memchr(idx->strtab + member->name, '\0',
+                          idx->strtab_size - member->name) == NULL) {
+            return NULL;
+        }
+        member_name = idx->strtab + member->name;
+
+        cmp = strcmp(name, member_name);
+        if (cmp == 0) {
+            if ((uint64_t) member->first_gid + member->num_gids
+                    > idx->hdr->num_gids) {
+                return NULL;
+            }
+            return member;
+        } else if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    return NULL;
+}
+
+int
+ph_grindex_getgrouplist(pam_handle_t *pamh,
+                        const char *index_path,
+                        const char *group_db,
+                        const char *nss_conf,
+                        const char *name,
+                        gid_t primary_gid,
+                        gid_t **_gids,
+                        int *_ngroups)
+{
+    struct ph_grindex idx = { NULL, 0, false, NULL, NULL, NULL, NULL, 0 };
+    const struct ph_grindex_member *member;
+    struct stat db_st;
+    gid_t *gids;
+    uint32_t num_gids;
+    uint32_t i;
+    int ngroups;
+    int ret;
+
+    if (index_path == NULL || group_db == NULL || nss_conf == NULL
+            || name == NULL || _gids == NULL || _ngroups == NULL) {
+        return EINVAL;
+    }
+
+    if (!grindex_files_only(nss_conf)) {
+        return EOPNOTSUPP;
+    }
+
+    if (stat(group_db, &db_st) == -1) {
+        return ENOENT;
+    }
+
+    ret = grindex_open(pamh, index_path, &db_st, &idx);
+    if (ret != 0) {
+        ret = grindex_build(group_db, &db_st, &idx);
+        if (ret != 0) {
+            return ret;
+        }
+
+        /* The groups are known now, a failed write only means that
+         * the next login builds the index again
+         */
+        grindex_write(pamh, index_path, &idx);
+    }
+
+    member = grindex_find(&idx, name);
+    num_gids = member ? member->num_gids : 0;
+
+    gids = malloc((num_gids + 1) * sizeof(gid_t));
+    if (gids == NULL) {
+        grindex_close(&idx);
+        return ENOMEM;
+    }
+
+    gids[0] = primary_gid;
+    ngroups = 1;            /* primary group already included */
+    for (i = 0; i < num_gids; i++) {
+        if (idx.gids[member->first_gid + i] != (uint32_t) primary_gid) {
+            gids[ngroups++] = idx.gids[member->first_gid + i];
+        }
+    }
+
+    grindex_close(&idx);
+    *_gids = gids;
+    *_ngroups = ngroups;
+    return 0;
+}
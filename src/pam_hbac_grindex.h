@@ -0,0 +1,51 @@
+/*
+    Copyright (C) 2026 Jakub Hrozek <jakub.hrozek@posteo.se>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __PAM_HBAC_GRINDEX_H__
+#define __PAM_HBAC_GRINDEX_H__
+
+#include <sys/types.h>
+
+#include "pam_hbac.h"
+
+/* On platforms without getgrouplist() the group memberships are found by
+ * walking all groups with getgrent(). The group index maps every member
+ * name to the GIDs of its groups in group_db. It is built in a single
+ * pass over the file, written to index_path and rebuilt once the
+ * modification time, size or inode of group_db changes, so that most
+ * logins only map the index and do one binary search.
+ *
+ * The index is only used if nss_conf lists files as the only source of
+ * groups. Groups from other sources such as NIS or LDAP can change
+ * without group_db changing and are always found by walking the groups.
+ */
+
+/* Returns the primary GID followed by the GIDs of the groups name is
+ * a member of in *_gids, which must be freed. Returns EOPNOTSUPP if there
+ * are other sources of groups and ENOENT if group_db does not exist, the
+ * caller must then walk the groups itself.
+ */
+int ph_grindex_getgrouplist(pam_handle_t *pamh,
+                            const char *index_path,
+                            const char *group_db,
+                            const char *nss_conf,
+                            const char *name,
+                            gid_t primary_gid,
+                            gid_t **_gids,
+                            int *_ngroups);
+
+#endif /* __PAM_HBAC_GRINDEX_H__ */
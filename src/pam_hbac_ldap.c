@@ -18,53 +18,257 @@
 #define _GNU_SOURCE
 
 #include <stdio.h>
+#include <time.h>
+#include <poll.h>
 #include <sys/time.h>
 
 #include "pam_hbac_compat.h"
 #include "pam_hbac_ldap.h"
+#include "pam_hbac_pool.h"
+#include "pam_hbac_scoreboard.h"
 
 static int
-internal_search(pam_handle_t *pamh,
-                LDAP *ld,
-                int timeout,
-                const char *search_base,
-                const char * const attrs[],
-                const char *filter,
-                LDAPMessage **_msg)
+ldap_to_errno(int lret)
+{
+    switch (lret) {
+    case LDAP_SERVER_DOWN:
+        return ENOTCONN;
+    case LDAP_TIMEOUT:
+        return ETIMEDOUT;
+    default:
+        break;
+    }
+
+    return EIO;
+}
+
+void
+ph_deadline_start(struct pam_hbac_ctx *ctx)
 {
     int ret;
-    LDAPMessage *msg;
+
+    if (ctx == NULL) {
+        return;
+    }
+
+    ctx->stage = NULL;
+    ctx->deadline.tv_sec = 0;
+    ctx->deadline.tv_nsec = 0;
+
+    if (ctx->pc == NULL || ctx->pc->timeout <= 0) {
+        return;
+    }
+
+    ret = clock_gettime(CLOCK_MONOTONIC, &ctx->deadline);
+    if (ret != 0) {
+        logger(ctx->pamh, LOG_NOTICE,
+               "Cannot read the clock, LDAP operations will not time out\n");
+        ctx->deadline.tv_sec = 0;
+        ctx->deadline.tv_nsec = 0;
+        return;
+    }
+    ctx->deadline.tv_sec += ctx->pc->timeout;
+}
+
+int
+ph_deadline_left(struct pam_hbac_ctx *ctx,
+                 const char *stage,
+                 struct timeval *buf,
+                 struct timeval **_left)
+{
+    struct timespec now;
+    long long usec;
+    int ret;
+
+    ctx->stage = stage;
+
+    if (ctx->deadline.tv_sec == 0 && ctx->deadline.tv_nsec == 0) {
+        *_left = NULL;
+        return 0;
+    }
+
+    ret = clock_gettime(CLOCK_MONOTONIC, &now);
+    if (ret != 0) {
+        *_left = NULL;
+        return 0;
+    }
+
+    usec = (long long) (ctx->deadline.tv_sec - now.tv_sec) * 1000000
+           + (ctx->deadline.tv_nsec - now.tv_nsec) / 1000;
+    if (usec <= 0) {
+        logger(ctx->pamh, LOG_DEBUG, "No time left for %s\n", stage);
+        return ETIMEDOUT;
+    }
+
+    buf->tv_sec = usec / 1000000;
+    buf->tv_usec = usec % 1000000;
+    *_left = buf;
+    return 0;
+}
+
+/* libldap reports a connection attempt that ran out of
+ * LDAP_OPT_NETWORK_TIMEOUT as a generic failure to reach the server
+ */
+static bool
+deadline_passed(struct pam_hbac_ctx *ctx)
+{
+    struct timeval buf;
+    struct timeval *left;
+
+    return ph_deadline_left(ctx, ctx->stage, &buf, &left) == ETIMEDOUT;
+}
+
+static int
+internal_search_send(pam_handle_t *pamh,
+                     LDAP *ld,
+                     int timeout,
+                     const char *search_base,
+                     const char * const attrs[],
+                     const char *filter,
+                     int *_msgid)
+{
+    int ret;
+    int msgid;
 
     logger(pamh, LOG_DEBUG,
            "Searching LDAP using filter [%s] base [%s] timeout [%d]\n",
            filter, search_base, timeout);
 
-    /* Explicitly don't specify timeout. The admin can set TIMELIMIT in
-     * ldap.conf instead */
-    ret = ldap_search_ext_s(ld, search_base, LDAP_SCOPE_SUBTREE, filter,
-                            discard_const(attrs),
-                            0, NULL, NULL, NULL, 0, &msg);
-    if (ret == LDAP_NO_SUCH_OBJECT) {
-        logger(pamh, LOG_NOTICE, "No such object\n");
-        msg = NULL;
-    } else if (ret != LDAP_SUCCESS) {
+    /* The client side limit is enforced when waiting for the result in
+     * internal_search_recv(). The admin can set TIMELIMIT in ldap.conf
+     * to limit the server side as well */
+    ret = ldap_search_ext(ld, search_base, LDAP_SCOPE_SUBTREE, filter,
+                          discard_const(attrs),
+                          0, NULL, NULL, NULL, 0, &msgid);
+    if (ret != LDAP_SUCCESS) {
         logger(pamh, LOG_ERR,
-               "ldap_search_ext_s failed [%d]: %s\n",
+               "ldap_search_ext failed [%d]: %s\n",
                ret, ldap_err2string(ret));
-        ret = EIO;
-        goto done;
+        return ldap_to_errno(ret);
     }
 
-    ret = 0;
-    *_msg = msg;
-done:
+    logger(pamh, LOG_DEBUG, "Sent search with message ID %d\n", msgid);
+    *_msgid = msgid;
+    return 0;
+}
+
+static int
+result_wait(pam_handle_t *pamh,
+            LDAP *ld,
+            int msgid,
+            int all,
+            struct timeval *timeout,
+            LDAPMessage **_msg)
+{
+    int ret;
+    int lret;
+    int optret;
+
+    *_msg = NULL;
+    ret = ldap_result(ld, msgid, all, timeout, _msg);
+    if (ret == -1) {
+        lret = LDAP_OTHER;
+        optret = ldap_get_option(ld, PH_RESULT_CODE, &lret);
+        if (optret != LDAP_SUCCESS) {
+            lret = LDAP_OTHER;
+        }
+        logger(pamh, LOG_ERR,
+               "ldap_result failed for message ID %d [%d]: %s\n",
+               msgid, lret, ldap_err2string(lret));
+        return ldap_to_errno(lret);
+    } else if (ret == 0) {
+        logger(pamh, LOG_ERR,
+               "ldap_result timed out for message ID %d\n", msgid);
+        return ETIMEDOUT;
+    }
+
+    return 0;
+}
+
+/* Checks the final result of the search msgid. Returns ENOENT if the
+ * search base does not exist, which callers treat as an empty result.
+ */
+static int
+result_check(pam_handle_t *pamh, LDAP *ld, int msgid, LDAPMessage *msg)
+{
+    int ret;
+    int lret;
+    char *errmsg = NULL;
+
+    lret = LDAP_OTHER;
+    ret = ldap_parse_result(ld, msg, &lret, NULL, &errmsg, NULL, NULL, 0);
+    if (ret != LDAP_SUCCESS) {
+        logger(pamh, LOG_ERR,
+               "ldap_parse_result failed for message ID %d [%d]: %s\n",
+               msgid, ret, ldap_err2string(ret));
+        return EIO;
+    }
+
+    if (lret == LDAP_NO_SUCH_OBJECT) {
+        logger(pamh, LOG_NOTICE, "No such object\n");
+        ret = ENOENT;
+    } else if (lret != LDAP_SUCCESS) {
+        logger(pamh, LOG_ERR,
+               "Search with message ID %d failed [%d]: %s %s\n",
+               msgid, lret, ldap_err2string(lret), errmsg ? errmsg : "");
+        ret = ldap_to_errno(lret);
+    } else {
+        ret = 0;
+    }
+
+    ldap_memfree(errmsg);
     return ret;
 }
 
+/* Waits for all results of the search msgid, results of other searches
+ * on the same handle stay queued in libldap
+ */
+static int
+internal_search_recv(pam_handle_t *pamh,
+                     LDAP *ld,
+                     int msgid,
+                     struct timeval *timeout,
+                     LDAPMessage **_msg)
+{
+    int ret;
+    LDAPMessage *msg = NULL;
+
+    ret = result_wait(pamh, ld, msgid, LDAP_MSG_ALL, timeout, &msg);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret = result_check(pamh, ld, msgid, msg);
+    if (ret == ENOENT) {
+        ldap_msgfree(msg);
+        msg = NULL;
+    } else if (ret != 0) {
+        ldap_msgfree(msg);
+        return ret;
+    }
+
+    *_msg = msg;
+    return 0;
+}
+
 static bool
-entry_has_oc(pam_handle_t *pamh, LDAP *ld, LDAPMessage *entry, const char *oc)
+vals_have_oc(pam_handle_t *pamh, struct berval **vals, const char *oc)
 {
     size_t i;
+
+    for (i = 0; vals[i] != NULL; i++) {
+        if (strcasecmp(vals[i]->bv_val, oc) == 0) {
+            return true;
+        }
+    }
+
+    logger(pamh, LOG_NOTICE, "Could not find objectclass %s\n", oc);
+    return false;
+}
+
+static bool
+entry_has_oc(pam_handle_t *pamh, LDAP *ld, LDAPMessage *entry, const char *oc)
+{
     struct berval **vals;
     bool ret;
 
@@ -74,29 +278,93 @@ entry_has_oc(pam_handle_t *pamh, LDAP *ld, LDAPMessage *entry, const char *oc)
         return false;
     }
 
-    for (i = 0; vals[i] != NULL; i++) {
-        if (strcasecmp(vals[i]->bv_val, oc) == 0) {
-            break;
+    ret = vals_have_oc(pamh, vals, oc);
+    ldap_value_free_len(vals);
+    return ret;
+}
+
+/* Must be a power of two and more than twice the number of attributes
+ * of any search
+ */
+#define PH_ATTR_INDEX_SIZE  64
+
+/* A case-insensitive hash table from the requested attribute names to
+ * their position in ph_search_ctx.attrs. Each search builds its own,
+ * which is cheap next to the round trip to the server.
+ */
+struct ph_attr_index {
+    /* The position plus one, 0 marks an empty slot */
+    uint8_t slots[PH_ATTR_INDEX_SIZE];
+    bool usable;
+};
+
+#define FNV32_OFFSET            2166136261U
+#define FNV32_PRIME             16777619U
+
+/* Attribute names are ASCII, fold them without the locale */
+static uint32_t
+attr_name_hash(const char *name)
+{
+    uint32_t h = FNV32_OFFSET;
+    unsigned char c;
+
+    for (; *name != '\0'; name++) {
+        c = (unsigned char) *name;
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
         }
+        h ^= c;
+        h *= FNV32_PRIME;
     }
 
-    if (vals[i] == NULL) {
-        logger(pamh, LOG_NOTICE, "Could not find objectclass %s\n", oc);
-        ret = false;
-    } else {
-        ret = true;
+    return h;
+}
+
+static void
+attr_index_build(struct ph_search_ctx *s, struct ph_attr_index *index)
+{
+    size_t i;
+    size_t slot;
+
+    memset(index->slots, 0, sizeof(index->slots));
+    index->usable = false;
+
+    /* Keep the load factor under one half */
+    if (s->num_attrs * 2 > PH_ATTR_INDEX_SIZE) {
+        return;
     }
 
-    ldap_value_free_len(vals);
-    return ret;
+    for (i = 0; i < s->num_attrs; i++) {
+        for (slot = attr_name_hash(s->attrs[i]) & (PH_ATTR_INDEX_SIZE - 1);
+             index->slots[slot] != 0;
+             slot = (slot + 1) & (PH_ATTR_INDEX_SIZE - 1)) ;
+
+        index->slots[slot] = i + 1;
+    }
+    index->usable = true;
 }
 
 static int
-want_attrname(const char *attr, struct ph_search_ctx *obj)
+want_attrname(const struct ph_attr_index *index,
+              const char *attr,
+              struct ph_search_ctx *obj)
 {
+    size_t slot;
     size_t i;
 
-    for (i = 0; i < obj->num_attrs; i++) {
+    if (!index->usable) {
+        for (i = 0; i < obj->num_attrs; i++) {
+            if (strcasecmp(obj->attrs[i], attr) == 0) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    for (slot = attr_name_hash(attr) & (PH_ATTR_INDEX_SIZE - 1);
+         index->slots[slot] != 0;
+         slot = (slot + 1) & (PH_ATTR_INDEX_SIZE - 1)) {
+        i = index->slots[slot] - 1;
         if (strcasecmp(obj->attrs[i], attr) == 0) {
             return i;
         }
@@ -105,69 +373,226 @@ want_attrname(const char *attr, struct ph_search_ctx *obj)
     return -1;
 }
 
+static void
+entry_clear(struct ph_entry *pentry)
+{
+    size_t i;
+
+    for (i = 0; i < pentry->num_attrs; i++) {
+        ph_attr_free(pentry->attrs[i]);
+        pentry->attrs[i] = NULL;
+    }
+}
+
 static int
-parse_entry(pam_handle_t *pamh,
+entry_add_attr(pam_handle_t *pamh,
+               struct ph_entry *pentry,
+               struct ph_attr *attr,
+               int idx)
+{
+    int ret;
+
+    logger(pamh, LOG_DEBUG, "Received attribute %s\n", attr->name);
+
+    /* A repeated attribute replaces the earlier one */
+    ph_attr_free(ph_entry_get_attr(pentry, idx));
+    ret = ph_entry_set_attr(pentry, attr, idx);
+    if (ret != 0) {
+        ph_attr_free(attr);
+        return ret;
+    }
+
+    return 0;
+}
+
+static int
+parse_attrs(pam_handle_t *pamh,
             LDAP *ld,
             LDAPMessage *entry,
             struct ph_search_ctx *obj,
+            const struct ph_attr_index *index,
             struct ph_entry *pentry)
 {
     BerElement *ber = NULL;
     char *a;
+    char *dn;
     struct berval **vals;
     struct ph_attr *attr;
     int idx;
-    int ret;
-    char *dn;
-    size_t num_attrs;
+    int ret = 0;
 
     dn = ldap_get_dn(ld, entry);
     logger(pamh, LOG_DEBUG, "received DN: %s\n", dn);
+    ldap_memfree(dn);
 
-    /* check objectclass first */
-    if (entry_has_oc(pamh, ld, entry, obj->oc) == false) {
-        return ENOENT;
-    }
-
-    /* Process the rest of the attributes */
-    num_attrs = 0;
     for (a = ldap_first_attribute(ld, entry, &ber);
          a != NULL;
          a = ldap_next_attribute(ld, entry, ber)) {
 
-        idx = want_attrname(a, obj);
+        idx = want_attrname(index, a, obj);
         if (idx == -1) {
             ldap_memfree(a);
             continue;
         }
 
-        logger(pamh, LOG_DEBUG, "Received attribute %s\n", a);
         vals = ldap_get_values_len(ld, entry, a);
         attr = ph_attr_new(a, vals);
         if (attr == NULL) {
             ldap_memfree(a);
             ldap_value_free_len(vals);
-            return ENOMEM;
+            ret = ENOMEM;
+            break;
         }
         /* attr owns vals and a now */
 
-        ret = ph_entry_set_attr(pentry, attr, idx);
-        if (ret) {
-            ph_attr_free(attr);
-            return ret;
+        ret = entry_add_attr(pamh, pentry, attr, idx);
+        if (ret != 0) {
+            break;
         }
-        num_attrs++;
     }
 
-    logger(pamh, LOG_DEBUG, "Total attributes %d\n", num_attrs);
+    if (ber != NULL) {
+        ber_free(ber, 0);
+    }
 
-    /* FIXME - should we iterate here over unset attrs and set them
-     * to an empty value?
-     */
+    return ret;
+}
+
+#ifdef HAVE_LDAP_GET_ATTRIBUTE_BER
+/* Like parse_attrs(), but the names and values are not copied out of
+ * the message, only the arrays that point to them are allocated
+ */
+static int
+parse_attrs_borrowed(pam_handle_t *pamh,
+                     LDAP *ld,
+                     LDAPMessage *entry,
+                     struct ph_search_ctx *obj,
+                     const struct ph_attr_index *index,
+                     struct ph_entry *pentry)
+{
+    BerElement *ber = NULL;
+    struct berval dn;
+    struct berval a;
+    BerVarray vals;
+    struct ph_attr *attr;
+    int idx;
+    int lret;
+    int ret = 0;
+
+    lret = ldap_get_dn_ber(ld, entry, &ber, &dn);
+    if (lret != LDAP_SUCCESS) {
+        logger(pamh, LOG_ERR,
+               "Cannot parse entry [%d]: %s\n", lret, ldap_err2string(lret));
+        ret = EIO;
+        goto done;
+    }
+    logger(pamh, LOG_DEBUG, "received DN: %s\n", dn.bv_val);
+
+    for (;;) {
+        vals = NULL;
+        lret = ldap_get_attribute_ber(ld, entry, ber, &a, &vals);
+        if (lret != LDAP_SUCCESS) {
+            logger(pamh, LOG_ERR,
+                   "Cannot parse the attributes of %s [%d]: %s\n",
+                   dn.bv_val, lret, ldap_err2string(lret));
+            ret = EIO;
+            break;
+        }
+
+        if (a.bv_val == NULL) {
+            /* No more attributes */
+            break;
+        }
+
+        idx = want_attrname(index, a.bv_val, obj);
+        if (idx == -1 || vals == NULL) {
+            ber_memfree(vals);
+            continue;
+        }
+
+        attr = ph_attr_new_borrowed(&a, vals);
+        if (attr == NULL) {
+            ber_memfree(vals);
+            ret = ENOMEM;
+            break;
+        }
+
+        ret = entry_add_attr(pamh, pentry, attr, idx);
+        if (ret != 0) {
+            break;
+        }
+    }
 
+done:
     if (ber != NULL) {
         ber_free(ber, 0);
     }
+    return ret;
+}
+#endif /* HAVE_LDAP_GET_ATTRIBUTE_BER */
+
+/* The objectclass is checked on the values already parsed into pentry,
+ * it is only fetched again if the search did not ask for it
+ */
+static bool
+entry_oc_matches(pam_handle_t *pamh,
+                 LDAP *ld,
+                 LDAPMessage *entry,
+                 struct ph_search_ctx *obj,
+                 const struct ph_attr_index *index,
+                 struct ph_entry *pentry)
+{
+    struct ph_attr *oc_attr;
+    int idx;
+
+    idx = want_attrname(index, PAM_HBAC_ATTR_OC, obj);
+    if (idx == -1) {
+        return entry_has_oc(pamh, ld, entry, obj->oc);
+    }
+
+    oc_attr = ph_entry_get_attr(pentry, idx);
+    if (oc_attr == NULL) {
+        logger(pamh, LOG_ERR, "No objectclass? Corrupt entry\n");
+        return false;
+    }
+
+    return vals_have_oc(pamh, oc_attr->vals, obj->oc);
+}
+
+/* With borrow set, the values of pentry point into entry and must not be
+ * used after the message is freed
+ */
+static int
+parse_entry(pam_handle_t *pamh,
+            LDAP *ld,
+            LDAPMessage *entry,
+            struct ph_search_ctx *obj,
+            const struct ph_attr_index *index,
+            bool borrow,
+            struct ph_entry *pentry)
+{
+    int ret;
+
+#ifdef HAVE_LDAP_GET_ATTRIBUTE_BER
+    if (borrow) {
+        ret = parse_attrs_borrowed(pamh, ld, entry, obj, index, pentry);
+    } else {
+        ret = parse_attrs(pamh, ld, entry, obj, index, pentry);
+    }
+#else
+    (void) borrow;
+    ret = parse_attrs(pamh, ld, entry, obj, index, pentry);
+#endif
+    if (ret == 0
+            && !entry_oc_matches(pamh, ld, entry, obj, index, pentry)) {
+        ret = ENOENT;
+    }
+
+    if (ret != 0) {
+        /* The entry is reused for the next message */
+        entry_clear(pentry);
+        return ret;
+    }
 
     return 0;
 }
@@ -184,12 +609,15 @@ parse_ldap_msg(pam_handle_t *pamh,
     int ent_type;
     int ret;
     size_t entry_idx = 0;
+    struct ph_attr_index index;
 
     if (msg == NULL) {
         /* Return empty array and let the caller iterate over it */
         return 0;
     }
 
+    attr_index_build(s, &index);
+
     /* Iterate through the results. */
     for (ent = ldap_first_message(ld, msg);
          ent != NULL;
@@ -205,7 +633,8 @@ parse_ldap_msg(pam_handle_t *pamh,
                 }
 
                 /* The result is an entry. */
-                ret = parse_entry(pamh, ld, ent, s, entries[entry_idx]);
+                ret = parse_entry(pamh, ld, ent, s, &index, false,
+                                  entries[entry_idx]);
                 if (ret != 0) {
                     /* This is safe b/c we don't support deny fules */
                     continue;
@@ -257,54 +686,215 @@ parse_message(pam_handle_t *pamh,
     return 0;
 }
 
-static char *
-compose_search_filter(struct ph_search_ctx *s,
-                      const char *obj_filter)
+#define PH_STRBUF_MIN_SIZE  256
+
+void
+ph_strbuf_init(struct ph_strbuf *sb)
 {
-    int ret;
-    char *oc_filter = NULL;
-    char *filter = NULL;
+    sb->data = NULL;
+    sb->len = 0;
+    sb->size = 0;
+    sb->failed = false;
+}
+
+void
+ph_strbuf_reserve(struct ph_strbuf *sb, size_t len)
+{
+    size_t need;
+    size_t size;
+    char *data;
 
-    ret = asprintf(&oc_filter, "(objectclass=%s)", s->oc);
-    if (ret < 0) {
-        return NULL;
+    if (sb->failed) {
+        return;
     }
 
-    if (obj_filter != NULL) {
-        ret = asprintf(&filter, "(&%s(%s))", oc_filter, obj_filter);
-        free(oc_filter);
-        if (ret < 0) {
-            return NULL;
+    /* Room for the terminating NUL as well */
+    need = sb->len + len + 1;
+    if (need < len) {
+        sb->failed = true;
+        return;
+    }
+
+    if (need <= sb->size) {
+        return;
+    }
+
+    size = sb->size ? sb->size : PH_STRBUF_MIN_SIZE;
+    while (size < need) {
+        if (size > SIZE_MAX / 2) {
+            size = need;
+            break;
         }
-    } else {
-        filter = oc_filter;
+        size *= 2;
+    }
+
+    data = realloc(sb->data, size);
+    if (data == NULL) {
+        sb->failed = true;
+        return;
+    }
+
+    sb->data = data;
+    sb->size = size;
+}
+
+static void
+strbuf_append_len(struct ph_strbuf *sb, const char *str, size_t len)
+{
+    ph_strbuf_reserve(sb, len);
+    if (sb->failed) {
+        return;
+    }
+
+    memcpy(sb->data + sb->len, str, len);
+    sb->len += len;
+    sb->data[sb->len] = '\0';
+}
+
+void
+ph_strbuf_append(struct ph_strbuf *sb, const char *str)
+{
+    strbuf_append_len(sb, str, strlen(str));
+}
+
+static bool
+filter_special(char c)
+{
+    return c == '*' || c == '(' || c == ')' || c == '\\';
+}
+
+size_t
+ph_filter_value_len(const char *str)
+{
+    size_t len = 0;
+
+    for (; *str != '\0'; str++) {
+        /* Special characters become \XX */
+        len += filter_special(*str) ? 3 : 1;
+    }
+
+    return len;
+}
+
+void
+ph_strbuf_append_value(struct ph_strbuf *sb, const char *str)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *run;
+    char *p;
+
+    ph_strbuf_reserve(sb, ph_filter_value_len(str));
+    if (sb->failed) {
+        return;
+    }
+
+    p = sb->data + sb->len;
+    while (*str != '\0') {
+        /* Copy the characters that need no escaping in one go */
+        for (run = str; *str != '\0' && !filter_special(*str); str++);
+        memcpy(p, run, str - run);
+        p += str - run;
+
+        if (*str != '\0') {
+            *p++ = '\\';
+            *p++ = hex[(unsigned char) *str >> 4];
+            *p++ = hex[(unsigned char) *str & 0xf];
+            str++;
+        }
+    }
+
+    sb->len = p - sb->data;
+    *p = '\0';
+}
+
+char *
+ph_strbuf_finish(struct ph_strbuf *sb)
+{
+    char *str = NULL;
+
+    /* An empty buffer is still a valid empty string */
+    ph_strbuf_reserve(sb, 0);
+    if (!sb->failed) {
+        sb->data[sb->len] = '\0';
+        str = sb->data;
+        sb->data = NULL;
+    }
+
+    ph_strbuf_free(sb);
+    return str;
+}
+
+void
+ph_strbuf_free(struct ph_strbuf *sb)
+{
+    free(sb->data);
+    ph_strbuf_init(sb);
+}
+
+static char *
+compose_search_filter(struct ph_search_ctx *s,
+                      const char *obj_filter)
+{
+    struct ph_strbuf sb;
+
+    ph_strbuf_init(&sb);
+    ph_strbuf_reserve(&sb, strlen(s->oc) + ph_filter_value_len(s->oc)
+                           + (obj_filter ? strlen(obj_filter) : 0) + 32);
+
+    if (obj_filter != NULL) {
+        ph_strbuf_append(&sb, "(&");
+    }
+
+    ph_strbuf_append(&sb, "(objectclass=");
+    ph_strbuf_append_value(&sb, s->oc);
+    ph_strbuf_append(&sb, ")");
+
+    if (obj_filter != NULL) {
+        ph_strbuf_append(&sb, "(");
+        ph_strbuf_append(&sb, obj_filter);
+        ph_strbuf_append(&sb, "))");
+    }
+
+    return ph_strbuf_finish(&sb);
+}
+
+static char *
+compose_search_base(struct ph_search_ctx *s,
+                    struct pam_hbac_config *conf)
+{
+    struct ph_strbuf sb;
+
+    ph_strbuf_init(&sb);
+    ph_strbuf_append(&sb, s->sub_base);
+    if (conf->search_base != NULL) {
+        ph_strbuf_reserve(&sb, strlen(conf->search_base) + 1);
+        ph_strbuf_append(&sb, ",");
+        ph_strbuf_append(&sb, conf->search_base);
     }
 
-    return filter;
+    return ph_strbuf_finish(&sb);
 }
 
 int
-ph_search(pam_handle_t *pamh,
-          LDAP *ld,
-          struct pam_hbac_config *conf,
-          struct ph_search_ctx *s,
-          const char *obj_filter,
-          struct ph_entry ***_entry_list)
+ph_search_send(pam_handle_t *pamh,
+               LDAP *ld,
+               struct pam_hbac_config *conf,
+               struct ph_search_ctx *s,
+               const char *obj_filter,
+               int *_msgid)
 {
-    LDAPMessage *msg = NULL;
     char *search_base = NULL;
     char *filter = NULL;
     int ret;
-    struct ph_entry **entry_list;
 
-    if (ld == NULL || conf == NULL || s == NULL) {
+    if (ld == NULL || conf == NULL || s == NULL || _msgid == NULL) {
         logger(pamh, LOG_ERR, "Invalid parameters\n");
         return EINVAL;
     }
 
-    ret = asprintf(&search_base, "%s,%s", s->sub_base, conf->search_base);
-    if (ret < 0) {
-        logger(pamh, LOG_CRIT, "Cannot create filter\n");
+    search_base = compose_search_base(s, conf);
+    if (search_base == NULL) {
+        logger(pamh, LOG_CRIT, "Cannot create search base\n");
         ret = ENOMEM;
         goto done;
     }
@@ -316,44 +906,254 @@ ph_search(pam_handle_t *pamh,
         goto done;
     }
 
-    ret = internal_search(pamh, ld, conf->timeout, search_base, s->attrs,
-                          filter, &msg);
+    ret = internal_search_send(pamh, ld, conf->timeout, search_base,
+                               s->attrs, filter, _msgid);
     if (ret != 0) {
         logger(pamh, LOG_ERR,
                "Search returned [%d]: %s\n", ret, strerror(ret));
         goto done;
     }
 
+    ret = 0;
+done:
+    free(search_base);
+    free(filter);
+    return ret;
+}
+
+int
+ph_search_recv(pam_handle_t *pamh,
+               LDAP *ld,
+               struct ph_search_ctx *s,
+               int msgid,
+               struct timeval *timeout,
+               struct ph_entry ***_entry_list)
+{
+    LDAPMessage *msg = NULL;
+    struct ph_entry **entry_list;
+    int ret;
+
+    if (ld == NULL || s == NULL || _entry_list == NULL) {
+        logger(pamh, LOG_ERR, "Invalid parameters\n");
+        return EINVAL;
+    }
+
+    ret = internal_search_recv(pamh, ld, msgid, timeout, &msg);
+    if (ret != 0) {
+        logger(pamh, LOG_ERR,
+               "Search returned [%d]: %s\n", ret, strerror(ret));
+        return ret;
+    }
+
     ret = parse_message(pamh, ld, msg, s, &entry_list);
+    ldap_msgfree(msg);
     if (ret != 0) {
         logger(pamh, LOG_ERR,
                "Message parsing failed [%d]: %s\n", ret, strerror(ret));
-        goto done;
+        return ret;
     }
 
     *_entry_list = entry_list;
-    ret = 0;
-done:
-    free(search_base);
-    free(filter);
+    return 0;
+}
+
+/* Converts a relative timeout into the point in time it ends at. Returns
+ * false if there is no timeout or the clock cannot be read.
+ */
+static bool
+stream_deadline(struct timeval *timeout, struct timespec *end)
+{
+    if (timeout == NULL || clock_gettime(CLOCK_MONOTONIC, end) != 0) {
+        return false;
+    }
+
+    end->tv_sec += timeout->tv_sec;
+    end->tv_nsec += timeout->tv_usec * 1000;
+    if (end->tv_nsec >= 1000000000) {
+        end->tv_sec++;
+        end->tv_nsec -= 1000000000;
+    }
+    return true;
+}
+
+/* Fills buf with the time left until end, buf is left alone if the clock
+ * cannot be read
+ */
+static int
+stream_left(const struct timespec *end, struct timeval *buf)
+{
+    struct timespec now;
+    long long usec;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
+        return 0;
+    }
+
+    usec = (long long) (end->tv_sec - now.tv_sec) * 1000000
+           + (end->tv_nsec - now.tv_nsec) / 1000;
+    if (usec <= 0) {
+        return ETIMEDOUT;
+    }
+
+    buf->tv_sec = usec / 1000000;
+    buf->tv_usec = usec % 1000000;
+    return 0;
+}
+
+int
+ph_search_recv_each(pam_handle_t *pamh,
+                    LDAP *ld,
+                    struct ph_search_ctx *s,
+                    int msgid,
+                    struct timeval *timeout,
+                    ph_search_entry_fn entry_fn,
+                    void *pvt)
+{
+    LDAPMessage *msg;
+    struct ph_entry *entry;
+    struct timespec end;
+    struct timeval buf;
+    struct timeval *left;
+    struct ph_attr_index index;
+    bool has_deadline;
+    size_t num_entries = 0;
+    int msgtype;
+    int ret;
+
+    if (ld == NULL || s == NULL || entry_fn == NULL) {
+        logger(pamh, LOG_ERR, "Invalid parameters\n");
+        return EINVAL;
+    }
+
+    attr_index_build(s, &index);
+
+    has_deadline = stream_deadline(timeout, &end);
+    if (has_deadline) {
+        buf = *timeout;
+    }
+    left = timeout;
+
+    for (;;) {
+        if (has_deadline) {
+            ret = stream_left(&end, &buf);
+            if (ret != 0) {
+                logger(pamh, LOG_ERR,
+                       "ldap_result timed out for message ID %d\n", msgid);
+                goto fail;
+            }
+            left = &buf;
+        }
+
+        ret = result_wait(pamh, ld, msgid, LDAP_MSG_ONE, left, &msg);
+        if (ret != 0) {
+            goto fail;
+        }
+
+        msgtype = ldap_msgtype(msg);
+        switch (msgtype) {
+        case LDAP_RES_SEARCH_ENTRY:
+            entry = ph_entry_alloc(s->num_attrs);
+            if (entry == NULL) {
+                ldap_msgfree(msg);
+                ret = ENOMEM;
+                goto fail;
+            }
+
+            /* The values are borrowed from msg, which is only freed
+             * once the callback is done with them
+             */
+            ret = parse_entry(pamh, ld, msg, s, &index, true, entry);
+            if (ret != 0) {
+                /* This is safe b/c we don't support deny rules */
+                ph_entry_free(entry);
+                ldap_msgfree(msg);
+                break;
+            }
+
+            num_entries++;
+            ret = entry_fn(entry, pvt);
+            ldap_msgfree(msg);
+            if (ret != 0) {
+                goto fail;
+            }
+            break;
+        case LDAP_RES_SEARCH_REFERENCE:
+            logger(pamh, LOG_NOTICE, "No support for referrals..");
+            ldap_msgfree(msg);
+            break;
+        case LDAP_RES_SEARCH_RESULT:
+            ret = result_check(pamh, ld, msgid, msg);
+            ldap_msgfree(msg);
+            if (ret != 0 && ret != ENOENT) {
+                logger(pamh, LOG_ERR,
+                       "Search returned [%d]: %s\n", ret, strerror(ret));
+                return ret;
+            }
+
+            logger(pamh, LOG_DEBUG, "Found %zu entries\n", num_entries);
+            return 0;
+        default:
+            logger(pamh, LOG_NOTICE,
+                   "Unexpected message type %d, ignoring\n", msgtype);
+            ldap_msgfree(msg);
+            break;
+        }
+    }
+
+fail:
+    /* The rest of the results would otherwise pile up on the handle */
+    ph_search_abandon(pamh, ld, msgid);
+    logger(pamh, LOG_ERR,
+           "Search returned [%d]: %s\n", ret, strerror(ret));
     return ret;
 }
 
+void
+ph_search_abandon(pam_handle_t *pamh, LDAP *ld, int msgid)
+{
+    int ret;
+
+    if (ld == NULL || msgid == -1) {
+        return;
+    }
+
+    ret = ldap_abandon_ext(ld, msgid, NULL, NULL);
+    if (ret != LDAP_SUCCESS) {
+        logger(pamh, LOG_NOTICE,
+               "ldap_abandon_ext failed for message ID %d [%d]: %s\n",
+               msgid, ret, ldap_err2string(ret));
+    }
+}
+
+int
+ph_search(pam_handle_t *pamh,
+          LDAP *ld,
+          struct pam_hbac_config *conf,
+          struct ph_search_ctx *s,
+          const char *obj_filter,
+          struct ph_entry ***_entry_list)
+{
+    int msgid;
+    int ret;
+
+    ret = ph_search_send(pamh, ld, conf, s, obj_filter, &msgid);
+    if (ret != 0) {
+        return ret;
+    }
+
+    return ph_search_recv(pamh, ld, s, msgid, NULL, _entry_list);
+}
+
 #ifdef HAVE_LDAP_START_TLS
 static int
-start_tls(pam_handle_t *ph, LDAP *ldap, const char *ca_cert, bool secure)
+start_tls_send(pam_handle_t *ph,
+               LDAP *ldap,
+               const char *ca_cert,
+               int *_msgid)
 {
     int lret;
-    int msgid;
     int optret;
     char *errmsg = NULL;
-    char *diag_msg = NULL;
-    int ldaperr;
-    LDAPMessage *result = NULL;
-
-    if (secure == false) {
-        return LDAP_SUCCESS;
-    }
 
     if (ca_cert != NULL) {
         lret = ldap_set_option(NULL, LDAP_OPT_X_TLS_CACERTFILE, ca_cert);
@@ -365,7 +1165,7 @@ start_tls(pam_handle_t *ph, LDAP *ldap, const char *ca_cert, bool secure)
         logger(ph, LOG_DEBUG, "CA cert set to: %s\n", ca_cert);
     }
 
-    lret = ldap_start_tls(ldap, NULL, NULL, &msgid);
+    lret = ldap_start_tls(ldap, NULL, NULL, _msgid);
     if (lret != LDAP_SUCCESS) {
         optret = ldap_get_option(ldap, PH_DIAGNOSTIC_MESSAGE, (void*)&errmsg);
         if (optret != LDAP_SUCCESS) {
@@ -378,11 +1178,30 @@ start_tls(pam_handle_t *ph, LDAP *ldap, const char *ca_cert, bool secure)
                    lret, ldap_err2string(lret), errmsg);
             ldap_memfree(errmsg);
         }
-        goto done;
     }
 
-    lret = ldap_result(ldap, msgid, 1, NULL, &result);
-    if (lret != LDAP_RES_EXTENDED) {
+    return lret;
+}
+
+static int
+start_tls_recv(pam_handle_t *ph,
+               LDAP *ldap,
+               int msgid,
+               struct timeval *timeout)
+{
+    int lret;
+    int optret;
+    char *errmsg = NULL;
+    char *diag_msg = NULL;
+    int ldaperr;
+    LDAPMessage *result = NULL;
+
+    lret = ldap_result(ldap, msgid, 1, timeout, &result);
+    if (lret == 0) {
+        logger(ph, LOG_ERR, "Timed out waiting for the START TLS result\n");
+        lret = LDAP_TIMEOUT;
+        goto done;
+    } else if (lret != LDAP_RES_EXTENDED) {
         logger(ph, LOG_ERR,
               "Unexpected ldap_result, expected [%lu] got [%d].\n",
                LDAP_RES_EXTENDED, lret);
@@ -439,6 +1258,28 @@ done:
     }
     return lret;
 }
+
+static int
+start_tls(pam_handle_t *ph,
+          LDAP *ldap,
+          const char *ca_cert,
+          bool secure,
+          struct timeval *timeout)
+{
+    int lret;
+    int msgid;
+
+    if (secure == false) {
+        return LDAP_SUCCESS;
+    }
+
+    lret = start_tls_send(ph, ldap, ca_cert, &msgid);
+    if (lret != LDAP_SUCCESS) {
+        return lret;
+    }
+
+    return start_tls_recv(ph, ldap, msgid, timeout);
+}
 #endif
 
 static int secure_preinit(pam_handle_t *ph,
@@ -507,12 +1348,13 @@ static int start_ssl(pam_handle_t *ph,
 static int secure_connection(pam_handle_t *ph,
                              LDAP *ldap,
                              const char *ca_cert,
-                             bool secure)
+                             bool secure,
+                             struct timeval *timeout)
 {
 #if defined(DISABLE_SSL)
     return LDAP_NOT_SUPPORTED;
 #elif defined(HAVE_LDAP_START_TLS)
-    return start_tls(ph, ldap, ca_cert, secure);
+    return start_tls(ph, ldap, ca_cert, secure, timeout);
 #elif defined(HAVE_LDAPSSL_CLIENT_INIT)
     return start_ssl(ph, ldap, ca_cert, secure);
 #else
@@ -520,17 +1362,14 @@ static int secure_connection(pam_handle_t *ph,
 #endif
 }
 
-int
-ph_connect(struct pam_hbac_ctx *ctx)
+static int
+connect_open(struct pam_hbac_ctx *ctx, const char *uri, LDAP **_ld)
 {
     int ret;
     LDAP *ld;
-    struct berval password = {0, NULL};
     int ldap_vers = LDAP_VERSION3;
-
-    if (ctx == NULL) {
-        return EINVAL;
-    }
+    struct timeval buf;
+    struct timeval *left;
 
     /* Some LDAP implementations require parts of the SSL/TLS setup are done
      * prior to initializing the LDAP handle
@@ -543,7 +1382,7 @@ ph_connect(struct pam_hbac_ctx *ctx)
         return EIO;
     }
 
-    ret = ph_ldap_initialize(&ld, ctx->pc->uri, ctx->pc->secure);
+    ret = ph_ldap_initialize(&ld, uri, ctx->pc->secure);
     if (ret != LDAP_SUCCESS) {
         logger(ctx->pamh, LOG_ERR,
                "ldap_initialize failed [%d]: %s\n",
@@ -560,7 +1399,102 @@ ph_connect(struct pam_hbac_ctx *ctx)
         return EIO;
     }
 
-    ret = secure_connection(ctx->pamh, ld, ctx->pc->ca_cert, ctx->pc->secure);
+    /* libldap connects lazily, during StartTLS or the bind */
+    ret = ph_deadline_left(ctx, "connecting", &buf, &left);
+    if (ret != 0) {
+        ldap_unbind_ext(ld, NULL, NULL);
+        return ret;
+    }
+
+    if (left != NULL) {
+        ret = ldap_set_option(ld, LDAP_OPT_NETWORK_TIMEOUT, left);
+        if (ret != LDAP_SUCCESS) {
+            logger(ctx->pamh, LOG_NOTICE,
+                   "Cannot set the network timeout [%d]: %s\n",
+                   ret, ldap_err2string(ret));
+        }
+    }
+
+    *_ld = ld;
+    return 0;
+}
+
+/* Consumes ld on failure */
+static int
+connect_bind(struct pam_hbac_ctx *ctx, LDAP *ld)
+{
+    int ret;
+    struct berval password = {0, NULL};
+    struct timeval buf;
+    struct timeval *left;
+
+    ret = ph_deadline_left(ctx, "binding", &buf, &left);
+    if (ret != 0) {
+        ldap_unbind_ext(ld, NULL, NULL);
+        return ret;
+    }
+
+    /* Limits the synchronous bind below */
+    if (left != NULL) {
+        ret = ldap_set_option(ld, LDAP_OPT_TIMEOUT, left);
+        if (ret != LDAP_SUCCESS) {
+            logger(ctx->pamh, LOG_NOTICE,
+                   "Cannot set the bind timeout [%d]: %s\n",
+                   ret, ldap_err2string(ret));
+        }
+    }
+
+    password.bv_len = strlen(ctx->pc->bind_pw);
+    password.bv_val = discard_const(ctx->pc->bind_pw);
+
+    ret = ldap_sasl_bind_s(ld, ctx->pc->bind_dn, LDAP_SASL_SIMPLE, &password,
+                           NULL, NULL, NULL);
+    if (ret != LDAP_SUCCESS) {
+        logger(ctx->pamh, LOG_ERR,
+               "ldap_simple_bind_s failed [%d]: %s\n",
+               ret, ldap_err2string(ret));
+        ldap_unbind_ext(ld, NULL, NULL);
+        if (ret == LDAP_TIMEOUT || deadline_passed(ctx)) {
+            return ETIMEDOUT;
+        }
+        return EACCES;
+    }
+
+    return 0;
+}
+
+static void
+connect_done(struct pam_hbac_ctx *ctx, LDAP *ld, const char *uri)
+{
+    ctx->ld = ld;
+    ctx->ld_reused = false;
+    ctx->ld_broken = false;
+    ctx->server = uri;
+}
+
+static int
+connect_server(struct pam_hbac_ctx *ctx, const char *uri)
+{
+    int ret;
+    LDAP *ld;
+    struct timeval buf;
+    struct timeval *left = NULL;
+
+    ret = connect_open(ctx, uri, &ld);
+    if (ret != 0) {
+        return ret;
+    }
+
+    if (ctx->pc->secure) {
+        ret = ph_deadline_left(ctx, "starting TLS", &buf, &left);
+        if (ret != 0) {
+            ldap_unbind_ext(ld, NULL, NULL);
+            return ret;
+        }
+    }
+
+    ret = secure_connection(ctx->pamh, ld, ctx->pc->ca_cert, ctx->pc->secure,
+                            left);
     if (ret == LDAP_NOT_SUPPORTED) {
         logger(ctx->pamh,
                LOG_NOTICE,
@@ -571,35 +1505,455 @@ ph_connect(struct pam_hbac_ctx *ctx)
                "start_tls failed [%d]: %s\n",
                ret, ldap_err2string(ret));
         ldap_unbind_ext(ld, NULL, NULL);
+        if (ret == LDAP_TIMEOUT || deadline_passed(ctx)) {
+            return ETIMEDOUT;
+        }
         return EIO;
     }
 
-    password.bv_len = strlen(ctx->pc->bind_pw);
-    password.bv_val = discard_const(ctx->pc->bind_pw);
+    ret = connect_bind(ctx, ld);
+    if (ret != 0) {
+        return ret;
+    }
 
-    ret = ldap_sasl_bind_s(ld, ctx->pc->bind_dn, LDAP_SASL_SIMPLE, &password,
-                           NULL, NULL, NULL);
+    connect_done(ctx, ld, uri);
+    return 0;
+}
+
+/* Tries the servers one by one in the order of the scoreboard */
+static int
+connect_failover(struct pam_hbac_ctx *ctx, const char **uris, size_t num_uris)
+{
+    struct timespec started;
+    size_t i;
+    int ret = EIO;
+
+    for (i = 0; i < num_uris; i++) {
+        logger(ctx->pamh, LOG_DEBUG, "Connecting to %s\n", uris[i]);
+
+        ph_scoreboard_clock(&started);
+        ret = connect_server(ctx, uris[i]);
+        ph_scoreboard_report(ctx, uris[i], PH_SERVER_CONNECT,
+                             ph_scoreboard_elapsed(&started), ret == 0);
+        if (ret == 0 || ret == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    return ret;
+}
+
+/* A hedged connection sends the first request, StartTLS or the bind, to
+ * the best server. If no reply arrives within the hedge delay, the same
+ * request is sent to the next server as well and the first server to
+ * answer is used.
+ */
+#if defined(HAVE_LDAP_START_TLS) && !defined(DISABLE_SSL)
+#define PH_HEDGE_TLS 1
+#endif
+
+#define PH_HEDGE_MAX    2
+
+struct connect_attempt {
+    const char *uri;
+    LDAP *ld;
+    int msgid;
+    int fd;
+    struct timespec started;
+};
+
+static bool
+can_hedge(struct pam_hbac_config *pc)
+{
+    if (pc->hedge_delay <= 0) {
+        return false;
+    }
+
+#ifdef PH_HEDGE_TLS
+    return true;
+#else
+    return pc->secure == false;
+#endif
+}
+
+static void
+attempt_drop(struct connect_attempt *a)
+{
+    if (a->ld != NULL) {
+        ldap_unbind_ext(a->ld, NULL, NULL);
+    }
+    a->ld = NULL;
+}
+
+/* libldap connects synchronously when the first request is sent, a
+ * server that does not accept the connection would keep the hedge from
+ * firing. Give up on it within the hedge delay when there is another
+ * server left to try.
+ */
+static int
+attempt_limit_connect(struct pam_hbac_ctx *ctx, LDAP *ld)
+{
+    struct timeval hedge;
+    struct timeval buf;
+    struct timeval *left;
+    int ret;
+
+    ret = ph_deadline_left(ctx, "connecting", &buf, &left);
+    if (ret != 0) {
+        return ret;
+    }
+
+    hedge.tv_sec = ctx->pc->hedge_delay / 1000;
+    hedge.tv_usec = (ctx->pc->hedge_delay % 1000) * 1000;
+    if (left != NULL && timercmp(left, &hedge, <)) {
+        /* connect_open() already set the shorter timeout */
+        return 0;
+    }
+
+    ret = ldap_set_option(ld, LDAP_OPT_NETWORK_TIMEOUT, &hedge);
     if (ret != LDAP_SUCCESS) {
-        logger(ctx->pamh, LOG_ERR,
-               "ldap_simple_bind_s failed [%d]: %s\n",
+        logger(ctx->pamh, LOG_NOTICE,
+               "Cannot set the network timeout [%d]: %s\n",
                ret, ldap_err2string(ret));
-        ldap_unbind_ext(ld, NULL, NULL);
+    }
+    return 0;
+}
+
+static int
+attempt_start(struct pam_hbac_ctx *ctx,
+              const char *uri,
+              bool last,
+              struct connect_attempt *a)
+{
+    struct berval password = {0, NULL};
+    int lret;
+    int ret;
+
+    memset(a, 0, sizeof(struct connect_attempt));
+    a->uri = uri;
+    a->msgid = -1;
+    a->fd = -1;
+    ph_scoreboard_clock(&a->started);
+
+    logger(ctx->pamh, LOG_DEBUG, "Connecting to %s\n", uri);
+
+    ret = connect_open(ctx, uri, &a->ld);
+    if (ret != 0) {
+        return ret;
+    }
+
+    if (!last) {
+        ret = attempt_limit_connect(ctx, a->ld);
+        if (ret != 0) {
+            attempt_drop(a);
+            return ret;
+        }
+    }
+
+    if (ctx->pc->secure) {
+#ifdef PH_HEDGE_TLS
+        lret = start_tls_send(ctx->pamh, a->ld, ctx->pc->ca_cert, &a->msgid);
+#else
+        lret = LDAP_NOT_SUPPORTED;
+#endif
+    } else {
+        password.bv_len = strlen(ctx->pc->bind_pw);
+        password.bv_val = discard_const(ctx->pc->bind_pw);
+
+        lret = ldap_sasl_bind(a->ld, ctx->pc->bind_dn, LDAP_SASL_SIMPLE,
+                              &password, NULL, NULL, &a->msgid);
+        if (lret != LDAP_SUCCESS) {
+            logger(ctx->pamh, LOG_ERR,
+                   "ldap_sasl_bind failed [%d]: %s\n",
+                   lret, ldap_err2string(lret));
+        }
+    }
+
+    if (lret == LDAP_SUCCESS) {
+        lret = ldap_get_option(a->ld, LDAP_OPT_DESC, &a->fd);
+        if (lret == LDAP_SUCCESS && a->fd < 0) {
+            lret = LDAP_SERVER_DOWN;
+        }
+    }
+
+    if (lret != LDAP_SUCCESS) {
+        attempt_drop(a);
+        return deadline_passed(ctx) ? ETIMEDOUT : EIO;
+    }
+
+    return 0;
+}
+
+/* Called once the server has replied to the first request */
+static int
+attempt_finish(struct pam_hbac_ctx *ctx, struct connect_attempt *a)
+{
+    LDAPMessage *result = NULL;
+    struct timeval buf;
+    struct timeval *left;
+    int ldaperr;
+    int lret;
+    int ret;
+
+    ret = ph_deadline_left(ctx,
+                           ctx->pc->secure ? "starting TLS" : "binding",
+                           &buf, &left);
+    if (ret != 0) {
+        return ret;
+    }
+
+    if (ctx->pc->secure) {
+#ifdef PH_HEDGE_TLS
+        lret = start_tls_recv(ctx->pamh, a->ld, a->msgid, left);
+#else
+        lret = LDAP_NOT_SUPPORTED;
+#endif
+        if (lret != LDAP_SUCCESS) {
+            return lret == LDAP_TIMEOUT ? ETIMEDOUT : EIO;
+        }
+        return 0;
+    }
+
+    lret = ldap_result(a->ld, a->msgid, 1, left, &result);
+    if (lret == 0) {
+        return ETIMEDOUT;
+    } else if (lret != LDAP_RES_BIND) {
+        logger(ctx->pamh, LOG_ERR,
+               "Unexpected ldap_result, expected [%d] got [%d].\n",
+               LDAP_RES_BIND, lret);
+        if (result != NULL) {
+            ldap_msgfree(result);
+        }
+        return EIO;
+    }
+
+    lret = ldap_parse_result(a->ld, result, &ldaperr, NULL, NULL,
+                             NULL, NULL, 1);
+    if (lret != LDAP_SUCCESS || ldaperr != LDAP_SUCCESS) {
+        logger(ctx->pamh, LOG_ERR,
+               "Bind to %s failed [%d]: %s\n",
+               a->uri, ldaperr, ldap_err2string(ldaperr));
         return EACCES;
     }
 
-    ctx->ld = ld;
     return 0;
 }
 
-void
-ph_disconnect(struct pam_hbac_ctx *ctx)
+static int
+connect_hedged(struct pam_hbac_ctx *ctx, const char **uris, size_t num_uris)
+{
+    struct connect_attempt att[PH_HEDGE_MAX];
+    struct pollfd pfd[PH_HEDGE_MAX];
+    struct timeval buf;
+    struct timeval *left;
+    size_t nact = 0;
+    size_t next = 0;
+    size_t i;
+    size_t j;
+    long waited;
+    int wait_ms;
+    int ret = EIO;
+    int pret;
+
+    while (true) {
+        /* Keep one request in flight, and a second once the hedge delay
+         * passed
+         */
+        while (nact == 0 && next < num_uris) {
+            ret = attempt_start(ctx, uris[next], next + 1 == num_uris,
+                                &att[nact]);
+            if (ret == 0) {
+                nact++;
+            } else {
+                ph_scoreboard_report(ctx, uris[next],
+                                     PH_SERVER_CONNECT, 0, false);
+                if (ret == ETIMEDOUT) {
+                    goto done;
+                }
+            }
+            next++;
+        }
+
+        if (nact == 0) {
+            goto done;
+        }
+
+        ret = ph_deadline_left(ctx, "connecting", &buf, &left);
+        if (ret != 0) {
+            goto done;
+        }
+
+        wait_ms = -1;
+        if (left != NULL) {
+            wait_ms = left->tv_sec * 1000 + left->tv_usec / 1000 + 1;
+        }
+
+        if (nact < PH_HEDGE_MAX && next < num_uris) {
+            waited = ph_scoreboard_elapsed(&att[nact - 1].started) / 1000;
+            if (waited >= ctx->pc->hedge_delay) {
+                logger(ctx->pamh, LOG_DEBUG,
+                       "%s did not answer within %d ms, trying %s as well\n",
+                       att[nact - 1].uri, ctx->pc->hedge_delay, uris[next]);
+                ret = attempt_start(ctx, uris[next], next + 1 == num_uris,
+                                    &att[nact]);
+                if (ret == 0) {
+                    nact++;
+                } else {
+                    ph_scoreboard_report(ctx, uris[next],
+                                         PH_SERVER_CONNECT, 0, false);
+                }
+                next++;
+                continue;
+            }
+
+            if (wait_ms < 0 || ctx->pc->hedge_delay - waited < wait_ms) {
+                wait_ms = ctx->pc->hedge_delay - waited;
+            }
+        }
+
+        for (i = 0; i < nact; i++) {
+            pfd[i].fd = att[i].fd;
+            pfd[i].events = POLLIN;
+            pfd[i].revents = 0;
+        }
+
+        pret = poll(pfd, nact, wait_ms);
+        if (pret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ret = errno;
+            goto done;
+        } else if (pret == 0) {
+            continue;
+        }
+
+        for (i = 0; i < nact; i++) {
+            if (pfd[i].revents == 0) {
+                continue;
+            }
+
+            ret = attempt_finish(ctx, &att[i]);
+            ph_scoreboard_report(ctx, att[i].uri,
+                                 PH_SERVER_CONNECT,
+                                 ph_scoreboard_elapsed(&att[i].started),
+                                 ret == 0);
+            if (ret == 0) {
+                break;
+            }
+
+            attempt_drop(&att[i]);
+            if (ret == ETIMEDOUT) {
+                goto done;
+            }
+        }
+
+        if (i < nact) {
+            break;
+        }
+
+        /* Forget about the failed attempts */
+        for (i = 0; i < nact; ) {
+            if (att[i].ld == NULL) {
+                att[i] = att[--nact];
+            } else {
+                i++;
+            }
+        }
+    }
+
+    /* att[i] won, the others are at least as slow as the winner. Those
+     * that failed earlier in this pass were already reported.
+     */
+    for (j = 0; j < nact; j++) {
+        if (j == i || att[j].ld == NULL) {
+            continue;
+        }
+        ph_scoreboard_report(ctx, att[j].uri,
+                             PH_SERVER_CONNECT,
+                             ph_scoreboard_elapsed(&att[j].started), true);
+        attempt_drop(&att[j]);
+    }
+
+    if (ctx->pc->secure) {
+        struct timespec bind_started;
+
+        ph_scoreboard_clock(&bind_started);
+        ret = connect_bind(ctx, att[i].ld);
+        ph_scoreboard_report(ctx, att[i].uri, PH_SERVER_BIND,
+                             ph_scoreboard_elapsed(&bind_started), ret == 0);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+    connect_done(ctx, att[i].ld, att[i].uri);
+    return 0;
+
+done:
+    for (i = 0; i < nact; i++) {
+        attempt_drop(&att[i]);
+    }
+    return ret;
+}
+
+static int
+connect_new(struct pam_hbac_ctx *ctx)
 {
+    const char **uris;
     int ret;
 
-    if (ctx == NULL || ctx->ld == NULL) {
-        return;
+    if (ctx->pc->num_uris < 2) {
+        return connect_server(ctx, ctx->pc->uri);
+    }
+
+    uris = malloc(ctx->pc->num_uris * sizeof(const char *));
+    if (uris == NULL) {
+        return ENOMEM;
+    }
+    memcpy(uris, ctx->pc->uris, ctx->pc->num_uris * sizeof(const char *));
+
+    ph_scoreboard_rank(ctx, uris, ctx->pc->num_uris);
+
+    if (can_hedge(ctx->pc)) {
+        ret = connect_hedged(ctx, uris, ctx->pc->num_uris);
+    } else {
+        ret = connect_failover(ctx, uris, ctx->pc->num_uris);
     }
 
+    free(uris);
+    return ret;
+}
+
+int
+ph_connect(struct pam_hbac_ctx *ctx)
+{
+    if (ctx == NULL) {
+        return EINVAL;
+    }
+
+    ctx->ld = ph_pool_get(ctx->pamh, ctx->pc, &ctx->server);
+    if (ctx->ld != NULL) {
+        ctx->ld_reused = true;
+        return 0;
+    }
+
+    return connect_new(ctx);
+}
+
+int
+ph_reconnect(struct pam_hbac_ctx *ctx)
+{
+    int ret;
+
+    if (ctx == NULL || ctx->ld == NULL
+            || ctx->ld_reused == false || ctx->pc->bind_pw == NULL) {
+        return ENOTCONN;
+    }
+
+    logger(ctx->pamh, LOG_NOTICE,
+           "Pooled connection to %s was lost, reconnecting\n", ctx->server);
+
     ret = ldap_unbind_ext(ctx->ld, NULL, NULL);
     if (ret != LDAP_SUCCESS) {
         logger(ctx->pamh, LOG_ERR,
@@ -607,4 +1961,32 @@ ph_disconnect(struct pam_hbac_ctx *ctx)
                ret, ldap_err2string(ret));
     }
     ctx->ld = NULL;
+    ctx->ld_reused = false;
+
+    return connect_new(ctx);
+}
+
+void
+ph_disconnect(struct pam_hbac_ctx *ctx)
+{
+    int ret;
+
+    if (ctx == NULL || ctx->ld == NULL) {
+        return;
+    }
+
+    if (ctx->ld_broken) {
+        ret = ldap_unbind_ext(ctx->ld, NULL, NULL);
+        if (ret != LDAP_SUCCESS) {
+            logger(ctx->pamh, LOG_ERR,
+                   "ldap_unbind_ext failed [%d]: %s\n",
+                   ret, ldap_err2string(ret));
+        }
+    } else {
+        /* Unbinds the handle unless the connection pool is enabled */
+        ph_pool_put(ctx->pamh, ctx->pc, ctx->server, ctx->ld);
+    }
+    ctx->ld = NULL;
+    ctx->ld_reused = false;
+    ctx->ld_broken = false;
 }
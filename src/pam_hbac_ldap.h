@@ -33,6 +33,12 @@
 #endif
 #endif
 
+#ifdef LDAP_OPT_RESULT_CODE
+#define PH_RESULT_CODE LDAP_OPT_RESULT_CODE
+#else
+#define PH_RESULT_CODE LDAP_OPT_ERROR_NUMBER
+#endif
+
 struct ph_search_ctx {
     const char *sub_base;
     const char **attrs;
@@ -47,8 +53,107 @@ int ph_search(pam_handle_t *pamh,
               const char *obj_filter,
               struct ph_entry ***_entry_list);
 
+/* Asynchronous searches. Any number of searches can be outstanding on the
+ * same handle, libldap keeps the results of each message ID apart until
+ * ph_search_recv() collects them. A search that is not going to be
+ * collected must be abandoned so that its results do not pile up on
+ * a pooled handle.
+ */
+int ph_search_send(pam_handle_t *pamh,
+                   LDAP *ld,
+                   struct pam_hbac_config *conf,
+                   struct ph_search_ctx *s,
+                   const char *obj_filter,
+                   int *_msgid);
+
+/* Returns ETIMEDOUT if the result does not arrive within timeout,
+ * a NULL timeout waits indefinitely
+ */
+int ph_search_recv(pam_handle_t *pamh,
+                   LDAP *ld,
+                   struct ph_search_ctx *s,
+                   int msgid,
+                   struct timeval *timeout,
+                   struct ph_entry ***_entry_list);
+
+/* Called for every entry of a search collected with ph_search_recv_each().
+ * The callback owns the entry, but its values may point into the LDAP
+ * message and are only valid until the callback returns. A non-zero
+ * return ends the search, which is then abandoned, and is returned by
+ * ph_search_recv_each().
+ */
+typedef int (*ph_search_entry_fn)(struct ph_entry *entry, void *pvt);
+
+/* Like ph_search_recv(), but hands each entry to entry_fn as soon as it
+ * arrives instead of waiting for the whole result, so that only one
+ * entry is held in memory at a time
+ */
+int ph_search_recv_each(pam_handle_t *pamh,
+                        LDAP *ld,
+                        struct ph_search_ctx *s,
+                        int msgid,
+                        struct timeval *timeout,
+                        ph_search_entry_fn entry_fn,
+                        void *pvt);
+
+/* Does nothing if msgid is -1 */
+void ph_search_abandon(pam_handle_t *pamh, LDAP *ld, int msgid);
+
+/* A growable string for building search filters and DNs. An append that
+ * cannot allocate memory marks the buffer as failed and the following
+ * appends do nothing, so callers only check the result of
+ * ph_strbuf_finish().
+ */
+struct ph_strbuf {
+    char *data;
+    size_t len;
+    size_t size;
+    bool failed;
+};
+
+void ph_strbuf_init(struct ph_strbuf *sb);
+/* Makes room for len more characters, callers that can tell the final
+ * length up front allocate only once
+ */
+void ph_strbuf_reserve(struct ph_strbuf *sb, size_t len);
+void ph_strbuf_append(struct ph_strbuf *sb, const char *str);
+/* Appends str as a filter assertion value, escaped as per RFC 4515 */
+void ph_strbuf_append_value(struct ph_strbuf *sb, const char *str);
+/* Returns the string, or NULL if an append failed. The buffer is empty
+ * afterwards either way.
+ */
+char *ph_strbuf_finish(struct ph_strbuf *sb);
+void ph_strbuf_free(struct ph_strbuf *sb);
+
+/* The length of str once escaped as a filter assertion value */
+size_t ph_filter_value_len(const char *str);
+
+/* The TIMEOUT option is a budget for all LDAP work of one access check,
+ * from connecting to the last search. ph_deadline_start() starts it and
+ * each stage asks ph_deadline_left() for the time that remains.
+ */
+void ph_deadline_start(struct pam_hbac_ctx *ctx);
+
+/* Records stage as the current one. Returns ETIMEDOUT if the budget is
+ * spent, otherwise points *_left at buf filled with the time left, or
+ * sets it to NULL if there is no budget.
+ */
+int ph_deadline_left(struct pam_hbac_ctx *ctx,
+                     const char *stage,
+                     struct timeval *buf,
+                     struct timeval **_left);
+
+/* Returns ETIMEDOUT if the budget ran out during connecting, StartTLS
+ * or the bind
+ */
 int ph_connect(struct pam_hbac_ctx *ctx);
 
+/* Replaces a pooled handle whose connection turned out to be dead with a
+ * new one. Returns ENOTCONN if the handle was not reused from the pool or
+ * the bind password is no longer available.
+ */
+int ph_reconnect(struct pam_hbac_ctx *ctx);
+
 void ph_disconnect(struct pam_hbac_ctx *ctx);
 
 #endif /* __PAM_HBAC_LDAP_H__ */
@@ -34,21 +34,129 @@
 
 #include "pam_hbac.h"
 #include "pam_hbac_entry.h"
+#include "pam_hbac_grindex.h"
 #include "pam_hbac_ldap.h"
 #include "pam_hbac_obj.h"
 #include "pam_hbac_obj_int.h"
+#include "pam_hbac_arena.h"
 #include "config.h"
 
+/* The NSS buffers are doubled on ERANGE up to this size */
+#define PH_NSS_BUFSIZE_MAX      (1024 * 1024)
+
+/* Most users are members of only a few groups, the GID list starts with
+ * this many entries and grows to the size getgrouplist() asks for
+ */
+#define PH_INITIAL_NGROUPS      32
+
+/* A buffer for the reentrant NSS calls, reused for a series of lookups */
+struct ph_nss_buf {
+    char *data;
+    size_t size;
+};
+
+static int
+nss_buf_grow(struct ph_nss_buf *buf, size_t initial)
+{
+    char *data;
+    size_t size;
+
+    if (buf->size >= PH_NSS_BUFSIZE_MAX) {
+        return ERANGE;
+    }
+
+    size = buf->size ? buf->size * 2 : initial;
+    if (size > PH_NSS_BUFSIZE_MAX) {
+        size = PH_NSS_BUFSIZE_MAX;
+    }
+
+    data = realloc(buf->data, size);
+    if (data == NULL) {
+        return ENOMEM;
+    }
+
+    buf->data = data;
+    buf->size = size;
+    return 0;
+}
+
+static int
+nss_buf_init(struct ph_nss_buf *buf, int sc_name, size_t fallback)
+{
+    long initial;
+
+    buf->data = NULL;
+    buf->size = 0;
+
+    initial = sysconf(sc_name);
+    return nss_buf_grow(buf, initial > 0 ? (size_t) initial : fallback);
+}
+
+static void
+nss_buf_free(struct ph_nss_buf *buf)
+{
+    free(buf->data);
+    buf->data = NULL;
+    buf->size = 0;
+}
+
+/* A growable list of GIDs */
+struct ph_gid_buf {
+    gid_t *gids;
+    int size;
+};
+
+static int
+gid_buf_resize(struct ph_gid_buf *buf, int size)
+{
+    gid_t *gids;
+
+    if (size <= buf->size) {
+        return 0;
+    }
+
+    gids = realloc(buf->gids, size * sizeof(gid_t));
+    if (gids == NULL) {
+        return ENOMEM;
+    }
+
+    buf->gids = gids;
+    buf->size = size;
+    return 0;
+}
+
 #if !defined(HAVE_GETGROUPLIST) && !defined(HAVE__GETGROUPSBYMEMBER) && !defined(HAVE_GETGRSET)
 static int
-ph_getgrouplist_fallback(const char *name, gid_t primary_gid,
-                         gid_t *groups, int *ngroups_ptr)
+ph_getgrouplist_fallback(pam_handle_t *ph,
+                         const char *name, gid_t primary_gid,
+                         struct ph_gid_buf *groups, int *ngroups_ptr)
 {
     struct group *gr;
+    gid_t *gids;
     int i, j;
     int ngroups;
+    int ret;
 
-    groups[0] = primary_gid;
+    /* Usually a single lookup in the index of the local groups */
+    ret = ph_grindex_getgrouplist(ph, PAM_HBAC_GROUP_INDEX, PAM_HBAC_GROUP_DB,
+                                  PAM_HBAC_NSSWITCH_CONF,
+                                  name, primary_gid, &gids, &ngroups);
+    if (ret == 0) {
+        ret = gid_buf_resize(groups, ngroups);
+        if (ret == 0) {
+            memcpy(groups->gids, gids, ngroups * sizeof(gid_t));
+            *ngroups_ptr = ngroups;
+        }
+        free(gids);
+        return ret;
+    }
+
+    logger(ph, LOG_DEBUG,
+           "Cannot use the group index [%d]: %s, walking all groups\n",
+           ret, strerror(ret));
+    ret = 0;
+
+    groups->gids[0] = primary_gid;
     ngroups = 1;                /* primary group already included */
 
     setgrent();
@@ -57,79 +165,102 @@ ph_getgrouplist_fallback(const char *name, gid_t primary_gid,
             if (strcmp(gr->gr_mem[i], name) == 0) {
                 bool gidexists = false;
                 for (j = 0; j < ngroups; j++) {
-                    if (groups[j] == gr->gr_gid) {
+                    if (groups->gids[j] == gr->gr_gid) {
                         gidexists = true;
                         break;
                     }
                 }
 
                 if (gidexists == false) {
-                    groups[ngroups++] = gr->gr_gid;
+                    if (ngroups == groups->size) {
+                        ret = gid_buf_resize(groups, groups->size * 2);
+                        if (ret != 0) {
+                            goto done;
+                        }
+                    }
+                    groups->gids[ngroups++] = gr->gr_gid;
                 }
             }
         }
     }
+
+done:
     endgrent();
 
     *ngroups_ptr = ngroups;
-    return ngroups;
+    return ret;
 }
 #endif
 
+/* Returns the name of the group or NULL. buf is reused between calls. */
 static char *
-getgroupname(gid_t gid)
+getgroupname(gid_t gid, struct ph_nss_buf *buf, struct ph_arena *arena)
 {
-#if defined(HAVE_POSIX_GETGRGID_R)
     int ret;
-#endif
-    char *buffer;
-    int bufsize;
     struct group grp;
     struct group *result = NULL;
-    char *name;
 
-    bufsize = sysconf(_SC_GETGR_R_SIZE_MAX);
-    if (bufsize == -1) {
-        bufsize = FALLBACK_GETGR_R_SIZE_MAX;
-    }
+    do {
+#if defined(HAVE_POSIX_GETGRGID_R)
+        ret = getgrgid_r(gid, &grp, buf->data, buf->size, &result);
+#elif defined(HAVE_NONPOSIX_GETGRGID_R)
+        errno = 0;
+        result = getgrgid_r(gid, &grp, buf->data, buf->size);
+        ret = result == NULL ? errno : 0;
+#else
+#error No known getgrgid_r implementation found!
+#endif
+    } while (ret == ERANGE
+             && nss_buf_grow(buf, FALLBACK_GETGR_R_SIZE_MAX) == 0);
 
-    buffer = malloc(bufsize);
-    if (buffer == NULL) {
+    if (ret != 0 || result == NULL) {
         return NULL;
     }
 
+    return ph_arena_strdup(arena, grp.gr_name);
+}
+
+/* Uses the same reentrant variant as getgrgid_r, the platforms that have
+ * the non-POSIX getgrgid_r have the non-POSIX getgrnam_r as well
+ */
+static int
+getgroupgid(const char *name, struct ph_nss_buf *buf, gid_t *_gid)
+{
+    int ret;
+    struct group grp;
+    struct group *result = NULL;
+
+    do {
 #if defined(HAVE_POSIX_GETGRGID_R)
-    ret = getgrgid_r(gid, &grp, buffer, bufsize, &result);
-    if (ret != 0 || result == NULL) {
-        free(buffer);
-        return NULL;
-    }
+        ret = getgrnam_r(name, &grp, buf->data, buf->size, &result);
 #elif defined(HAVE_NONPOSIX_GETGRGID_R)
-    result = getgrgid_r(gid, &grp, buffer, bufsize);
-    if (result == NULL) {
-        free(buffer);
-        return NULL;
-    }
+        errno = 0;
+        result = getgrnam_r(name, &grp, buf->data, buf->size);
+        ret = result == NULL ? errno : 0;
 #else
-#error No known getgrgid_r implementation found!
+#error No known getgrnam_r implementation found!
 #endif
+    } while (ret == ERANGE
+             && nss_buf_grow(buf, FALLBACK_GETGR_R_SIZE_MAX) == 0);
+
+    if (ret == 0 && result == NULL) {
+        ret = ENOENT;
+    }
 
-    name = strdup(grp.gr_name);
-    free(buffer);
-    return name;
+    if (ret == 0) {
+        *_gid = grp.gr_gid;
+    }
+    return ret;
 }
 
-struct ph_user *
-get_user_names(pam_handle_t *ph,
-               struct passwd *pwd,
-               gid_t *gidlist,
-               size_t ngroups)
+static struct ph_user *
+alloc_user(struct passwd *pwd,
+           gid_t *gidlist,
+           size_t ngroups)
 {
     struct ph_user *user = NULL;
-    size_t gid_i = 0;
-    size_t name_i = 0;
 
-    user = malloc(sizeof(struct ph_user));
+    user = calloc(1, sizeof(struct ph_user));
     if (user == NULL) {
         return NULL;
     }
@@ -140,55 +271,147 @@ get_user_names(pam_handle_t *ph,
         return NULL;
     }
 
-    user->group_names = calloc(ngroups + 1, sizeof(char *));
-    if (user->group_names == NULL) {
+    user->gids = malloc((ngroups ? ngroups : 1) * sizeof(gid_t));
+    if (user->gids == NULL) {
         ph_free_user(user);
         return NULL;
     }
+    if (ngroups > 0) {
+        memcpy(user->gids, gidlist, ngroups * sizeof(gid_t));
+    }
+    user->num_gids = ngroups;
+
+    return user;
+}
+
+static int
+resolve_group_names(pam_handle_t *ph,
+                    struct ph_arena *arena,
+                    struct ph_user *user)
+{
+    struct ph_nss_buf buf;
+    char **group_names;
+    size_t gid_i = 0;
+    size_t name_i = 0;
+    int ret;
+
+    ret = nss_buf_init(&buf, _SC_GETGR_R_SIZE_MAX, FALLBACK_GETGR_R_SIZE_MAX);
+    if (ret != 0) {
+        return ret;
+    }
+
+    group_names = ph_arena_calloc(arena, user->num_gids + 1, sizeof(char *));
+    if (group_names == NULL) {
+        nss_buf_free(&buf);
+        return ENOMEM;
+    }
 
-    for (gid_i = 0; gid_i < ngroups; gid_i++) {
-        user->group_names[name_i] = getgroupname(gidlist[gid_i]);
-        if (user->group_names[name_i] == NULL) {
+    for (gid_i = 0; gid_i < user->num_gids; gid_i++) {
+        group_names[name_i] = getgroupname(user->gids[gid_i], &buf, arena);
+        if (group_names[name_i] == NULL) {
             logger(ph, LOG_NOTICE,
                    "Cannot find name for group %lu\n",
-                   (unsigned long) gidlist[gid_i]);
+                   (unsigned long) user->gids[gid_i]);
             continue;
         }
         name_i++;
     }
 
+    nss_buf_free(&buf);
+    user->group_names = group_names;
+    user->arena = arena;
+    return 0;
+}
+
+struct ph_user *
+get_user_names(pam_handle_t *ph,
+               struct passwd *pwd,
+               gid_t *gidlist,
+               size_t ngroups)
+{
+    struct ph_user *user = NULL;
+
+    user = alloc_user(pwd, gidlist, ngroups);
+    if (user == NULL) {
+        return NULL;
+    }
+
+    if (resolve_group_names(ph, NULL, user) != 0) {
+        ph_free_user(user);
+        return NULL;
+    }
+
     return user;
 }
 
+/* Fills groups with the GIDs of the user, growing it as needed up to
+ * maxgroups entries unless the platform reports how many are needed
+ */
 static int
 get_user_groups(pam_handle_t *ph,
                 const char *name,
                 gid_t primary_gid,
-                gid_t *groups,
+                int maxgroups,
+                struct ph_gid_buf *groups,
                 int *ngroups_ptr)
 {
     int ret;
 
 #if defined(HAVE_GETGROUPLIST)
+    int ngroups;
+
     logger(ph, LOG_DEBUG, "running getgrouplist for %s\n", name);
-    ret = getgrouplist(name, primary_gid, groups, ngroups_ptr);
+    while (1) {
+        ngroups = groups->size;
+        ret = getgrouplist(name, primary_gid, groups->gids, &ngroups);
+        if (ret != -1) {
+            *ngroups_ptr = ngroups;
+            ret = 0;
+            break;
+        }
+
+        /* Most implementations store the number of groups the user is a
+         * member of, the others only say that the list is too short
+         */
+        if (ngroups <= groups->size) {
+            if (groups->size >= maxgroups) {
+                logger(ph, LOG_ERR,
+                       "User %s is a member of more than %d groups\n",
+                       name, maxgroups);
+                ret = ERANGE;
+                break;
+            }
+            ngroups = groups->size * 2 < maxgroups ? groups->size * 2
+                                                   : maxgroups;
+        }
+
+        logger(ph, LOG_DEBUG, "growing the group list to %d\n", ngroups);
+        ret = gid_buf_resize(groups, ngroups);
+        if (ret != 0) {
+            break;
+        }
+    }
 #elif defined(HAVE__GETGROUPSBYMEMBER)
     int ngroups;
 
-    groups[0] = primary_gid;
+    /* The list is silently truncated, only maxgroups is safe */
+    ret = gid_buf_resize(groups, maxgroups);
+    if (ret != 0) {
+        return ret;
+    }
+
+    groups->gids[0] = primary_gid;
     logger(ph, LOG_DEBUG, "running _getgroupsbymember for %s\n", name);
-    ngroups = _getgroupsbymember(name, groups, *ngroups_ptr, 1);
-    if (ngroups != -1) {
+    ngroups = _getgroupsbymember(name, groups->gids, groups->size, 1);
+    if (ngroups == -1) {
+        ret = EIO;
+    } else {
         ret = 0;
         *ngroups_ptr = ngroups;
     }
 #elif defined(HAVE_GETGRSET)
     int ngroups;
-    long max_group_len;
-    char *gid_list_s, *gid_s;
-
-    ngroups = 0;
-    max_group_len = sysconf(_SC_LOGIN_NAME_MAX);
+    char *gid_list_s, *gid_list, *gid_s;
 
     /* string containing comma separated list of gids the user belongs to */
     logger(ph, LOG_DEBUG, "running getgrset for %s\n", name);
@@ -197,14 +420,24 @@ get_user_groups(pam_handle_t *ph,
         return EIO;
     }
 
-    gid_s = malloc(sizeof(char)*max_group_len);
-    if (gid_s == NULL) {
+    /* The list is sized exactly by the number of commas */
+    ngroups = 1;
+    for (gid_s = gid_list_s; *gid_s != '\0'; gid_s++) {
+        if (*gid_s == ',') {
+            ngroups++;
+        }
+    }
+
+    ret = gid_buf_resize(groups, ngroups);
+    if (ret != 0) {
         free(gid_list_s);
-        return ENOMEM;
+        return ret;
     }
 
-    while ((gid_s = strsep(&gid_list_s, ",")) != NULL) {
-        groups[ngroups++] = atoi(gid_s);
+    ngroups = 0;
+    gid_list = gid_list_s;
+    while ((gid_s = strsep(&gid_list, ",")) != NULL) {
+        groups->gids[ngroups++] = atoi(gid_s);
     }
 
     ret = 0;
@@ -213,10 +446,11 @@ get_user_groups(pam_handle_t *ph,
     free(gid_list_s);
 #else
     /* for systems lacking the above functions, tested on hpux only */
-    ret = ph_getgrouplist_fallback(name, primary_gid, groups, ngroups_ptr);
+    ret = ph_getgrouplist_fallback(ph, name, primary_gid,
+                                   groups, ngroups_ptr);
 #endif
 
-    logger(ph, LOG_NOTICE, "returning %d\n", ret);
+    logger(ph, LOG_DEBUG, "returning %d\n", ret);
     return ret;
 }
 
@@ -224,43 +458,65 @@ struct ph_user *
 get_user_int(pam_handle_t *ph,
              const char *username,
              const size_t bufsize,
-             const int maxgroups)
+             const int maxgroups,
+             bool resolve_groups)
 {
-    char buffer[bufsize];
-    gid_t gidlist[maxgroups];
+    struct ph_nss_buf buf = { NULL, 0 };
+    struct ph_gid_buf groups = { NULL, 0 };
+    struct ph_user *user = NULL;
     int ret;
     struct passwd pwd;
     struct passwd *result = NULL;
     int ngroups;
 
-#if defined(HAVE_POSIX_GETPWNAM_R)
-    ret = getpwnam_r(username, &pwd, buffer, bufsize, &result);
-    if (ret != 0 || result == NULL) {
-        logger(ph, LOG_NOTICE, "getpwnam_r failed for %s\n", username);
-        return NULL;
+    ret = nss_buf_grow(&buf, bufsize);
+    if (ret != 0) {
+        goto done;
     }
+
+    do {
+#if defined(HAVE_POSIX_GETPWNAM_R)
+        ret = getpwnam_r(username, &pwd, buf.data, buf.size, &result);
 #elif defined(HAVE_NONPOSIX_GETPWNAM_R)
-    result = getpwnam_r(username, &pwd, buffer, bufsize);
-    if (result == NULL) {
-        logger(ph, LOG_NOTICE, "getpwnam_r failed for %s\n", username);
-        return NULL;
-    }
+        errno = 0;
+        result = getpwnam_r(username, &pwd, buf.data, buf.size);
+        ret = result == NULL ? errno : 0;
 #else
 #error No known getpwnam_r implementation found!
 #endif
+    } while (ret == ERANGE && nss_buf_grow(&buf, bufsize) == 0);
 
-    ngroups = maxgroups;    /* don't modify input parameter */
-    ret = get_user_groups(ph, pwd.pw_name, pwd.pw_gid, gidlist, &ngroups);
-    if (ret == -1) {
-        /* FIXME - resize on platforms where we allocate fewer groups? */
-        return NULL;
+    if (ret != 0 || result == NULL) {
+        logger(ph, LOG_NOTICE, "getpwnam_r failed for %s\n", username);
+        goto done;
+    }
+
+    ret = gid_buf_resize(&groups, PH_INITIAL_NGROUPS < maxgroups ?
+                                  PH_INITIAL_NGROUPS : maxgroups);
+    if (ret != 0) {
+        goto done;
     }
 
-    return get_user_names(ph, &pwd, gidlist, ngroups);
+    ret = get_user_groups(ph, pwd.pw_name, pwd.pw_gid, maxgroups,
+                          &groups, &ngroups);
+    if (ret != 0) {
+        goto done;
+    }
+
+    if (!resolve_groups) {
+        user = alloc_user(&pwd, groups.gids, ngroups);
+    } else {
+        user = get_user_names(ph, &pwd, groups.gids, ngroups);
+    }
+
+done:
+    free(groups.gids);
+    nss_buf_free(&buf);
+    return user;
 }
 
-struct ph_user *
-ph_get_user(pam_handle_t *ph, const char *username)
+static struct ph_user *
+get_user(pam_handle_t *ph, const char *username, bool resolve_groups)
 {
     int bufsize;
     int maxgroups;
@@ -275,15 +531,14 @@ ph_get_user(pam_handle_t *ph, const char *username)
     }
 
     maxgroups = sysconf(_SC_NGROUPS_MAX);
-    if (maxgroups == -1) {
+    if (maxgroups <= 0) {
         logger(ph, LOG_NOTICE,
                "Cannot get the value of _SC_NGROUPS_MAX, "
                "using fallback\n");
         maxgroups = FALLBACK_NGROUPS_MAX;
-        return NULL;
     }
 
-    pu = get_user_int(ph, username, bufsize, maxgroups);
+    pu = get_user_int(ph, username, bufsize, maxgroups, resolve_groups);
     if (pu == NULL) {
         logger(ph, LOG_NOTICE, "Cannot find user %s\n", username);
         return NULL;
@@ -292,6 +547,150 @@ ph_get_user(pam_handle_t *ph, const char *username)
     return pu;
 }
 
+struct ph_user *
+ph_get_user(pam_handle_t *ph, const char *username)
+{
+    return get_user(ph, username, true);
+}
+
+struct ph_user *
+ph_get_user_gids(pam_handle_t *ph, const char *username)
+{
+    return get_user(ph, username, false);
+}
+
+int
+ph_user_resolve_groups(pam_handle_t *ph,
+                       struct ph_arena *arena,
+                       struct ph_user *user)
+{
+    if (user == NULL) {
+        return EINVAL;
+    }
+
+    if (user->group_names != NULL) {
+        return 0;
+    }
+
+    return resolve_group_names(ph, arena, user);
+}
+
+static int
+cmp_gid(const void *a, const void *b)
+{
+    gid_t ga = *(const gid_t *) a;
+    gid_t gb = *(const gid_t *) b;
+
+    return ga < gb ? -1 : (ga > gb);
+}
+
+static int
+cmp_group_name(const void *a, const void *b)
+{
+    return strcmp(*(const char * const *) a, *(const char * const *) b);
+}
+
+int
+ph_user_match_groups(pam_handle_t *ph,
+                     struct ph_arena *arena,
+                     struct ph_user *user,
+                     const char **groups)
+{
+    const char **names = NULL;
+    char **group_names = NULL;
+    gid_t *gids = NULL;
+    size_t num_names;
+    size_t name_i;
+    size_t i, n;
+    struct ph_nss_buf buf = { NULL, 0 };
+    gid_t gid;
+    int ret;
+
+    if (user == NULL) {
+        return EINVAL;
+    }
+
+    if (user->group_names != NULL) {
+        /* Already resolved */
+        return 0;
+    }
+
+    num_names = null_cstring_array_size(groups);
+
+    /* Several rules usually name the same groups, look each up once */
+    names = malloc((num_names ? num_names : 1) * sizeof(const char *));
+    gids = malloc((user->num_gids ? user->num_gids : 1) * sizeof(gid_t));
+    group_names = ph_arena_calloc(arena, num_names + 1, sizeof(char *));
+    if (names == NULL || gids == NULL || group_names == NULL) {
+        ret = ENOMEM;
+        goto done;
+    }
+
+    if (num_names > 0) {
+        memcpy(names, groups, num_names * sizeof(const char *));
+        qsort(names, num_names, sizeof(const char *), cmp_group_name);
+    }
+    for (i = 1, n = num_names ? 1 : 0; i < num_names; i++) {
+        if (strcmp(names[i], names[n - 1]) != 0) {
+            names[n++] = names[i];
+        }
+    }
+    num_names = n;
+
+    memcpy(gids, user->gids, user->num_gids * sizeof(gid_t));
+    qsort(gids, user->num_gids, sizeof(gid_t), cmp_gid);
+
+    ret = nss_buf_init(&buf, _SC_GETGR_R_SIZE_MAX, FALLBACK_GETGR_R_SIZE_MAX);
+    if (ret != 0) {
+        goto done;
+    }
+
+    for (i = 0, name_i = 0; i < num_names; i++) {
+        ret = getgroupgid(names[i], &buf, &gid);
+        if (ret == ENOMEM) {
+            goto done;
+        } else if (ret != 0) {
+            /* A non-POSIX group, or one NSS only knows under another
+             * spelling. Only its name can be compared.
+             */
+            logger(ph, LOG_DEBUG,
+                   "Group %s has no GID, matching groups by name\n",
+                   names[i]);
+            ret = resolve_group_names(ph, arena, user);
+            goto done;
+        }
+
+        if (bsearch(&gid, gids, user->num_gids,
+                    sizeof(gid_t), cmp_gid) == NULL) {
+            continue;
+        }
+
+        group_names[name_i] = ph_arena_strdup(arena, names[i]);
+        if (group_names[name_i] == NULL) {
+            ret = ENOMEM;
+            goto done;
+        }
+        name_i++;
+    }
+
+    logger(ph, LOG_DEBUG,
+           "User %s is a member of %zu of %zu groups in the rules\n",
+           user->name, name_i, num_names);
+    user->group_names = group_names;
+    user->arena = arena;
+    group_names = NULL;
+    ret = 0;
+
+done:
+    nss_buf_free(&buf);
+    if (arena == NULL) {
+        free_string_list(group_names);
+    }
+    free(gids);
+    free(names);
+    return ret;
+}
+
 void
 ph_free_user(struct ph_user *user)
 {
@@ -299,32 +698,47 @@ ph_free_user(struct ph_user *user)
         return;
     }
 
-    free_string_list(user->group_names);
+    if (user->arena == NULL) {
+        free_string_list(user->group_names);
+    }
+    free(user->gids);
     free(user->name);
     free(user);
 }
 
-int
-ph_get_host(struct pam_hbac_ctx *ctx,
+static const char *ph_host_attrs[] = { PAM_HBAC_ATTR_OC,
+                                       "fqdn",
+                                       "memberOf",
+                                       NULL };
+
+static struct ph_search_ctx host_search_obj = {
+    .sub_base = "cn=computers,cn=accounts",
+    .oc = "ipaHost",
+    .attrs = ph_host_attrs,
+    .num_attrs = PH_MAP_HOST_END,
+};
+
+static const char *ph_svc_attrs[] = { PAM_HBAC_ATTR_OC,
+                                      "cn",
+                                      "memberOf",
+                                      NULL };
+
+static struct ph_search_ctx svc_search_obj = {
+    /* FIXME - this is copied in parsing DN as well, should we use
+    * common definition?
+    */
+    .sub_base = "cn=hbacservices,cn=hbac",
+    .oc = "ipaHbacService",
+    .attrs = ph_svc_attrs,
+    .num_attrs = PH_MAP_HOST_END,
+};
+
+static int
+host_filter(struct pam_hbac_ctx *ctx,
             const char *hostname,
-            struct ph_entry **_host)
+            char **_filter)
 {
-    size_t num;
-    int ret;
-    char *host_filter;
-    struct ph_entry **hosts;
-    struct ph_attr *fqdn;
-    static const char *ph_host_attrs[] = { PAM_HBAC_ATTR_OC,
-                                           "fqdn",
-                                           "memberOf",
-                                           NULL };
-
-    static struct ph_search_ctx host_search_obj = {
-        .sub_base = "cn=computers,cn=accounts",
-        .oc = "ipaHost",
-        .attrs = ph_host_attrs,
-        .num_attrs = PH_MAP_HOST_END,
-    };
+    struct ph_strbuf sb;
 
     if (ctx == NULL || hostname == NULL) {
         return EINVAL;
@@ -335,21 +749,30 @@ ph_get_host(struct pam_hbac_ctx *ctx,
         return ENOENT;
     }
 
-    ret = asprintf(&host_filter, "%s=%s",
-                   ph_host_attrs[PH_MAP_HOST_FQDN], hostname);
-    if (ret < 0) {
+    ph_strbuf_init(&sb);
+    ph_strbuf_append(&sb, ph_host_attrs[PH_MAP_HOST_FQDN]);
+    ph_strbuf_append(&sb, "=");
+    ph_strbuf_append_value(&sb, hostname);
+    *_filter = ph_strbuf_finish(&sb);
+    if (*_filter == NULL) {
         return ENOMEM;
     }
     logger(ctx->pamh, LOG_DEBUG,
            "Searching for host %s using filter [%s]\n",
-           hostname, host_filter);
+           hostname, *_filter);
 
-    ret = ph_search(ctx->pamh, ctx->ld, ctx->pc,
-                    &host_search_obj, host_filter, &hosts);
-    free(host_filter);
-    if (ret != 0) {
-        return ret;
-    }
+    return 0;
+}
+
+/* Takes ownership of hosts */
+static int
+host_from_entries(struct pam_hbac_ctx *ctx,
+                  const char *hostname,
+                  struct ph_entry **hosts,
+                  struct ph_entry **_host)
+{
+    size_t num;
+    struct ph_attr *fqdn;
 
     num = ph_num_entries(hosts);
     if (num == 0) {
@@ -385,52 +808,109 @@ ph_get_host(struct pam_hbac_ctx *ctx,
     return 0;
 }
 
-/* FIXME - shouldn't we just merge get_svc and get_hosts? */
 int
-ph_get_svc(struct pam_hbac_ctx *ctx,
-           const char *svcname,
-           struct ph_entry **_svc)
+ph_get_host(struct pam_hbac_ctx *ctx,
+            const char *hostname,
+            struct ph_entry **_host)
 {
-    size_t num;
     int ret;
-    char *svc_filter;
-    struct ph_entry **services;
-    struct ph_attr *svc_cn;
-    static const char *ph_svc_attrs[] = { PAM_HBAC_ATTR_OC,
-                                          "cn",
-                                          "memberOf",
-                                          NULL };
-
-    static struct ph_search_ctx svc_search_obj = {
-        /* FIXME - this is copied in parsing DN as well, should we use
-        * common definition?
-        */
-        .sub_base = "cn=hbacservices,cn=hbac",
-        .oc = "ipaHbacService",
-        .attrs = ph_svc_attrs,
-        .num_attrs = PH_MAP_HOST_END,
-    };
+    char *filter;
+    struct ph_entry **hosts;
+
+    ret = host_filter(ctx, hostname, &filter);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret = ph_search(ctx->pamh, ctx->ld, ctx->pc,
+                    &host_search_obj, filter, &hosts);
+    free(filter);
+    if (ret != 0) {
+        return ret;
+    }
+
+    return host_from_entries(ctx, hostname, hosts, _host);
+}
+
+int
+ph_get_host_send(struct pam_hbac_ctx *ctx,
+                 const char *hostname,
+                 int *_msgid)
+{
+    int ret;
+    char *filter;
+
+    ret = host_filter(ctx, hostname, &filter);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret = ph_search_send(ctx->pamh, ctx->ld, ctx->pc,
+                         &host_search_obj, filter, _msgid);
+    free(filter);
+    return ret;
+}
+
+int
+ph_get_host_recv(struct pam_hbac_ctx *ctx,
+                 const char *hostname,
+                 int msgid,
+                 struct ph_entry **_host)
+{
+    int ret;
+    struct ph_entry **hosts;
+    struct timeval buf;
+    struct timeval *left;
+
+    ret = ph_deadline_left(ctx, "searching for the host", &buf, &left);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret = ph_search_recv(ctx->pamh, ctx->ld, &host_search_obj, msgid, left,
+                         &hosts);
+    if (ret != 0) {
+        return ret;
+    }
+
+    return host_from_entries(ctx, hostname, hosts, _host);
+}
+
+static int
+svc_filter(struct pam_hbac_ctx *ctx,
+           const char *svcname,
+           char **_filter)
+{
+    struct ph_strbuf sb;
 
     if (ctx == NULL || svcname == NULL) {
         return EINVAL;
     }
 
-    /* FIXME - GNU extenstion!! */
-    ret = asprintf(&svc_filter, "%s=%s",
-                   ph_svc_attrs[PH_MAP_SVC_NAME], svcname);
-    if (ret < 0) {
+    ph_strbuf_init(&sb);
+    ph_strbuf_append(&sb, ph_svc_attrs[PH_MAP_SVC_NAME]);
+    ph_strbuf_append(&sb, "=");
+    ph_strbuf_append_value(&sb, svcname);
+    *_filter = ph_strbuf_finish(&sb);
+    if (*_filter == NULL) {
         return ENOMEM;
     }
     logger(ctx->pamh, LOG_DEBUG,
            "Searching for service %s using filter [%s]\n",
-           svcname, svc_filter);
+           svcname, *_filter);
 
-    ret = ph_search(ctx->pamh, ctx->ld, ctx->pc,
-                    &svc_search_obj, svc_filter, &services);
-    free(svc_filter);
-    if (ret != 0) {
-        return ret;
-    }
+    return 0;
+}
+
+/* Takes ownership of services */
+static int
+svc_from_entries(struct pam_hbac_ctx *ctx,
+                 const char *svcname,
+                 struct ph_entry **services,
+                 struct ph_entry **_svc)
+{
+    size_t num;
+    struct ph_attr *svc_cn;
 
     num = ph_num_entries(services);
     if (num == 0) {
@@ -465,3 +945,72 @@ ph_get_svc(struct pam_hbac_ctx *ctx,
     ph_entry_array_shallow_free(services);
     return 0;
 }
+
+/* FIXME - shouldn't we just merge get_svc and get_hosts? */
+int
+ph_get_svc(struct pam_hbac_ctx *ctx,
+           const char *svcname,
+           struct ph_entry **_svc)
+{
+    int ret;
+    char *filter;
+    struct ph_entry **services;
+
+    ret = svc_filter(ctx, svcname, &filter);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret = ph_search(ctx->pamh, ctx->ld, ctx->pc,
+                    &svc_search_obj, filter, &services);
+    free(filter);
+    if (ret != 0) {
+        return ret;
+    }
+
+    return svc_from_entries(ctx, svcname, services, _svc);
+}
+
+int
+ph_get_svc_send(struct pam_hbac_ctx *ctx,
+                const char *svcname,
+                int *_msgid)
+{
+    int ret;
+    char *filter;
+
+    ret = svc_filter(ctx, svcname, &filter);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret = ph_search_send(ctx->pamh, ctx->ld, ctx->pc,
+                         &svc_search_obj, filter, _msgid);
+    free(filter);
+    return ret;
+}
+
+int
+ph_get_svc_recv(struct pam_hbac_ctx *ctx,
+                const char *svcname,
+                int msgid,
+                struct ph_entry **_svc)
+{
+    int ret;
+    struct ph_entry **services;
+    struct timeval buf;
+    struct timeval *left;
+
+    ret = ph_deadline_left(ctx, "searching for the service", &buf, &left);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret = ph_search_recv(ctx->pamh, ctx->ld, &svc_search_obj, msgid, left,
+                         &services);
+    if (ret != 0) {
+        return ret;
+    }
+
+    return svc_from_entries(ctx, svcname, services, _svc);
+}
@@ -30,6 +30,30 @@ struct ph_user *
 ph_get_user(pam_handle_t *ph, const char *username);
 void ph_free_user(struct ph_user *user);
 
+/* Only reads the GIDs of the user's groups. The group names must be
+ * resolved with ph_user_match_groups() or ph_user_resolve_groups()
+ * before the user is evaluated.
+ */
+struct ph_user *
+ph_get_user_gids(pam_handle_t *ph, const char *username);
+
+/* Resolves the names of all the user's groups. The names are allocated
+ * from arena unless it is NULL and ph_free_user() leaves them to it.
+ */
+int ph_user_resolve_groups(pam_handle_t *ph,
+                           struct ph_arena *arena,
+                           struct ph_user *user);
+
+/* Looks up the GIDs of the groups the rules reference and keeps the names
+ * of those the user is a member of. If a group has no GID, all the user's
+ * groups are resolved by name instead. The names are allocated like with
+ * ph_user_resolve_groups().
+ */
+int ph_user_match_groups(pam_handle_t *ph,
+                         struct ph_arena *arena,
+                         struct ph_user *user,
+                         const char **groups);
+
 struct ph_entry;
 
 int ph_get_host(struct pam_hbac_ctx *ctx,
@@ -40,19 +64,76 @@ int ph_get_svc(struct pam_hbac_ctx *ctx,
                const char *svcname,
                struct ph_entry **_svc);
 
+/* Asynchronous variants. The _send functions start the search and return
+ * its message ID, the matching _recv function waits for that search only,
+ * so several searches can be in flight on one connection.
+ */
+int ph_get_host_send(struct pam_hbac_ctx *ctx,
+                     const char *hostname,
+                     int *_msgid);
+int ph_get_host_recv(struct pam_hbac_ctx *ctx,
+                     const char *hostname,
+                     int msgid,
+                     struct ph_entry **_host);
+
+int ph_get_svc_send(struct pam_hbac_ctx *ctx,
+                    const char *svcname,
+                    int *_msgid);
+int ph_get_svc_recv(struct pam_hbac_ctx *ctx,
+                    const char *svcname,
+                    int msgid,
+                    struct ph_entry **_svc);
+
 /* pam_hbac_eval_req.c */
 
-int ph_create_hbac_eval_req(struct ph_user *user,
+/* The service entry may be NULL if the rules don't depend on it, the
+ * request then only carries svcname without any service groups. A request
+ * allocated from an arena is released with the arena.
+ */
+int ph_create_hbac_eval_req(struct ph_arena *arena,
+                            struct ph_user *user,
                             struct ph_entry *targethost,
                             struct ph_entry *service,
+                            const char *svcname,
                             const char *basedn,
                             struct hbac_eval_req **_req);
 void ph_free_hbac_eval_req(struct hbac_eval_req *req);
 
 /* pam_hbac_rules.c */
+/* Returns the user groups the rules reference. The names are borrowed
+ * from the rules, only the array must be freed.
+ */
+int ph_hbac_rules_user_groups(struct hbac_rule **rules,
+                              const char ***_groups);
+/* Returns true if an enabled rule is limited to some services, only then
+ * the service entry can change the outcome
+ */
+bool ph_hbac_rules_need_service(struct hbac_rule **rules);
+
+/* Narrows the rules search down to the rules that can match the service
+ * and the user besides the host. A NULL svcname or user does not narrow
+ * by that member. The service entry may be NULL if it does not exist,
+ * the user's group names must be resolved.
+ */
+struct ph_rules_scope {
+    const char *svcname;
+    struct ph_entry *service;
+    struct ph_user *user;
+};
+
 int ph_get_hbac_rules(struct pam_hbac_ctx *ctx,
                       struct ph_entry *targethost,
+                      struct ph_rules_scope *scope,
                       struct hbac_rule ***_rules);
+int ph_get_hbac_rules_send(struct pam_hbac_ctx *ctx,
+                           struct ph_entry *targethost,
+                           struct ph_rules_scope *scope,
+                           int *_msgid);
+int ph_get_hbac_rules_recv(struct pam_hbac_ctx *ctx,
+                           struct ph_entry *targethost,
+                           int msgid,
+                           struct hbac_rule ***_rules);
+/* Does nothing for rules allocated from ctx->arena */
 void ph_free_hbac_rules(struct hbac_rule **rules);
 
 #endif /* __PAM_HBAC_OBJ_H__ */
@@ -21,6 +21,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <sys/types.h>
 
 struct ph_user {
     char *name;
@@ -29,6 +30,13 @@ struct ph_user {
      * names directly, not DNs
      */
     char **group_names;
+    /* The GIDs getgrouplist() returned. group_names is NULL until the
+     * names are resolved if the user was read with ph_get_user_gids()
+     */
+    gid_t *gids;
+    size_t num_gids;
+    /* The arena group_names was allocated from, NULL for the heap */
+    struct ph_arena *arena;
 };
 
 enum ph_host_attrmap {
@@ -0,0 +1,395 @@
+/*
+    Copyright (C) 2026 Jakub Hrozek <jakub.hrozek@posteo.se>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "pam_hbac.h"
+#include "pam_hbac_pool.h"
+
+#define PH_POOL_SIZE    8
+
+#define FNV64_OFFSET    0xcbf29ce484222325ULL
+#define FNV64_PRIME     0x100000001b3ULL
+
+static void
+pool_unbind(pam_handle_t *pamh, LDAP *ld)
+{
+    int ret;
+
+    ret = ldap_unbind_ext(ld, NULL, NULL);
+    if (ret != LDAP_SUCCESS) {
+        logger(pamh, LOG_ERR,
+               "ldap_unbind_ext failed [%d]: %s\n",
+               ret, ldap_err2string(ret));
+    }
+}
+
+#ifdef HAVE_FUNCTION_ATTRIBUTE_DESTRUCTOR
+
+struct ph_pool_entry {
+    LDAP *ld;
+    /* The server the handle is connected to */
+    char *server;
+    /* Who the handle is bound as, see pool_key() */
+    char *key;
+    time_t expires;
+};
+
+/* Only ever touched with pool_mutex held, no I/O is done under it */
+static struct ph_pool_entry pool[PH_POOL_SIZE];
+static pid_t pool_pid;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+pool_clear_entry(struct ph_pool_entry *e)
+{
+    free(e->server);
+    free(e->key);
+    e->server = NULL;
+    e->key = NULL;
+    e->ld = NULL;
+    e->expires = 0;
+}
+
+/* Must be called with the lock held. Returns the number of handles
+ * that were inherited from the parent process and dropped.
+ */
+static size_t
+pool_check_fork(void)
+{
+    pid_t pid;
+    size_t dropped = 0;
+    size_t i;
+
+    pid = getpid();
+    if (pool_pid == pid) {
+        return 0;
+    }
+
+    if (pool_pid != 0) {
+        for (i = 0; i < PH_POOL_SIZE; i++) {
+            if (pool[i].ld == NULL) {
+                continue;
+            }
+
+            /* Unbinding would send an unbind request over the socket
+             * the parent still uses. Leak the handle instead.
+             */
+            pool_clear_entry(&pool[i]);
+            dropped++;
+        }
+    }
+
+    pool_pid = pid;
+    return dropped;
+}
+
+/* PAM applications usually unload the module in pam_end(). The handles
+ * cannot outlive the code that manages them, close them on the way out.
+ */
+static void pool_destroy(void) __attribute__((destructor));
+
+static void
+pool_destroy(void)
+{
+    size_t i;
+
+    pthread_mutex_lock(&pool_mutex);
+    (void) pool_check_fork();
+    for (i = 0; i < PH_POOL_SIZE; i++) {
+        if (pool[i].ld != NULL) {
+            pool_unbind(NULL, pool[i].ld);
+            pool_clear_entry(&pool[i]);
+        }
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/* The password is only kept as a hash, a changed password must not reuse
+ * a handle bound with the old one
+ */
+static uint64_t
+pool_pw_hash(const char *pw)
+{
+    uint64_t h = FNV64_OFFSET;
+    const char *p;
+
+    for (p = pw ? pw : ""; *p != '\0'; p++) {
+        h ^= (uint8_t) *p;
+        h *= FNV64_PRIME;
+    }
+
+    return h;
+}
+
+static char *
+pool_key(struct pam_hbac_config *pc)
+{
+    char *key;
+    int ret;
+
+    ret = asprintf(&key, "%s\n%016llx\n%s\n%d",
+                   pc->bind_dn ? pc->bind_dn : "",
+                   (unsigned long long) pool_pw_hash(pc->bind_pw),
+                   pc->ca_cert ? pc->ca_cert : "",
+                   pc->secure ? 1 : 0);
+    if (ret < 0) {
+        return NULL;
+    }
+
+    return key;
+}
+
+/* Returns the configured URI equal to server, so that the caller gets a
+ * string that lives as long as the configuration, or NULL if the server
+ * is no longer configured. A single server is only kept in pc->uri.
+ */
+static const char *
+pool_configured_server(struct pam_hbac_config *pc, const char *server)
+{
+    size_t i;
+
+    if (pc->uri != NULL && strcmp(pc->uri, server) == 0) {
+        return pc->uri;
+    }
+
+    for (i = 0; i < pc->num_uris; i++) {
+        if (strcmp(pc->uris[i], server) == 0) {
+            return pc->uris[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* An idle LDAP connection has nothing to read. Readable data or a hangup
+ * means that the server closed the connection or sent a notice of
+ * disconnection.
+ */
+static bool
+pool_alive(LDAP *ld)
+{
+#ifdef LDAP_OPT_DESC
+    struct pollfd pfd;
+    int fd = -1;
+    int ret;
+
+    ret = ldap_get_option(ld, LDAP_OPT_DESC, &fd);
+    if (ret != LDAP_SUCCESS || fd < 0) {
+        return false;
+    }
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    ret = poll(&pfd, 1, 0);
+    return ret == 0;
+#else
+    return true;
+#endif
+}
+
+LDAP *
+ph_pool_get(pam_handle_t *pamh,
+            struct pam_hbac_config *pc,
+            const char **_server)
+{
+    LDAP *stale[PH_POOL_SIZE];
+    size_t nstale;
+    size_t dropped;
+    LDAP *ld;
+    const char *server;
+    char *key;
+    time_t now;
+    size_t i;
+
+    if (pc == NULL || _server == NULL || pc->pool_idle_timeout <= 0) {
+        return NULL;
+    }
+
+    key = pool_key(pc);
+    if (key == NULL) {
+        return NULL;
+    }
+
+    do {
+        ld = NULL;
+        server = NULL;
+        nstale = 0;
+        now = time(NULL);
+
+        pthread_mutex_lock(&pool_mutex);
+        dropped = pool_check_fork();
+        for (i = 0; i < PH_POOL_SIZE; i++) {
+            if (pool[i].ld == NULL) {
+                continue;
+            }
+
+            if (pool[i].expires < now) {
+                stale[nstale++] = pool[i].ld;
+                pool_clear_entry(&pool[i]);
+                continue;
+            }
+
+            if (ld != NULL || strcmp(pool[i].key, key) != 0) {
+                continue;
+            }
+
+            server = pool_configured_server(pc, pool[i].server);
+            if (server != NULL) {
+                ld = pool[i].ld;
+                pool_clear_entry(&pool[i]);
+            }
+        }
+        pthread_mutex_unlock(&pool_mutex);
+
+        if (dropped > 0) {
+            logger(pamh, LOG_DEBUG,
+                   "Dropped %zu pooled connections of the parent process\n",
+                   dropped);
+        }
+
+        for (i = 0; i < nstale; i++) {
+            logger(pamh, LOG_DEBUG, "Closing idle pooled connection\n");
+            pool_unbind(pamh, stale[i]);
+        }
+
+        if (ld != NULL && !pool_alive(ld)) {
+            logger(pamh, LOG_DEBUG,
+                   "Pooled connection to %s was closed by the server\n",
+                   server);
+            pool_unbind(pamh, ld);
+            /* There might be another handle for the same server */
+            continue;
+        }
+
+        break;
+    } while (true);
+
+    free(key);
+    if (ld != NULL) {
+        logger(pamh, LOG_DEBUG, "Reusing pooled connection to %s\n", server);
+        *_server = server;
+    }
+    return ld;
+}
+
+void
+ph_pool_put(pam_handle_t *pamh,
+            struct pam_hbac_config *pc,
+            const char *server,
+            LDAP *ld)
+{
+    LDAP *victim = NULL;
+    char *key;
+    char *server_copy;
+    size_t slot;
+    size_t i;
+
+    if (ld == NULL) {
+        return;
+    }
+
+    if (pc == NULL || server == NULL || pc->pool_idle_timeout <= 0) {
+        pool_unbind(pamh, ld);
+        return;
+    }
+
+    key = pool_key(pc);
+    server_copy = strdup(server);
+    if (key == NULL || server_copy == NULL) {
+        free(key);
+        free(server_copy);
+        pool_unbind(pamh, ld);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    (void) pool_check_fork();
+
+    /* Use a free slot or replace the handle that expires first */
+    slot = 0;
+    for (i = 0; i < PH_POOL_SIZE; i++) {
+        if (pool[i].ld == NULL) {
+            slot = i;
+            break;
+        }
+
+        if (pool[i].expires < pool[slot].expires) {
+            slot = i;
+        }
+    }
+
+    if (pool[slot].ld != NULL) {
+        victim = pool[slot].ld;
+        pool_clear_entry(&pool[slot]);
+    }
+
+    pool[slot].ld = ld;
+    pool[slot].server = server_copy;
+    pool[slot].key = key;
+    pool[slot].expires = time(NULL) + pc->pool_idle_timeout;
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (victim != NULL) {
+        logger(pamh, LOG_DEBUG, "Connection pool full, closing a connection\n");
+        pool_unbind(pamh, victim);
+    }
+}
+
+#else /* HAVE_FUNCTION_ATTRIBUTE_DESTRUCTOR */
+
+LDAP *
+ph_pool_get(pam_handle_t *pamh,
+            struct pam_hbac_config *pc,
+            const char **_server)
+{
+    if (pc != NULL && pc->pool_idle_timeout > 0) {
+        logger(pamh, LOG_NOTICE,
+               "The connection pool is not supported on this platform\n");
+    }
+    return NULL;
+}
+
+void
+ph_pool_put(pam_handle_t *pamh,
+            struct pam_hbac_config *pc,
+            const char *server,
+            LDAP *ld)
+{
+    if (ld == NULL) {
+        return;
+    }
+
+    pool_unbind(pamh, ld);
+}
+
+#endif /* HAVE_FUNCTION_ATTRIBUTE_DESTRUCTOR */
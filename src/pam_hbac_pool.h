@@ -0,0 +1,55 @@
+/*
+    Copyright (C) 2026 Jakub Hrozek <jakub.hrozek@posteo.se>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __PAM_HBAC_POOL_H__
+#define __PAM_HBAC_POOL_H__
+
+#include <ldap.h>
+
+#include "pam_hbac.h"
+
+/* The connection pool keeps bound LDAP handles alive between calls of
+ * the module in long-lived processes. Handles are keyed by the server
+ * they are connected to, the bind DN, a hash of the bind password, the CA
+ * certificate and whether TLS is used. A handle is taken out of the pool
+ * while it is in use, so it is never shared between two callers at the
+ * same time.
+ *
+ * Handles that were idle for longer than CONNECTION_POOL_IDLE_TIMEOUT or
+ * whose connection was closed are discarded on the next lookup. Handles
+ * inherited across fork() are forgotten without being unbound, the parent
+ * still owns the connection. The remaining handles are unbound when the
+ * module is unloaded.
+ */
+
+/* Returns a bound handle to one of the configured servers or NULL. The
+ * server the handle is connected to is returned in _server, pointing into
+ * the configuration.
+ */
+LDAP *ph_pool_get(pam_handle_t *pamh,
+                  struct pam_hbac_config *pc,
+                  const char **_server);
+
+/* Returns the handle connected to server to the pool or unbinds it if
+ * pooling is disabled or the pool is full
+ */
+void ph_pool_put(pam_handle_t *pamh,
+                 struct pam_hbac_config *pc,
+                 const char *server,
+                 LDAP *ld);
+
+#endif /* __PAM_HBAC_POOL_H__ */
@@ -19,40 +19,82 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stddef.h>
+#include <ctype.h>
 #include <errno.h>
 
 #include "pam_hbac.h"
 #include "pam_hbac_ldap.h"      /* FIXME - should we merge this module and obj? */
+#include "pam_hbac_obj.h"
 #include "pam_hbac_obj_int.h"
 #include "pam_hbac_dnparse.h"
 #include "pam_hbac_entry.h"
+#include "pam_hbac_scoreboard.h"
+#include "pam_hbac_arena.h"
 
 #include "libhbac/ipa_hbac.h"
 #include "config.h"
 
 #define RULE_NAME_FALLBACK  "unknown rule name"
 
-static void free_hbac_rule_element(struct hbac_rule_element *el)
+#define FNV64_OFFSET        0xcbf29ce484222325ULL
+#define FNV64_PRIME         0x100000001b3ULL
+
+/* The NULL-terminated rule arrays remember the arena they were allocated
+ * from, ph_free_hbac_rules() leaves those to the arena
+ */
+struct ph_rules_array {
+    struct ph_arena *arena;
+    struct hbac_rule *rules[];
+};
+
+static struct ph_rules_array *
+rules_array_of(struct hbac_rule **rules)
 {
-    if (el == NULL) {
+    return (struct ph_rules_array *) ((char *) rules
+                                  - offsetof(struct ph_rules_array, rules));
+}
+
+/* Elements in an arena keep the references to the member names until the
+ * arena is released
+ */
+static void release_hbac_rule_element(void *ptr)
+{
+    struct hbac_rule_element *el = ptr;
+    size_t i;
+
+    for (i = 0; el->names != NULL && el->names[i] != NULL; i++) {
+        ph_dn_name_unref(el->names[i]);
+    }
+    for (i = 0; el->groups != NULL && el->groups[i] != NULL; i++) {
+        ph_dn_name_unref(el->groups[i]);
+    }
+}
+
+static void free_hbac_rule_element(struct ph_arena *arena,
+                                   struct hbac_rule_element *el)
+{
+    if (el == NULL || arena != NULL) {
         return;
     }
 
-    free_string_clist(el->names);
-    free_string_clist(el->groups);
+    ph_dn_name_list_free(el->names);
+    ph_dn_name_list_free(el->groups);
     free(el);
 }
 
-static void free_hbac_rule(struct hbac_rule *rule)
+static void free_hbac_rule(struct ph_arena *arena, struct hbac_rule *rule)
 {
-    if (rule == NULL) {
+    if (rule == NULL || arena != NULL) {
         return;
     }
 
-    free_hbac_rule_element(rule->users);
-    free_hbac_rule_element(rule->targethosts);
-    free_hbac_rule_element(rule->services);
-    free_hbac_rule_element(rule->srchosts);
+    free_hbac_rule_element(arena, rule->users);
+    free_hbac_rule_element(arena, rule->targethosts);
+    free_hbac_rule_element(arena, rule->services);
+    free_hbac_rule_element(arena, rule->srchosts);
 
     free_const(rule->name);
     free(rule);
@@ -60,16 +102,83 @@ static void free_hbac_rule(struct hbac_rule *rule)
 
 void ph_free_hbac_rules(struct hbac_rule **rules)
 {
+    struct ph_rules_array *array;
     size_t i;
 
     if (rules == NULL) {
         return;
     }
 
+    array = rules_array_of(rules);
+    if (array->arena != NULL) {
+        return;
+    }
+
     for (i = 0; rules[i]; i++) {
-        free_hbac_rule(rules[i]);
+        free_hbac_rule(NULL, rules[i]);
+    }
+    free(array);
+}
+
+int
+ph_hbac_rules_user_groups(struct hbac_rule **rules, const char ***_groups)
+{
+    const char **groups;
+    struct hbac_rule_element *users;
+    size_t num_groups = 0;
+    size_t i, j;
+
+    if (_groups == NULL) {
+        return EINVAL;
+    }
+
+    for (i = 0; rules != NULL && rules[i]; i++) {
+        num_groups += null_cstring_array_size(rules[i]->users ?
+                                              rules[i]->users->groups : NULL);
+    }
+
+    groups = calloc(num_groups + 1, sizeof(const char *));
+    if (groups == NULL) {
+        return ENOMEM;
+    }
+
+    num_groups = 0;
+    for (i = 0; rules != NULL && rules[i]; i++) {
+        users = rules[i]->users;
+        /* Groups of rules that can't match the user don't matter */
+        if (!rules[i]->enabled || users == NULL
+                || users->category & HBAC_CATEGORY_ALL
+                || users->groups == NULL) {
+            continue;
+        }
+
+        for (j = 0; users->groups[j]; j++) {
+            groups[num_groups++] = users->groups[j];
+        }
+    }
+
+    *_groups = groups;
+    return 0;
+}
+
+bool
+ph_hbac_rules_need_service(struct hbac_rule **rules)
+{
+    struct hbac_rule_element *services;
+    size_t i;
+
+    for (i = 0; rules != NULL && rules[i]; i++) {
+        services = rules[i]->services;
+        if (!rules[i]->enabled) {
+            continue;
+        }
+
+        if (services == NULL || !(services->category & HBAC_CATEGORY_ALL)) {
+            return true;
+        }
     }
-    free(rules);
+
+    return false;
 }
 
 static const char *ph_rule_attrs[] = { PAM_HBAC_ATTR_OC, "cn", "ipaUniqueID",
@@ -86,81 +195,261 @@ static struct ph_search_ctx rule_search_obj = {
     .num_attrs = PH_MAP_RULE_END,
 };
 
-static char *
-create_host_dn(const char *fqdn, const char *basedn)
+/* Names with characters that would need escaping in a DN cannot be IPA
+ * user, group or service names, these are left out
+ */
+static bool
+member_name_usable(const char *name)
 {
-    char *dn;
-    int ret;
+    size_t len = strlen(name);
 
-    ret = asprintf(&dn, "fqdn=%s,cn=computers,cn=accounts,%s", fqdn, basedn);
-    if (ret < 0) {
-        return NULL;
+    return len > 0
+        && name[0] != ' ' && name[0] != '#' && name[len - 1] != ' '
+        && strpbrk(name, ",+\"\\<>;=") == NULL;
+}
+
+/* The length of (attr=rdn_key=name,container,basedn) */
+static size_t
+member_dn_len(const char *attr,
+              const char *rdn_key,
+              const char *name,
+              const char *container,
+              const char *basedn)
+{
+    return strlen(attr) + strlen(rdn_key) + ph_filter_value_len(name)
+           + strlen(container) + ph_filter_value_len(basedn) + 6;
+}
+
+static void
+append_member_dn(struct ph_strbuf *sb,
+                 const char *attr,
+                 const char *rdn_key,
+                 const char *name,
+                 const char *container,
+                 const char *basedn)
+{
+    ph_strbuf_append(sb, "(");
+    ph_strbuf_append(sb, attr);
+    ph_strbuf_append(sb, "=");
+    ph_strbuf_append(sb, rdn_key);
+    ph_strbuf_append(sb, "=");
+    ph_strbuf_append_value(sb, name);
+    ph_strbuf_append(sb, ",");
+    ph_strbuf_append(sb, container);
+    ph_strbuf_append(sb, ",");
+    ph_strbuf_append_value(sb, basedn);
+    ph_strbuf_append(sb, ")");
+}
+
+static void
+append_member_value(struct ph_strbuf *sb, const char *attr, const char *value)
+{
+    ph_strbuf_append(sb, "(");
+    ph_strbuf_append(sb, attr);
+    ph_strbuf_append(sb, "=");
+    ph_strbuf_append_value(sb, value);
+    ph_strbuf_append(sb, ")");
+}
+
+static size_t
+member_values_len(const char *attr, struct ph_attr *values)
+{
+    size_t len = 0;
+    size_t i;
+
+    for (i = 0; values != NULL && i < values->nvals; i++) {
+        len += strlen(attr) + 3
+               + ph_filter_value_len((const char *) values->vals[i]->bv_val);
+    }
+
+    return len;
+}
+
+static void
+append_member_values(struct ph_strbuf *sb,
+                     const char *attr,
+                     struct ph_attr *values)
+{
+    size_t i;
+
+    for (i = 0; values != NULL && i < values->nvals; i++) {
+        append_member_value(sb, attr,
+                            (const char *) values->vals[i]->bv_val);
     }
+}
+
+/* The length of (|(cat_attr=all) */
+static size_t
+category_all_len(const char *cat_attr)
+{
+    return strlen(cat_attr) + sizeof(PAM_HBAC_ALL_VALUE) + 4;
+}
 
-    return dn;
+/* Opens a disjunction that the category value matches on its own */
+static void
+append_category_all(struct ph_strbuf *sb, const char *cat_attr)
+{
+    ph_strbuf_append(sb, "(|(");
+    ph_strbuf_append(sb, cat_attr);
+    ph_strbuf_append(sb, "=" PAM_HBAC_ALL_VALUE ")");
 }
 
+/* The service scope is
+ * (|(serviceCategory=all)(memberService=<service DN>)
+ *   (memberService=<service group DN>)...)
+ * The service entry might not exist, rules can't reference it then
+ * but they still can apply to all services.
+ */
+static size_t
+service_scope_len(const char *base_dn, struct ph_rules_scope *scope)
+{
+    const char *attr = ph_rule_attrs[PH_MAP_RULE_MEMBER_SVC];
+    size_t len;
+
+    len = category_all_len(ph_rule_attrs[PH_MAP_RULE_SVC_CAT]) + 1;
+    len += member_dn_len(attr, "cn", scope->svcname,
+                         "cn=hbacservices,cn=hbac", base_dn);
+    if (scope->service != NULL) {
+        len += member_values_len(attr,
+                    ph_entry_get_attr(scope->service, PH_MAP_SVC_MEMBEROF));
+    }
+
+    return len;
+}
+
+static void
+append_service_scope(struct ph_strbuf *sb,
+                     const char *base_dn,
+                     struct ph_rules_scope *scope)
+{
+    const char *attr = ph_rule_attrs[PH_MAP_RULE_MEMBER_SVC];
+
+    append_category_all(sb, ph_rule_attrs[PH_MAP_RULE_SVC_CAT]);
+    if (member_name_usable(scope->svcname)) {
+        append_member_dn(sb, attr, "cn", scope->svcname,
+                         "cn=hbacservices,cn=hbac", base_dn);
+    }
+    if (scope->service != NULL) {
+        append_member_values(sb, attr,
+                    ph_entry_get_attr(scope->service, PH_MAP_SVC_MEMBEROF));
+    }
+    ph_strbuf_append(sb, ")");
+}
+
+/* The user scope is
+ * (|(userCategory=all)(memberUser=<user DN>)(memberUser=<group DN>)...)
+ */
+static size_t
+user_scope_len(const char *base_dn, struct ph_user *user)
+{
+    const char *attr = ph_rule_attrs[PH_MAP_RULE_MEMBER_USER];
+    size_t len;
+    size_t i;
+
+    len = category_all_len(ph_rule_attrs[PH_MAP_RULE_USER_CAT]) + 1;
+    len += member_dn_len(attr, "uid", user->name,
+                         "cn=users,cn=accounts", base_dn);
+    for (i = 0; user->group_names != NULL && user->group_names[i]; i++) {
+        len += member_dn_len(attr, "cn", user->group_names[i],
+                             "cn=groups,cn=accounts", base_dn);
+    }
+
+    return len;
+}
+
+static void
+append_user_scope(struct ph_strbuf *sb,
+                  const char *base_dn,
+                  struct ph_user *user)
+{
+    const char *attr = ph_rule_attrs[PH_MAP_RULE_MEMBER_USER];
+    size_t i;
+
+    append_category_all(sb, ph_rule_attrs[PH_MAP_RULE_USER_CAT]);
+    if (member_name_usable(user->name)) {
+        append_member_dn(sb, attr, "uid", user->name,
+                         "cn=users,cn=accounts", base_dn);
+    }
+    for (i = 0; user->group_names != NULL && user->group_names[i]; i++) {
+        if (member_name_usable(user->group_names[i])) {
+            append_member_dn(sb, attr, "cn", user->group_names[i],
+                             "cn=groups,cn=accounts", base_dn);
+        }
+    }
+    ph_strbuf_append(sb, ")");
+}
+
+/* Without host_clause the server returns the rules for all hosts, the
+ * caller must then check memberHost itself
+ */
 static char *
 create_rules_filter(pam_handle_t *pamh,
                     const char *base_dn,
-                    struct ph_entry *host)
+                    struct ph_entry *host,
+                    bool host_clause,
+                    struct ph_rules_scope *scope)
 {
-    char *prev;
-    char *filter;
-    int ret;
-    size_t i;
+    struct ph_strbuf sb;
     struct ph_attr *hostname;
     struct ph_attr *hostgroups;
-    char *host_dn;
+    const char *fqdn;
+    const char *attr = ph_rule_attrs[PH_MAP_RULE_MEMBER_HOST];
+    size_t len;
 
     hostname = ph_entry_get_attr(host, PH_MAP_HOST_FQDN);
     if (hostname == NULL || hostname->nvals != 1) {
         logger(pamh, LOG_ERR, "No hostname or more than one hostname\n");
         return NULL;
     }
+    fqdn = (const char *) hostname->vals[0]->bv_val;
+    hostgroups = ph_entry_get_attr(host, PH_MAP_HOST_MEMBEROF);
 
-    host_dn = create_host_dn((const char *)hostname->vals[0]->bv_val,
-                             base_dn);
-    if (host_dn == NULL) {
-        logger(pamh, LOG_ERR, "Cannot construct host DN\n");
-        return NULL;
+    /* Size the buffer once, the filter lists every hostgroup and with
+     * NARROW_RULES_BY_USER every group of the user
+     */
+    len = strlen(ph_rule_attrs[PH_MAP_RULE_ENABLED_FLAG])
+          + sizeof(PAM_HBAC_TRUE_VALUE)
+          + strlen(ph_rule_attrs[PH_MAP_RULE_ACCESS_RULE_TYPE])
+          + sizeof(PAM_HBAC_ALLOW_VALUE) + 8;
+    if (host_clause) {
+        len += category_all_len(ph_rule_attrs[PH_MAP_RULE_HOST_CAT]) + 1
+               + member_dn_len(attr, "fqdn", fqdn, "cn=computers,cn=accounts",
+                               base_dn)
+               + member_values_len(attr, hostgroups);
     }
-
-    ret = asprintf(&filter, "&(%s=%s)(%s=%s)(|(%s=%s)(%s=%s)",
-                   ph_rule_attrs[PH_MAP_RULE_ENABLED_FLAG], PAM_HBAC_TRUE_VALUE,
-                   ph_rule_attrs[PH_MAP_RULE_ACCESS_RULE_TYPE], PAM_HBAC_ALLOW_VALUE,
-                   ph_rule_attrs[PH_MAP_RULE_HOST_CAT], PAM_HBAC_ALL_VALUE,
-                   ph_rule_attrs[PH_MAP_RULE_MEMBER_HOST], host_dn);
-    free(host_dn);
-    if (ret < 0) {
-        return NULL;
+    if (scope != NULL && scope->svcname != NULL) {
+        len += service_scope_len(base_dn, scope);
+    }
+    if (scope != NULL && scope->user != NULL) {
+        len += user_scope_len(base_dn, scope->user);
     }
 
-    hostgroups = ph_entry_get_attr(host, PH_MAP_HOST_MEMBEROF);
-    if (hostgroups) {
-        for (i = 0; i < hostgroups->nvals; i++) {
-            prev = filter;
-
-            ret = asprintf(&filter, "%s(%s=%s)",
-                        prev,
-                        ph_rule_attrs[PH_MAP_RULE_MEMBER_HOST],
-                        (const char *) hostgroups->vals[i]->bv_val);
-            free(prev);
-            if (ret < 0) {
-                return NULL;
-            }
-        }
+    ph_strbuf_init(&sb);
+    ph_strbuf_reserve(&sb, len);
+
+    ph_strbuf_append(&sb, "&(");
+    ph_strbuf_append(&sb, ph_rule_attrs[PH_MAP_RULE_ENABLED_FLAG]);
+    ph_strbuf_append(&sb, "=" PAM_HBAC_TRUE_VALUE ")(");
+    ph_strbuf_append(&sb, ph_rule_attrs[PH_MAP_RULE_ACCESS_RULE_TYPE]);
+    ph_strbuf_append(&sb, "=" PAM_HBAC_ALLOW_VALUE ")");
+
+    if (host_clause) {
+        append_category_all(&sb, ph_rule_attrs[PH_MAP_RULE_HOST_CAT]);
+        append_member_dn(&sb, attr, "fqdn", fqdn, "cn=computers,cn=accounts",
+                         base_dn);
+        append_member_values(&sb, attr, hostgroups);
+        ph_strbuf_append(&sb, ")");
     }
 
-    prev = filter;
+    if (scope != NULL && scope->svcname != NULL) {
+        append_service_scope(&sb, base_dn, scope);
+    }
 
-    ret = asprintf(&filter, "%s)", prev);
-    free(prev);
-    if (ret < 0) {
-        return NULL;
+    if (scope != NULL && scope->user != NULL) {
+        append_user_scope(&sb, base_dn, scope->user);
     }
 
-    return filter;
+    return ph_strbuf_finish(&sb);
 }
 
 static struct ph_attr *
@@ -237,20 +526,40 @@ el_fill_category(pam_handle_t *pamh,
     return 0;
 }
 
-static int
-add_empty_rule_element(struct hbac_rule_element **_el)
+/* Allocates an element with room for nvals names and groups */
+static struct hbac_rule_element *
+alloc_rule_element(struct ph_arena *arena, size_t nvals)
 {
     struct hbac_rule_element *el;
 
-    el = calloc(1, sizeof(struct hbac_rule_element));
+    el = ph_arena_calloc(arena, 1, sizeof(struct hbac_rule_element));
     if (el == NULL) {
-        return ENOMEM;
+        return NULL;
+    }
+
+    if (arena != NULL
+            && ph_arena_defer(arena, release_hbac_rule_element, el) != 0) {
+        return NULL;
     }
 
-    el->names = calloc(1, sizeof(char *));
-    el->groups = calloc(1, sizeof(char *));
+    el->names = ph_arena_calloc(arena, nvals + 1, sizeof(char *));
+    el->groups = ph_arena_calloc(arena, nvals + 1, sizeof(char *));
     if (el->names == NULL || el->groups == NULL) {
-        free_hbac_rule_element(el);
+        free_hbac_rule_element(arena, el);
+        return NULL;
+    }
+
+    return el;
+}
+
+static int
+add_empty_rule_element(struct ph_arena *arena,
+                       struct hbac_rule_element **_el)
+{
+    struct hbac_rule_element *el;
+
+    el = alloc_rule_element(arena, 0);
+    if (el == NULL) {
         return ENOMEM;
     }
     el->category |= HBAC_CATEGORY_ALL;
@@ -261,9 +570,10 @@ add_empty_rule_element(struct hbac_rule_element **_el)
 
 static int
 attr_to_rule_element(pam_handle_t *pamh,
+                     struct ph_arena *arena,
                      struct ph_entry *rule_entry,
                      enum member_el_type el_type,
-                     const char *basedn,
+                     struct ph_dn_memo *memo,
                      struct hbac_rule_element **_el)
 {
     struct ph_attr *a;
@@ -274,8 +584,15 @@ attr_to_rule_element(pam_handle_t *pamh,
     size_t nvals;
     int ret;
     const char *member_name;
+    enum ph_dn_class dn_class;
+    enum ph_dn_class name_class;
+    enum ph_dn_class group_class;
 
-    el = calloc(1, sizeof(struct hbac_rule_element));
+    a = el_member_attr(rule_entry, el_type);
+    nvals = a ? a->nvals : 0;
+    logger(pamh, LOG_DEBUG, "Found %zu members\n", nvals);
+
+    el = alloc_rule_element(arena, nvals);
     if (el == NULL) {
         return ENOMEM;
     }
@@ -284,41 +601,34 @@ attr_to_rule_element(pam_handle_t *pamh,
     if (ret == 0) {
         /* Do we still need to check the elements? */
     } else if (ret != ENOENT) {
-        free_hbac_rule_element(el);
+        free_hbac_rule_element(arena, el);
         return ret;
     }
 
-    a = el_member_attr(rule_entry, el_type);
-    nvals = a ? a->nvals : 0;
-    logger(pamh, LOG_DEBUG, "Found %zu members\n", nvals);
-
-    el->names = calloc(nvals + 1, sizeof(char *));
-    el->groups = calloc(nvals + 1, sizeof(char *));
-    if (el->names == NULL || el->groups == NULL) {
-        free_hbac_rule_element(el);
-        return ENOMEM;
-    }
+    name_class = ph_dn_class_of(el_type, false);
+    group_class = ph_dn_class_of(el_type, true);
 
     ni = gi = 0;
     for (i = 0; i < nvals; i++) {
         member_name = NULL;
 
-        ret = ph_name_from_dn(a->vals[i]->bv_val, el_type, basedn, &member_name);
-        if (ret == 0) {
+        ret = ph_dn_memo_classify(memo, a->vals[i], &dn_class, &member_name);
+        if (ret == ENOMEM) {
+            free_hbac_rule_element(arena, el);
+            return ENOMEM;
+        } else if (ret == 0 && dn_class == name_class) {
             logger(pamh, LOG_DEBUG, "%s is a single member object\n", member_name);
             el->names[ni] = member_name;
             ni++;
             continue;
-        }
-
-        ret = ph_group_name_from_dn(a->vals[i]->bv_val, el_type, basedn, &member_name);
-        if (ret == 0) {
+        } else if (ret == 0 && dn_class == group_class) {
             logger(pamh, LOG_DEBUG, "%s is a group member object\n", member_name);
             el->groups[gi] = member_name;
             gi++;
             continue;
         }
 
+        ph_dn_name_unref(member_name);
         logger(pamh, LOG_NOTICE,
                "Cannot determine type of member %s\n", a->vals[i]->bv_val);
     }
@@ -360,6 +670,7 @@ fill_rule_enabled(pam_handle_t *pamh,
 
 static int
 fill_rule_name(pam_handle_t *pamh,
+               struct ph_arena *arena,
                struct ph_entry *rule_entry,
                struct hbac_rule *rule)
 {
@@ -368,7 +679,7 @@ fill_rule_name(pam_handle_t *pamh,
     name_attr = ph_entry_get_attr(rule_entry, PH_MAP_RULE_NAME);
     if (name_attr == NULL || name_attr->nvals < 1) {
         logger(pamh, LOG_WARNING, "No value for name, using fallback\n");
-        rule->name = strdup(RULE_NAME_FALLBACK);
+        rule->name = ph_arena_strdup(arena, RULE_NAME_FALLBACK);
         if (rule->name == NULL) {
             return ENOMEM;
         }
@@ -381,7 +692,7 @@ fill_rule_name(pam_handle_t *pamh,
         /* Not fatal */
     }
 
-    rule->name = strdup(name_attr->vals[0]->bv_val);
+    rule->name = ph_arena_strdup(arena, name_attr->vals[0]->bv_val);
     if (rule->name == NULL) {
         return ENOMEM;
     }
@@ -391,7 +702,8 @@ fill_rule_name(pam_handle_t *pamh,
 
 static int
 entry_to_hbac_rule(pam_handle_t *pamh,
-                   const char *basedn,
+                   struct ph_arena *arena,
+                   struct ph_dn_memo *memo,
                    struct ph_entry *rule_entry,
                    struct hbac_rule **_rule)
 {
@@ -400,16 +712,16 @@ entry_to_hbac_rule(pam_handle_t *pamh,
     bool ok;
     uint32_t missing_attrs;
 
-    rule = calloc(1, sizeof(struct hbac_rule));
+    rule = ph_arena_calloc(arena, 1, sizeof(struct hbac_rule));
     if (rule == NULL) {
         return ENOMEM;
     }
 
-    ret = fill_rule_name(pamh, rule_entry, rule);
+    ret = fill_rule_name(pamh, arena, rule_entry, rule);
     if (ret != 0) {
         logger(pamh, LOG_ERR,
                "Cannot determine rule name [%d]: %s\n", ret, strerror(ret));
-        free_hbac_rule(rule);
+        free_hbac_rule(arena, rule);
         return ret;
     }
 
@@ -420,48 +732,49 @@ entry_to_hbac_rule(pam_handle_t *pamh,
     if (ret != 0) {
         logger(pamh, LOG_ERR,
                "Cannot fill the enabled flag [%d]: %s\n", ret, strerror(ret));
-        free_hbac_rule(rule);
+        free_hbac_rule(arena, rule);
         return ret;
     }
 
-    ret = attr_to_rule_element(pamh, rule_entry, DN_TYPE_USER, basedn, &rule->users);
+    ret = attr_to_rule_element(pamh, arena, rule_entry, DN_TYPE_USER, memo,
+                               &rule->users);
     if (ret != 0) {
         logger(pamh, LOG_ERR,
                "Cannot add user data to rule [%d]: %s\n",
                ret, strerror(ret));
-        free_hbac_rule(rule);
+        free_hbac_rule(arena, rule);
         return ret;
     }
 
-    ret = attr_to_rule_element(pamh, rule_entry, DN_TYPE_SVC, basedn,
+    ret = attr_to_rule_element(pamh, arena, rule_entry, DN_TYPE_SVC, memo,
                                &rule->services);
     if (ret != 0) {
         logger(pamh, LOG_ERR,
                "Cannot add service data to rule [%d]: %s\n",
                ret, strerror(ret));
-        free_hbac_rule(rule);
+        free_hbac_rule(arena, rule);
         return ret;
     }
 
-    ret = attr_to_rule_element(pamh, rule_entry, DN_TYPE_HOST,
-                               basedn, &rule->targethosts);
+    ret = attr_to_rule_element(pamh, arena, rule_entry, DN_TYPE_HOST,
+                               memo, &rule->targethosts);
     if (ret != 0) {
         logger(pamh, LOG_ERR,
                "Cannot add target host data to rule [%d]: %s\n",
                ret, strerror(ret));
-        free_hbac_rule(rule);
+        free_hbac_rule(arena, rule);
         return ret;
     }
 
     /* We don't support srchosts, but we need to provide an empty array,
      * otherwise libhbac would barf
      */
-    ret = add_empty_rule_element(&rule->srchosts);
+    ret = add_empty_rule_element(arena, &rule->srchosts);
     if (ret != 0) {
         logger(pamh, LOG_ERR,
                "Cannot add source host data to rule [%d]: %s\n",
                ret, strerror(ret));
-        free_hbac_rule(rule);
+        free_hbac_rule(arena, rule);
         return ret;
     }
 
@@ -469,7 +782,7 @@ entry_to_hbac_rule(pam_handle_t *pamh,
     ok = hbac_rule_is_complete(rule, &missing_attrs);
     if (!ok) {
         logger(pamh, LOG_ERR, "Missing attributes: %X\n", missing_attrs);
-        free_hbac_rule(rule);
+        free_hbac_rule(arena, rule);
         return EFAULT;
     }
 
@@ -477,26 +790,421 @@ entry_to_hbac_rule(pam_handle_t *pamh,
     return 0;
 }
 
+/* With more hostgroups than HOSTGROUP_FILTER_LIMIT, the rules for all
+ * hosts are downloaded and matched against the host's groups here
+ * instead of listing every hostgroup in the search filter
+ */
+static bool
+rules_match_host_locally(struct pam_hbac_ctx *ctx, struct ph_entry *host)
+{
+    struct ph_attr *hostgroups;
+
+    if (ctx->pc->hostgroup_filter_limit <= 0) {
+        return false;
+    }
+
+    hostgroups = ph_entry_get_attr(host, PH_MAP_HOST_MEMBEROF);
+    return hostgroups != NULL
+           && hostgroups->nvals > (size_t) ctx->pc->hostgroup_filter_limit;
+}
+
+/* The host and its hostgroups, a rule applies to the host if one of its
+ * memberHost values names one of them. The DNs are compared by their
+ * class and RDN value, so that differences in case, spacing or escaping
+ * of equivalent DNs do not matter.
+ */
+struct ph_host_set_entry {
+    enum ph_dn_class dn_class;
+    const char *name;
+};
+
+struct ph_host_set {
+    struct ph_host_set_entry *slots;
+    /* Always a power of two */
+    size_t size;
+};
+
+static uint64_t
+host_set_hash(enum ph_dn_class dn_class, const char *name)
+{
+    uint64_t h = FNV64_OFFSET ^ dn_class;
+
+    for (; *name != '\0'; name++) {
+        h ^= (uint8_t) tolower((unsigned char) *name);
+        h *= FNV64_PRIME;
+    }
+
+    return h;
+}
+
+static struct ph_host_set_entry *
+host_set_slot(struct ph_host_set *set,
+              enum ph_dn_class dn_class,
+              const char *name)
+{
+    struct ph_host_set_entry *e;
+    size_t i;
+
+    for (i = host_set_hash(dn_class, name) & (set->size - 1); ;
+            i = (i + 1) & (set->size - 1)) {
+        e = &set->slots[i];
+        if (e->name == NULL) {
+            return e;
+        }
+
+        if (e->dn_class == dn_class && strcasecmp(e->name, name) == 0) {
+            return e;
+        }
+    }
+}
+
+static void
+host_set_add(struct ph_host_set *set,
+             enum ph_dn_class dn_class,
+             const char *name)
+{
+    struct ph_host_set_entry *e;
+
+    e = host_set_slot(set, dn_class, name);
+    e->dn_class = dn_class;
+    e->name = name;
+}
+
+static void
+host_set_free(struct ph_host_set *set)
+{
+    if (set == NULL) {
+        return;
+    }
+
+    free(set->slots);
+    free(set);
+}
+
+/* The set borrows the host name from host and the hostgroup names from
+ * memo, it must be freed before either of them
+ */
+static int
+host_set_new(struct ph_dn_memo *memo,
+             struct ph_entry *host,
+             struct ph_host_set **_set)
+{
+    struct ph_host_set *set;
+    struct ph_attr *hostname;
+    struct ph_attr *hostgroups;
+    enum ph_dn_class dn_class;
+    const char *name;
+    size_t nnames;
+    size_t i;
+    int ret;
+
+    hostname = ph_entry_get_attr(host, PH_MAP_HOST_FQDN);
+    if (hostname == NULL || hostname->nvals != 1) {
+        return EINVAL;
+    }
+    hostgroups = ph_entry_get_attr(host, PH_MAP_HOST_MEMBEROF);
+    nnames = 1 + (hostgroups ? hostgroups->nvals : 0);
+
+    set = calloc(1, sizeof(struct ph_host_set));
+    if (set == NULL) {
+        return ENOMEM;
+    }
+
+    /* Keep the load factor under one half */
+    set->size = 16;
+    while (set->size < nnames * 2) {
+        set->size *= 2;
+    }
+
+    set->slots = calloc(set->size, sizeof(struct ph_host_set_entry));
+    if (set->slots == NULL) {
+        host_set_free(set);
+        return ENOMEM;
+    }
+
+    host_set_add(set, PH_DN_HOST, hostname->vals[0]->bv_val);
+
+    for (i = 0; hostgroups != NULL && i < hostgroups->nvals; i++) {
+        ret = ph_dn_memo_classify(memo, hostgroups->vals[i],
+                                  &dn_class, &name);
+        if (ret == ENOMEM) {
+            host_set_free(set);
+            return ret;
+        } else if (ret != 0) {
+            /* Roles, netgroups and the like */
+            continue;
+        }
+
+        /* The memo keeps its own reference until it is freed */
+        ph_dn_name_unref(name);
+        if (dn_class == PH_DN_HOSTGROUP) {
+            host_set_add(set, dn_class, name);
+        }
+    }
+
+    *_set = set;
+    return 0;
+}
+
+static int
+rule_entry_applies_to_host(struct ph_entry *rule_entry,
+                           struct ph_dn_memo *memo,
+                           struct ph_host_set *set,
+                           bool *_applies)
+{
+    struct ph_attr *category;
+    struct ph_attr *members;
+    enum ph_dn_class dn_class;
+    const char *name;
+    bool applies = false;
+    size_t i;
+    int ret;
+
+    category = ph_entry_get_attr(rule_entry, PH_MAP_RULE_HOST_CAT);
+    for (i = 0; category != NULL && i < category->nvals; i++) {
+        if (strcasecmp(category->vals[i]->bv_val, PAM_HBAC_ALL_VALUE) == 0) {
+            *_applies = true;
+            return 0;
+        }
+    }
+
+    members = ph_entry_get_attr(rule_entry, PH_MAP_RULE_MEMBER_HOST);
+    for (i = 0; members != NULL && i < members->nvals && !applies; i++) {
+        ret = ph_dn_memo_classify(memo, members->vals[i], &dn_class, &name);
+        if (ret == ENOMEM) {
+            return ret;
+        } else if (ret != 0) {
+            continue;
+        }
+
+        applies = host_set_slot(set, dn_class, name)->name != NULL;
+        ph_dn_name_unref(name);
+    }
+
+    *_applies = applies;
+    return 0;
+}
+
+/* Converts the rule entries into rules one by one, as they are received.
+ * The rules are only kept as entries while they are converted.
+ */
+struct ph_rules_builder {
+    struct pam_hbac_ctx *ctx;
+    /* ctx->arena, NULL if the rules are allocated from the heap */
+    struct ph_arena *arena;
+    struct ph_dn_classifier *dc;
+    struct ph_dn_memo *memo;
+    /* NULL unless the hostgroups are matched locally */
+    struct ph_host_set *hosts;
+    struct timespec started;
+
+    struct hbac_rule **rules;
+    size_t num_rules;
+    size_t size;
+    size_t num_fetched;
+};
+
+static void
+rules_builder_free(struct ph_rules_builder *b)
+{
+    size_t i;
+
+    if (b->arena == NULL && b->rules != NULL) {
+        for (i = 0; i < b->num_rules; i++) {
+            free_hbac_rule(NULL, b->rules[i]);
+        }
+        free(rules_array_of(b->rules));
+    }
+    host_set_free(b->hosts);
+    ph_dn_memo_free(b->memo);
+    ph_dn_classifier_free(b->dc);
+}
+
+static int
+rules_builder_init(struct ph_rules_builder *b,
+                   struct pam_hbac_ctx *ctx,
+                   struct ph_entry *targethost)
+{
+    int ret;
+
+    memset(b, 0, sizeof(struct ph_rules_builder));
+    b->ctx = ctx;
+    b->arena = ctx->arena;
+    ph_scoreboard_clock(&b->started);
+
+    /* Parse the base DN once for all the member DNs */
+    ret = ph_dn_classifier_new(ctx->pc->search_base, &b->dc);
+    if (ret != 0) {
+        logger(ctx->pamh, LOG_ERR,
+               "Cannot parse the base DN [%d]: %s\n", ret, strerror(ret));
+        return ret;
+    }
+
+    /* The same groups and services are members of many rules, classify
+     * each DN only once
+     */
+    ret = ph_dn_memo_new(b->dc, &b->memo);
+    if (ret != 0) {
+        logger(ctx->pamh, LOG_CRIT, "Cannot allocate the DN table\n");
+        rules_builder_free(b);
+        return ret;
+    }
+
+    if (rules_match_host_locally(ctx, targethost)) {
+        ret = host_set_new(b->memo, targethost, &b->hosts);
+        if (ret != 0) {
+            logger(ctx->pamh, LOG_ERR,
+                   "Cannot match the rules against the host [%d]: %s\n",
+                   ret, strerror(ret));
+            rules_builder_free(b);
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/* Returns the rule array with room for size rules. An array in the arena
+ * cannot be resized, the old one is left to the arena.
+ */
+static struct hbac_rule **
+rules_builder_grow(struct ph_rules_builder *b, size_t size)
+{
+    struct ph_rules_array *array;
+    size_t array_size;
+
+    array_size = sizeof(struct ph_rules_array)
+                 + size * sizeof(struct hbac_rule *);
+
+    if (b->arena == NULL) {
+        array = realloc(b->rules ? rules_array_of(b->rules) : NULL,
+                        array_size);
+        if (array == NULL) {
+            return NULL;
+        }
+        array->arena = NULL;
+        return array->rules;
+    }
+
+    array = ph_arena_calloc(b->arena, 1, array_size);
+    if (array == NULL) {
+        return NULL;
+    }
+    array->arena = b->arena;
+    if (b->num_rules > 0) {
+        memcpy(array->rules, b->rules,
+               b->num_rules * sizeof(struct hbac_rule *));
+    }
+    return array->rules;
+}
+
+/* Takes ownership of rule_entry */
+static int
+rules_builder_add(struct ph_entry *rule_entry, void *pvt)
+{
+    struct ph_rules_builder *b = pvt;
+    struct hbac_rule **rules;
+    struct hbac_rule *rule;
+    bool applies;
+    size_t size;
+    int ret;
+
+    b->num_fetched++;
+    if (b->hosts != NULL) {
+        ret = rule_entry_applies_to_host(rule_entry, b->memo, b->hosts,
+                                         &applies);
+        if (ret != 0 || !applies) {
+            ph_entry_free(rule_entry);
+            return ret;
+        }
+    }
+
+    ret = entry_to_hbac_rule(b->ctx->pamh, b->arena, b->memo,
+                             rule_entry, &rule);
+    ph_entry_free(rule_entry);
+    if (ret == ENOMEM) {
+        return ret;
+    } else if (ret != 0) {
+        logger(b->ctx->pamh, LOG_WARNING,
+               "Skipping malformed rule %zu\n", b->num_fetched);
+        return 0;
+    }
+
+    /* Keep room for the terminating NULL */
+    if (b->num_rules + 1 >= b->size) {
+        size = b->size ? b->size * 2 : 16;
+        rules = rules_builder_grow(b, size);
+        if (rules == NULL) {
+            free_hbac_rule(b->arena, rule);
+            return ENOMEM;
+        }
+        b->rules = rules;
+        b->size = size;
+    }
+
+    b->rules[b->num_rules++] = rule;
+    return 0;
+}
+
+static int
+rules_builder_finish(struct ph_rules_builder *b, struct hbac_rule ***_rules)
+{
+    struct hbac_rule **rules;
+
+    if (b->rules == NULL) {
+        b->rules = rules_builder_grow(b, 1);
+        if (b->rules == NULL) {
+            rules_builder_free(b);
+            return ENOMEM;
+        }
+    }
+    b->rules[b->num_rules] = NULL;
+
+    logger(b->ctx->pamh, LOG_DEBUG,
+           "Matched the hostgroups %s: %zu of %zu rules apply to the "
+           "host, took %ld ms\n",
+           b->hosts ? "locally" : "in the search filter",
+           b->num_rules, b->num_fetched,
+           ph_scoreboard_elapsed(&b->started));
+
+    rules = b->rules;
+    b->rules = NULL;
+    b->num_rules = 0;
+    rules_builder_free(b);
+
+    *_rules = rules;
+    return 0;
+}
+
 int
 ph_get_hbac_rules(struct pam_hbac_ctx *ctx,
                   struct ph_entry *targethost,
+                  struct ph_rules_scope *scope,
                   struct hbac_rule ***_rules)
 {
     char *rule_filter;
     int ret;
-    struct hbac_rule **rules;
     struct ph_entry **rule_entries;
-    size_t num_rule_entries;
+    struct ph_rules_builder b;
     size_t i;
-    size_t num_rules;
 
     if (ctx == NULL || targethost == NULL || _rules == NULL) {
         return EINVAL;
     }
 
-    rule_filter = create_rules_filter(ctx->pamh, ctx->pc->search_base, targethost);
+    ret = rules_builder_init(&b, ctx, targethost);
+    if (ret != 0) {
+        return ret;
+    }
+
+    rule_filter = create_rules_filter(ctx->pamh, ctx->pc->search_base,
+                                      targethost,
+                                      !rules_match_host_locally(ctx,
+                                                                targethost),
+                                      scope);
     if (rule_filter == NULL) {
         logger(ctx->pamh, LOG_CRIT, "Cannot create filter\n");
+        rules_builder_free(&b);
         return ENOMEM;
     }
 
@@ -506,30 +1214,92 @@ ph_get_hbac_rules(struct pam_hbac_ctx *ctx,
     if (ret != 0) {
         logger(ctx->pamh, LOG_ERR,
                "Search failed [%d]: %s\n", ret, strerror(ret));
+        rules_builder_free(&b);
         return ret;
     }
 
-    num_rule_entries = ph_num_entries(rule_entries);
-    rules = calloc(num_rule_entries + 1, sizeof(struct hbac_rule *));
-    if (rules == NULL) {
-        ph_entry_array_free(rule_entries);
-        logger(ctx->pamh, LOG_CRIT, "Cannot allocate entries\n");
+    /* The builder takes ownership of the entries one by one */
+    for (i = 0; rule_entries[i] != NULL; i++) {
+        if (ret == 0) {
+            ret = rules_builder_add(rule_entries[i], &b);
+        } else {
+            ph_entry_free(rule_entries[i]);
+        }
+    }
+    ph_entry_array_shallow_free(rule_entries);
+    if (ret != 0) {
+        rules_builder_free(&b);
+        return ret;
+    }
+
+    return rules_builder_finish(&b, _rules);
+}
+
+int
+ph_get_hbac_rules_send(struct pam_hbac_ctx *ctx,
+                       struct ph_entry *targethost,
+                       struct ph_rules_scope *scope,
+                       int *_msgid)
+{
+    char *rule_filter;
+    int ret;
+
+    if (ctx == NULL || targethost == NULL || _msgid == NULL) {
+        return EINVAL;
+    }
+
+    rule_filter = create_rules_filter(ctx->pamh, ctx->pc->search_base,
+                                      targethost,
+                                      !rules_match_host_locally(ctx,
+                                                                targethost),
+                                      scope);
+    if (rule_filter == NULL) {
+        logger(ctx->pamh, LOG_CRIT, "Cannot create filter\n");
         return ENOMEM;
     }
 
-    num_rules = 0;
-    for (i = 0; i < num_rule_entries; i++) {
-        ret = entry_to_hbac_rule(ctx->pamh, ctx->pc->search_base, rule_entries[i],
-                                 &rules[num_rules]);
-        if (ret != 0) {
-            logger(ctx->pamh, LOG_WARNING,
-                   "Skipping malformed rule %d/%d\n", i+1, num_rule_entries);
-            continue;
-        }
-        num_rules++;
+    ret = ph_search_send(ctx->pamh, ctx->ld, ctx->pc, &rule_search_obj,
+                         rule_filter, _msgid);
+    free(rule_filter);
+    return ret;
+}
+
+int
+ph_get_hbac_rules_recv(struct pam_hbac_ctx *ctx,
+                       struct ph_entry *targethost,
+                       int msgid,
+                       struct hbac_rule ***_rules)
+{
+    int ret;
+    struct ph_rules_builder b;
+    struct timeval buf;
+    struct timeval *left;
+
+    if (ctx == NULL || targethost == NULL || _rules == NULL) {
+        return EINVAL;
     }
 
-    ph_entry_array_free(rule_entries);
-    *_rules = rules;
-    return 0;
+    ret = ph_deadline_left(ctx, "searching for HBAC rules", &buf, &left);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret = rules_builder_init(&b, ctx, targethost);
+    if (ret != 0) {
+        return ret;
+    }
+
+    /* Each rule is converted as soon as its entry arrives, so neither the
+     * whole result nor all the entries are ever held at once
+     */
+    ret = ph_search_recv_each(ctx->pamh, ctx->ld, &rule_search_obj,
+                              msgid, left, rules_builder_add, &b);
+    if (ret != 0) {
+        logger(ctx->pamh, LOG_ERR,
+               "Search failed [%d]: %s\n", ret, strerror(ret));
+        rules_builder_free(&b);
+        return ret;
+    }
+
+    return rules_builder_finish(&b, _rules);
 }
@@ -0,0 +1,352 @@
+/*
+    Copyright (C) 2026 Jakub Hrozek <jakub.hrozek@posteo.se>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "pam_hbac.h"
+#include "pam_hbac_scoreboard.h"
+
+#define PH_SB_MAGIC             0x5048534552564552ULL   /* "PHSERVER" */
+#define PH_SB_VERSION           1
+#define PH_SB_SLOTS             32
+
+/* A server that failed is skipped for PH_SB_BACKOFF seconds, doubled with
+ * every further consecutive failure up to PH_SB_BACKOFF_MAX
+ */
+#define PH_SB_BACKOFF           5
+#define PH_SB_BACKOFF_MAX       300
+
+#define FNV64_OFFSET            0xcbf29ce484222325ULL
+#define FNV64_PRIME             0x100000001b3ULL
+
+struct ph_sb_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t num_slots;
+};
+
+struct ph_sb_slot {
+    /* Hash of the URI, 0 marks an empty slot */
+    uint64_t key;
+    int64_t updated;
+    int64_t failed;
+    /* Consecutive failures */
+    uint32_t failures;
+    uint32_t reserved;
+    /* Moving average in microseconds, 0 if there was no sample yet */
+    int64_t latency[PH_SERVER_OP_END];
+};
+
+struct ph_sb_file {
+    struct ph_sb_header hdr;
+    struct ph_sb_slot slots[PH_SB_SLOTS];
+};
+
+struct ph_sb_rank {
+    const char *uri;
+    bool failing;
+    int64_t cost;
+    size_t idx;
+};
+
+void
+ph_scoreboard_clock(struct timespec *ts)
+{
+    if (clock_gettime(CLOCK_MONOTONIC, ts) != 0) {
+        ts->tv_sec = time(NULL);
+        ts->tv_nsec = 0;
+    }
+}
+
+long
+ph_scoreboard_elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    ph_scoreboard_clock(&now);
+    return (now.tv_sec - start->tv_sec) * 1000000L
+           + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static const char *
+sb_path(struct pam_hbac_config *pc)
+{
+    return pc->scoreboard_path ? pc->scoreboard_path
+                               : PAM_HBAC_SERVER_SCOREBOARD;
+}
+
+static uint64_t
+sb_key(const char *uri)
+{
+    uint64_t h = FNV64_OFFSET;
+    const char *p;
+
+    for (p = uri; *p != '\0'; p++) {
+        h ^= (uint8_t) *p;
+        h *= FNV64_PRIME;
+    }
+
+    /* 0 is reserved for empty slots */
+    return h ? h : 1;
+}
+
+/* Opens and locks the scoreboard and reads its contents. A file that has
+ * an unexpected size or format is reported as empty, writers reinitialize
+ * it. A scoreboard that stays locked is skipped rather than waited for.
+ * Returns the locked descriptor or -1.
+ */
+static int
+sb_open(struct pam_hbac_ctx *ctx, bool write, struct ph_sb_file *sb)
+{
+    const char *path = sb_path(ctx->pc);
+    int fd;
+    int ret;
+
+    ret = ph_state_open(ctx->pamh, "server scoreboard", path,
+                        write ? O_RDWR | O_CREAT : O_RDONLY,
+                        write ? F_WRLCK : F_RDLCK,
+                        &ctx->deadline, &fd);
+    if (ret != 0) {
+        return -1;
+    }
+
+    ret = ph_state_read(fd, sb, sizeof(struct ph_sb_file),
+                        PH_SB_MAGIC, PH_SB_VERSION);
+    if (ret != 0 || sb->hdr.num_slots != PH_SB_SLOTS) {
+        if (ret != ENOENT) {
+            logger(ctx->pamh, LOG_NOTICE,
+                   "Server scoreboard %s has an unknown format\n", path);
+        }
+        memset(sb, 0, sizeof(struct ph_sb_file));
+        sb->hdr.magic = PH_SB_MAGIC;
+        sb->hdr.version = PH_SB_VERSION;
+        sb->hdr.num_slots = PH_SB_SLOTS;
+    }
+
+    return fd;
+}
+
+static struct ph_sb_slot *
+sb_find(struct ph_sb_file *sb, uint64_t key)
+{
+    size_t i;
+
+    for (i = 0; i < PH_SB_SLOTS; i++) {
+        if (sb->slots[i].key == key) {
+            return &sb->slots[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Returns the slot of key, reusing the least recently updated one if
+ * the scoreboard is full
+ */
+static struct ph_sb_slot *
+sb_get(struct ph_sb_file *sb, uint64_t key)
+{
+    struct ph_sb_slot *slot;
+    size_t oldest = 0;
+    size_t i;
+
+    slot = sb_find(sb, key);
+    if (slot != NULL) {
+        return slot;
+    }
+
+    for (i = 0; i < PH_SB_SLOTS; i++) {
+        if (sb->slots[i].key == 0) {
+            oldest = i;
+            break;
+        }
+
+        if (sb->slots[i].updated < sb->slots[oldest].updated) {
+            oldest = i;
+        }
+    }
+
+    slot = &sb->slots[oldest];
+    memset(slot, 0, sizeof(struct ph_sb_slot));
+    slot->key = key;
+    return slot;
+}
+
+static bool
+sb_failing(const struct ph_sb_slot *slot, time_t now)
+{
+    int64_t backoff;
+    uint32_t shift;
+
+    if (slot->failures == 0) {
+        return false;
+    }
+
+    shift = slot->failures - 1;
+    backoff = shift < 7 ? (int64_t) PH_SB_BACKOFF << shift : PH_SB_BACKOFF_MAX;
+    if (backoff > PH_SB_BACKOFF_MAX) {
+        backoff = PH_SB_BACKOFF_MAX;
+    }
+
+    return now - slot->failed < backoff;
+}
+
+static int
+sb_rank_cmp(const void *a, const void *b)
+{
+    const struct ph_sb_rank *ra = a;
+    const struct ph_sb_rank *rb = b;
+
+    if (ra->failing != rb->failing) {
+        return ra->failing ? 1 : -1;
+    }
+
+    if (ra->cost != rb->cost) {
+        return ra->cost < rb->cost ? -1 : 1;
+    }
+
+    /* Keep the configured order otherwise */
+    return ra->idx < rb->idx ? -1 : (ra->idx > rb->idx);
+}
+
+void
+ph_scoreboard_rank(struct pam_hbac_ctx *ctx,
+                   const char **uris,
+                   size_t num_uris)
+{
+    struct ph_sb_file sb;
+    struct ph_sb_rank *rank;
+    struct ph_sb_slot *slot;
+    time_t now;
+    size_t i;
+    int op;
+    int fd;
+
+    if (ctx == NULL || ctx->pc == NULL || uris == NULL || num_uris < 2) {
+        return;
+    }
+
+    rank = calloc(num_uris, sizeof(struct ph_sb_rank));
+    if (rank == NULL) {
+        return;
+    }
+
+    fd = sb_open(ctx, false, &sb);
+    if (fd == -1) {
+        free(rank);
+        return;
+    }
+    close(fd);
+
+    now = time(NULL);
+    for (i = 0; i < num_uris; i++) {
+        rank[i].uri = uris[i];
+        rank[i].idx = i;
+
+        slot = sb_find(&sb, sb_key(uris[i]));
+        if (slot == NULL) {
+            continue;
+        }
+
+        rank[i].failing = sb_failing(slot, now);
+        for (op = 0; op < PH_SERVER_OP_END; op++) {
+            rank[i].cost += slot->latency[op];
+        }
+    }
+
+    qsort(rank, num_uris, sizeof(struct ph_sb_rank), sb_rank_cmp);
+
+    for (i = 0; i < num_uris; i++) {
+        uris[i] = rank[i].uri;
+        logger(ctx->pamh, LOG_DEBUG,
+               "Server %zu: %s, expected latency %lld us%s\n",
+               i, rank[i].uri, (long long) rank[i].cost,
+               rank[i].failing ? ", failing" : "");
+    }
+
+    free(rank);
+}
+
+void
+ph_scoreboard_report(struct pam_hbac_ctx *ctx,
+                     const char *uri,
+                     enum ph_server_op op,
+                     long usec,
+                     bool ok)
+{
+    struct ph_sb_file sb;
+    struct ph_sb_slot *slot;
+    int64_t *latency;
+    ssize_t n;
+    int fd;
+
+    /* With a single server there is nothing to choose from */
+    if (ctx == NULL || ctx->pc == NULL || uri == NULL
+            || ctx->pc->num_uris < 2 || op >= PH_SERVER_OP_END) {
+        return;
+    }
+
+    fd = sb_open(ctx, true, &sb);
+    if (fd == -1) {
+        return;
+    }
+
+    slot = sb_get(&sb, sb_key(uri));
+    slot->updated = time(NULL);
+    if (ok) {
+        slot->failures = 0;
+
+        latency = &slot->latency[op];
+        if (usec < 1) {
+            usec = 1;
+        }
+
+        if (*latency == 0) {
+            *latency = usec;
+        } else {
+            /* Recent samples weigh the most */
+            *latency += (usec - *latency) / 4;
+            if (*latency == 0) {
+                *latency = 1;
+            }
+        }
+    } else {
+        slot->failures++;
+        slot->failed = slot->updated;
+        logger(ctx->pamh, LOG_DEBUG,
+               "Server %s failed %u times in a row\n", uri, slot->failures);
+    }
+
+    n = pwrite(fd, &sb, sizeof(sb), 0);
+    if (n != sizeof(sb)) {
+        logger(ctx->pamh, LOG_NOTICE,
+               "Cannot update server scoreboard %s\n", sb_path(ctx->pc));
+    }
+    close(fd);
+}
@@ -0,0 +1,58 @@
+/*
+    Copyright (C) 2026 Jakub Hrozek <jakub.hrozek@posteo.se>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __PAM_HBAC_SCOREBOARD_H__
+#define __PAM_HBAC_SCOREBOARD_H__
+
+#include <time.h>
+
+#include "pam_hbac.h"
+
+/* The scoreboard keeps recent latencies and failures of each LDAP server
+ * in a small file shared by all processes that load pam_hbac, so that
+ * a login can start with the server that answered fastest for the
+ * previous ones. The file only holds hints, a missing, unusable or
+ * locked scoreboard keeps the configured order of the servers.
+ */
+enum ph_server_op {
+    PH_SERVER_CONNECT,
+    PH_SERVER_BIND,
+    PH_SERVER_SEARCH,
+
+    PH_SERVER_OP_END
+};
+
+/* Sorts uris by the expected latency, best first. Servers that failed
+ * recently are moved to the end, servers without any record are tried
+ * before the known ones so that they get measured.
+ */
+void ph_scoreboard_rank(struct pam_hbac_ctx *ctx,
+                        const char **uris,
+                        size_t num_uris);
+
+/* Records the latency of a successful operation or a failure */
+void ph_scoreboard_report(struct pam_hbac_ctx *ctx,
+                          const char *uri,
+                          enum ph_server_op op,
+                          long usec,
+                          bool ok);
+
+/* Monotonic time helpers for measuring the latencies */
+void ph_scoreboard_clock(struct timespec *ts);
+long ph_scoreboard_elapsed(const struct timespec *start);
+
+#endif /* __PAM_HBAC_SCOREBOARD_H__ */
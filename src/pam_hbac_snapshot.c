@@ -0,0 +1,928 @@
+/*
+    Copyright (C) 2026 Jakub Hrozek <jakub.hrozek@posteo.se>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "pam_hbac.h"
+#include "pam_hbac_obj_int.h"
+#include "pam_hbac_snapshot.h"
+
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
+
+#ifndef MAP_FAILED
+#define MAP_FAILED ((void *) -1)
+#endif
+
+#define PH_SNAP_MAGIC           "PHSNAP\0\0"
+#define PH_SNAP_MAGIC_LEN       8
+#define PH_SNAP_VERSION         1
+#define PH_SNAP_BYTE_ORDER      0x01020304
+/* How far in the future a snapshot may be dated before we distrust it */
+#define PH_SNAP_CLOCK_SKEW      60
+
+/* On-disk layout. All offsets are relative to the start of the file except
+ * string references which are relative to the start of the string table.
+ * The file is only ever read on the host that wrote it, so native byte
+ * order and alignment are used.
+ */
+struct ph_snap_list {
+    uint32_t off;           /* array of 'count' string references */
+    uint32_t count;
+};
+
+struct ph_snap_element {
+    uint32_t category;
+    struct ph_snap_list names;
+    struct ph_snap_list groups;
+};
+
+struct ph_snap_rule {
+    uint32_t name;
+    uint32_t enabled;
+    struct ph_snap_element services;
+    struct ph_snap_element users;
+    struct ph_snap_element targethosts;
+    struct ph_snap_element srchosts;
+};
+
+struct ph_snap_req_element {
+    uint32_t name;
+    struct ph_snap_list groups;
+};
+
+struct ph_snap_header {
+    char magic[PH_SNAP_MAGIC_LEN];
+    uint32_t byte_order;
+    uint32_t version;
+    uint64_t size;
+    int64_t created;
+    uint32_t key;
+    uint32_t num_rules;
+    uint32_t rules_off;
+    uint32_t strtab_off;
+    uint32_t strtab_size;
+    struct ph_snap_req_element targethost;
+    struct ph_snap_req_element service;
+};
+
+struct ph_snapshot {
+    const uint8_t *base;
+    size_t size;
+
+    const struct ph_snap_header *hdr;
+    const struct ph_snap_rule *rules;
+    const char *strtab;
+
+    /* The rules and the request as libhbac structures. Only the pointer
+     * arrays are allocated, the strings are those of the mapping.
+     */
+    struct hbac_rule **hbac_rules;
+    struct hbac_rule *rule_views;
+    struct hbac_rule_element *element_views;
+    const char **string_views;
+
+    struct hbac_request_element targethost;
+    struct hbac_request_element service;
+    struct hbac_request_element user;
+    struct hbac_eval_req req;
+};
+
+/* Growable byte buffer used while serializing */
+struct snap_buf {
+    uint8_t *data;
+    size_t len;
+    size_t alloc;
+};
+
+static int
+snap_buf_append(struct snap_buf *b,
+                const void *data,
+                size_t len,
+                size_t align,
+                uint32_t *_off)
+{
+    size_t start;
+    size_t need;
+    size_t nalloc;
+    uint8_t *ndata;
+
+    start = (b->len + align - 1) & ~(align - 1);
+    need = start + len;
+    if (need < start || need > UINT32_MAX) {
+        return E2BIG;
+    }
+
+    if (need > b->alloc) {
+        nalloc = b->alloc ? b->alloc : 4096;
+        while (nalloc < need) {
+            nalloc *= 2;
+        }
+
+        ndata = realloc(b->data, nalloc);
+        if (ndata == NULL) {
+            return ENOMEM;
+        }
+        b->data = ndata;
+        b->alloc = nalloc;
+    }
+
+    memset(b->data + b->len, 0, start - b->len);
+    if (data != NULL) {
+        memcpy(b->data + start, data, len);
+    } else {
+        memset(b->data + start, 0, len);
+    }
+    b->len = need;
+
+    if (_off != NULL) {
+        *_off = (uint32_t) start;
+    }
+    return 0;
+}
+
+static int
+snap_add_string(struct snap_buf *strtab, const char *s, uint32_t *_ref)
+{
+    if (s == NULL) {
+        return EINVAL;
+    }
+
+    return snap_buf_append(strtab, s, strlen(s) + 1, 1, _ref);
+}
+
+static int
+snap_add_list(struct snap_buf *b,
+              struct snap_buf *strtab,
+              const char **strings,
+              struct ph_snap_list *list)
+{
+    size_t count;
+    size_t i;
+    uint32_t ref;
+    uint32_t off;
+    int ret;
+
+    count = null_cstring_array_size(strings);
+
+    ret = snap_buf_append(b, NULL, count * sizeof(uint32_t),
+                          sizeof(uint32_t), &off);
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < count; i++) {
+        ret = snap_add_string(strtab, strings[i], &ref);
+        if (ret != 0) {
+            return ret;
+        }
+        /* b->data may have moved, always index from the current base */
+        memcpy(b->data + off + i * sizeof(uint32_t), &ref, sizeof(uint32_t));
+    }
+
+    list->off = off;
+    list->count = (uint32_t) count;
+    return 0;
+}
+
+static int
+snap_add_element(struct snap_buf *b,
+                 struct snap_buf *strtab,
+                 struct hbac_rule_element *el,
+                 struct ph_snap_element *sel)
+{
+    int ret;
+
+    if (el == NULL) {
+        return EINVAL;
+    }
+
+    sel->category = el->category;
+
+    ret = snap_add_list(b, strtab, el->names, &sel->names);
+    if (ret != 0) {
+        return ret;
+    }
+
+    return snap_add_list(b, strtab, el->groups, &sel->groups);
+}
+
+static int
+snap_add_req_element(struct snap_buf *b,
+                     struct snap_buf *strtab,
+                     struct hbac_request_element *el,
+                     struct ph_snap_req_element *sel)
+{
+    int ret;
+
+    if (el == NULL || el->name == NULL) {
+        return EINVAL;
+    }
+
+    ret = snap_add_string(strtab, el->name, &sel->name);
+    if (ret != 0) {
+        return ret;
+    }
+
+    return snap_add_list(b, strtab, el->groups, &sel->groups);
+}
+
+static int
+snap_add_rule(struct snap_buf *b,
+              struct snap_buf *strtab,
+              struct hbac_rule *rule,
+              uint32_t rule_off)
+{
+    struct ph_snap_rule srule;
+    int ret;
+
+    memset(&srule, 0, sizeof(srule));
+
+    ret = snap_add_string(strtab, rule->name, &srule.name);
+    if (ret != 0) {
+        return ret;
+    }
+    srule.enabled = rule->enabled ? 1 : 0;
+
+    ret = snap_add_element(b, strtab, rule->services, &srule.services);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret = snap_add_element(b, strtab, rule->users, &srule.users);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret = snap_add_element(b, strtab, rule->targethosts, &srule.targethosts);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret = snap_add_element(b, strtab, rule->srchosts, &srule.srchosts);
+    if (ret != 0) {
+        return ret;
+    }
+
+    memcpy(b->data + rule_off, &srule, sizeof(srule));
+    return 0;
+}
+
+/* The key ties a snapshot to the configuration and service it was
+ * created for
+ */
+static char *
+snap_key(struct pam_hbac_config *pc, const char *service)
+{
+    char *key;
+    int ret;
+
+    ret = asprintf(&key, "%s\n%s\n%s\n%s",
+                   pc->uri, pc->search_base, pc->hostname, service);
+    if (ret < 0) {
+        return NULL;
+    }
+
+    return key;
+}
+
+static uint64_t
+snap_hash(const char *s)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (; *s != '\0'; s++) {
+        h ^= (uint8_t) *s;
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+static char *
+snap_path(struct pam_hbac_config *pc, const char *service)
+{
+    char *path;
+    int ret;
+
+    /* The service name comes from the application, don't use it as
+     * a path component directly
+     */
+    ret = asprintf(&path, "%s/rules-%016llx.snap",
+                   pc->rules_cache_dir ? pc->rules_cache_dir
+                                       : PAM_HBAC_CACHE_DIR,
+                   (unsigned long long) snap_hash(service));
+    if (ret < 0) {
+        return NULL;
+    }
+
+    return path;
+}
+
+static int
+snap_serialize(struct pam_hbac_config *pc,
+               const char *service,
+               struct hbac_rule **rules,
+               struct hbac_eval_req *req,
+               struct snap_buf *b)
+{
+    struct snap_buf strtab = { NULL, 0, 0 };
+    struct ph_snap_header hdr;
+    size_t num_rules;
+    size_t i;
+    uint32_t rules_off;
+    char *key = NULL;
+    int ret;
+
+    memset(&hdr, 0, sizeof(hdr));
+
+    num_rules = 0;
+    if (rules != NULL) {
+        for (num_rules = 0; rules[num_rules] != NULL; num_rules++);
+    }
+
+    if (num_rules > UINT32_MAX / sizeof(struct ph_snap_rule)) {
+        return E2BIG;
+    }
+
+    /* Header first, filled in at the end */
+    ret = snap_buf_append(b, NULL, sizeof(hdr), 8, NULL);
+    if (ret != 0) {
+        goto done;
+    }
+
+    ret = snap_buf_append(b, NULL, num_rules * sizeof(struct ph_snap_rule),
+                          8, &rules_off);
+    if (ret != 0) {
+        goto done;
+    }
+
+    for (i = 0; i < num_rules; i++) {
+        ret = snap_add_rule(b, &strtab, rules[i],
+                            rules_off + i * sizeof(struct ph_snap_rule));
+        if (ret != 0) {
+            goto done;
+        }
+    }
+
+    ret = snap_add_req_element(b, &strtab, req->targethost, &hdr.targethost);
+    if (ret != 0) {
+        goto done;
+    }
+
+    ret = snap_add_req_element(b, &strtab, req->service, &hdr.service);
+    if (ret != 0) {
+        goto done;
+    }
+
+    key = snap_key(pc, service);
+    if (key == NULL) {
+        ret = ENOMEM;
+        goto done;
+    }
+
+    ret = snap_add_string(&strtab, key, &hdr.key);
+    if (ret != 0) {
+        goto done;
+    }
+
+    ret = snap_buf_append(b, strtab.data, strtab.len, 8, &hdr.strtab_off);
+    if (ret != 0) {
+        goto done;
+    }
+
+    memcpy(hdr.magic, PH_SNAP_MAGIC, PH_SNAP_MAGIC_LEN);
+    hdr.byte_order = PH_SNAP_BYTE_ORDER;
+    hdr.version = PH_SNAP_VERSION;
+    hdr.size = b->len;
+    hdr.created = (int64_t) time(NULL);
+    hdr.num_rules = (uint32_t) num_rules;
+    hdr.rules_off = rules_off;
+    hdr.strtab_size = (uint32_t) strtab.len;
+    memcpy(b->data, &hdr, sizeof(hdr));
+
+    ret = 0;
+done:
+    free(key);
+    free(strtab.data);
+    return ret;
+}
+
+static int
+write_all(int fd, const uint8_t *data, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int
+ph_snapshot_write(pam_handle_t *pamh,
+                  struct pam_hbac_config *pc,
+                  const char *service,
+                  struct hbac_rule **rules,
+                  struct hbac_eval_req *req)
+{
+    struct snap_buf b = { NULL, 0, 0 };
+    const char *dir;
+    char *path = NULL;
+    char *tmp_path = NULL;
+    int fd = -1;
+    int ret;
+
+    if (pc == NULL || service == NULL || req == NULL) {
+        return EINVAL;
+    }
+
+    if (pc->rules_cache_ttl <= 0) {
+        return 0;
+    }
+
+    ret = snap_serialize(pc, service, rules, req, &b);
+    if (ret != 0) {
+        logger(pamh, LOG_ERR,
+               "Cannot serialize rules snapshot [%d]: %s\n",
+               ret, strerror(ret));
+        goto done;
+    }
+
+    dir = pc->rules_cache_dir ? pc->rules_cache_dir : PAM_HBAC_CACHE_DIR;
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        ret = errno;
+        logger(pamh, LOG_NOTICE,
+               "Cannot create snapshot directory %s [%d]: %s\n",
+               dir, ret, strerror(ret));
+        goto done;
+    }
+
+    path = snap_path(pc, service);
+    if (path == NULL || asprintf(&tmp_path, "%s.XXXXXX", path) < 0) {
+        tmp_path = NULL;
+        ret = ENOMEM;
+        goto done;
+    }
+
+    /* Write a private temporary file and rename it over the old snapshot,
+     * so that readers always map either the old or the new file, never
+     * a partial one.
+     */
+    fd = mkstemp(tmp_path);
+    if (fd == -1) {
+        ret = errno;
+        logger(pamh, LOG_NOTICE,
+               "Cannot create temporary snapshot %s [%d]: %s\n",
+               tmp_path, ret, strerror(ret));
+        goto done;
+    }
+
+    ret = write_all(fd, b.data, b.len);
+    if (ret == 0 && fsync(fd) == -1) {
+        ret = errno;
+    }
+    if (close(fd) == -1 && ret == 0) {
+        ret = errno;
+    }
+    fd = -1;
+    if (ret != 0) {
+        logger(pamh, LOG_ERR,
+               "Cannot write snapshot %s [%d]: %s\n",
+               tmp_path, ret, strerror(ret));
+        goto done;
+    }
+
+    if (rename(tmp_path, path) == -1) {
+        ret = errno;
+        logger(pamh, LOG_ERR,
+               "Cannot rename snapshot to %s [%d]: %s\n",
+               path, ret, strerror(ret));
+        goto done;
+    }
+
+    logger(pamh, LOG_DEBUG,
+           "Wrote rules snapshot %s (%zu bytes)\n", path, b.len);
+    ret = 0;
+done:
+    if (fd != -1) {
+        close(fd);
+    }
+    if (ret != 0 && tmp_path != NULL) {
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    free(path);
+    free(b.data);
+    return ret;
+}
+
+static bool
+snap_ref_valid(const struct ph_snapshot *snap, uint32_t ref)
+{
+    return ref < snap->hdr->strtab_size;
+}
+
+static bool
+snap_list_valid(const struct ph_snapshot *snap,
+                const struct ph_snap_list *list)
+{
+    const uint32_t *refs;
+    uint32_t i;
+
+    if (list->off % sizeof(uint32_t) != 0 || list->off > snap->size) {
+        return false;
+    }
+
+    if (list->count > (snap->size - list->off) / sizeof(uint32_t)) {
+        return false;
+    }
+
+    refs = (const uint32_t *) (const void *) (snap->base + list->off);
+    for (i = 0; i < list->count; i++) {
+        if (!snap_ref_valid(snap, refs[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool
+snap_element_valid(const struct ph_snapshot *snap,
+                   const struct ph_snap_element *el)
+{
+    return snap_list_valid(snap, &el->names)
+            && snap_list_valid(snap, &el->groups);
+}
+
+/* Check every offset once when the file is mapped so that evaluation
+ * can follow them without further bounds checking
+ */
+static bool
+snap_valid(const struct ph_snapshot *snap)
+{
+    const struct ph_snap_header *hdr = snap->hdr;
+    const struct ph_snap_rule *rule;
+    uint32_t i;
+
+    if (hdr->strtab_size == 0
+            || hdr->strtab_off > snap->size
+            || hdr->strtab_size > snap->size - hdr->strtab_off
+            || snap->strtab[hdr->strtab_size - 1] != '\0') {
+        return false;
+    }
+
+    if (hdr->rules_off % 8 != 0
+            || hdr->rules_off > snap->size
+            || hdr->num_rules > (snap->size - hdr->rules_off)
+                                    / sizeof(struct ph_snap_rule)) {
+        return false;
+    }
+
+    if (!snap_ref_valid(snap, hdr->key)
+            || !snap_ref_valid(snap, hdr->targethost.name)
+            || !snap_list_valid(snap, &hdr->targethost.groups)
+            || !snap_ref_valid(snap, hdr->service.name)
+            || !snap_list_valid(snap, &hdr->service.groups)) {
+        return false;
+    }
+
+    for (i = 0; i < hdr->num_rules; i++) {
+        rule = &snap->rules[i];
+
+        if (!snap_ref_valid(snap, rule->name)
+                || !snap_element_valid(snap, &rule->services)
+                || !snap_element_valid(snap, &rule->users)
+                || !snap_element_valid(snap, &rule->targethosts)
+                || !snap_element_valid(snap, &rule->srchosts)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static const char *
+snap_list_str(const struct ph_snapshot *snap,
+              const struct ph_snap_list *list,
+              uint32_t idx)
+{
+    const uint32_t *refs;
+
+    refs = (const uint32_t *) (const void *) (snap->base + list->off);
+    return snap->strtab + refs[idx];
+}
+
+/* Fills the next list->count + 1 entries of the string views */
+static const char **
+snap_list_view(const struct ph_snapshot *snap,
+               const struct ph_snap_list *list,
+               size_t *_next)
+{
+    const char **strings = snap->string_views + *_next;
+    uint32_t i;
+
+    for (i = 0; i < list->count; i++) {
+        strings[i] = snap_list_str(snap, list, i);
+    }
+    strings[list->count] = NULL;
+
+    *_next += list->count + 1;
+    return strings;
+}
+
+static struct hbac_rule_element *
+snap_element_view(const struct ph_snapshot *snap,
+                  const struct ph_snap_element *el,
+                  struct hbac_rule_element *view,
+                  size_t *_next)
+{
+    view->category = el->category;
+    view->names = snap_list_view(snap, &el->names, _next);
+    view->groups = snap_list_view(snap, &el->groups, _next);
+    return view;
+}
+
+static size_t
+snap_element_strings(const struct ph_snap_element *el)
+{
+    return el->names.count + 1 + el->groups.count + 1;
+}
+
+/* Builds libhbac rules and request elements over the mapped snapshot so
+ * that it is evaluated exactly like rules read from LDAP
+ */
+static int
+snap_views(struct ph_snapshot *snap)
+{
+    const struct ph_snap_rule *rule;
+    struct hbac_rule *view;
+    struct hbac_rule_element *els;
+    size_t num_strings;
+    size_t next = 0;
+    uint32_t i;
+
+    num_strings = snap->hdr->targethost.groups.count + 1
+                  + snap->hdr->service.groups.count + 1;
+    for (i = 0; i < snap->hdr->num_rules; i++) {
+        rule = &snap->rules[i];
+        num_strings += snap_element_strings(&rule->services)
+                       + snap_element_strings(&rule->users)
+                       + snap_element_strings(&rule->targethosts)
+                       + snap_element_strings(&rule->srchosts);
+    }
+
+    snap->hbac_rules = calloc(snap->hdr->num_rules + 1,
+                              sizeof(struct hbac_rule *));
+    snap->rule_views = calloc(snap->hdr->num_rules + 1,
+                              sizeof(struct hbac_rule));
+    snap->element_views = calloc(snap->hdr->num_rules * 4 + 1,
+                                 sizeof(struct hbac_rule_element));
+    snap->string_views = calloc(num_strings, sizeof(const char *));
+    if (snap->hbac_rules == NULL || snap->rule_views == NULL
+            || snap->element_views == NULL || snap->string_views == NULL) {
+        return ENOMEM;
+    }
+
+    for (i = 0; i < snap->hdr->num_rules; i++) {
+        rule = &snap->rules[i];
+        view = &snap->rule_views[i];
+        els = &snap->element_views[i * 4];
+
+        view->name = snap->strtab + rule->name;
+        view->enabled = rule->enabled ? true : false;
+        view->services = snap_element_view(snap, &rule->services,
+                                           &els[0], &next);
+        view->users = snap_element_view(snap, &rule->users,
+                                        &els[1], &next);
+        view->targethosts = snap_element_view(snap, &rule->targethosts,
+                                              &els[2], &next);
+        view->srchosts = snap_element_view(snap, &rule->srchosts,
+                                           &els[3], &next);
+        snap->hbac_rules[i] = view;
+    }
+
+    snap->targethost.name = snap->strtab + snap->hdr->targethost.name;
+    snap->targethost.groups = snap_list_view(snap,
+                                             &snap->hdr->targethost.groups,
+                                             &next);
+    snap->service.name = snap->strtab + snap->hdr->service.name;
+    snap->service.groups = snap_list_view(snap,
+                                          &snap->hdr->service.groups,
+                                          &next);
+    return 0;
+}
+
+static void
+snap_free_views(struct ph_snapshot *snap)
+{
+    if (snap == NULL) {
+        return;
+    }
+
+    free(snap->hbac_rules);
+    free(snap->rule_views);
+    free(snap->element_views);
+    free(snap->string_views);
+}
+
+struct ph_snapshot *
+ph_snapshot_open(pam_handle_t *pamh,
+                 struct pam_hbac_config *pc,
+                 const char *service)
+{
+    struct ph_snapshot *snap = NULL;
+    struct stat st;
+    char *path = NULL;
+    char *key = NULL;
+    void *map = MAP_FAILED;
+    time_t now;
+    int fd = -1;
+
+    if (pc == NULL || service == NULL || pc->rules_cache_ttl <= 0) {
+        return NULL;
+    }
+
+    path = snap_path(pc, service);
+    key = snap_key(pc, service);
+    if (path == NULL || key == NULL) {
+        goto fail;
+    }
+
+    fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd == -1) {
+        logger(pamh, LOG_DEBUG,
+               "No usable snapshot %s [%d]: %s\n",
+               path, errno, strerror(errno));
+        goto fail;
+    }
+
+    if (fstat(fd, &st) == -1 || !ph_file_trusted(pamh, path, &st)) {
+        goto fail;
+    }
+
+    if ((size_t) st.st_size < sizeof(struct ph_snap_header)
+            || (uint64_t) st.st_size > UINT32_MAX) {
+        logger(pamh, LOG_NOTICE, "Snapshot %s has a bad size\n", path);
+        goto fail;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        logger(pamh, LOG_ERR,
+               "Cannot map snapshot %s [%d]: %s\n",
+               path, errno, strerror(errno));
+        goto fail;
+    }
+
+    snap = calloc(1, sizeof(struct ph_snapshot));
+    if (snap == NULL) {
+        goto fail;
+    }
+    snap->base = map;
+    snap->size = st.st_size;
+    snap->hdr = map;
+
+    if (memcmp(snap->hdr->magic, PH_SNAP_MAGIC, PH_SNAP_MAGIC_LEN) != 0
+            || snap->hdr->byte_order != PH_SNAP_BYTE_ORDER
+            || snap->hdr->version != PH_SNAP_VERSION
+            || snap->hdr->size != snap->size) {
+        logger(pamh, LOG_NOTICE,
+               "Snapshot %s has an unknown format, ignoring\n", path);
+        goto fail;
+    }
+
+    now = time(NULL);
+    if (snap->hdr->created > (int64_t) now + PH_SNAP_CLOCK_SKEW
+            || (int64_t) now - snap->hdr->created >= pc->rules_cache_ttl) {
+        logger(pamh, LOG_DEBUG, "Snapshot %s has expired\n", path);
+        goto fail;
+    }
+
+    snap->rules = (const struct ph_snap_rule *) (const void *)
+                        (snap->base + snap->hdr->rules_off);
+    snap->strtab = (const char *) snap->base + snap->hdr->strtab_off;
+
+    if (!snap_valid(snap)) {
+        logger(pamh, LOG_ERR, "Snapshot %s is corrupt, ignoring\n", path);
+        goto fail;
+    }
+
+    if (strcmp(snap->strtab + snap->hdr->key, key) != 0) {
+        logger(pamh, LOG_NOTICE,
+               "Snapshot %s was created with a different configuration\n",
+               path);
+        goto fail;
+    }
+
+    if (snap_views(snap) != 0) {
+        logger(pamh, LOG_ERR, "Cannot map the rules of snapshot %s\n", path);
+        goto fail;
+    }
+
+    logger(pamh, LOG_DEBUG,
+           "Using rules snapshot %s with %u rules\n",
+           path, snap->hdr->num_rules);
+    close(fd);
+    free(path);
+    free(key);
+    return snap;
+
+fail:
+    if (map != MAP_FAILED) {
+        munmap(map, st.st_size);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    snap_free_views(snap);
+    free(snap);
+    free(path);
+    free(key);
+    return NULL;
+}
+
+void
+ph_snapshot_close(struct ph_snapshot *snap)
+{
+    if (snap == NULL) {
+        return;
+    }
+
+    munmap(discard_const(snap->base), snap->size);
+    snap_free_views(snap);
+    free(snap);
+}
+
+struct hbac_rule **
+ph_snapshot_rules(struct ph_snapshot *snap)
+{
+    if (snap == NULL) {
+        return NULL;
+    }
+
+    return snap->hbac_rules;
+}
+
+struct hbac_eval_req *
+ph_snapshot_eval_req(struct ph_snapshot *snap, struct ph_user *user)
+{
+    static const char *no_groups[] = { NULL };
+
+    if (snap == NULL || user == NULL) {
+        return NULL;
+    }
+
+    /* The groups are not resolved if no rule references them */
+    snap->user.name = user->name;
+    snap->user.groups = user->group_names != NULL ?
+                            discard_const(user->group_names) : no_groups;
+
+    snap->req.user = &snap->user;
+    snap->req.service = &snap->service;
+    snap->req.targethost = &snap->targethost;
+    /* pam_hbac never sends a source host */
+    snap->req.srchost = NULL;
+    snap->req.request_time = time(NULL);
+    return &snap->req;
+}
+
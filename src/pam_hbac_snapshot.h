@@ -0,0 +1,57 @@
+/*
+    Copyright (C) 2026 Jakub Hrozek <jakub.hrozek@posteo.se>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __PAM_HBAC_SNAPSHOT_H__
+#define __PAM_HBAC_SNAPSHOT_H__
+
+#include "pam_hbac.h"
+
+/* A snapshot is a binary copy of the converted HBAC rules that apply to
+ * this host, together with the host and service request elements. It is
+ * written atomically into the cache directory after a successful LDAP
+ * fetch and mapped read-only by subsequent logins. All references inside
+ * the file are offsets, the rules are handed to libhbac as views of the
+ * mapping.
+ */
+struct ph_snapshot;
+struct ph_user;
+
+struct ph_snapshot *ph_snapshot_open(pam_handle_t *pamh,
+                                     struct pam_hbac_config *pc,
+                                     const char *service);
+void ph_snapshot_close(struct ph_snapshot *snap);
+
+int ph_snapshot_write(pam_handle_t *pamh,
+                      struct pam_hbac_config *pc,
+                      const char *service,
+                      struct hbac_rule **rules,
+                      struct hbac_eval_req *req);
+
+/* Returns the rules of the snapshot as a NULL-terminated array for the
+ * libhbac evaluator. The rules point into the snapshot and are valid
+ * until it is closed.
+ */
+struct hbac_rule **ph_snapshot_rules(struct ph_snapshot *snap);
+
+/* Returns a request for the user and the host and service stored in the
+ * snapshot. The request is owned by the snapshot and borrows the user's
+ * group names, resolve them before calling this function.
+ */
+struct hbac_eval_req *ph_snapshot_eval_req(struct ph_snapshot *snap,
+                                           struct ph_user *user);
+
+#endif /* __PAM_HBAC_SNAPSHOT_H__ */
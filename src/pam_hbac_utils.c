@@ -18,7 +18,12 @@
 #include "config.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include <syslog.h>
 
@@ -88,6 +93,198 @@ null_cstring_array_size(const char *arr[])
     return nelem;
 }
 
+int
+ph_mkdir_parent(const char *path)
+{
+    char *dir;
+    char *slash;
+    int ret = 0;
+
+    dir = strdup(path);
+    if (dir == NULL) {
+        return ENOMEM;
+    }
+
+    slash = strrchr(dir, '/');
+    if (slash != NULL && slash != dir) {
+        *slash = '\0';
+        if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+            ret = errno;
+        }
+    }
+
+    free(dir);
+    return ret;
+}
+
+/* Processes only hold the lock of a state file while they read or write a
+ * few hundred bytes, a lock that stays taken for longer belongs to a stuck
+ * process that must not stall the logins
+ */
+#define PH_LOCK_WAIT_MS         100
+#define PH_LOCK_RETRY_MS        2
+
+int
+ph_lock_file(int fd, short type, const struct timespec *deadline)
+{
+    struct flock fl;
+    struct timespec now;
+    struct timespec retry;
+    long long waited_ms = 0;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+
+    retry.tv_sec = 0;
+    retry.tv_nsec = PH_LOCK_RETRY_MS * 1000000L;
+
+    while (fcntl(fd, F_SETLK, &fl) == -1) {
+        if (errno == EINTR) {
+            continue;
+        } else if (errno != EAGAIN && errno != EACCES) {
+            return errno;
+        }
+
+        if (waited_ms >= PH_LOCK_WAIT_MS) {
+            return EWOULDBLOCK;
+        }
+
+        if (deadline != NULL
+                && (deadline->tv_sec != 0 || deadline->tv_nsec != 0)
+                && clock_gettime(CLOCK_MONOTONIC, &now) == 0
+                && (now.tv_sec > deadline->tv_sec
+                    || (now.tv_sec == deadline->tv_sec
+                        && now.tv_nsec >= deadline->tv_nsec))) {
+            return EWOULDBLOCK;
+        }
+
+        nanosleep(&retry, NULL);
+        waited_ms += PH_LOCK_RETRY_MS;
+    }
+
+    return 0;
+}
+
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
+
+int
+ph_state_open(pam_handle_t *pamh,
+              const char *what,
+              const char *path,
+              int flags,
+              short lock_type,
+              const struct timespec *deadline,
+              int *_fd)
+{
+    struct stat st;
+    int fd;
+    int ret;
+
+    flags |= O_NOFOLLOW;
+    fd = open(path, flags, 0600);
+    if (fd == -1 && errno == ENOENT && (flags & O_CREAT)) {
+        ret = ph_mkdir_parent(path);
+        if (ret == 0) {
+            fd = open(path, flags, 0600);
+        }
+    }
+
+    if (fd == -1) {
+        ret = errno;
+        if (ret != ENOENT || (flags & O_CREAT)) {
+            logger(pamh, LOG_DEBUG,
+                   "Cannot open %s %s [%d]: %s\n",
+                   what, path, ret, strerror(ret));
+        }
+        return ret;
+    }
+
+    /* Don't let an untrusted file block us */
+    if (fstat(fd, &st) == -1) {
+        ret = errno;
+        close(fd);
+        return ret;
+    }
+
+    if (!ph_file_trusted(pamh, path, &st)) {
+        close(fd);
+        return EPERM;
+    }
+
+    if (lock_type != F_UNLCK) {
+        ret = ph_lock_file(fd, lock_type, deadline);
+        if (ret != 0) {
+            logger(pamh, LOG_NOTICE,
+                   "Cannot lock %s %s [%d]: %s\n",
+                   what, path, ret, strerror(ret));
+            close(fd);
+            return ret;
+        }
+    }
+
+    *_fd = fd;
+    return 0;
+}
+
+int
+ph_state_read(int fd,
+              void *state,
+              size_t size,
+              uint64_t magic,
+              uint32_t version)
+{
+    uint64_t file_magic;
+    uint32_t file_version;
+    ssize_t n;
+
+    if (size < sizeof(uint64_t) + sizeof(uint32_t)) {
+        return EINVAL;
+    }
+
+    n = pread(fd, state, size, 0);
+    if (n == 0) {
+        return ENOENT;
+    } else if (n < 0 || (size_t) n != size) {
+        return EINVAL;
+    }
+
+    memcpy(&file_magic, state, sizeof(uint64_t));
+    memcpy(&file_version, (uint8_t *) state + sizeof(uint64_t),
+           sizeof(uint32_t));
+    if (file_magic != magic || file_version != version) {
+        return EINVAL;
+    }
+
+    return 0;
+}
+
+bool
+ph_file_trusted(pam_handle_t *pamh, const char *path, const struct stat *st)
+{
+    if (!S_ISREG(st->st_mode)) {
+        logger(pamh, LOG_NOTICE, "%s is not a regular file\n", path);
+        return false;
+    }
+
+    /* Cached data can grant access, only trust files that were written
+     * by root or by ourselves and that nobody else can modify
+     */
+    if (st->st_uid != 0 && st->st_uid != geteuid()) {
+        logger(pamh, LOG_NOTICE, "%s has an unexpected owner\n", path);
+        return false;
+    }
+
+    if (st->st_mode & (S_IWGRP | S_IWOTH)) {
+        logger(pamh, LOG_NOTICE, "%s is writable by others\n", path);
+        return false;
+    }
+
+    return true;
+}
+
 void set_debug_mode(bool v)
 {
     debug_mode = v;
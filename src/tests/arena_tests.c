@@ -0,0 +1,152 @@
+/*
+    Copyright (C) 2026 Jakub Hrozek <jakub.hrozek@posteo.se>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdarg.h>
+#include <errno.h>
+
+#include "pam_hbac_arena.h"
+
+static void
+test_arena_alloc(void **state)
+{
+    struct ph_arena *arena;
+    uint64_t *small;
+    char *large;
+    char *s;
+    size_t i;
+    size_t j;
+
+    (void) state; /* unused */
+
+    arena = ph_arena_new();
+    assert_non_null(arena);
+
+    /* Enough allocations to fill several chunks */
+    for (i = 0; i < 10000; i++) {
+        small = ph_arena_calloc(arena, i % 7 + 1, sizeof(uint64_t));
+        assert_non_null(small);
+        assert_true(((uintptr_t) small & 15) == 0);
+        for (j = 0; j < i % 7 + 1; j++) {
+            assert_int_equal(small[j], 0);
+            small[j] = UINT64_MAX;
+        }
+    }
+
+    /* Larger than a chunk */
+    large = ph_arena_calloc(arena, 1, 1024 * 1024);
+    assert_non_null(large);
+    assert_int_equal(large[0], 0);
+    assert_int_equal(large[1024 * 1024 - 1], 0);
+    memset(large, 'x', 1024 * 1024);
+
+    s = ph_arena_strdup(arena, "admins");
+    assert_non_null(s);
+    assert_string_equal(s, "admins");
+
+    assert_non_null(ph_arena_calloc(arena, 0, 0));
+    assert_null(ph_arena_calloc(arena, SIZE_MAX / 2, 4));
+
+    ph_arena_free(arena);
+}
+
+static void
+test_arena_heap(void **state)
+{
+    char **names;
+    int ret;
+
+    (void) state; /* unused */
+
+    /* Without an arena the memory comes from the heap */
+    names = ph_arena_calloc(NULL, 2, sizeof(char *));
+    assert_non_null(names);
+    assert_null(names[1]);
+
+    names[0] = ph_arena_strdup(NULL, "admins");
+    assert_string_equal(names[0], "admins");
+
+    ret = ph_arena_defer(NULL, free, names[0]);
+    assert_int_equal(ret, EINVAL);
+
+    free(names[0]);
+    free(names);
+    ph_arena_free(NULL);
+}
+
+static int cleanup_order[3];
+static int num_cleanups;
+
+static void
+record_cleanup(void *ptr)
+{
+    cleanup_order[num_cleanups++] = *(int *) ptr;
+}
+
+static void
+test_arena_defer(void **state)
+{
+    struct ph_arena *arena;
+    int *vals;
+    int ret;
+    int i;
+
+    (void) state; /* unused */
+
+    arena = ph_arena_new();
+    assert_non_null(arena);
+
+    vals = ph_arena_calloc(arena, 3, sizeof(int));
+    assert_non_null(vals);
+    for (i = 0; i < 3; i++) {
+        vals[i] = i;
+        ret = ph_arena_defer(arena, record_cleanup, &vals[i]);
+        assert_int_equal(ret, 0);
+    }
+
+    /* Heap memory owned by objects in the arena */
+    ret = ph_arena_defer(arena, free, strdup("admins"));
+    assert_int_equal(ret, 0);
+
+    /* The cleanups run in the reverse order and before the memory is
+     * released, vals is still readable
+     */
+    num_cleanups = 0;
+    ph_arena_free(arena);
+    assert_int_equal(num_cleanups, 3);
+    assert_int_equal(cleanup_order[0], 2);
+    assert_int_equal(cleanup_order[1], 1);
+    assert_int_equal(cleanup_order[2], 0);
+}
+
+int
+main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_arena_alloc),
+        cmocka_unit_test(test_arena_heap),
+        cmocka_unit_test(test_arena_defer),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,256 @@
+/*
+    Copyright (C) 2026 Jakub Hrozek <jakub.hrozek@posteo.se>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "pam_hbac_breaker.h"
+
+#include "common_mock.h"
+
+static time_t mock_now = 1000000;
+
+time_t
+__wrap_time(time_t *t)
+{
+    if (t != NULL) {
+        *t = mock_now;
+    }
+    return mock_now;
+}
+
+struct breaker_test_ctx {
+    struct pam_hbac_ctx ctx;
+    struct pam_hbac_config pc;
+    char *dir;
+    char *path;
+};
+
+static int
+test_breaker_setup(void **state)
+{
+    struct breaker_test_ctx *test_ctx;
+
+    test_ctx = calloc(1, sizeof(struct breaker_test_ctx));
+    if (test_ctx == NULL) {
+        return 1;
+    }
+
+    test_ctx->dir = test_tmpdir_new("breaker_tests");
+    if (test_ctx->dir == NULL) {
+        return 1;
+    }
+
+    test_ctx->path = test_tmpdir_file(test_ctx->dir, "breaker");
+    if (test_ctx->path == NULL) {
+        return 1;
+    }
+
+    test_ctx->pc.uri = "ldap://ipa.test";
+    test_ctx->pc.timeout = 5;
+    test_ctx->pc.breaker_threshold = 3;
+    test_ctx->pc.breaker_backoff = 10;
+    test_ctx->pc.breaker_path = test_ctx->path;
+    test_ctx->ctx.pc = &test_ctx->pc;
+
+    *state = test_ctx;
+    return 0;
+}
+
+static int
+test_breaker_teardown(void **state)
+{
+    struct breaker_test_ctx *test_ctx = *state;
+
+    free(test_ctx->path);
+    test_tmpdir_free(test_ctx->dir);
+    free(test_ctx);
+    return 0;
+}
+
+static void
+fail_times(struct breaker_test_ctx *test_ctx, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        assert_true(ph_breaker_allow(&test_ctx->ctx));
+        ph_breaker_report(&test_ctx->ctx, EIO);
+    }
+}
+
+static void
+test_breaker_disabled(void **state)
+{
+    struct breaker_test_ctx *test_ctx = *state;
+    struct stat st;
+    int ret;
+
+    test_ctx->pc.breaker_threshold = 0;
+    fail_times(test_ctx, 10);
+    assert_true(ph_breaker_allow(&test_ctx->ctx));
+
+    ret = stat(test_ctx->path, &st);
+    assert_int_equal(ret, -1);
+    assert_int_equal(errno, ENOENT);
+
+    /* Successes don't create the file either */
+    test_ctx->pc.breaker_threshold = 3;
+    ph_breaker_report(&test_ctx->ctx, 0);
+    ret = stat(test_ctx->path, &st);
+    assert_int_equal(ret, -1);
+}
+
+static void
+test_breaker_open(void **state)
+{
+    struct breaker_test_ctx *test_ctx = *state;
+    time_t start = mock_now;
+
+    fail_times(test_ctx, 2);
+    assert_true(ph_breaker_allow(&test_ctx->ctx));
+
+    /* The third failure opens the breaker */
+    ph_breaker_report(&test_ctx->ctx, ETIMEDOUT);
+    assert_false(ph_breaker_allow(&test_ctx->ctx));
+
+    /* A straggler that started earlier does not extend the backoff */
+    ph_breaker_report(&test_ctx->ctx, EIO);
+
+    mock_now = start + 9;
+    assert_false(ph_breaker_allow(&test_ctx->ctx));
+
+    /* Half-open, only one probe is let through */
+    mock_now = start + 10;
+    assert_true(ph_breaker_allow(&test_ctx->ctx));
+    assert_false(ph_breaker_allow(&test_ctx->ctx));
+
+    /* The probe fails, the backoff doubles */
+    ph_breaker_report(&test_ctx->ctx, EIO);
+    mock_now = start + 10 + 19;
+    assert_false(ph_breaker_allow(&test_ctx->ctx));
+    mock_now = start + 10 + 20;
+    assert_true(ph_breaker_allow(&test_ctx->ctx));
+
+    /* The probe connects and closes the breaker */
+    ph_breaker_report(&test_ctx->ctx, 0);
+    assert_true(ph_breaker_allow(&test_ctx->ctx));
+
+    /* The failures start counting from zero again */
+    fail_times(test_ctx, 2);
+    assert_true(ph_breaker_allow(&test_ctx->ctx));
+}
+
+static void
+test_breaker_lost_probe(void **state)
+{
+    struct breaker_test_ctx *test_ctx = *state;
+    time_t start = mock_now;
+
+    fail_times(test_ctx, 3);
+    assert_false(ph_breaker_allow(&test_ctx->ctx));
+
+    mock_now = start + 10;
+    assert_true(ph_breaker_allow(&test_ctx->ctx));
+    assert_false(ph_breaker_allow(&test_ctx->ctx));
+
+    /* The probe never reported back, another one is allowed once it
+     * must have timed out
+     */
+    mock_now = start + 10 + test_ctx->pc.timeout + 1;
+    assert_true(ph_breaker_allow(&test_ctx->ctx));
+}
+
+static void
+test_breaker_errors(void **state)
+{
+    struct breaker_test_ctx *test_ctx = *state;
+
+    /* Errors that say nothing about the server don't count */
+    fail_times(test_ctx, 2);
+    ph_breaker_report(&test_ctx->ctx, ENOMEM);
+    assert_true(ph_breaker_allow(&test_ctx->ctx));
+
+    /* A rejected bind means that the server is reachable */
+    ph_breaker_report(&test_ctx->ctx, EACCES);
+    fail_times(test_ctx, 2);
+    assert_true(ph_breaker_allow(&test_ctx->ctx));
+
+    ph_breaker_report(&test_ctx->ctx, EIO);
+    assert_false(ph_breaker_allow(&test_ctx->ctx));
+
+    /* A different server configuration starts with a closed breaker */
+    test_ctx->pc.uri = "ldap://other.ipa.test";
+    assert_true(ph_breaker_allow(&test_ctx->ctx));
+}
+
+static void
+test_breaker_locked(void **state)
+{
+    struct breaker_test_ctx *test_ctx = *state;
+    int release;
+    pid_t pid;
+
+    fail_times(test_ctx, 3);
+    assert_false(ph_breaker_allow(&test_ctx->ctx));
+
+    /* A breaker that stays locked is treated like a closed one and the
+     * reports are dropped instead of waited for
+     */
+    pid = hold_lock(test_ctx->path, &release);
+    assert_true(ph_breaker_allow(&test_ctx->ctx));
+    ph_breaker_report(&test_ctx->ctx, 0);
+    release_lock(pid, release);
+
+    /* The success above was not recorded */
+    assert_false(ph_breaker_allow(&test_ctx->ctx));
+}
+
+int
+main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_breaker_disabled,
+                                        test_breaker_setup,
+                                        test_breaker_teardown),
+        cmocka_unit_test_setup_teardown(test_breaker_open,
+                                        test_breaker_setup,
+                                        test_breaker_teardown),
+        cmocka_unit_test_setup_teardown(test_breaker_lost_probe,
+                                        test_breaker_setup,
+                                        test_breaker_teardown),
+        cmocka_unit_test_setup_teardown(test_breaker_locked,
+                                        test_breaker_setup,
+                                        test_breaker_teardown),
+        cmocka_unit_test_setup_teardown(test_breaker_errors,
+                                        test_breaker_setup,
+                                        test_breaker_teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
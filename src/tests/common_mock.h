@@ -30,6 +30,17 @@ void
 assert_string_list_matches(const char *list[],
                            const char *expected[]);
 
+/* Creates a scratch directory named after prefix in the current directory */
+char *test_tmpdir_new(const char *prefix);
+/* Returns the path of name inside dir, free with free() */
+char *test_tmpdir_file(const char *dir, const char *name);
+/* Removes dir together with the files in it and frees dir */
+void test_tmpdir_free(char *dir);
+
+/* Holds a write lock on path in a child process until release_lock() */
+pid_t hold_lock(const char *path, int *_release);
+void release_lock(pid_t pid, int release);
+
 struct ph_attr *mock_ph_attr(const char *name, ...);
 struct ph_user *mock_user_obj(const char *name, ...);
 int mock_ph_host(struct ph_entry *host, const char *fqdn, ...);
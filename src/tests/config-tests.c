@@ -108,6 +108,27 @@ void test_trailing_whitespace(void **state)
     ph_cleanup_config(conf);
 }
 
+void test_multiple_uris(void **state)
+{
+    struct pam_hbac_config *conf;
+
+    (void) state; /* unused */
+
+    conf = read_test_config(TEST_CONF_DIR"/src/tests/configs/multi_uri.conf");
+    assert_int_equal(conf->num_uris, 3);
+    assert_string_equal(conf->uris[0], "ldap://dc1.example.com");
+    assert_string_equal(conf->uris[1], "ldap://dc2.example.com");
+    assert_string_equal(conf->uris[2], "ldap://dc3.example.com");
+    assert_int_equal(conf->hedge_delay, 50);
+    ph_cleanup_config(conf);
+
+    conf = read_test_config(TEST_CONF_DIR"/src/tests/configs/good1.conf");
+    assert_int_equal(conf->num_uris, 1);
+    assert_string_equal(conf->uris[0], EXAMPLE_URI);
+    assert_int_equal(conf->hedge_delay, PAM_HBAC_DEFAULT_HEDGE_DELAY);
+    ph_cleanup_config(conf);
+}
+
 void test_no_equal_sign(void **state)
 {
     struct pam_hbac_config *conf;
@@ -199,6 +220,7 @@ int main(void)
         cmocka_unit_test(test_whitespace_around_equal_sign),
         cmocka_unit_test(test_leading_whitespace),
         cmocka_unit_test(test_trailing_whitespace),
+        cmocka_unit_test(test_multiple_uris),
         cmocka_unit_test(test_no_equal_sign),
         cmocka_unit_test(test_empty_lines),
         cmocka_unit_test(test_missing_opts),
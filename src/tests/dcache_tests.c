@@ -0,0 +1,432 @@
+/*
+    Copyright (C) 2026 Jakub Hrozek <jakub.hrozek@posteo.se>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "pam_hbac_dcache.h"
+
+#include "common_mock.h"
+
+struct dcache_test_ctx {
+    struct pam_hbac_config pc;
+    char *dir;
+    char *path;
+};
+
+static int
+test_dcache_setup(void **state)
+{
+    struct dcache_test_ctx *test_ctx;
+
+    test_ctx = calloc(1, sizeof(struct dcache_test_ctx));
+    if (test_ctx == NULL) {
+        return 1;
+    }
+
+    test_ctx->dir = test_tmpdir_new("dcache_tests");
+    if (test_ctx->dir == NULL) {
+        return 1;
+    }
+
+    test_ctx->path = test_tmpdir_file(test_ctx->dir, "decisions");
+    if (test_ctx->path == NULL) {
+        return 1;
+    }
+
+    test_ctx->pc.uri = "ldap://ipa.test";
+    test_ctx->pc.search_base = "dc=ipa,dc=test";
+    test_ctx->pc.hostname = discard_const("client.ipa.test");
+    test_ctx->pc.decision_cache_ttl = 60;
+    test_ctx->pc.decision_cache_path = test_ctx->path;
+
+    *state = test_ctx;
+    return 0;
+}
+
+static int
+test_dcache_teardown(void **state)
+{
+    struct dcache_test_ctx *test_ctx = *state;
+
+    free(test_ctx->path);
+    test_tmpdir_free(test_ctx->dir);
+    free(test_ctx);
+    return 0;
+}
+
+static int
+lookup(struct dcache_test_ctx *test_ctx,
+       struct ph_user *user,
+       const char *service,
+       enum hbac_eval_result *_result)
+{
+    struct ph_dcache *dc;
+    int ret;
+
+    dc = ph_dcache_open(NULL, &test_ctx->pc, user, service);
+    assert_non_null(dc);
+
+    ret = ph_dcache_lookup(dc, _result);
+    ph_dcache_close(dc);
+    return ret;
+}
+
+static void
+store(struct dcache_test_ctx *test_ctx,
+      struct ph_user *user,
+      const char *service,
+      enum hbac_eval_result result)
+{
+    struct ph_dcache *dc;
+
+    dc = ph_dcache_open(NULL, &test_ctx->pc, user, service);
+    assert_non_null(dc);
+
+    ph_dcache_store(dc, result);
+    ph_dcache_close(dc);
+}
+
+static void
+test_dcache_hit(void **state)
+{
+    struct dcache_test_ctx *test_ctx = *state;
+    struct ph_user *user;
+    struct ph_user *reordered;
+    struct ph_user *other_groups;
+    enum hbac_eval_result res;
+    int ret;
+
+    user = mock_user_obj("tuser", "group1", "group2", NULL);
+    reordered = mock_user_obj("tuser", "group2", "group1", NULL);
+    other_groups = mock_user_obj("tuser", "group1", NULL);
+    assert_non_null(user);
+    assert_non_null(reordered);
+    assert_non_null(other_groups);
+
+    ret = lookup(test_ctx, user, "sshd", &res);
+    assert_int_equal(ret, ENOENT);
+
+    store(test_ctx, user, "sshd", HBAC_EVAL_ALLOW);
+
+    ret = lookup(test_ctx, user, "sshd", &res);
+    assert_int_equal(ret, 0);
+    assert_int_equal(res, HBAC_EVAL_ALLOW);
+
+    /* NSS may return the groups in any order */
+    ret = lookup(test_ctx, reordered, "sshd", &res);
+    assert_int_equal(ret, 0);
+    assert_int_equal(res, HBAC_EVAL_ALLOW);
+
+    ret = lookup(test_ctx, other_groups, "sshd", &res);
+    assert_int_equal(ret, ENOENT);
+
+    ret = lookup(test_ctx, user, "sudo", &res);
+    assert_int_equal(ret, ENOENT);
+
+    /* A decision made against another host must not be reused */
+    test_ctx->pc.hostname = discard_const("other.ipa.test");
+    ret = lookup(test_ctx, user, "sshd", &res);
+    assert_int_equal(ret, ENOENT);
+
+    ph_free_user(user);
+    ph_free_user(reordered);
+    ph_free_user(other_groups);
+}
+
+static struct ph_user *
+gid_user(gid_t g1, gid_t g2)
+{
+    struct ph_user *user;
+
+    user = mock_user_obj("tuser", NULL);
+    assert_non_null(user);
+
+    /* Read with MATCH_GROUPS_BY_GID, the names are not resolved yet */
+    free(user->group_names);
+    user->group_names = NULL;
+
+    user->gids = malloc(2 * sizeof(gid_t));
+    assert_non_null(user->gids);
+    user->gids[0] = g1;
+    user->gids[1] = g2;
+    user->num_gids = 2;
+    return user;
+}
+
+static void
+test_dcache_gids(void **state)
+{
+    struct dcache_test_ctx *test_ctx = *state;
+    struct ph_user *user;
+    struct ph_user *reordered;
+    struct ph_user *other_gids;
+    enum hbac_eval_result res;
+    int ret;
+
+    user = gid_user(1000, 2000);
+    reordered = gid_user(2000, 1000);
+    other_gids = gid_user(1000, 3000);
+
+    store(test_ctx, user, "sshd", HBAC_EVAL_ALLOW);
+
+    ret = lookup(test_ctx, reordered, "sshd", &res);
+    assert_int_equal(ret, 0);
+    assert_int_equal(res, HBAC_EVAL_ALLOW);
+
+    ret = lookup(test_ctx, other_gids, "sshd", &res);
+    assert_int_equal(ret, ENOENT);
+
+    ph_free_user(user);
+    ph_free_user(reordered);
+    ph_free_user(other_gids);
+}
+
+static void
+test_dcache_deny_and_error(void **state)
+{
+    struct dcache_test_ctx *test_ctx = *state;
+    struct ph_user *user;
+    enum hbac_eval_result res;
+    int ret;
+
+    user = mock_user_obj("tuser", NULL);
+    assert_non_null(user);
+
+    store(test_ctx, user, "sshd", HBAC_EVAL_ERROR);
+    ret = lookup(test_ctx, user, "sshd", &res);
+    assert_int_equal(ret, ENOENT);
+
+    store(test_ctx, user, "sshd", HBAC_EVAL_DENY);
+    ret = lookup(test_ctx, user, "sshd", &res);
+    assert_int_equal(ret, 0);
+    assert_int_equal(res, HBAC_EVAL_DENY);
+
+    /* A later decision replaces the earlier one */
+    store(test_ctx, user, "sshd", HBAC_EVAL_ALLOW);
+    ret = lookup(test_ctx, user, "sshd", &res);
+    assert_int_equal(ret, 0);
+    assert_int_equal(res, HBAC_EVAL_ALLOW);
+
+    ph_free_user(user);
+}
+
+static void
+test_dcache_many(void **state)
+{
+    struct dcache_test_ctx *test_ctx = *state;
+    struct ph_user *user;
+    enum hbac_eval_result res;
+    char name[32];
+    int i;
+    int ret;
+
+    for (i = 0; i < 500; i++) {
+        snprintf(name, sizeof(name), "user%d", i);
+        user = mock_user_obj(name, NULL);
+        assert_non_null(user);
+        store(test_ctx, user, "sshd",
+              i % 2 ? HBAC_EVAL_ALLOW : HBAC_EVAL_DENY);
+        ph_free_user(user);
+    }
+
+    for (i = 0; i < 500; i++) {
+        snprintf(name, sizeof(name), "user%d", i);
+        user = mock_user_obj(name, NULL);
+        assert_non_null(user);
+        ret = lookup(test_ctx, user, "sshd", &res);
+        assert_int_equal(ret, 0);
+        assert_int_equal(res, i % 2 ? HBAC_EVAL_ALLOW : HBAC_EVAL_DENY);
+        ph_free_user(user);
+    }
+}
+
+static void
+test_dcache_flush(void **state)
+{
+    struct dcache_test_ctx *test_ctx = *state;
+    struct ph_user *user;
+    enum hbac_eval_result res;
+    int ret;
+
+    user = mock_user_obj("tuser", NULL);
+    assert_non_null(user);
+
+    store(test_ctx, user, "sshd", HBAC_EVAL_ALLOW);
+    ret = lookup(test_ctx, user, "sshd", &res);
+    assert_int_equal(ret, 0);
+
+    ret = ph_dcache_flush(NULL, &test_ctx->pc);
+    assert_int_equal(ret, 0);
+
+    ret = lookup(test_ctx, user, "sshd", &res);
+    assert_int_equal(ret, ENOENT);
+
+    ph_free_user(user);
+}
+
+/* Leaves the first used slot the way a writer that died halfway through
+ * an update would
+ */
+static void
+abandon_slot(struct dcache_test_ctx *test_ctx)
+{
+    uint32_t slot[8];
+    off_t off;
+    int fd;
+
+    fd = open(test_ctx->path, O_RDWR);
+    assert_int_not_equal(fd, -1);
+
+    for (off = 32; pread(fd, slot, sizeof(slot), off) == sizeof(slot);
+         off += sizeof(slot)) {
+        if (slot[2] != 0 || slot[3] != 0 || slot[4] != 0 || slot[5] != 0) {
+            slot[0] |= 1;
+            assert_int_equal(pwrite(fd, slot, sizeof(uint32_t), off),
+                             sizeof(uint32_t));
+            break;
+        }
+    }
+
+    close(fd);
+}
+
+static int
+count_odd_slots(struct dcache_test_ctx *test_ctx)
+{
+    uint32_t slot[8];
+    off_t off;
+    int odd = 0;
+    int fd;
+
+    fd = open(test_ctx->path, O_RDONLY);
+    assert_int_not_equal(fd, -1);
+
+    for (off = 32; pread(fd, slot, sizeof(slot), off) == sizeof(slot);
+         off += sizeof(slot)) {
+        odd += slot[0] & 1;
+    }
+
+    close(fd);
+    return odd;
+}
+
+static void
+test_dcache_abandoned_slot(void **state)
+{
+    struct dcache_test_ctx *test_ctx = *state;
+    struct ph_user *user;
+    enum hbac_eval_result res;
+    int ret;
+
+    user = mock_user_obj("tuser", NULL);
+    assert_non_null(user);
+
+    store(test_ctx, user, "sshd", HBAC_EVAL_ALLOW);
+    abandon_slot(test_ctx);
+    assert_int_equal(count_odd_slots(test_ctx), 1);
+
+    ret = lookup(test_ctx, user, "sshd", &res);
+    assert_int_equal(ret, ENOENT);
+
+    /* Nobody holds the slot lock, so the next writer reclaims the slot */
+    store(test_ctx, user, "sshd", HBAC_EVAL_DENY);
+    assert_int_equal(count_odd_slots(test_ctx), 0);
+
+    ret = lookup(test_ctx, user, "sshd", &res);
+    assert_int_equal(ret, 0);
+    assert_int_equal(res, HBAC_EVAL_DENY);
+
+    ph_free_user(user);
+}
+
+static void
+test_dcache_unusable(void **state)
+{
+    struct dcache_test_ctx *test_ctx = *state;
+    struct ph_user *user;
+    struct ph_dcache *dc;
+    int ret;
+
+    user = mock_user_obj("tuser", NULL);
+    assert_non_null(user);
+
+    test_ctx->pc.decision_cache_ttl = 0;
+    dc = ph_dcache_open(NULL, &test_ctx->pc, user, "sshd");
+    assert_null(dc);
+    test_ctx->pc.decision_cache_ttl = 60;
+
+    /* creates the file */
+    dc = ph_dcache_open(NULL, &test_ctx->pc, user, "sshd");
+    assert_non_null(dc);
+    ph_dcache_close(dc);
+
+    ret = chmod(test_ctx->path, 0622);
+    assert_int_equal(ret, 0);
+    dc = ph_dcache_open(NULL, &test_ctx->pc, user, "sshd");
+    assert_null(dc);
+
+    ret = chmod(test_ctx->path, 0600);
+    assert_int_equal(ret, 0);
+    ret = truncate(test_ctx->path, 64);
+    assert_int_equal(ret, 0);
+    dc = ph_dcache_open(NULL, &test_ctx->pc, user, "sshd");
+    assert_null(dc);
+
+    ph_free_user(user);
+}
+
+int
+main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_dcache_hit,
+                                        test_dcache_setup,
+                                        test_dcache_teardown),
+        cmocka_unit_test_setup_teardown(test_dcache_gids,
+                                        test_dcache_setup,
+                                        test_dcache_teardown),
+        cmocka_unit_test_setup_teardown(test_dcache_deny_and_error,
+                                        test_dcache_setup,
+                                        test_dcache_teardown),
+        cmocka_unit_test_setup_teardown(test_dcache_many,
+                                        test_dcache_setup,
+                                        test_dcache_teardown),
+        cmocka_unit_test_setup_teardown(test_dcache_flush,
+                                        test_dcache_setup,
+                                        test_dcache_teardown),
+        cmocka_unit_test_setup_teardown(test_dcache_abandoned_slot,
+                                        test_dcache_setup,
+                                        test_dcache_teardown),
+        cmocka_unit_test_setup_teardown(test_dcache_unusable,
+                                        test_dcache_setup,
+                                        test_dcache_teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
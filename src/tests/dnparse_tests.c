@@ -22,6 +22,7 @@
 #include <setjmp.h>
 #include <cmocka.h>
 #include <stdarg.h>
+#include <errno.h>
 #include <ldap.h>
 
 #include "pam_hbac.h"
@@ -179,6 +180,263 @@ test_rdn_key_mismatch(void **state)
     assert_int_not_equal(ret, 0);
 }
 
+static void
+test_classify_dn(void **state)
+{
+    struct ph_dn_classifier *dc;
+    enum ph_dn_class dn_class;
+    const char *name;
+    size_t i;
+    int ret;
+    struct {
+        const char *dn;
+        enum ph_dn_class dn_class;
+        const char *name;
+    } ok[] = {
+        { " uid = admin , cn = users ,cn=accounts,dc=ipa,dc=test",
+          PH_DN_USER, "admin" },
+        { "cn=admins,cn=groups,cn=accounts,dc=ipa,dc=test",
+          PH_DN_USERGROUP, "admins" },
+        { "fqdn=server.ipa.test,cn=computers,cn=accounts,DC=IPA,dc=test",
+          PH_DN_HOST, "server.ipa.test" },
+        { "cn=servers,CN=HostGroups,cn=accounts,dc=ipa,dc=test",
+          PH_DN_HOSTGROUP, "servers" },
+        { "cn=login,cn=hbacservices,cn=hbac,dc=ipa,dc=test",
+          PH_DN_SVC, "login" },
+        { "cn=Sudo,cn=hbacservicegroups,cn=hbac,dc=ipa,dc=test",
+          PH_DN_SVCGROUP, "Sudo" },
+    };
+    const char *bad[] = {
+        /* Container under the wrong parent */
+        "cn=admins,cn=groups,cn=hbac,dc=ipa,dc=test",
+        /* Unknown container */
+        "cn=admins,cn=roles,cn=accounts,dc=ipa,dc=test",
+        /* The RDN key does not fit the container */
+        "cn=admin,cn=users,cn=accounts,dc=ipa,dc=test",
+        "uidx=admin,cn=users,cn=accounts,dc=ipa,dc=test",
+#ifndef COMPAT_LDAP_UNIT_TESTS
+        /* Multi-valued RDN, the compat parser does not split those */
+        "uid=admin+cn=admin,cn=users,cn=accounts,dc=ipa,dc=test",
+#endif
+        /* Base DN mismatches */
+        "uid=admin,cn=users,cn=accounts,"TEST_BASEDN2,
+        "uid=admin,cn=users,cn=accounts,"TEST_BASEDN_short,
+        "uid=admin,cn=users,cn=accounts,"TEST_BASEDN_long,
+        "uid=admin,cn=users,cn=accounts,"TEST_BASEDN4,
+        "uid=admin,cn=users,cn=accounts",
+        "uid=admin",
+    };
+
+    (void) state; /* unused */
+
+    ret = ph_dn_classifier_new(NULL, &dc);
+    assert_int_equal(ret, EINVAL);
+
+    ret = ph_dn_classifier_new(TEST_BASEDN, &dc);
+    assert_int_equal(ret, 0);
+
+    for (i = 0; i < sizeof(ok) / sizeof(ok[0]); i++) {
+        ret = ph_classify_dn(dc, ok[i].dn, &dn_class, &name);
+        assert_int_equal(ret, 0);
+        assert_int_equal(dn_class, ok[i].dn_class);
+        assert_string_equal(name, ok[i].name);
+        free_const(name);
+    }
+
+    for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        name = NULL;
+        ret = ph_classify_dn(dc, bad[i], &dn_class, &name);
+        assert_int_equal(ret, EINVAL);
+        assert_null(name);
+    }
+
+    ph_dn_classifier_free(dc);
+}
+
+static void
+test_classify_dn_fast(void **state)
+{
+    struct ph_dn_classifier *dc;
+    enum ph_dn_class dn_class;
+    struct berval dn;
+    struct berval name;
+    const char *name_str;
+    size_t i;
+    int ret;
+    const char *fallback[] = {
+        /* Unusual spacing */
+        " uid = admin , cn = users ,cn=accounts,dc=ipa,dc=test",
+        "uid=admin,cn=users,cn=accounts, dc=ipa,dc=test",
+        /* Escapes */
+        "cn=a\\,b,cn=groups,cn=accounts,dc=ipa,dc=test",
+        "cn=\"admins\",cn=groups,cn=accounts,dc=ipa,dc=test",
+        /* Multi-valued RDN */
+        "uid=admin+cn=admin,cn=users,cn=accounts,dc=ipa,dc=test",
+    };
+    const char *bad[] = {
+        "cn=admins,cn=groups,cn=hbac,dc=ipa,dc=test",
+        "cn=admin,cn=users,cn=accounts,dc=ipa,dc=test",
+        "uid=admin,cn=users,cn=accounts,"TEST_BASEDN2,
+        "uid=admin,cn=users,cn=accounts,"TEST_BASEDN_long,
+        "uid=admin,cn=users",
+    };
+
+    (void) state; /* unused */
+
+    ret = ph_dn_classifier_new(TEST_BASEDN, &dc);
+    assert_int_equal(ret, 0);
+
+    /* The name points into the DN */
+    dn.bv_val = discard_const("uid=admin,cn=users,cn=accounts,DC=ipa,dc=TEST");
+    dn.bv_len = strlen(dn.bv_val);
+    ret = ph_classify_dn_fast(dc, &dn, &dn_class, &name);
+    assert_int_equal(ret, 0);
+    assert_int_equal(dn_class, PH_DN_USER);
+    assert_ptr_equal(name.bv_val, dn.bv_val + 4);
+    assert_int_equal(name.bv_len, 5);
+
+    /* The berval does not have to be terminated */
+    dn.bv_val = discard_const("cn=login,cn=hbacservices,cn=hbac,dc=ipa,dc=testX");
+    dn.bv_len = strlen(dn.bv_val) - 1;
+    ret = ph_classify_dn_fast(dc, &dn, &dn_class, &name);
+    assert_int_equal(ret, 0);
+    assert_int_equal(dn_class, PH_DN_SVC);
+    assert_ptr_equal(name.bv_val, dn.bv_val + 3);
+    assert_int_equal(name.bv_len, 5);
+
+    for (i = 0; i < sizeof(fallback) / sizeof(fallback[0]); i++) {
+        dn.bv_val = discard_const(fallback[i]);
+        dn.bv_len = strlen(fallback[i]);
+        ret = ph_classify_dn_fast(dc, &dn, &dn_class, &name);
+        assert_int_equal(ret, EAGAIN);
+    }
+
+    for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        dn.bv_val = discard_const(bad[i]);
+        dn.bv_len = strlen(bad[i]);
+        ret = ph_classify_dn_fast(dc, &dn, &dn_class, &name);
+        assert_int_equal(ret, EINVAL);
+    }
+
+    /* The full parser handles what the scanner does not */
+    ret = ph_classify_dn(dc, fallback[1], &dn_class, &name_str);
+    assert_int_equal(ret, 0);
+    assert_int_equal(dn_class, PH_DN_USER);
+    assert_string_equal(name_str, "admin");
+    free_const(name_str);
+
+    ph_dn_classifier_free(dc);
+
+    /* The base DN is matched in its normalized form */
+    ret = ph_dn_classifier_new("dc=ipa, dc=test", &dc);
+    assert_int_equal(ret, 0);
+
+    dn.bv_val = discard_const("uid=admin,cn=users,cn=accounts,dc=ipa,dc=test");
+    dn.bv_len = strlen(dn.bv_val);
+    ret = ph_classify_dn_fast(dc, &dn, &dn_class, &name);
+    assert_int_equal(ret, 0);
+    assert_int_equal(dn_class, PH_DN_USER);
+
+    ph_dn_classifier_free(dc);
+
+    /* A base DN that cannot be written plainly always falls back */
+    ret = ph_dn_classifier_new("dc=ipa\\,x,dc=test", &dc);
+    assert_int_equal(ret, 0);
+
+    ret = ph_classify_dn_fast(dc, &dn, &dn_class, &name);
+    assert_int_equal(ret, EAGAIN);
+
+    ph_dn_classifier_free(dc);
+}
+
+static void
+test_dn_memo(void **state)
+{
+    struct ph_dn_classifier *dc;
+    struct ph_dn_memo *memo;
+    enum ph_dn_class dn_class;
+    struct berval dn;
+    const char *name;
+    const char *name2;
+    const char *names[200];
+    char buf[200][128];
+    char copy[128];
+    size_t i;
+    int ret;
+
+    (void) state; /* unused */
+
+    ret = ph_dn_classifier_new(TEST_BASEDN, &dc);
+    assert_int_equal(ret, 0);
+
+    ret = ph_dn_memo_new(dc, &memo);
+    assert_int_equal(ret, 0);
+
+    /* The same DN in another buffer yields the same name */
+    strcpy(copy, "cn=admins,cn=groups,cn=accounts,dc=ipa,dc=test");
+    dn.bv_val = copy;
+    dn.bv_len = strlen(copy);
+    ret = ph_dn_memo_classify(memo, &dn, &dn_class, &name);
+    assert_int_equal(ret, 0);
+    assert_int_equal(dn_class, PH_DN_USERGROUP);
+    assert_string_equal(name, "admins");
+
+    dn.bv_val = discard_const("cn=admins,cn=groups,cn=accounts,dc=ipa,dc=test");
+    ret = ph_dn_memo_classify(memo, &dn, &dn_class, &name2);
+    assert_int_equal(ret, 0);
+    assert_int_equal(dn_class, PH_DN_USERGROUP);
+    assert_ptr_equal(name, name2);
+    ph_dn_name_unref(name2);
+
+    /* DNs that need the full parser are remembered too */
+    dn.bv_val = discard_const("cn=sshd, cn=hbacservices, cn=hbac, dc=ipa, dc=test");
+    dn.bv_len = strlen(dn.bv_val);
+    ret = ph_dn_memo_classify(memo, &dn, &dn_class, &name2);
+    assert_int_equal(ret, 0);
+    assert_int_equal(dn_class, PH_DN_SVC);
+    assert_string_equal(name2, "sshd");
+    ph_dn_name_unref(name2);
+
+    /* So are the ones that cannot be classified */
+    dn.bv_val = discard_const("cn=admins,cn=roles,cn=accounts,dc=ipa,dc=test");
+    dn.bv_len = strlen(dn.bv_val);
+    ret = ph_dn_memo_classify(memo, &dn, &dn_class, &name2);
+    assert_int_equal(ret, EINVAL);
+    ret = ph_dn_memo_classify(memo, &dn, &dn_class, &name2);
+    assert_int_equal(ret, EINVAL);
+
+    /* Enough DNs to grow the table */
+    for (i = 0; i < 200; i++) {
+        snprintf(buf[i], sizeof(buf[i]),
+                 "uid=user%zu,cn=users,cn=accounts,dc=ipa,dc=test", i);
+        dn.bv_val = buf[i];
+        dn.bv_len = strlen(buf[i]);
+        ret = ph_dn_memo_classify(memo, &dn, &dn_class, &names[i]);
+        assert_int_equal(ret, 0);
+        assert_int_equal(dn_class, PH_DN_USER);
+    }
+
+    for (i = 0; i < 200; i++) {
+        dn.bv_val = buf[i];
+        dn.bv_len = strlen(buf[i]);
+        ret = ph_dn_memo_classify(memo, &dn, &dn_class, &name2);
+        assert_int_equal(ret, 0);
+        assert_ptr_equal(name2, names[i]);
+        ph_dn_name_unref(name2);
+    }
+
+    /* The names outlive the memo until they are released */
+    ph_dn_memo_free(memo);
+    assert_string_equal(name, "admins");
+    assert_string_equal(names[199], "user199");
+
+    ph_dn_name_unref(name);
+    for (i = 0; i < 200; i++) {
+        ph_dn_name_unref(names[i]);
+    }
+    ph_dn_classifier_free(dc);
+}
+
 int
 main(void)
 {
@@ -186,6 +444,9 @@ main(void)
         cmocka_unit_test(test_ph_name_from_dn),
         cmocka_unit_test(test_ph_group_name_from_dn),
         cmocka_unit_test(test_rdn_key_mismatch),
+        cmocka_unit_test(test_classify_dn),
+        cmocka_unit_test(test_classify_dn_fast),
+        cmocka_unit_test(test_dn_memo),
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);
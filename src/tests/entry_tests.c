@@ -63,6 +63,38 @@ static void test_ph_attr(void **state)
     assert_null(a);
 }
 
+static void test_ph_attr_borrowed(void **state)
+{
+    struct ph_attr *a;
+    char msg[] = "key\0value1\0value2";
+    struct berval name = { 3, msg };
+    struct berval *vals;
+
+    (void) state; /* unused */
+
+    vals = ber_memcalloc(3, sizeof(struct berval));
+    assert_non_null(vals);
+    vals[0].bv_val = msg + 4;
+    vals[0].bv_len = 6;
+    vals[1].bv_val = msg + 11;
+    vals[1].bv_len = 6;
+
+    /* Nothing but the value array is copied */
+    a = ph_attr_new_borrowed(&name, vals);
+    assert_non_null(a);
+    assert_ptr_equal(a->name, msg);
+    assert_int_equal(a->nvals, 2);
+    assert_ptr_equal(a->vals[0]->bv_val, msg + 4);
+    assert_string_equal(a->vals[0]->bv_val, "value1");
+    assert_string_equal(a->vals[1]->bv_val, "value2");
+    assert_null(a->vals[2]);
+
+    ph_attr_free(a);
+
+    a = ph_attr_new_borrowed(&name, NULL);
+    assert_null(a);
+}
+
 static void test_ph_entry(void **state)
 {
     const size_t num_attrs = 3;
@@ -155,6 +187,7 @@ int main(void)
 {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_ph_attr),
+        cmocka_unit_test(test_ph_attr_borrowed),
         cmocka_unit_test(test_ph_entry),
         cmocka_unit_test(test_ph_entry_array),
     };
@@ -28,6 +28,7 @@
 #include "pam_hbac_entry.h"
 #include "pam_hbac_obj.h"
 #include "pam_hbac_obj_int.h"
+#include "pam_hbac_arena.h"
 #include "common_mock.h"
 
 #define TEST_BASEDN "dc=ipa,dc=test"
@@ -133,7 +134,7 @@ test_create_eval_req_invalid(void **state)
 
     (void) state; /* unused */
 
-    ret = ph_create_hbac_eval_req(NULL, NULL, NULL, NULL, NULL);
+    ret = ph_create_hbac_eval_req(NULL, NULL, NULL, NULL, NULL, NULL, NULL);
     assert_int_equal(ret, EINVAL);
 }
 
@@ -165,9 +166,11 @@ static void test_create_eval_req_nogroups(void **state)
     int ret;
     struct eval_req_test_ctx *test_ctx = *state;
 
-    ret = ph_create_hbac_eval_req(test_ctx->user,
+    ret = ph_create_hbac_eval_req(NULL,
+                                  test_ctx->user,
                                   test_ctx->targethost,
                                   test_ctx->service,
+                                  NULL,
                                   TEST_BASEDN,
                                   &test_ctx->req);
     assert_int_equal(ret, 0);
@@ -182,6 +185,31 @@ static void test_create_eval_req_nogroups(void **state)
     assert_int_equal(test_ctx->req->request_time, time(NULL));
 }
 
+static void test_create_eval_req_lazy(void **state)
+{
+    int ret;
+    struct eval_req_test_ctx *test_ctx = *state;
+
+    /* Neither the user's groups nor the service were looked up */
+    free(test_ctx->user->group_names);
+    test_ctx->user->group_names = NULL;
+
+    ret = ph_create_hbac_eval_req(NULL,
+                                  test_ctx->user,
+                                  test_ctx->targethost,
+                                  NULL,
+                                  "sshd",
+                                  TEST_BASEDN,
+                                  &test_ctx->req);
+    assert_int_equal(ret, 0);
+
+    assert_string_equal(test_ctx->req->user->name, "testuser");
+    assert_empty_groups(test_ctx->req->user);
+    assert_string_equal(test_ctx->req->targethost->name, "testhost");
+    assert_string_equal(test_ctx->req->service->name, "sshd");
+    assert_empty_groups(test_ctx->req->service);
+}
+
 static int
 test_create_eval_req_valid_groups_setup(void **state)
 {
@@ -247,9 +275,11 @@ static void test_create_eval_req_valid_groups(void **state)
         NULL
     };
 
-    ret = ph_create_hbac_eval_req(test_ctx->user,
+    ret = ph_create_hbac_eval_req(NULL,
+                                  test_ctx->user,
                                   test_ctx->targethost,
                                   test_ctx->service,
+                                  NULL,
                                   TEST_BASEDN,
                                   &test_ctx->req);
     assert_int_equal(ret, 0);
@@ -266,6 +296,39 @@ static void test_create_eval_req_valid_groups(void **state)
     assert_int_equal(test_ctx->req->request_time, time(NULL));
 }
 
+static void test_create_eval_req_arena(void **state)
+{
+    int ret;
+    struct eval_req_test_ctx *test_ctx = *state;
+    struct ph_arena *arena;
+    const char *exp_svc_groups[] = {
+        SVC_GROUP1,
+        SVC_GROUP2,
+        NULL
+    };
+
+    arena = ph_arena_new();
+    assert_non_null(arena);
+
+    ret = ph_create_hbac_eval_req(arena,
+                                  test_ctx->user,
+                                  test_ctx->targethost,
+                                  test_ctx->service,
+                                  NULL,
+                                  TEST_BASEDN,
+                                  &test_ctx->req);
+    assert_int_equal(ret, 0);
+
+    /* The request is left to the arena */
+    ph_free_hbac_eval_req(test_ctx->req);
+    assert_string_equal(test_ctx->req->service->name, "testsvc");
+    assert_string_list_matches(test_ctx->req->service->groups,
+                               exp_svc_groups);
+
+    ph_arena_free(arena);
+    test_ctx->req = NULL;
+}
+
 static int
 test_create_eval_req_invalid_groups_setup(void **state)
 {
@@ -332,9 +395,11 @@ static void test_create_eval_req_skip_invalid_groups(void **state)
         NULL
     };
 
-    ret = ph_create_hbac_eval_req(test_ctx->user,
+    ret = ph_create_hbac_eval_req(NULL,
+                                  test_ctx->user,
                                   test_ctx->targethost,
                                   test_ctx->service,
+                                  NULL,
                                   TEST_BASEDN,
                                   &test_ctx->req);
     assert_int_equal(ret, 0);
@@ -356,9 +421,15 @@ int main(void)
         cmocka_unit_test_setup_teardown(test_create_eval_req_nogroups,
                                         test_create_eval_req_nogroups_setup,
                                         test_create_eval_req_nogroups_teardown),
+        cmocka_unit_test_setup_teardown(test_create_eval_req_lazy,
+                                        test_create_eval_req_nogroups_setup,
+                                        test_create_eval_req_nogroups_teardown),
         cmocka_unit_test_setup_teardown(test_create_eval_req_valid_groups,
                                         test_create_eval_req_valid_groups_setup,
                                         test_create_eval_req_valid_groups_teardown),
+        cmocka_unit_test_setup_teardown(test_create_eval_req_arena,
+                                        test_create_eval_req_valid_groups_setup,
+                                        test_create_eval_req_valid_groups_teardown),
         cmocka_unit_test_setup_teardown(test_create_eval_req_skip_invalid_groups,
                                         test_create_eval_req_invalid_groups_setup,
                                         test_create_eval_req_invalid_groups_teardown),
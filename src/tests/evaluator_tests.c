@@ -0,0 +1,462 @@
+/*
+    Copyright (C) 2026 Jakub Hrozek <jakub.hrozek@posteo.se>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdarg.h>
+#include <errno.h>
+
+#include "pam_hbac.h"
+
+/* Members are drawn from a small pool so that rules and requests overlap.
+ * The pool contains case variants, non-ASCII names and a string that is
+ * not valid UTF-8.
+ */
+static const char *pool[] = {
+    "admins", "ADMINS", "Admins", "devel", "DevEl", "qa",
+    "sshd", "SSHD", "sudo", "client.ipa.test", "Client.IPA.test",
+    "\xc3\x84rger", "\xc3\xa4RGER", "stra\xc3\x9f" "e",
+    "\xff\xfe", NULL,
+};
+
+#define POOL_VALID  14  /* the last entry is invalid */
+#define POOL_SIZE   15
+
+static unsigned int seed;
+
+static unsigned int
+rnd(unsigned int n)
+{
+    /* deterministic, so that failures are reproducible */
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) % n;
+}
+
+static const char **
+rnd_list(size_t max, unsigned int pool_size)
+{
+    const char **list;
+    size_t n;
+    size_t i;
+
+    n = rnd(max + 1);
+    list = calloc(n + 1, sizeof(const char *));
+    assert_non_null(list);
+
+    for (i = 0; i < n; i++) {
+        list[i] = pool[rnd(pool_size)];
+    }
+
+    return list;
+}
+
+static struct hbac_rule_element *
+rnd_rule_element(unsigned int pool_size)
+{
+    struct hbac_rule_element *el;
+
+    /* the reference evaluator reports incomplete rules as errors */
+    if (rnd(40) == 0) {
+        return NULL;
+    }
+
+    el = calloc(1, sizeof(struct hbac_rule_element));
+    assert_non_null(el);
+
+    el->category = rnd(4) == 0 ? HBAC_CATEGORY_ALL : HBAC_CATEGORY_NULL;
+    el->names = rnd_list(2, pool_size);
+    el->groups = rnd_list(3, pool_size);
+    return el;
+}
+
+static void
+free_rule_element(struct hbac_rule_element *el)
+{
+    if (el == NULL) {
+        return;
+    }
+
+    free(el->names);
+    free(el->groups);
+    free(el);
+}
+
+static struct hbac_rule **
+rnd_rules(size_t num_rules, unsigned int pool_size)
+{
+    struct hbac_rule **rules;
+    struct hbac_rule_element *srchosts;
+    char *name;
+    size_t i;
+
+    rules = calloc(num_rules + 1, sizeof(struct hbac_rule *));
+    assert_non_null(rules);
+
+    for (i = 0; i < num_rules; i++) {
+        rules[i] = calloc(1, sizeof(struct hbac_rule));
+        assert_non_null(rules[i]);
+
+        name = malloc(32);
+        assert_non_null(name);
+        snprintf(name, 32, "rule%zu", i);
+        rules[i]->name = name;
+
+        rules[i]->enabled = rnd(8) != 0;
+        rules[i]->users = rnd_rule_element(pool_size);
+        rules[i]->services = rnd_rule_element(pool_size);
+        rules[i]->targethosts = rnd_rule_element(pool_size);
+
+        /* Requests never carry a source host, like in pam_hbac */
+        srchosts = calloc(1, sizeof(struct hbac_rule_element));
+        assert_non_null(srchosts);
+        srchosts->category = HBAC_CATEGORY_ALL;
+        rules[i]->srchosts = srchosts;
+    }
+
+    return rules;
+}
+
+static void
+free_rules(struct hbac_rule **rules)
+{
+    size_t i;
+
+    for (i = 0; rules[i]; i++) {
+        free_rule_element(rules[i]->users);
+        free_rule_element(rules[i]->services);
+        free_rule_element(rules[i]->targethosts);
+        free_rule_element(rules[i]->srchosts);
+        free(discard_const(rules[i]->name));
+        free(rules[i]);
+    }
+    free(rules);
+}
+
+static struct hbac_request_element *
+rnd_req_element(size_t max_groups, unsigned int pool_size)
+{
+    struct hbac_request_element *el;
+
+    el = calloc(1, sizeof(struct hbac_request_element));
+    assert_non_null(el);
+
+    el->name = pool[rnd(pool_size)];
+    el->groups = rnd_list(max_groups, pool_size);
+    return el;
+}
+
+static void
+free_req_element(struct hbac_request_element *el)
+{
+    free(el->groups);
+    free(el);
+}
+
+static void
+assert_same_info(enum hbac_eval_result res,
+                 struct hbac_info *info,
+                 enum hbac_eval_result ref_res,
+                 struct hbac_info *ref_info)
+{
+    assert_int_equal(res, ref_res);
+    assert_non_null(info);
+    assert_non_null(ref_info);
+    assert_int_equal(info->code, ref_info->code);
+    if (ref_info->rule_name == NULL) {
+        assert_null(info->rule_name);
+    } else {
+        assert_non_null(info->rule_name);
+        assert_string_equal(info->rule_name, ref_info->rule_name);
+    }
+}
+
+#define NUM_REQS    20
+
+/* Evaluates reqs against rules and checks the results against the
+ * reference results of hbac_evaluate() with assert_same_info() */
+typedef void (*evaluate_fn)(struct hbac_rule **rules,
+                            struct hbac_eval_req *reqs,
+                            size_t num_reqs,
+                            enum hbac_eval_result *ref_res,
+                            struct hbac_info **ref_info);
+
+static void
+run_equivalence(unsigned int pool_size, evaluate_fn evaluate)
+{
+    struct hbac_rule **rules;
+    struct hbac_eval_req reqs[NUM_REQS];
+    enum hbac_eval_result ref_res[NUM_REQS];
+    struct hbac_info *ref_info[NUM_REQS];
+    size_t num_rules;
+    int iter;
+    int r;
+
+    for (iter = 0; iter < 200; iter++) {
+        /* long rule lists, so that the intersections gallop */
+        num_rules = rnd(150);
+        rules = rnd_rules(num_rules, pool_size);
+
+        /* The plain evaluation is the reference */
+        for (r = 0; r < NUM_REQS; r++) {
+            memset(&reqs[r], 0, sizeof(reqs[r]));
+            reqs[r].user = rnd_req_element(5, pool_size);
+            reqs[r].service = rnd_req_element(2, pool_size);
+            reqs[r].targethost = rnd_req_element(2, pool_size);
+
+            ref_info[r] = NULL;
+            ref_res[r] = hbac_evaluate(rules, &reqs[r], &ref_info[r]);
+        }
+
+        evaluate(rules, reqs, NUM_REQS, ref_res, ref_info);
+
+        for (r = 0; r < NUM_REQS; r++) {
+            hbac_free_info(ref_info[r]);
+            free_req_element(reqs[r].user);
+            free_req_element(reqs[r].service);
+            free_req_element(reqs[r].targethost);
+        }
+        free_rules(rules);
+    }
+}
+
+static void
+assert_evaluate_compiled(struct hbac_compiled_rules *compiled,
+                         struct hbac_eval_req *req,
+                         enum hbac_eval_result ref_res,
+                         struct hbac_info *ref_info)
+{
+    enum hbac_eval_result res;
+    struct hbac_info *info = NULL;
+
+    res = hbac_evaluate_compiled(compiled, req, &info);
+    assert_same_info(res, info, ref_res, ref_info);
+    hbac_free_info(info);
+}
+
+static void
+evaluate_compiled(struct hbac_rule **rules,
+                  struct hbac_eval_req *reqs,
+                  size_t num_reqs,
+                  enum hbac_eval_result *ref_res,
+                  struct hbac_info **ref_info)
+{
+    struct hbac_compiled_rules *compiled;
+    enum hbac_error_code ret;
+    size_t r;
+
+    ret = hbac_compile_rules(rules, &compiled);
+    assert_int_equal(ret, HBAC_SUCCESS);
+
+    for (r = 0; r < num_reqs; r++) {
+        assert_evaluate_compiled(compiled, &reqs[r], ref_res[r], ref_info[r]);
+    }
+
+    hbac_free_compiled_rules(compiled);
+}
+
+static void
+test_compiled_equivalence_valid(void **state)
+{
+    (void) state;
+
+    seed = 1;
+    run_equivalence(POOL_VALID, evaluate_compiled);
+}
+
+static void
+test_compiled_equivalence_invalid(void **state)
+{
+    (void) state;
+
+    seed = 2;
+    run_equivalence(POOL_SIZE, evaluate_compiled);
+}
+
+static const char **
+group_list(size_t first, size_t count, size_t step)
+{
+    const char **list;
+    char *name;
+    size_t i;
+
+    list = calloc(count + 1, sizeof(const char *));
+    assert_non_null(list);
+
+    for (i = 0; i < count; i++) {
+        name = malloc(16);
+        assert_non_null(name);
+        snprintf(name, 16, "G%zu", first + i * step);
+        list[i] = name;
+    }
+
+    return list;
+}
+
+static void
+free_group_list(const char **list)
+{
+    size_t i;
+
+    for (i = 0; list[i]; i++) {
+        free(discard_const(list[i]));
+    }
+    free(list);
+}
+
+static bool
+compiled_match(struct hbac_rule_element *rule_el, const char **groups)
+{
+    struct hbac_rule *rules[2];
+    struct hbac_rule rule;
+    struct hbac_compiled_rules *compiled;
+    struct hbac_request_element req_el;
+    struct hbac_eval_req req;
+    enum hbac_eval_result ref_res;
+    enum hbac_eval_result res;
+
+    memset(&req_el, 0, sizeof(req_el));
+    req_el.name = "nobody";
+    req_el.groups = groups;
+
+    memset(&rule, 0, sizeof(rule));
+    rule.name = "groups";
+    rule.enabled = true;
+    rule.users = rule_el;
+    rule.services = rule_el;
+    rule.targethosts = rule_el;
+    rule.srchosts = rule_el;
+    rules[0] = &rule;
+    rules[1] = NULL;
+
+    memset(&req, 0, sizeof(req));
+    req.user = &req_el;
+    req.service = &req_el;
+    req.targethost = &req_el;
+    req.srchost = &req_el;
+
+    assert_int_equal(hbac_compile_rules(rules, &compiled), HBAC_SUCCESS);
+    res = hbac_evaluate_compiled(compiled, &req, NULL);
+    hbac_free_compiled_rules(compiled);
+
+    ref_res = hbac_evaluate(rules, &req, NULL);
+    assert_int_equal(res, ref_res);
+    return res == HBAC_EVAL_ALLOW;
+}
+
+static void
+test_compiled_groups(void **state)
+{
+    const char *no_names[] = { NULL };
+    struct hbac_rule_element el;
+    const char **groups;
+    const char **req_groups;
+
+    (void) state;
+
+    /* G0, G3, ..., G897 */
+    groups = group_list(0, 300, 3);
+    memset(&el, 0, sizeof(el));
+    el.names = no_names;
+    el.groups = groups;
+
+    req_groups = group_list(1, 3, 300);
+    assert_false(compiled_match(&el, req_groups));
+    free_group_list(req_groups);
+
+    req_groups = group_list(298, 4, 299);
+    assert_true(compiled_match(&el, req_groups));
+    free_group_list(req_groups);
+
+    req_groups = group_list(897, 1, 1);
+    assert_true(compiled_match(&el, req_groups));
+    free_group_list(req_groups);
+
+    req_groups = group_list(1, 200, 3);
+    assert_false(compiled_match(&el, req_groups));
+    free_group_list(req_groups);
+
+    req_groups = group_list(2, 200, 2);
+    assert_true(compiled_match(&el, req_groups));
+    free_group_list(req_groups);
+
+    /* A member that cannot be case folded leaves the rule to the
+     * reference evaluator, which gives the same result */
+    free_group_list(groups);
+    groups = group_list(0, 2, 1);
+    free(discard_const(groups[1]));
+    groups[1] = strdup("\xff\xfe");
+    assert_non_null(groups[1]);
+    el.groups = groups;
+
+    req_groups = group_list(0, 1, 1);
+    assert_true(compiled_match(&el, req_groups));
+    free_group_list(req_groups);
+
+    req_groups = group_list(5, 1, 1);
+    compiled_match(&el, req_groups);
+    free_group_list(req_groups);
+
+    free_group_list(groups);
+}
+
+static void
+test_compiled_no_rules(void **state)
+{
+    struct hbac_rule *rules[] = { NULL };
+    struct hbac_compiled_rules *compiled;
+    struct hbac_request_element user = { "admins", NULL };
+    struct hbac_eval_req req;
+    struct hbac_info *info = NULL;
+    const char *no_groups[] = { NULL };
+    enum hbac_eval_result res;
+    enum hbac_error_code ret;
+
+    (void) state;
+
+    user.groups = no_groups;
+    memset(&req, 0, sizeof(req));
+    req.user = &user;
+    req.service = &user;
+    req.targethost = &user;
+
+    ret = hbac_compile_rules(rules, &compiled);
+    assert_int_equal(ret, HBAC_SUCCESS);
+
+    res = hbac_evaluate_compiled(compiled, &req, &info);
+    assert_int_equal(res, HBAC_EVAL_DENY);
+    assert_null(info->rule_name);
+
+    hbac_free_info(info);
+    hbac_free_compiled_rules(compiled);
+}
+
+int
+main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_compiled_equivalence_valid),
+        cmocka_unit_test(test_compiled_equivalence_invalid),
+        cmocka_unit_test(test_compiled_groups),
+        cmocka_unit_test(test_compiled_no_rules),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
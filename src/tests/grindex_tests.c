@@ -0,0 +1,370 @@
+/*
+    Copyright (C) 2026 Jakub Hrozek <jakub.hrozek@posteo.se>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <grp.h>
+#include <sys/stat.h>
+
+#include "pam_hbac_grindex.h"
+
+#include "common_mock.h"
+
+#define DB_GROUPS \
+    "gr1:x:1001:alice,bob\n" \
+    "gr2:x:1002:bob\n" \
+    "gr3:x:1003:carol,bob,bob\n" \
+    "empty:x:1004:\n" \
+    "+:::\n"
+
+#define DB_GROUPS_NO_GR3 \
+    "gr1:x:1001:alice,bob\n" \
+    "gr2:x:1002:bob\n" \
+    "empty:x:1004:\n"
+
+/* A group that NSS returns from a source other than the group file */
+static char bob[] = "bob";
+static char *remote_members[] = { bob, NULL };
+
+static struct group remote_group = {
+    discard_const("remote"), discard_const("x"), 2001, remote_members
+};
+
+static bool remote_has_bob;
+static bool remote_returned;
+static int getgrent_calls;
+
+void
+__wrap_setgrent(void)
+{
+    remote_returned = false;
+}
+
+struct group *
+__wrap_getgrent(void)
+{
+    getgrent_calls++;
+    if (remote_returned || !remote_has_bob) {
+        return NULL;
+    }
+
+    remote_returned = true;
+    return &remote_group;
+}
+
+void
+__wrap_endgrent(void)
+{
+}
+
+struct grindex_test_ctx {
+    char *dir;
+    char *index_path;
+    char *db_path;
+    char *nss_path;
+};
+
+static void
+write_file(const char *path, const char *contents)
+{
+    FILE *f;
+
+    f = fopen(path, "w");
+    assert_non_null(f);
+    fputs(contents, f);
+    fclose(f);
+}
+
+static ino_t
+index_ino(struct grindex_test_ctx *test_ctx)
+{
+    struct stat st;
+    int ret;
+
+    ret = stat(test_ctx->index_path, &st);
+    assert_int_equal(ret, 0);
+    return st.st_ino;
+}
+
+static int
+test_grindex_setup(void **state)
+{
+    struct grindex_test_ctx *test_ctx;
+
+    test_ctx = calloc(1, sizeof(struct grindex_test_ctx));
+    if (test_ctx == NULL) {
+        return 1;
+    }
+
+    test_ctx->dir = test_tmpdir_new("grindex_tests");
+    if (test_ctx->dir == NULL) {
+        return 1;
+    }
+
+    test_ctx->index_path = test_tmpdir_file(test_ctx->dir, "groups");
+    test_ctx->db_path = test_tmpdir_file(test_ctx->dir, "group");
+    test_ctx->nss_path = test_tmpdir_file(test_ctx->dir, "nsswitch.conf");
+    if (test_ctx->index_path == NULL || test_ctx->db_path == NULL
+            || test_ctx->nss_path == NULL) {
+        return 1;
+    }
+
+    write_file(test_ctx->db_path, DB_GROUPS);
+    write_file(test_ctx->nss_path,
+               "# comments and other databases are skipped\n"
+               "passwd:     files sss\n"
+               "group:      files\n");
+    remote_has_bob = true;
+    getgrent_calls = 0;
+
+    *state = test_ctx;
+    return 0;
+}
+
+static int
+test_grindex_teardown(void **state)
+{
+    struct grindex_test_ctx *test_ctx = *state;
+
+    free(test_ctx->index_path);
+    free(test_ctx->db_path);
+    free(test_ctx->nss_path);
+    test_tmpdir_free(test_ctx->dir);
+    free(test_ctx);
+    return 0;
+}
+
+static int
+lookup_ret(struct grindex_test_ctx *test_ctx,
+           const char *name,
+           gid_t primary_gid,
+           gid_t **_gids,
+           int *_ngroups)
+{
+    return ph_grindex_getgrouplist(NULL, test_ctx->index_path,
+                                   test_ctx->db_path, test_ctx->nss_path,
+                                   name, primary_gid, _gids, _ngroups);
+}
+
+static int
+lookup(struct grindex_test_ctx *test_ctx,
+       const char *name,
+       gid_t primary_gid,
+       gid_t **_gids)
+{
+    int ngroups;
+    int ret;
+
+    ret = lookup_ret(test_ctx, name, primary_gid, _gids, &ngroups);
+    assert_int_equal(ret, 0);
+    return ngroups;
+}
+
+static void
+test_grindex_lookup(void **state)
+{
+    struct grindex_test_ctx *test_ctx = *state;
+    gid_t *gids;
+    int ngroups;
+    ino_t ino;
+
+    /* The first lookup reads the group file and writes the index */
+    ngroups = lookup(test_ctx, "bob", 500, &gids);
+    assert_int_equal(ngroups, 4);
+    assert_int_equal(gids[0], 500);
+    assert_int_equal(gids[1], 1001);
+    assert_int_equal(gids[2], 1002);
+    assert_int_equal(gids[3], 1003);
+    free(gids);
+    ino = index_ino(test_ctx);
+
+    /* The next ones only read the index */
+    ngroups = lookup(test_ctx, "alice", 500, &gids);
+    assert_int_equal(ngroups, 2);
+    assert_int_equal(gids[0], 500);
+    assert_int_equal(gids[1], 1001);
+    free(gids);
+
+    /* The primary group is not listed twice */
+    ngroups = lookup(test_ctx, "carol", 1003, &gids);
+    assert_int_equal(ngroups, 1);
+    assert_int_equal(gids[0], 1003);
+    free(gids);
+
+    ngroups = lookup(test_ctx, "nobody", 600, &gids);
+    assert_int_equal(ngroups, 1);
+    assert_int_equal(gids[0], 600);
+    free(gids);
+
+    assert_int_equal(index_ino(test_ctx), ino);
+    assert_int_equal(getgrent_calls, 0);
+}
+
+static void
+test_grindex_rebuild(void **state)
+{
+    struct grindex_test_ctx *test_ctx = *state;
+    gid_t *gids;
+    int ngroups;
+    ino_t ino;
+
+    ngroups = lookup(test_ctx, "carol", 500, &gids);
+    assert_int_equal(ngroups, 2);
+    free(gids);
+    ino = index_ino(test_ctx);
+
+    /* gr3 is removed from the database */
+    write_file(test_ctx->db_path, DB_GROUPS_NO_GR3);
+
+    ngroups = lookup(test_ctx, "carol", 500, &gids);
+    assert_int_equal(ngroups, 1);
+    free(gids);
+    assert_int_not_equal(index_ino(test_ctx), ino);
+    ino = index_ino(test_ctx);
+
+    ngroups = lookup(test_ctx, "bob", 500, &gids);
+    assert_int_equal(ngroups, 3);
+    free(gids);
+    assert_int_equal(index_ino(test_ctx), ino);
+}
+
+static void
+test_grindex_other_sources(void **state)
+{
+    struct grindex_test_ctx *test_ctx = *state;
+    struct stat before, after;
+    gid_t *gids = NULL;
+    int ngroups;
+    int i;
+    int ret;
+
+    /* Only the group file is indexed, never the groups of other sources */
+    ngroups = lookup(test_ctx, "bob", 500, &gids);
+    assert_int_equal(ngroups, 4);
+    for (i = 0; i < ngroups; i++) {
+        assert_int_not_equal(gids[i], 2001);
+    }
+    free(gids);
+    assert_int_equal(getgrent_calls, 0);
+
+    /* With another source, a membership is revoked there while the group
+     * file stays the same. The index must not be used, the caller walks
+     * the groups and does not find the revoked membership.
+     */
+    ret = stat(test_ctx->db_path, &before);
+    assert_int_equal(ret, 0);
+    write_file(test_ctx->nss_path,
+               "group: files [SUCCESS=merge] ldap # or sss\n");
+    remote_has_bob = false;
+    ret = stat(test_ctx->db_path, &after);
+    assert_int_equal(ret, 0);
+    assert_int_equal(before.st_mtime, after.st_mtime);
+    assert_int_equal(before.st_size, after.st_size);
+    assert_int_equal(before.st_ino, after.st_ino);
+
+    ret = lookup_ret(test_ctx, "bob", 500, &gids, &ngroups);
+    assert_int_equal(ret, EOPNOTSUPP);
+
+    /* The compat source reads NIS entries from the group file */
+    write_file(test_ctx->nss_path, "group: compat\n");
+    ret = lookup_ret(test_ctx, "bob", 500, &gids, &ngroups);
+    assert_int_equal(ret, EOPNOTSUPP);
+
+    /* Without a group line the default sources are not known */
+    write_file(test_ctx->nss_path, "passwd: files\n");
+    ret = lookup_ret(test_ctx, "bob", 500, &gids, &ngroups);
+    assert_int_equal(ret, EOPNOTSUPP);
+
+    unlink(test_ctx->nss_path);
+    ret = lookup_ret(test_ctx, "bob", 500, &gids, &ngroups);
+    assert_int_equal(ret, EOPNOTSUPP);
+
+    write_file(test_ctx->nss_path, "group:files [NOTFOUND=return]\n");
+    ngroups = lookup(test_ctx, "bob", 500, &gids);
+    assert_int_equal(ngroups, 4);
+    free(gids);
+    assert_int_equal(getgrent_calls, 0);
+}
+
+static void
+test_grindex_unusable(void **state)
+{
+    struct grindex_test_ctx *test_ctx = *state;
+    gid_t *gids;
+    int ngroups;
+    ino_t ino;
+    int ret;
+    FILE *f;
+
+    f = fopen(test_ctx->index_path, "w");
+    assert_non_null(f);
+    fprintf(f, "this is not a group index\n");
+    fclose(f);
+    ino = index_ino(test_ctx);
+
+    /* A corrupt index is replaced */
+    ngroups = lookup(test_ctx, "bob", 500, &gids);
+    assert_int_equal(ngroups, 4);
+    free(gids);
+    assert_int_not_equal(index_ino(test_ctx), ino);
+
+    /* An index writable by others is not trusted */
+    ret = chmod(test_ctx->index_path, 0666);
+    assert_int_equal(ret, 0);
+    ino = index_ino(test_ctx);
+    ngroups = lookup(test_ctx, "bob", 500, &gids);
+    assert_int_equal(ngroups, 4);
+    free(gids);
+    assert_int_not_equal(index_ino(test_ctx), ino);
+
+    /* Without a group database the caller walks the groups itself */
+    ret = ph_grindex_getgrouplist(NULL, test_ctx->index_path,
+                                  "/nonexistent/group", test_ctx->nss_path,
+                                  "bob", 500, &gids, &ngroups);
+    assert_int_equal(ret, ENOENT);
+}
+
+int
+main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_grindex_lookup,
+                                        test_grindex_setup,
+                                        test_grindex_teardown),
+        cmocka_unit_test_setup_teardown(test_grindex_rebuild,
+                                        test_grindex_setup,
+                                        test_grindex_teardown),
+        cmocka_unit_test_setup_teardown(test_grindex_other_sources,
+                                        test_grindex_setup,
+                                        test_grindex_teardown),
+        cmocka_unit_test_setup_teardown(test_grindex_unusable,
+                                        test_grindex_setup,
+                                        test_grindex_teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
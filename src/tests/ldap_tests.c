@@ -24,9 +24,12 @@
 #include <cmocka.h>
 
 #include <errno.h>
+#include <unistd.h>
 #include "pam_hbac.h"
 #include "pam_hbac_entry.h"
 #include "pam_hbac_ldap.h"
+#include "pam_hbac_pool.h"
+#include "pam_hbac_scoreboard.h"
 
 #include "common_mock.h"
 
@@ -36,6 +39,25 @@
 
 LDAPMessage *dummy_ent = (LDAPMessage *) 0xdeadbeef;
 
+/* Descriptor reported for LDAP_OPT_DESC, the pool polls it */
+static int mock_ldap_fd = -1;
+/* Descriptors handed out one per LDAP_OPT_DESC call before mock_ldap_fd */
+static int mock_fd_queue[4];
+static size_t mock_fd_queued;
+static size_t mock_fd_next;
+/* Written to once the last queued descriptor was handed out */
+static int mock_fd_wake = -1;
+static pid_t mock_pid = 1000;
+static int bind_count;
+static int unbind_count;
+static int search_msgid;
+static int abandoned_msgid = -1;
+static int search_done_msg;
+static int mock_result_code = LDAP_OTHER;
+/* Network timeouts set on LDAP handles, in milliseconds */
+static long net_timeouts[4];
+static size_t num_net_timeouts;
+
 struct mock_ldap_attr {
     const char *name;
     const char **values;
@@ -186,6 +208,73 @@ __wrap_ldap_get_dn(LDAP *ld, LDAPMessage *entry)
     return ph_mock_ptr_type(char *);
 }
 
+/* The position of the attribute iteration of a borrowed entry */
+struct mock_ber_iter {
+    struct mock_ldap_entry *entry;
+    size_t idx;
+};
+
+static struct mock_ber_iter mock_ber;
+
+int
+__wrap_ldap_get_dn_ber(LDAP *ld, LDAPMessage *entry,
+                       BerElement **berout, struct berval *dn)
+{
+    struct mock_ldap_entry *mock_entry = (struct mock_ldap_entry *) entry;
+
+    mock_ber.entry = mock_entry;
+    mock_ber.idx = 0;
+    *berout = (BerElement *) &mock_ber;
+
+    dn->bv_val = discard_const(mock_entry->dn);
+    dn->bv_len = strlen(mock_entry->dn);
+    return LDAP_SUCCESS;
+}
+
+int
+__wrap_ldap_get_attribute_ber(LDAP *ld, LDAPMessage *entry, BerElement *ber,
+                              struct berval *attr, struct berval **vals)
+{
+    struct mock_ber_iter *iter = (struct mock_ber_iter *) ber;
+    struct mock_ldap_attr *mock_attr;
+    size_t count, i;
+
+    if (iter->entry->attrs == NULL
+            || iter->entry->attrs[iter->idx].name == NULL) {
+        attr->bv_val = NULL;
+        attr->bv_len = 0;
+        return LDAP_SUCCESS;
+    }
+
+    mock_attr = &iter->entry->attrs[iter->idx++];
+    attr->bv_val = discard_const(mock_attr->name);
+    attr->bv_len = strlen(mock_attr->name);
+
+    for (count = 0; mock_attr->values[count] != NULL; count++) ;
+    if (count == 0) {
+        *vals = NULL;
+        return LDAP_SUCCESS;
+    }
+
+    /* The values point into the mock entry like they would into the
+     * message
+     */
+    *vals = calloc(count + 1, sizeof(struct berval));
+    assert_non_null(*vals);
+    for (i = 0; i < count; i++) {
+        (*vals)[i].bv_val = discard_const(mock_attr->values[i]);
+        (*vals)[i].bv_len = strlen(mock_attr->values[i]);
+    }
+
+    return LDAP_SUCCESS;
+}
+
+void
+__wrap_ber_memfree(void *p)
+{
+    free(p);
+}
+
 LDAPMessage *
 __wrap_ldap_first_message(LDAP *ld, LDAPMessage *chain)
 {
@@ -219,6 +308,7 @@ __wrap_ldap_sasl_bind_s(LDAP *ld, const char *dn, const char *mechanism,
         return -1;
     }
 
+    bind_count++;
     return LDAP_SUCCESS;
 }
 
@@ -231,26 +321,41 @@ __wrap_ldap_unbind_ext(LDAP *ld, LDAPControl *sctrls[],
 {
     assert_non_null(ld);
     __real_ldap_unbind_ext(ld, NULL, NULL);
+    unbind_count++;
 
     return 0;
 }
 
 int
-__wrap_ldap_search_ext_s(LDAP *ld, const char *base, int scope,
-                         const char *filter, char **attrs,
-                         int attrsonly, LDAPControl **sctrls,
-                         LDAPControl **cctrls, struct timeval *timeout,
-                         int sizelimit, LDAPMessage **res)
+__wrap_ldap_search_ext(LDAP *ld, const char *base, int scope,
+                       const char *filter, char **attrs,
+                       int attrsonly, LDAPControl **sctrls,
+                       LDAPControl **cctrls, struct timeval *timeout,
+                       int sizelimit, int *msgidp)
 {
     assert_non_null(ld);
     assert_non_null(base);
     assert_non_null(filter);
     assert_non_null(attrs);
-    *res = (LDAPMessage *) ph_mock_type(uintptr_t);
+    *msgidp = ++search_msgid;
 
     return ph_mock_type(int);
 }
 
+int
+__wrap_ldap_abandon_ext(LDAP *ld, int msgid,
+                        LDAPControl **sctrls, LDAPControl **cctrls)
+{
+    abandoned_msgid = msgid;
+    return LDAP_SUCCESS;
+}
+
+int
+__wrap_ldap_msgfree(LDAPMessage *msg)
+{
+    return LDAP_RES_SEARCH_RESULT;
+}
+
 int
 __wrap_ldap_tls_inplace(LDAP *ld)
 {
@@ -272,11 +377,39 @@ __wrap_ldap_install_tls(LDAP *ld)
     return LDAP_SUCCESS;
 }
 
+int
+__real_ldap_set_option(LDAP *ld, int option, const void *invalue);
+int
+__wrap_ldap_set_option(LDAP *ld, int option, const void *invalue)
+{
+    const struct timeval *tv;
+
+    if (option == LDAP_OPT_NETWORK_TIMEOUT
+            && num_net_timeouts < sizeof(net_timeouts) / sizeof(long)) {
+        tv = invalue;
+        net_timeouts[num_net_timeouts++] = tv->tv_sec * 1000
+                                           + tv->tv_usec / 1000;
+    }
+
+    return __real_ldap_set_option(ld, option, invalue);
+}
+
 int
 __wrap_ldap_get_option(LDAP *ld, int option, void *outvalue)
 {
     if (option == PH_DIAGNOSTIC_MESSAGE) {
         *(char **) outvalue = ph_mock_ptr_type(char *);
+    } else if (option == LDAP_OPT_DESC) {
+        if (mock_fd_next < mock_fd_queued) {
+            *(int *) outvalue = mock_fd_queue[mock_fd_next++];
+            if (mock_fd_next == mock_fd_queued && mock_fd_wake != -1) {
+                assert_int_equal(write(mock_fd_wake, "x", 1), 1);
+            }
+        } else {
+            *(int *) outvalue = mock_ldap_fd;
+        }
+    } else if (option == PH_RESULT_CODE) {
+        *(int *) outvalue = mock_result_code;
     }
 
     return LDAP_SUCCESS;
@@ -298,7 +431,23 @@ int
 __wrap_ldap_result(LDAP *ld, int msgid, int all,
                    struct timeval *timeout, LDAPMessage **result)
 {
-    return ph_mock_type(int);
+    int ret;
+
+    ret = ph_mock_type(int);
+    if (ret == LDAP_RES_SEARCH_RESULT || ret == LDAP_RES_SEARCH_ENTRY) {
+        check_expected(msgid);
+        *result = ph_mock_ptr_type(LDAPMessage *);
+    } else {
+        *result = NULL;
+    }
+
+    return ret;
+}
+
+pid_t
+__wrap_getpid(void)
+{
+    return mock_pid;
 }
 
 static void
@@ -370,7 +519,17 @@ test_search_teardown(void **state)
 }
 
 static void
-will_return_entry_msg_array(struct mock_ldap_msg_array *msgs)
+will_return_search(int msgid, int errcode)
+{
+    will_return(__wrap_ldap_result, LDAP_RES_SEARCH_RESULT);
+    expect_value(__wrap_ldap_result, msgid, msgid);
+    will_return(__wrap_ldap_result, &search_done_msg);
+    will_return(__wrap_ldap_parse_result, errcode);
+    will_return(__wrap_ldap_parse_result, NULL);
+}
+
+static void
+will_return_entries(struct mock_ldap_msg_array *msgs)
 {
     size_t count;
 
@@ -386,12 +545,18 @@ will_return_entry_msg_array(struct mock_ldap_msg_array *msgs)
     }
     will_return(__wrap_ldap_next_message, NULL);
 
-    will_return(__wrap_ldap_search_ext_s, count);
-    will_return(__wrap_ldap_search_ext_s, 0);
-
     will_return(__wrap_ldap_count_entries, count);
 }
 
+static void
+will_return_entry_msg_array(struct mock_ldap_msg_array *msgs)
+{
+    will_return_entries(msgs);
+    will_return(__wrap_ldap_search_ext, LDAP_SUCCESS);
+    will_return_search(search_msgid + 1, LDAP_SUCCESS);
+}
+
+
 static void
 assert_entry_attr_vals(struct ph_entry *e,
                        int attr_index,
@@ -470,6 +635,54 @@ test_search_host_full(void **state)
     ph_entry_array_free(entry_list);
 }
 
+static void
+test_search_attr_case(void **state)
+{
+    int ret;
+    struct ph_entry **entry_list;
+    struct search_test_ctx *test_ctx = *state;
+
+    const char *oc_values[] = { "top",
+                                "ipaHost",
+                                NULL };
+    const char *fqdn_values[] = { "client.ipa.test",
+                                  NULL };
+    const char *memberof_values[] = { "cn=servers,cn=hostgroups,cn=accounts,dc=ipa,dc=test",
+                                      NULL };
+    const char *other_values[] = { "something",
+                                   NULL };
+    /* Attribute names are matched regardless of case */
+    struct mock_ldap_attr test_ipa_host_attrs[] = {
+        { .name = "OBJECTCLASS", .values = oc_values },
+        { .name = "description", .values = other_values },
+        { .name = "FQDN", .values = fqdn_values },
+        { .name = "memberof", .values = memberof_values },
+        { NULL, NULL }
+    };
+    struct mock_ldap_entry test_ipa_host;
+    struct mock_ldap_entry *ldap_result[] = { &test_ipa_host, NULL };
+    struct mock_ldap_msg_array test_msg = {
+        .array = ldap_result,
+        .index = 0
+    };
+
+    test_ipa_host.dn = "fqdn=client.ipa.test,cn=computers,dc=ipa,dc=test";
+    test_ipa_host.attrs = test_ipa_host_attrs;
+
+    will_return_entry_msg_array(&test_msg);
+
+    ret = ph_search(NULL, test_ctx->ctx.ld, test_ctx->ctx.pc, &test_search_obj,
+                    "fqdn=client.ipa.test", &entry_list);
+    assert_int_equal(ret, 0);
+    assert_int_equal(ph_num_entries(entry_list), 1);
+
+    assert_entry_attr_vals(entry_list[0], PH_MAP_HOST_OC, oc_values);
+    assert_entry_attr_vals(entry_list[0], PH_MAP_HOST_FQDN, fqdn_values);
+    assert_entry_attr_vals(entry_list[0], PH_MAP_HOST_MEMBEROF, memberof_values);
+
+    ph_entry_array_free(entry_list);
+}
+
 static void
 test_search_host_no_memberof(void **state)
 {
@@ -591,8 +804,7 @@ test_search_host_search_fail(void **state)
     struct ph_entry **entry_list = NULL;
     struct search_test_ctx *test_ctx = *state;
 
-    will_return(__wrap_ldap_search_ext_s, NULL);
-    will_return(__wrap_ldap_search_ext_s, EIO);
+    will_return(__wrap_ldap_search_ext, LDAP_OTHER);
 
     ret = ph_search(NULL, test_ctx->ctx.ld, test_ctx->ctx.pc, &test_search_obj,
                     "fqdn=client.ipa.test", &entry_list);
@@ -600,6 +812,303 @@ test_search_host_search_fail(void **state)
     assert_null(entry_list);
 }
 
+static void
+test_search_server_down(void **state)
+{
+    int ret;
+    struct ph_entry **entry_list = NULL;
+    struct search_test_ctx *test_ctx = *state;
+
+    /* The connection dropped while waiting for the result */
+    will_return(__wrap_ldap_search_ext, LDAP_SUCCESS);
+    will_return(__wrap_ldap_result, -1);
+    mock_result_code = LDAP_SERVER_DOWN;
+
+    ret = ph_search(NULL, test_ctx->ctx.ld, test_ctx->ctx.pc, &test_search_obj,
+                    "fqdn=client.ipa.test", &entry_list);
+    mock_result_code = LDAP_OTHER;
+    assert_int_equal(ret, ENOTCONN);
+    assert_null(entry_list);
+
+    /* The server reported a failure of the search itself */
+    will_return(__wrap_ldap_search_ext, LDAP_SUCCESS);
+    will_return_search(search_msgid + 1, LDAP_UNWILLING_TO_PERFORM);
+
+    ret = ph_search(NULL, test_ctx->ctx.ld, test_ctx->ctx.pc, &test_search_obj,
+                    "fqdn=client.ipa.test", &entry_list);
+    assert_int_equal(ret, EIO);
+    assert_null(entry_list);
+}
+
+static void
+test_search_pipelined(void **state)
+{
+    int ret;
+    int msgid_empty;
+    int msgid_host;
+    int msgid_abandoned;
+    struct ph_entry **entry_list = NULL;
+    struct search_test_ctx *test_ctx = *state;
+
+    const char *oc_values[] = { "top",
+                                "ipaHost",
+                                NULL };
+    const char *fqdn_values[] = { "client.ipa.test",
+                                  NULL };
+    const char *memberof_values[] = { NULL };
+    struct mock_ldap_attr test_ipa_host_attrs[] = {
+        { .name = "objectClass", .values = oc_values },
+        { .name = "fqdn", .values = fqdn_values },
+        { .name = "memberOf", .values = memberof_values },
+        { NULL, NULL }
+    };
+    struct mock_ldap_entry test_ipa_host;
+    struct mock_ldap_entry *ldap_result[] = { &test_ipa_host, NULL };
+    struct mock_ldap_msg_array test_msg = {
+        .array = ldap_result,
+        .index = 0
+    };
+
+    test_ipa_host.dn = "fqdn=client.ipa.test,cn=computers,dc=ipa,dc=test";
+    test_ipa_host.attrs = test_ipa_host_attrs;
+
+    will_return_count(__wrap_ldap_search_ext, LDAP_SUCCESS, 3);
+    ret = ph_search_send(NULL, test_ctx->ctx.ld, test_ctx->ctx.pc,
+                         &test_search_obj, "fqdn=other.ipa.test",
+                         &msgid_empty);
+    assert_int_equal(ret, 0);
+    ret = ph_search_send(NULL, test_ctx->ctx.ld, test_ctx->ctx.pc,
+                         &test_search_obj, "fqdn=client.ipa.test",
+                         &msgid_host);
+    assert_int_equal(ret, 0);
+    ret = ph_search_send(NULL, test_ctx->ctx.ld, test_ctx->ctx.pc,
+                         &test_search_obj, "fqdn=unused.ipa.test",
+                         &msgid_abandoned);
+    assert_int_equal(ret, 0);
+
+    /* Results are collected per message ID, in any order */
+    will_return_entries(&test_msg);
+    will_return_search(msgid_host, LDAP_SUCCESS);
+    ret = ph_search_recv(NULL, test_ctx->ctx.ld, &test_search_obj,
+                         msgid_host, NULL, &entry_list);
+    assert_int_equal(ret, 0);
+    assert_int_equal(ph_num_entries(entry_list), 1);
+    assert_entry_attr_vals(entry_list[0], PH_MAP_HOST_FQDN, fqdn_values);
+    ph_entry_array_free(entry_list);
+
+    will_return_search(msgid_empty, LDAP_NO_SUCH_OBJECT);
+    will_return(__wrap_ldap_count_entries, 0);
+    ret = ph_search_recv(NULL, test_ctx->ctx.ld, &test_search_obj,
+                         msgid_empty, NULL, &entry_list);
+    assert_int_equal(ret, 0);
+    assert_int_equal(ph_num_entries(entry_list), 0);
+    ph_entry_array_free(entry_list);
+
+    abandoned_msgid = -1;
+    ph_search_abandon(NULL, test_ctx->ctx.ld, -1);
+    assert_int_equal(abandoned_msgid, -1);
+    ph_search_abandon(NULL, test_ctx->ctx.ld, msgid_abandoned);
+    assert_int_equal(abandoned_msgid, msgid_abandoned);
+}
+
+struct stream_test_ctx {
+    const char *fqdns[4];
+    size_t num_entries;
+    int ret;
+};
+
+static int
+stream_test_entry(struct ph_entry *entry, void *pvt)
+{
+    struct stream_test_ctx *st = pvt;
+    struct ph_attr *fqdn;
+
+    fqdn = ph_entry_get_attr(entry, PH_MAP_HOST_FQDN);
+    assert_non_null(fqdn);
+    assert_string_equal(fqdn->vals[0]->bv_val, st->fqdns[st->num_entries]);
+    st->num_entries++;
+
+    ph_entry_free(entry);
+    return st->ret;
+}
+
+static void
+will_return_stream_entry(int msgid, struct mock_ldap_entry *entry)
+{
+    will_return(__wrap_ldap_result, LDAP_RES_SEARCH_ENTRY);
+    expect_value(__wrap_ldap_result, msgid, msgid);
+    will_return(__wrap_ldap_result, entry);
+    will_return(__wrap_ldap_msgtype, LDAP_RES_SEARCH_ENTRY);
+#ifndef HAVE_LDAP_GET_ATTRIBUTE_BER
+    will_return(__wrap_ldap_get_dn, entry->dn);
+#endif
+}
+
+static void
+test_search_stream(void **state)
+{
+    int ret;
+    int msgid;
+    struct search_test_ctx *test_ctx = *state;
+    struct stream_test_ctx st = {
+        .fqdns = { "client.ipa.test", "other.ipa.test", NULL },
+    };
+
+    const char *oc_values[] = { "top",
+                                "ipaHost",
+                                NULL };
+    const char *no_oc_values[] = { "top",
+                                   NULL };
+    const char *client_values[] = { "client.ipa.test",
+                                    NULL };
+    const char *other_values[] = { "other.ipa.test",
+                                   NULL };
+    struct mock_ldap_attr client_attrs[] = {
+        { .name = "objectClass", .values = oc_values },
+        { .name = "fqdn", .values = client_values },
+        { NULL, NULL }
+    };
+    struct mock_ldap_attr other_attrs[] = {
+        { .name = "objectClass", .values = oc_values },
+        { .name = "fqdn", .values = other_values },
+        { NULL, NULL }
+    };
+    struct mock_ldap_attr no_oc_attrs[] = {
+        { .name = "objectClass", .values = no_oc_values },
+        { .name = "fqdn", .values = other_values },
+        { NULL, NULL }
+    };
+    struct mock_ldap_entry client = {
+        .dn = "fqdn=client.ipa.test,cn=computers,dc=ipa,dc=test",
+        .attrs = client_attrs,
+    };
+    struct mock_ldap_entry other = {
+        .dn = "fqdn=other.ipa.test,cn=computers,dc=ipa,dc=test",
+        .attrs = other_attrs,
+    };
+    struct mock_ldap_entry no_oc = {
+        .dn = "fqdn=no-oc.ipa.test,cn=computers,dc=ipa,dc=test",
+        .attrs = no_oc_attrs,
+    };
+
+    /* Entries are handed over one at a time, an entry of the wrong
+     * objectclass is skipped
+     */
+    will_return(__wrap_ldap_search_ext, LDAP_SUCCESS);
+    ret = ph_search_send(NULL, test_ctx->ctx.ld, test_ctx->ctx.pc,
+                         &test_search_obj, "fqdn=*", &msgid);
+    assert_int_equal(ret, 0);
+
+    will_return_stream_entry(msgid, &client);
+    will_return_stream_entry(msgid, &no_oc);
+    will_return_stream_entry(msgid, &other);
+    will_return_search(msgid, LDAP_SUCCESS);
+    will_return(__wrap_ldap_msgtype, LDAP_RES_SEARCH_RESULT);
+    ret = ph_search_recv_each(NULL, test_ctx->ctx.ld, &test_search_obj,
+                              msgid, NULL, stream_test_entry, &st);
+    assert_int_equal(ret, 0);
+    assert_int_equal(st.num_entries, 2);
+
+    /* A callback failure ends the search and abandons the rest */
+    st.num_entries = 0;
+    st.ret = ENOMEM;
+    will_return(__wrap_ldap_search_ext, LDAP_SUCCESS);
+    ret = ph_search_send(NULL, test_ctx->ctx.ld, test_ctx->ctx.pc,
+                         &test_search_obj, "fqdn=*", &msgid);
+    assert_int_equal(ret, 0);
+
+    abandoned_msgid = -1;
+    will_return_stream_entry(msgid, &client);
+    ret = ph_search_recv_each(NULL, test_ctx->ctx.ld, &test_search_obj,
+                              msgid, NULL, stream_test_entry, &st);
+    assert_int_equal(ret, ENOMEM);
+    assert_int_equal(st.num_entries, 1);
+    assert_int_equal(abandoned_msgid, msgid);
+
+    /* A missing search base is an empty result */
+    st.num_entries = 0;
+    st.ret = 0;
+    will_return(__wrap_ldap_search_ext, LDAP_SUCCESS);
+    ret = ph_search_send(NULL, test_ctx->ctx.ld, test_ctx->ctx.pc,
+                         &test_search_obj, "fqdn=*", &msgid);
+    assert_int_equal(ret, 0);
+
+    will_return_search(msgid, LDAP_NO_SUCH_OBJECT);
+    will_return(__wrap_ldap_msgtype, LDAP_RES_SEARCH_RESULT);
+    ret = ph_search_recv_each(NULL, test_ctx->ctx.ld, &test_search_obj,
+                              msgid, NULL, stream_test_entry, &st);
+    assert_int_equal(ret, 0);
+    assert_int_equal(st.num_entries, 0);
+}
+
+static void
+test_deadline(void **state)
+{
+    int ret;
+    int msgid;
+    struct pam_hbac_ctx ctx;
+    struct pam_hbac_config pc;
+    struct ph_entry **entry_list = NULL;
+    struct timeval buf;
+    struct timeval *left;
+
+    (void) state; /* unused */
+
+    set_dummy_config(&pc);
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.pc = &pc;
+
+    /* No budget configured */
+    ph_deadline_start(&ctx);
+    ret = ph_deadline_left(&ctx, "testing", &buf, &left);
+    assert_int_equal(ret, 0);
+    assert_null(left);
+
+    pc.timeout = 5;
+    ph_deadline_start(&ctx);
+    ret = ph_deadline_left(&ctx, "testing", &buf, &left);
+    assert_int_equal(ret, 0);
+    assert_ptr_equal(left, &buf);
+    assert_true(buf.tv_sec <= 5);
+    assert_string_equal(ctx.stage, "testing");
+
+    /* The server does not answer StartTLS in time */
+    mock_tls(0, 0, NULL);
+    ret = ph_connect(&ctx);
+    assert_int_equal(ret, ETIMEDOUT);
+    assert_null(ctx.ld);
+    assert_string_equal(ctx.stage, "starting TLS");
+
+    /* A search does not finish in time */
+    assert_connect(&ctx);
+    will_return(__wrap_ldap_search_ext, LDAP_SUCCESS);
+    ret = ph_search_send(NULL, ctx.ld, &pc, &test_search_obj,
+                         "fqdn=client.ipa.test", &msgid);
+    assert_int_equal(ret, 0);
+    will_return(__wrap_ldap_result, 0);
+    ret = ph_search_recv(NULL, ctx.ld, &test_search_obj, msgid, &buf,
+                         &entry_list);
+    assert_int_equal(ret, ETIMEDOUT);
+    assert_null(entry_list);
+
+    /* A handle with a timed out request is never pooled */
+    pc.pool_idle_timeout = 60;
+    unbind_count = 0;
+    ctx.ld_broken = true;
+    ph_disconnect(&ctx);
+    assert_null(ctx.ld);
+    assert_int_equal(unbind_count, 1);
+    pc.pool_idle_timeout = 0;
+
+    /* The budget is spent before connecting */
+    ctx.deadline.tv_sec = 1;
+    ctx.deadline.tv_nsec = 0;
+    ret = ph_connect(&ctx);
+    assert_int_equal(ret, ETIMEDOUT);
+    assert_null(ctx.ld);
+    assert_string_equal(ctx.stage, "connecting");
+}
+
 static void
 test_connect(void **state)
 {
@@ -637,23 +1146,489 @@ test_connect(void **state)
     assert_null(ctx.ld);
 }
 
+static void
+test_connect_failover(void **state)
+{
+    struct pam_hbac_ctx ctx;
+    struct pam_hbac_config pc;
+    char *uris[2];
+    const char *ranked[2];
+    char path[] = "ldap_tests_servers";
+
+    (void) state; /* unused */
+
+    set_dummy_config(&pc);
+    uris[0] = discard_const("http://broken.ipa.test");
+    uris[1] = discard_const(LDAP_URI);
+    pc.uris = uris;
+    pc.num_uris = 2;
+    pc.scoreboard_path = path;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.pc = &pc;
+
+    /* The first server cannot be used, the second one is */
+    assert_connect(&ctx);
+    assert_string_equal(ctx.server, LDAP_URI);
+    ph_disconnect(&ctx);
+
+    /* The broken server is tried last now */
+    ranked[0] = uris[0];
+    ranked[1] = uris[1];
+    ph_scoreboard_rank(&ctx, ranked, 2);
+    assert_string_equal(ranked[0], LDAP_URI);
+    assert_string_equal(ranked[1], "http://broken.ipa.test");
+
+    unlink(path);
+}
+
+static void
+test_connect_hedged(void **state)
+{
+    int ret;
+    struct pam_hbac_ctx ctx;
+    struct pam_hbac_config pc;
+    char *uris[2];
+    char path[] = "ldap_tests_servers";
+    int slow[2];
+    int fast[2];
+    ssize_t n;
+
+    (void) state; /* unused */
+
+    ret = pipe(slow);
+    assert_int_equal(ret, 0);
+    ret = pipe(fast);
+    assert_int_equal(ret, 0);
+
+    /* The first server never answers, the second one has a reply ready */
+    n = write(fast[1], "x", 1);
+    assert_int_equal(n, 1);
+    mock_fd_queue[0] = slow[0];
+    mock_fd_queue[1] = fast[0];
+    mock_fd_queued = 2;
+    mock_fd_next = 0;
+
+    set_dummy_config(&pc);
+    uris[0] = discard_const("ldap://slow.ipa.test");
+    uris[1] = discard_const("ldap://fast.ipa.test");
+    pc.uris = uris;
+    pc.num_uris = 2;
+    pc.hedge_delay = 10;
+    pc.scoreboard_path = path;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.pc = &pc;
+
+    bind_count = 0;
+    unbind_count = 0;
+    num_net_timeouts = 0;
+    assert_connect(&ctx);
+    assert_string_equal(ctx.server, "ldap://fast.ipa.test");
+    assert_int_equal(mock_fd_next, 2);
+    /* Connecting to the first server may not take longer than the hedge
+     * delay, the last one has no deadline
+     */
+    assert_int_equal(num_net_timeouts, 1);
+    assert_int_equal(net_timeouts[0], 10);
+    /* The slow server's handle was dropped */
+    assert_int_equal(unbind_count, 1);
+    assert_int_equal(bind_count, 1);
+    ph_disconnect(&ctx);
+
+    mock_fd_queued = 0;
+    mock_fd_next = 0;
+    close(slow[0]);
+    close(slow[1]);
+    close(fast[0]);
+    close(fast[1]);
+    unlink(path);
+}
+
+static void
+test_connect_hedged_refused(void **state)
+{
+    int ret;
+    struct pam_hbac_ctx ctx;
+    struct pam_hbac_config pc;
+    char *uris[2];
+    const char *ranked[2];
+    char path[] = "ldap_tests_servers";
+    int refused[2];
+    int fast[2];
+    ssize_t n;
+
+    (void) state; /* unused */
+
+    ret = pipe(refused);
+    assert_int_equal(ret, 0);
+    ret = pipe(fast);
+    assert_int_equal(ret, 0);
+
+    set_dummy_config(&pc);
+    uris[0] = discard_const("ldap://refused.ipa.test");
+    uris[1] = discard_const("ldap://fast.ipa.test");
+    pc.uris = uris;
+    pc.num_uris = 2;
+    pc.hedge_delay = 10;
+    pc.scoreboard_path = path;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.pc = &pc;
+
+    /* Without failures the refused server would keep being tried first */
+    ph_scoreboard_report(&ctx, uris[0], PH_SERVER_SEARCH, 1, true);
+    ph_scoreboard_report(&ctx, uris[1], PH_SERVER_SEARCH, 10000000, true);
+
+    /* The first server answers only once the hedge fired, so that both
+     * replies are read in the same pass. Its connection was refused.
+     */
+    n = write(fast[1], "x", 1);
+    assert_int_equal(n, 1);
+    mock_fd_queue[0] = refused[0];
+    mock_fd_queue[1] = fast[0];
+    mock_fd_queued = 2;
+    mock_fd_next = 0;
+    mock_fd_wake = refused[1];
+
+    mock_tls(-1, 0, NULL);
+    assert_connect(&ctx);
+    assert_string_equal(ctx.server, "ldap://fast.ipa.test");
+    assert_int_equal(mock_fd_next, 2);
+    ph_disconnect(&ctx);
+
+    /* The failure was not overwritten once the other server won */
+    ranked[0] = uris[0];
+    ranked[1] = uris[1];
+    ph_scoreboard_rank(&ctx, ranked, 2);
+    assert_string_equal(ranked[0], "ldap://fast.ipa.test");
+    assert_string_equal(ranked[1], "ldap://refused.ipa.test");
+
+    mock_fd_queued = 0;
+    mock_fd_next = 0;
+    mock_fd_wake = -1;
+    close(refused[0]);
+    close(refused[1]);
+    close(fast[0]);
+    close(fast[1]);
+    unlink(path);
+}
+
+struct pool_test_ctx {
+    struct pam_hbac_ctx ctx;
+    struct pam_hbac_config conf;
+    int fds[2];
+};
+
+static int
+test_pool_setup(void **state)
+{
+    struct pool_test_ctx *test_ctx;
+
+    test_ctx = calloc(1, sizeof(struct pool_test_ctx));
+    if (test_ctx == NULL) {
+        return 1;
+    }
+
+    if (pipe(test_ctx->fds) != 0) {
+        free(test_ctx);
+        return 1;
+    }
+    /* Nothing to read on the descriptor means the connection is alive */
+    mock_ldap_fd = test_ctx->fds[0];
+
+    set_dummy_config(&test_ctx->conf);
+    test_ctx->conf.pool_idle_timeout = 60;
+    test_ctx->ctx.pc = &test_ctx->conf;
+
+    bind_count = 0;
+    unbind_count = 0;
+
+    *state = test_ctx;
+    return 0;
+}
+
+static int
+test_pool_teardown(void **state)
+{
+    struct pool_test_ctx *test_ctx = *state;
+    struct pam_hbac_config no_pool;
+    const char *server;
+    LDAP *ld;
+
+    /* Empty the pool for the next test */
+    set_dummy_config(&no_pool);
+    while ((ld = ph_pool_get(NULL, &test_ctx->conf, &server)) != NULL) {
+        ph_pool_put(NULL, &no_pool, server, ld);
+    }
+
+    mock_ldap_fd = -1;
+    close(test_ctx->fds[0]);
+    close(test_ctx->fds[1]);
+    free(test_ctx);
+    return 0;
+}
+
+static void
+test_pool_reuse(void **state)
+{
+    struct pool_test_ctx *test_ctx = *state;
+    struct pam_hbac_ctx other_ctx;
+    struct pam_hbac_config other_conf;
+    const char *server;
+    LDAP *ld;
+    int ret;
+
+    assert_connect(&test_ctx->ctx);
+    assert_false(test_ctx->ctx.ld_reused);
+    ld = test_ctx->ctx.ld;
+
+    ph_disconnect(&test_ctx->ctx);
+    assert_null(test_ctx->ctx.ld);
+    assert_int_equal(unbind_count, 0);
+
+    /* The second connection neither connects nor binds, but still knows
+     * which server it talks to
+     */
+    test_ctx->ctx.server = NULL;
+    ret = ph_connect(&test_ctx->ctx);
+    assert_int_equal(ret, 0);
+    assert_ptr_equal(test_ctx->ctx.ld, ld);
+    assert_true(test_ctx->ctx.ld_reused);
+    assert_int_equal(bind_count, 1);
+    assert_string_equal(test_ctx->ctx.server, LDAP_URI);
+
+    /* A different bind DN must not get the same handle */
+    memcpy(&other_conf, &test_ctx->conf, sizeof(other_conf));
+    other_conf.bind_dn = "cn=other,dc=ipa,dc=test";
+    memset(&other_ctx, 0, sizeof(other_ctx));
+    other_ctx.pc = &other_conf;
+
+    ph_disconnect(&test_ctx->ctx);
+    assert_connect(&other_ctx);
+    assert_false(other_ctx.ld_reused);
+    assert_int_equal(bind_count, 2);
+
+    ph_disconnect(&other_ctx);
+    assert_int_equal(unbind_count, 0);
+
+    /* Drain the other configuration's handle as well */
+    ld = ph_pool_get(NULL, &other_conf, &server);
+    assert_non_null(ld);
+    other_conf.pool_idle_timeout = 0;
+    ph_pool_put(NULL, &other_conf, server, ld);
+    assert_int_equal(unbind_count, 1);
+}
+
+static void
+test_pool_key(void **state)
+{
+    struct pool_test_ctx *test_ctx = *state;
+    struct pam_hbac_config other_conf;
+    char *other_uris[] = { discard_const("ldap://other.ipa.test"),
+                           discard_const(LDAP_URI) };
+    const char *server = NULL;
+    LDAP *ld;
+
+    assert_connect(&test_ctx->ctx);
+    ld = test_ctx->ctx.ld;
+    ph_disconnect(&test_ctx->ctx);
+
+    /* A changed password must bind again */
+    memcpy(&other_conf, &test_ctx->conf, sizeof(other_conf));
+    other_conf.bind_pw = "changed";
+    assert_null(ph_pool_get(NULL, &other_conf, &server));
+
+    /* So must a server that is no longer configured */
+    memcpy(&other_conf, &test_ctx->conf, sizeof(other_conf));
+    other_conf.uri = "ldap://other.ipa.test";
+    assert_null(ph_pool_get(NULL, &other_conf, &server));
+
+    /* The handle is reused if its server is one of several */
+    other_conf.uri = "ldap://other.ipa.test " LDAP_URI;
+    other_conf.uris = other_uris;
+    other_conf.num_uris = 2;
+    assert_ptr_equal(ph_pool_get(NULL, &other_conf, &server), ld);
+    assert_ptr_equal(server, other_uris[1]);
+    ph_pool_put(NULL, &other_conf, server, ld);
+    assert_int_equal(unbind_count, 0);
+}
+
+static void
+test_pool_dead_connection(void **state)
+{
+    struct pool_test_ctx *test_ctx = *state;
+    ssize_t n;
+    int ret;
+
+    assert_connect(&test_ctx->ctx);
+    ph_disconnect(&test_ctx->ctx);
+
+    /* The server closed the connection or sent a notice of disconnection */
+    n = write(test_ctx->fds[1], "x", 1);
+    assert_int_equal(n, 1);
+
+    mock_tls(LDAP_RES_EXTENDED, LDAP_SUCCESS, "Success");
+    ret = ph_connect(&test_ctx->ctx);
+    assert_int_equal(ret, 0);
+    assert_false(test_ctx->ctx.ld_reused);
+    assert_int_equal(bind_count, 2);
+    assert_int_equal(unbind_count, 1);
+
+    test_ctx->conf.pool_idle_timeout = 0;
+    ph_disconnect(&test_ctx->ctx);
+    assert_int_equal(unbind_count, 2);
+}
+
+static void
+test_pool_fork(void **state)
+{
+    struct pool_test_ctx *test_ctx = *state;
+    int ret;
+
+    assert_connect(&test_ctx->ctx);
+    ph_disconnect(&test_ctx->ctx);
+
+    /* A child process must open its own connection and must not unbind
+     * the one of its parent
+     */
+    mock_pid++;
+    mock_tls(LDAP_RES_EXTENDED, LDAP_SUCCESS, "Success");
+    ret = ph_connect(&test_ctx->ctx);
+    assert_int_equal(ret, 0);
+    assert_false(test_ctx->ctx.ld_reused);
+    assert_int_equal(bind_count, 2);
+    assert_int_equal(unbind_count, 0);
+
+    ph_disconnect(&test_ctx->ctx);
+}
+
+static void
+test_pool_reconnect(void **state)
+{
+    struct pool_test_ctx *test_ctx = *state;
+    int ret;
+
+    /* A fresh connection is not retried */
+    assert_connect(&test_ctx->ctx);
+    ret = ph_reconnect(&test_ctx->ctx);
+    assert_int_equal(ret, ENOTCONN);
+    ph_disconnect(&test_ctx->ctx);
+
+    ret = ph_connect(&test_ctx->ctx);
+    assert_int_equal(ret, 0);
+    assert_true(test_ctx->ctx.ld_reused);
+
+    mock_tls(LDAP_RES_EXTENDED, LDAP_SUCCESS, "Success");
+    ret = ph_reconnect(&test_ctx->ctx);
+    assert_int_equal(ret, 0);
+    assert_non_null(test_ctx->ctx.ld);
+    assert_false(test_ctx->ctx.ld_reused);
+    assert_int_equal(bind_count, 2);
+    assert_int_equal(unbind_count, 1);
+
+    /* Only one retry */
+    ret = ph_reconnect(&test_ctx->ctx);
+    assert_int_equal(ret, ENOTCONN);
+
+    ph_disconnect(&test_ctx->ctx);
+}
+
+static void
+test_strbuf(void **state)
+{
+    struct ph_strbuf sb;
+    char *str;
+    size_t i;
+
+    (void) state; /* unused */
+
+    /* Characters special in a filter are escaped, others are not */
+    ph_strbuf_init(&sb);
+    ph_strbuf_append(&sb, "cn=");
+    ph_strbuf_append_value(&sb, "web (prod)*\\,dc=test");
+    str = ph_strbuf_finish(&sb);
+    assert_non_null(str);
+    assert_string_equal(str, "cn=web \\28prod\\29\\2a\\5c,dc=test");
+    assert_int_equal(ph_filter_value_len("web (prod)*\\,dc=test"),
+                     strlen(str) - strlen("cn="));
+    free(str);
+
+    /* An empty buffer is an empty string */
+    ph_strbuf_init(&sb);
+    str = ph_strbuf_finish(&sb);
+    assert_non_null(str);
+    assert_string_equal(str, "");
+    free(str);
+
+    /* Many appends past the initial reservation */
+    ph_strbuf_init(&sb);
+    ph_strbuf_reserve(&sb, 10);
+    for (i = 0; i < 10000; i++) {
+        ph_strbuf_append(&sb, "(a=b)");
+    }
+    assert_int_equal(sb.len, 50000);
+    str = ph_strbuf_finish(&sb);
+    assert_non_null(str);
+    assert_int_equal(strlen(str), 50000);
+    assert_memory_equal(str + 49995, "(a=b)", 5);
+    free(str);
+
+    /* A failed buffer stays failed */
+    ph_strbuf_init(&sb);
+    ph_strbuf_append(&sb, "abc");
+    ph_strbuf_reserve(&sb, SIZE_MAX);
+    ph_strbuf_append(&sb, "def");
+    assert_null(ph_strbuf_finish(&sb));
+    assert_null(sb.data);
+}
+
 int
 main(void)
 {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_connect),
+        cmocka_unit_test(test_strbuf),
+        cmocka_unit_test(test_deadline),
+        cmocka_unit_test(test_connect_failover),
+        cmocka_unit_test(test_connect_hedged),
+        cmocka_unit_test(test_connect_hedged_refused),
+        cmocka_unit_test_setup_teardown(test_pool_reuse,
+                                        test_pool_setup,
+                                        test_pool_teardown),
+        cmocka_unit_test_setup_teardown(test_pool_key,
+                                        test_pool_setup,
+                                        test_pool_teardown),
+        cmocka_unit_test_setup_teardown(test_pool_dead_connection,
+                                        test_pool_setup,
+                                        test_pool_teardown),
+        cmocka_unit_test_setup_teardown(test_pool_fork,
+                                        test_pool_setup,
+                                        test_pool_teardown),
+        cmocka_unit_test_setup_teardown(test_pool_reconnect,
+                                        test_pool_setup,
+                                        test_pool_teardown),
         cmocka_unit_test_setup_teardown(test_search_host_full,
                                         test_search_setup,
                                         test_search_teardown),
         cmocka_unit_test_setup_teardown(test_search_host_no_memberof,
                                         test_search_setup,
                                         test_search_teardown),
+        cmocka_unit_test_setup_teardown(test_search_attr_case,
+                                        test_search_setup,
+                                        test_search_teardown),
         cmocka_unit_test_setup_teardown(test_search_host_no_oc,
                                         test_search_setup,
                                         test_search_teardown),
         cmocka_unit_test_setup_teardown(test_search_host_search_fail,
                                         test_search_setup,
                                         test_search_teardown),
+        cmocka_unit_test_setup_teardown(test_search_server_down,
+                                        test_search_setup,
+                                        test_search_teardown),
+        cmocka_unit_test_setup_teardown(test_search_pipelined,
+                                        test_search_setup,
+                                        test_search_teardown),
+        cmocka_unit_test_setup_teardown(test_search_stream,
+                                        test_search_setup,
+                                        test_search_teardown),
         cmocka_unit_test_setup_teardown(test_search_neg,
                                         test_search_setup,
                                         test_search_teardown),
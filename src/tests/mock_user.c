@@ -48,7 +48,7 @@ mock_user_obj(const char *name,
     }
     va_end(ap_copy);
 
-    user = malloc(sizeof(struct ph_user));
+    user = calloc(1, sizeof(struct ph_user));
     if (user == NULL) {
         return NULL;
     }
@@ -109,6 +109,133 @@ test_ph_get_user_unresolvable_gid(void **state)
     ph_free_user(u);
 }
 
+static int getgrgid_calls;
+static int getgrouplist_calls;
+
+static void
+test_ph_user_match_groups(void **state)
+{
+    struct ph_user *u;
+    const char *groups[] = { "gr2", "no_sup_groups", "gr2", NULL };
+    int ret;
+
+    (void) state; /* unused */
+
+    getgrgid_calls = 0;
+    u = ph_get_user_gids(NULL, "sup_groups");
+    assert_non_null(u);
+    assert_null(u->group_names);
+    assert_int_equal(u->num_gids, 3);
+
+    ret = ph_user_match_groups(NULL, NULL, u, groups);
+    assert_int_equal(ret, 0);
+
+    /* Only the groups the rules reference and the user is a member of,
+     * without resolving a single GID
+     */
+    assert_non_null(u->group_names);
+    assert_int_equal(null_string_array_size(u->group_names), 1);
+    assert_string_equal(u->group_names[0], "gr2");
+    assert_int_equal(getgrgid_calls, 0);
+
+    /* Already resolved, nothing changes */
+    ret = ph_user_match_groups(NULL, NULL, u, NULL);
+    assert_int_equal(ret, 0);
+    assert_int_equal(null_string_array_size(u->group_names), 1);
+
+    ph_free_user(u);
+}
+
+static void
+test_ph_user_match_groups_no_gid(void **state)
+{
+    struct ph_user *u;
+    const char *groups[] = { "gr1", "nonposix", NULL };
+    size_t ngroups;
+    int ret;
+
+    (void) state; /* unused */
+
+    u = ph_get_user_gids(NULL, "sup_groups");
+    assert_non_null(u);
+
+    /* A group without a GID can only be matched by name */
+    ret = ph_user_match_groups(NULL, NULL, u, groups);
+    assert_int_equal(ret, 0);
+
+    assert_non_null(u->group_names);
+    ngroups = null_string_array_size(u->group_names);
+    assert_int_equal(ngroups, 3);
+    assert_string_equal(u->group_names[0], "sup_groups");
+    assert_string_equal(u->group_names[1], "gr1");
+    assert_string_equal(u->group_names[2], "gr2");
+
+    ph_free_user(u);
+}
+
+static void
+test_ph_user_match_groups_none(void **state)
+{
+    struct ph_user *u;
+    int ret;
+
+    (void) state; /* unused */
+
+    u = ph_get_user_gids(NULL, "no_sup_groups");
+    assert_non_null(u);
+
+    ret = ph_user_match_groups(NULL, NULL, u, NULL);
+    assert_int_equal(ret, 0);
+    assert_non_null(u->group_names);
+    assert_null(u->group_names[0]);
+
+    ph_free_user(u);
+}
+
+static void
+test_ph_get_user_many_groups(void **state)
+{
+    struct ph_user *u;
+
+    (void) state; /* unused */
+
+    getgrouplist_calls = 0;
+    setenv("PH_OBJ_TEST_WRAP_GETGROUPLIST_MANY", "1", 1);
+    u = ph_get_user_gids(NULL, "sup_groups");
+    unsetenv("PH_OBJ_TEST_WRAP_GETGROUPLIST_MANY");
+    assert_non_null(u);
+
+    /* The list is resized once, to exactly the size needed */
+    assert_int_equal(getgrouplist_calls, 2);
+    assert_int_equal(u->num_gids, 1000);
+    assert_int_equal(u->gids[0], 1011);
+    assert_int_equal(u->gids[999], 100999);
+
+    ph_free_user(u);
+}
+
+static void
+test_ph_get_user_erange(void **state)
+{
+    struct ph_user *u;
+    size_t ngroups;
+
+    (void) state; /* unused */
+
+    setenv("PH_OBJ_TEST_WRAP_GETGRGID_ERANGE", "1", 1);
+    u = ph_get_user(NULL, "sup_groups");
+    unsetenv("PH_OBJ_TEST_WRAP_GETGRGID_ERANGE");
+    assert_non_null(u);
+
+    ngroups = null_string_array_size(u->group_names);
+    assert_int_equal(ngroups, 3);
+    assert_string_equal(u->group_names[0], "sup_groups");
+    assert_string_equal(u->group_names[1], "gr1");
+    assert_string_equal(u->group_names[2], "gr2");
+
+    ph_free_user(u);
+}
+
 static void
 test_ph_get_user_unknown(void **state)
 {
@@ -220,6 +347,13 @@ int
 __wrap_getgrgid_r(gid_t gid, struct group *grp,
                   char *buf, size_t buflen, struct group **result)
 {
+   getgrgid_calls++;
+
+   /* Simulate a group with a long member list */
+   if (getenv("PH_OBJ_TEST_WRAP_GETGRGID_ERANGE") != NULL && buflen < 4096) {
+       return ERANGE;
+   }
+
    if (getenv("PH_OBJ_TEST_WRAP_GETGRGID_NOTFOUND") == NULL) {
        return __real_getgrgid_r(gid, grp, buf, buflen, result);
    }
@@ -233,6 +367,35 @@ __wrap_getgrgid_r(gid_t gid, struct group *grp,
    return 0;
 }
 
+int
+__real_getgrouplist(const char *user, gid_t group,
+                    gid_t *groups, int *ngroups);
+
+int
+__wrap_getgrouplist(const char *user, gid_t group,
+                    gid_t *groups, int *ngroups)
+{
+    int i;
+
+    getgrouplist_calls++;
+    if (getenv("PH_OBJ_TEST_WRAP_GETGROUPLIST_MANY") == NULL) {
+        return __real_getgrouplist(user, group, groups, ngroups);
+    }
+
+    /* A user with many groups, report the size needed like glibc does */
+    if (*ngroups < 1000) {
+        *ngroups = 1000;
+        return -1;
+    }
+
+    groups[0] = group;
+    for (i = 1; i < 1000; i++) {
+        groups[i] = 100000 + i;
+    }
+    *ngroups = 1000;
+    return 1000;
+}
+
 static void
 mock_ph_search(int ret, const char *key)
 {
@@ -392,6 +555,11 @@ main(void)
         cmocka_unit_test(test_ph_get_user_no_sup_groups),
         cmocka_unit_test(test_ph_get_user_sup_groups),
         cmocka_unit_test(test_ph_get_user_unresolvable_gid),
+        cmocka_unit_test(test_ph_user_match_groups),
+        cmocka_unit_test(test_ph_user_match_groups_no_gid),
+        cmocka_unit_test(test_ph_user_match_groups_none),
+        cmocka_unit_test(test_ph_get_user_many_groups),
+        cmocka_unit_test(test_ph_get_user_erange),
         cmocka_unit_test(test_ph_get_user_unknown),
         cmocka_unit_test(test_ph_host),
         cmocka_unit_test(test_ph_host_multiple),
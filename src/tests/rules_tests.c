@@ -24,10 +24,14 @@
 #include <stdarg.h>
 
 #include "pam_hbac_obj.h"
+#include "pam_hbac_obj_int.h"
 #include "pam_hbac_ldap.h"
+#include "pam_hbac_arena.h"
 
 #include "common_mock.h"
 
+static char *last_obj_filter;
+
 int
 __wrap_ph_search(pam_handle_t *pamh,
                  LDAP *ld,
@@ -42,6 +46,8 @@ __wrap_ph_search(pam_handle_t *pamh,
 #if 0
     check_expected(obj_filter);
 #endif
+    free(last_obj_filter);
+    last_obj_filter = strdup(obj_filter);
 
     rv = ph_mock_type(int);
     entry_list = ph_mock_ptr_type(struct ph_entry **);
@@ -63,6 +69,35 @@ mock_ph_search(int ret, struct ph_entry **entries)
     will_return(__wrap_ph_search, entries);
 }
 
+/* Hands the entries over one by one, like a search whose results are
+ * still arriving
+ */
+int
+__wrap_ph_search_recv_each(pam_handle_t *pamh,
+                           LDAP *ld,
+                           struct ph_search_ctx *s,
+                           int msgid,
+                           struct timeval *timeout,
+                           ph_search_entry_fn entry_fn,
+                           void *pvt)
+{
+    struct ph_entry **entry_list;
+    size_t i;
+    int ret = 0;
+
+    entry_list = ph_mock_ptr_type(struct ph_entry **);
+    for (i = 0; entry_list[i] != NULL; i++) {
+        if (ret == 0) {
+            ret = entry_fn(entry_list[i], pvt);
+        } else {
+            ph_entry_free(entry_list[i]);
+        }
+    }
+    ph_entry_array_shallow_free(entry_list);
+
+    return ret;
+}
+
 struct get_rules_ctx {
     struct pam_hbac_ctx ctx;
     struct pam_hbac_config pc;
@@ -101,7 +136,10 @@ test_get_rules_teardown(void **state)
 
     ph_entry_free(test_ctx->targethost);
     ph_free_hbac_rules(test_ctx->rules);
+    ph_arena_free(test_ctx->ctx.arena);
     free(test_ctx);
+    free(last_obj_filter);
+    last_obj_filter = NULL;
     return 0;
 }
 
@@ -171,6 +209,7 @@ test_get_rules_allow_all(void **state)
 
     ret = ph_get_hbac_rules(&test_ctx->ctx,
                             test_ctx->targethost,
+                            NULL,
                             &test_ctx->rules);
     assert_int_equal(ret, 0);
     assert_non_null(test_ctx->rules);
@@ -178,6 +217,11 @@ test_get_rules_allow_all(void **state)
                      NULL, NULL, HBAC_CATEGORY_ALL,
                      NULL, NULL, HBAC_CATEGORY_ALL,
                      NULL, NULL, HBAC_CATEGORY_ALL);
+
+    /* The rule matches any service */
+    assert_false(ph_hbac_rules_need_service(test_ctx->rules));
+    test_ctx->rules[0]->enabled = false;
+    assert_false(ph_hbac_rules_need_service(test_ctx->rules));
 }
 
 static void
@@ -234,6 +278,7 @@ test_get_rules_user_svc_host(void **state)
 
     ret = ph_get_hbac_rules(&test_ctx->ctx,
                             test_ctx->targethost,
+                            NULL,
                             &test_ctx->rules);
     assert_int_equal(ret, 0);
     assert_non_null(test_ctx->rules);
@@ -296,6 +341,7 @@ test_get_rules_groups(void **state)
 
     ret = ph_get_hbac_rules(&test_ctx->ctx,
                             test_ctx->targethost,
+                            NULL,
                             &test_ctx->rules);
     assert_int_equal(ret, 0);
     assert_non_null(test_ctx->rules);
@@ -304,12 +350,296 @@ test_get_rules_groups(void **state)
                      NULL, exp_group_names, 0,
                      NULL, exp_svc_groups, 0,
                      NULL, exp_host_groups, 0);
+
+    assert_true(ph_hbac_rules_need_service(test_ctx->rules));
+    test_ctx->rules[0]->enabled = false;
+    assert_false(ph_hbac_rules_need_service(test_ctx->rules));
+}
+
+static void
+test_get_rules_scope(void **state)
+{
+    int ret;
+    struct get_rules_ctx *test_ctx = *state;
+    struct ph_entry **ldap_rules = NULL;
+    struct ph_entry *service;
+    char tuser[] = "tuser";
+    char admins[] = "admins";
+    char unusable[] = "no,such(group";
+    char *user_groups[] = { admins, unusable, NULL };
+    struct ph_user user = { .name = tuser, .group_names = user_groups };
+    struct ph_rules_scope scope = { "sshd", NULL, &user };
+
+    ret = mock_ph_host(test_ctx->targethost, "client.ipa.test",
+                       "cn=web(prod),cn=hostgroups,cn=accounts,dc=ipa,dc=test",
+                       NULL);
+    assert_int_equal(ret, 0);
+
+    service = ph_entry_alloc(PH_MAP_SVC_END);
+    assert_non_null(service);
+    service->attrs[PH_MAP_SVC_MEMBEROF] = \
+            mock_ph_attr("memberof",
+                         "cn=Sudo,cn=hbacservicegroups,cn=hbac,dc=ipa,dc=test",
+                         NULL);
+    assert_non_null(service->attrs[PH_MAP_SVC_MEMBEROF]);
+    scope.service = service;
+
+    ldap_rules = ph_entry_array_alloc(PH_MAP_RULE_END, 1);
+    assert_non_null(ldap_rules);
+    ret = mock_ph_rule(ldap_rules[0],
+                       "allow_all",
+                       "1-2-3-4-",
+                       "true",
+                       NULL, NULL, "all", /* users */
+                       NULL, NULL, "all", /* services */
+                       NULL, NULL, "all", /* hosts */
+                       NULL);
+    mock_ph_search(0, ldap_rules);
+
+    ret = ph_get_hbac_rules(&test_ctx->ctx,
+                            test_ctx->targethost,
+                            &scope,
+                            &test_ctx->rules);
+    assert_int_equal(ret, 0);
+    ph_entry_free(service);
+
+    /* The group name that cannot be an IPA group is left out, special
+     * characters in the DNs are escaped
+     */
+    assert_string_equal(last_obj_filter,
+        "&(ipaEnabledFlag=TRUE)(accessRuleType=allow)"
+        "(|(hostCategory=all)"
+        "(memberHost=fqdn=client.ipa.test,cn=computers,cn=accounts,"
+                                                    "dc=ipa,dc=test)"
+        "(memberHost=cn=web\\28prod\\29,cn=hostgroups,cn=accounts,"
+                                                    "dc=ipa,dc=test))"
+        "(|(serviceCategory=all)"
+        "(memberService=cn=sshd,cn=hbacservices,cn=hbac,dc=ipa,dc=test)"
+        "(memberService=cn=Sudo,cn=hbacservicegroups,cn=hbac,"
+                                                    "dc=ipa,dc=test))"
+        "(|(userCategory=all)"
+        "(memberUser=uid=tuser,cn=users,cn=accounts,dc=ipa,dc=test)"
+        "(memberUser=cn=admins,cn=groups,cn=accounts,dc=ipa,dc=test))");
+}
+
+static void
+test_get_rules_local_hosts(void **state)
+{
+    int ret;
+    struct get_rules_ctx *test_ctx = *state;
+    struct ph_entry **ldap_rules = NULL;
+    /* Equivalent DNs are matched no matter how they are spelled */
+    const char *this_host[] = {
+        "FQDN=Client.IPA.test,CN=Computers,cn=accounts,DC=ipa,dc=test",
+        NULL,
+    };
+    const char *other_host[] = {
+        "fqdn=other.ipa.test,cn=computers,cn=accounts,dc=ipa,dc=test",
+        NULL,
+    };
+    const char *member_host_groups[] = {
+        "CN=HGR\\32,cn=hostgroups,cn=accounts,dc=ipa,dc=test",
+        NULL,
+    };
+    /* A user DN with the same name as the host is not the host */
+    const char *user_named_like_host[] = {
+        "uid=client.ipa.test,cn=users,cn=accounts,dc=ipa,dc=test",
+        NULL,
+    };
+
+    ret = mock_ph_host(test_ctx->targethost, "client.ipa.test",
+                       "cn=hgr1,cn=hostgroups,cn=accounts,dc=ipa,dc=test",
+                       "cn=hgr2,cn=hostgroups,cn=accounts,dc=ipa,dc=test",
+                       NULL);
+    assert_int_equal(ret, 0);
+
+    /* Two hostgroups are over the limit */
+    test_ctx->pc.hostgroup_filter_limit = 1;
+
+    ldap_rules = ph_entry_array_alloc(PH_MAP_RULE_END, 5);
+    assert_non_null(ldap_rules);
+    ret = mock_ph_rule(ldap_rules[0], "by_hostgroup", "1", "true",
+                       NULL, NULL, "all",
+                       NULL, NULL, "all",
+                       NULL, member_host_groups, NULL,
+                       NULL);
+    assert_int_equal(ret, 0);
+    ret = mock_ph_rule(ldap_rules[1], "other_host", "2", "true",
+                       NULL, NULL, "all",
+                       NULL, NULL, "all",
+                       other_host, NULL, NULL,
+                       NULL);
+    assert_int_equal(ret, 0);
+    ret = mock_ph_rule(ldap_rules[2], "all_hosts", "3", "true",
+                       NULL, NULL, "all",
+                       NULL, NULL, "all",
+                       NULL, NULL, "all",
+                       NULL);
+    assert_int_equal(ret, 0);
+    ret = mock_ph_rule(ldap_rules[3], "this_host", "4", "true",
+                       NULL, NULL, "all",
+                       NULL, NULL, "all",
+                       this_host, NULL, NULL,
+                       NULL);
+    assert_int_equal(ret, 0);
+    ret = mock_ph_rule(ldap_rules[4], "not_a_host", "5", "true",
+                       NULL, NULL, "all",
+                       NULL, NULL, "all",
+                       user_named_like_host, NULL, NULL,
+                       NULL);
+    assert_int_equal(ret, 0);
+    mock_ph_search(0, ldap_rules);
+
+    ret = ph_get_hbac_rules(&test_ctx->ctx,
+                            test_ctx->targethost,
+                            NULL,
+                            &test_ctx->rules);
+    assert_int_equal(ret, 0);
+
+    /* The hostgroups are not in the filter but matched locally */
+    assert_string_equal(last_obj_filter,
+                        "&(ipaEnabledFlag=TRUE)(accessRuleType=allow)");
+    assert_non_null(test_ctx->rules);
+    assert_string_equal(test_ctx->rules[0]->name, "by_hostgroup");
+    assert_string_equal(test_ctx->rules[1]->name, "all_hosts");
+    assert_string_equal(test_ctx->rules[2]->name, "this_host");
+    assert_null(test_ctx->rules[3]);
+}
+
+static void
+test_get_rules_stream(void **state)
+{
+    int ret;
+    struct get_rules_ctx *test_ctx = *state;
+    struct ph_entry **ldap_rules = NULL;
+    const char *member_host_groups[] = {
+        "cn=hgr2,cn=hostgroups,cn=accounts,dc=ipa,dc=test",
+        NULL,
+    };
+    const char *other_host_groups[] = {
+        "cn=hgr3,cn=hostgroups,cn=accounts,dc=ipa,dc=test",
+        NULL,
+    };
+    const char *member_groups[] = {
+        "cn=admins,cn=groups,cn=accounts,dc=ipa,dc=test",
+        NULL,
+    };
+
+    ret = mock_ph_host(test_ctx->targethost, "client.ipa.test",
+                       "cn=hgr1,cn=hostgroups,cn=accounts,dc=ipa,dc=test",
+                       "cn=hgr2,cn=hostgroups,cn=accounts,dc=ipa,dc=test",
+                       NULL);
+    assert_int_equal(ret, 0);
+    test_ctx->pc.hostgroup_filter_limit = 1;
+
+    /* Two rules share a group, the second one refers to its DN after the
+     * entry of the first one is gone
+     */
+    ldap_rules = ph_entry_array_alloc(PH_MAP_RULE_END, 3);
+    assert_non_null(ldap_rules);
+    ret = mock_ph_rule(ldap_rules[0], "admins", "1", "true",
+                       NULL, member_groups, NULL,
+                       NULL, NULL, "all",
+                       NULL, member_host_groups, NULL,
+                       NULL);
+    assert_int_equal(ret, 0);
+    ret = mock_ph_rule(ldap_rules[1], "other_hosts", "2", "true",
+                       NULL, member_groups, NULL,
+                       NULL, NULL, "all",
+                       NULL, other_host_groups, NULL,
+                       NULL);
+    assert_int_equal(ret, 0);
+    ret = mock_ph_rule(ldap_rules[2], "admins_everywhere", "3", "true",
+                       NULL, member_groups, NULL,
+                       NULL, NULL, "all",
+                       NULL, NULL, "all",
+                       NULL);
+    assert_int_equal(ret, 0);
+    will_return(__wrap_ph_search_recv_each, ldap_rules);
+
+    ret = ph_get_hbac_rules_recv(&test_ctx->ctx, test_ctx->targethost,
+                                 1, &test_ctx->rules);
+    assert_int_equal(ret, 0);
+    assert_non_null(test_ctx->rules);
+    assert_string_equal(test_ctx->rules[0]->name, "admins");
+    assert_string_equal(test_ctx->rules[0]->users->groups[0], "admins");
+    assert_string_equal(test_ctx->rules[1]->name, "admins_everywhere");
+    assert_string_equal(test_ctx->rules[1]->users->groups[0], "admins");
+    assert_null(test_ctx->rules[2]);
+}
+
+static void
+test_get_rules_arena(void **state)
+{
+    int ret;
+    struct get_rules_ctx *test_ctx = *state;
+    struct ph_entry **ldap_rules = NULL;
+    const char *member_users[] = {
+        "uid=tuser,cn=users,cn=accounts,dc=ipa,dc=test",
+        NULL,
+    };
+    const char *exp_names[] = {
+        "tuser",
+        NULL,
+    };
+    size_t num_rules = 20;
+    size_t i;
+
+    test_ctx->ctx.arena = ph_arena_new();
+    assert_non_null(test_ctx->ctx.arena);
+
+    ret = mock_ph_host(test_ctx->targethost, "client.ipa.test", NULL);
+    assert_int_equal(ret, 0);
+
+    /* More rules than the first rule array has room for */
+    ldap_rules = ph_entry_array_alloc(PH_MAP_RULE_END, num_rules);
+    assert_non_null(ldap_rules);
+    for (i = 0; i < num_rules; i++) {
+        ret = mock_ph_rule(ldap_rules[i],
+                           "tuser_everywhere",
+                           "1-2-3-4",
+                           "true",
+                           member_users, NULL, NULL,
+                           NULL, NULL, "all",
+                           NULL, NULL, "all",
+                           NULL);
+        assert_int_equal(ret, 0);
+    }
+    mock_ph_search(0, ldap_rules);
+
+    ret = ph_get_hbac_rules(&test_ctx->ctx,
+                            test_ctx->targethost,
+                            NULL,
+                            &test_ctx->rules);
+    assert_int_equal(ret, 0);
+    assert_non_null(test_ctx->rules);
+    for (i = 0; i < num_rules; i++) {
+        assert_hbac_rule(test_ctx->rules[i],
+                         "tuser_everywhere",
+                         exp_names, NULL, 0,
+                         NULL, NULL, HBAC_CATEGORY_ALL,
+                         NULL, NULL, HBAC_CATEGORY_ALL);
+    }
+    assert_null(test_ctx->rules[num_rules]);
+
+    /* The rules are left to the arena, which the teardown releases */
+    ph_free_hbac_rules(test_ctx->rules);
+    assert_string_equal(test_ctx->rules[0]->users->names[0], "tuser");
 }
 
 int
 main(void)
 {
     const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_get_rules_scope,
+                                        test_get_rules_setup,
+                                        test_get_rules_teardown),
+        cmocka_unit_test_setup_teardown(test_get_rules_local_hosts,
+                                        test_get_rules_setup,
+                                        test_get_rules_teardown),
+        cmocka_unit_test_setup_teardown(test_get_rules_stream,
+                                        test_get_rules_setup,
+                                        test_get_rules_teardown),
         cmocka_unit_test_setup_teardown(test_get_rules_allow_all,
                                         test_get_rules_setup,
                                         test_get_rules_teardown),
@@ -319,6 +649,9 @@ main(void)
         cmocka_unit_test_setup_teardown(test_get_rules_groups,
                                         test_get_rules_setup,
                                         test_get_rules_teardown),
+        cmocka_unit_test_setup_teardown(test_get_rules_arena,
+                                        test_get_rules_setup,
+                                        test_get_rules_teardown),
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);
@@ -0,0 +1,309 @@
+/*
+    Copyright (C) 2026 Jakub Hrozek <jakub.hrozek@posteo.se>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "pam_hbac_scoreboard.h"
+
+#include "common_mock.h"
+
+#define SRV_A   "ldap://a.ipa.test"
+#define SRV_B   "ldap://b.ipa.test"
+#define SRV_C   "ldap://c.ipa.test"
+
+struct scoreboard_test_ctx {
+    struct pam_hbac_ctx ctx;
+    struct pam_hbac_config pc;
+    char *uris[3];
+    char *dir;
+    char *path;
+};
+
+static int
+test_scoreboard_setup(void **state)
+{
+    struct scoreboard_test_ctx *test_ctx;
+
+    test_ctx = calloc(1, sizeof(struct scoreboard_test_ctx));
+    if (test_ctx == NULL) {
+        return 1;
+    }
+
+    test_ctx->dir = test_tmpdir_new("scoreboard_tests");
+    if (test_ctx->dir == NULL) {
+        return 1;
+    }
+
+    test_ctx->path = test_tmpdir_file(test_ctx->dir, "servers");
+    if (test_ctx->path == NULL) {
+        return 1;
+    }
+
+    test_ctx->uris[0] = discard_const(SRV_A);
+    test_ctx->uris[1] = discard_const(SRV_B);
+    test_ctx->uris[2] = discard_const(SRV_C);
+
+    test_ctx->pc.uri = SRV_A" "SRV_B" "SRV_C;
+    test_ctx->pc.uris = test_ctx->uris;
+    test_ctx->pc.num_uris = 3;
+    test_ctx->pc.scoreboard_path = test_ctx->path;
+    test_ctx->ctx.pc = &test_ctx->pc;
+
+    *state = test_ctx;
+    return 0;
+}
+
+static int
+test_scoreboard_teardown(void **state)
+{
+    struct scoreboard_test_ctx *test_ctx = *state;
+
+    free(test_ctx->path);
+    test_tmpdir_free(test_ctx->dir);
+    free(test_ctx);
+    return 0;
+}
+
+static void
+rank(struct scoreboard_test_ctx *test_ctx, const char **uris)
+{
+    uris[0] = SRV_A;
+    uris[1] = SRV_B;
+    uris[2] = SRV_C;
+
+    ph_scoreboard_rank(&test_ctx->ctx, uris, 3);
+}
+
+static void
+test_scoreboard_empty(void **state)
+{
+    struct scoreboard_test_ctx *test_ctx = *state;
+    const char *uris[3];
+
+    /* No file yet, the configured order is kept */
+    rank(test_ctx, uris);
+    assert_string_equal(uris[0], SRV_A);
+    assert_string_equal(uris[1], SRV_B);
+    assert_string_equal(uris[2], SRV_C);
+}
+
+static void
+test_scoreboard_latency(void **state)
+{
+    struct scoreboard_test_ctx *test_ctx = *state;
+    const char *uris[3];
+
+    ph_scoreboard_report(&test_ctx->ctx, SRV_A,
+                         PH_SERVER_CONNECT, 9000, true);
+    ph_scoreboard_report(&test_ctx->ctx, SRV_B,
+                         PH_SERVER_CONNECT, 1000, true);
+    ph_scoreboard_report(&test_ctx->ctx, SRV_B,
+                         PH_SERVER_SEARCH, 2000, true);
+
+    /* C was never measured and goes first, then the faster B */
+    rank(test_ctx, uris);
+    assert_string_equal(uris[0], SRV_C);
+    assert_string_equal(uris[1], SRV_B);
+    assert_string_equal(uris[2], SRV_A);
+
+    ph_scoreboard_report(&test_ctx->ctx, SRV_C,
+                         PH_SERVER_CONNECT, 5000, true);
+    rank(test_ctx, uris);
+    assert_string_equal(uris[0], SRV_B);
+    assert_string_equal(uris[1], SRV_C);
+    assert_string_equal(uris[2], SRV_A);
+
+    /* The average follows the recent samples */
+    ph_scoreboard_report(&test_ctx->ctx, SRV_A,
+                         PH_SERVER_CONNECT, 100, true);
+    ph_scoreboard_report(&test_ctx->ctx, SRV_A,
+                         PH_SERVER_CONNECT, 100, true);
+    ph_scoreboard_report(&test_ctx->ctx, SRV_A,
+                         PH_SERVER_CONNECT, 100, true);
+    rank(test_ctx, uris);
+    assert_string_equal(uris[0], SRV_B);
+    assert_string_equal(uris[1], SRV_A);
+    assert_string_equal(uris[2], SRV_C);
+}
+
+static void
+test_scoreboard_failure(void **state)
+{
+    struct scoreboard_test_ctx *test_ctx = *state;
+    const char *uris[3];
+
+    ph_scoreboard_report(&test_ctx->ctx, SRV_A,
+                         PH_SERVER_CONNECT, 1000, true);
+    ph_scoreboard_report(&test_ctx->ctx, SRV_B,
+                         PH_SERVER_CONNECT, 2000, true);
+    ph_scoreboard_report(&test_ctx->ctx, SRV_C,
+                         PH_SERVER_CONNECT, 3000, true);
+
+    /* A failing server goes last even though it is the fastest one */
+    ph_scoreboard_report(&test_ctx->ctx, SRV_A,
+                         PH_SERVER_CONNECT, 0, false);
+    rank(test_ctx, uris);
+    assert_string_equal(uris[0], SRV_B);
+    assert_string_equal(uris[1], SRV_C);
+    assert_string_equal(uris[2], SRV_A);
+
+    /* A success clears the failure */
+    ph_scoreboard_report(&test_ctx->ctx, SRV_A,
+                         PH_SERVER_SEARCH, 1500, true);
+    rank(test_ctx, uris);
+    assert_string_equal(uris[0], SRV_B);
+    assert_string_equal(uris[1], SRV_A);
+    assert_string_equal(uris[2], SRV_C);
+
+    ph_scoreboard_report(&test_ctx->ctx, SRV_B,
+                         PH_SERVER_SEARCH, 5000, true);
+    rank(test_ctx, uris);
+    assert_string_equal(uris[0], SRV_A);
+    assert_string_equal(uris[1], SRV_C);
+    assert_string_equal(uris[2], SRV_B);
+}
+
+static void
+test_scoreboard_single(void **state)
+{
+    struct scoreboard_test_ctx *test_ctx = *state;
+    struct stat st;
+    int ret;
+
+    /* With one server the scoreboard is never written */
+    test_ctx->pc.num_uris = 1;
+    ph_scoreboard_report(&test_ctx->ctx, SRV_A,
+                         PH_SERVER_CONNECT, 1000, true);
+
+    ret = stat(test_ctx->path, &st);
+    assert_int_equal(ret, -1);
+    assert_int_equal(errno, ENOENT);
+}
+
+static void
+test_scoreboard_unusable(void **state)
+{
+    struct scoreboard_test_ctx *test_ctx = *state;
+    const char *uris[3];
+    FILE *f;
+    int ret;
+
+    f = fopen(test_ctx->path, "w");
+    assert_non_null(f);
+    fprintf(f, "this is not a scoreboard\n");
+    fclose(f);
+
+    rank(test_ctx, uris);
+    assert_string_equal(uris[0], SRV_A);
+    assert_string_equal(uris[1], SRV_B);
+    assert_string_equal(uris[2], SRV_C);
+
+    /* A writer starts over */
+    ph_scoreboard_report(&test_ctx->ctx, SRV_A,
+                         PH_SERVER_CONNECT, 0, false);
+    rank(test_ctx, uris);
+    assert_string_equal(uris[0], SRV_B);
+    assert_string_equal(uris[1], SRV_C);
+    assert_string_equal(uris[2], SRV_A);
+
+    /* A scoreboard writable by others is ignored */
+    ret = chmod(test_ctx->path, 0666);
+    assert_int_equal(ret, 0);
+    rank(test_ctx, uris);
+    assert_string_equal(uris[0], SRV_A);
+    assert_string_equal(uris[1], SRV_B);
+    assert_string_equal(uris[2], SRV_C);
+}
+
+static void
+test_scoreboard_locked(void **state)
+{
+    struct scoreboard_test_ctx *test_ctx = *state;
+    struct timespec started;
+    const char *uris[3];
+    int release;
+    pid_t pid;
+
+    ph_scoreboard_report(&test_ctx->ctx, SRV_A,
+                         PH_SERVER_CONNECT, 1000, true);
+    ph_scoreboard_report(&test_ctx->ctx, SRV_B,
+                         PH_SERVER_CONNECT, 2000, true);
+    ph_scoreboard_report(&test_ctx->ctx, SRV_C,
+                         PH_SERVER_CONNECT, 3000, true);
+
+    /* A scoreboard that stays locked is skipped instead of waited for */
+    pid = hold_lock(test_ctx->path, &release);
+
+    ph_scoreboard_clock(&started);
+    ph_scoreboard_report(&test_ctx->ctx, SRV_A,
+                         PH_SERVER_CONNECT, 0, false);
+    rank(test_ctx, uris);
+    assert_true(ph_scoreboard_elapsed(&started) < 2000000);
+
+    release_lock(pid, release);
+
+    /* The failure above was not recorded, this one is */
+    rank(test_ctx, uris);
+    assert_string_equal(uris[0], SRV_A);
+    assert_string_equal(uris[1], SRV_B);
+    assert_string_equal(uris[2], SRV_C);
+
+    ph_scoreboard_report(&test_ctx->ctx, SRV_A,
+                         PH_SERVER_CONNECT, 0, false);
+    rank(test_ctx, uris);
+    assert_string_equal(uris[0], SRV_B);
+    assert_string_equal(uris[1], SRV_C);
+    assert_string_equal(uris[2], SRV_A);
+}
+
+int
+main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_scoreboard_empty,
+                                        test_scoreboard_setup,
+                                        test_scoreboard_teardown),
+        cmocka_unit_test_setup_teardown(test_scoreboard_latency,
+                                        test_scoreboard_setup,
+                                        test_scoreboard_teardown),
+        cmocka_unit_test_setup_teardown(test_scoreboard_failure,
+                                        test_scoreboard_setup,
+                                        test_scoreboard_teardown),
+        cmocka_unit_test_setup_teardown(test_scoreboard_single,
+                                        test_scoreboard_setup,
+                                        test_scoreboard_teardown),
+        cmocka_unit_test_setup_teardown(test_scoreboard_unusable,
+                                        test_scoreboard_setup,
+                                        test_scoreboard_teardown),
+        cmocka_unit_test_setup_teardown(test_scoreboard_locked,
+                                        test_scoreboard_setup,
+                                        test_scoreboard_teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
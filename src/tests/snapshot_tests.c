@@ -0,0 +1,512 @@
+/*
+    Copyright (C) 2026 Jakub Hrozek <jakub.hrozek@posteo.se>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "pam_hbac_obj.h"
+#include "pam_hbac_ldap.h"
+#include "pam_hbac_snapshot.h"
+
+#include "common_mock.h"
+
+#define TEST_BASEDN     "dc=ipa,dc=test"
+
+int
+__wrap_ph_search(pam_handle_t *pamh,
+                 LDAP *ld,
+                 struct pam_hbac_config *conf,
+                 struct ph_search_ctx *s,
+                 const char *obj_filter,
+                 struct ph_entry ***_entry_list)
+{
+    int rv;
+    struct ph_entry **entry_list;
+
+    rv = ph_mock_type(int);
+    entry_list = ph_mock_ptr_type(struct ph_entry **);
+    if (rv != 0) {
+        return rv;
+    }
+
+    if (entry_list) {
+        *_entry_list = entry_list;
+    }
+
+    return 0;
+}
+
+static void
+mock_ph_search(int ret, struct ph_entry **entries)
+{
+    will_return(__wrap_ph_search, ret);
+    will_return(__wrap_ph_search, entries);
+}
+
+struct snapshot_test_ctx {
+    struct pam_hbac_ctx ctx;
+    struct pam_hbac_config pc;
+    char *cache_dir;
+
+    struct ph_entry *targethost;
+    struct ph_entry *service;
+    struct hbac_rule **rules;
+    struct hbac_eval_req *req;
+
+    struct ph_snapshot *snap;
+    struct hbac_info *info;
+};
+
+static int
+test_snapshot_setup(void **state)
+{
+    struct snapshot_test_ctx *test_ctx;
+    struct ph_entry **ldap_rules;
+    const char *member_user_groups[] = {
+        "cn=tgroup,cn=groups,cn=accounts,"TEST_BASEDN,
+        NULL,
+    };
+    const char *member_service[] = {
+        "cn=sshd,cn=hbacservices,cn=hbac,"TEST_BASEDN,
+        NULL,
+    };
+    int ret;
+
+    test_ctx = calloc(1, sizeof(struct snapshot_test_ctx));
+    if (test_ctx == NULL) {
+        return 1;
+    }
+
+    test_ctx->cache_dir = test_tmpdir_new("snapshot_tests");
+    if (test_ctx->cache_dir == NULL) {
+        return 1;
+    }
+
+    test_ctx->pc.uri = "ldap://ipa.test";
+    test_ctx->pc.search_base = TEST_BASEDN;
+    test_ctx->pc.hostname = discard_const("client.ipa.test");
+    test_ctx->pc.rules_cache_ttl = 60;
+    test_ctx->pc.rules_cache_dir = test_ctx->cache_dir;
+    test_ctx->ctx.pc = &test_ctx->pc;
+
+    test_ctx->targethost = ph_entry_alloc(PH_MAP_HOST_END);
+    test_ctx->service = ph_entry_alloc(PH_MAP_SVC_END);
+    if (test_ctx->targethost == NULL || test_ctx->service == NULL) {
+        return 1;
+    }
+
+    ret = mock_ph_host(test_ctx->targethost, "client.ipa.test", NULL);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = mock_ph_svc(test_ctx->service, "sshd");
+    if (ret != 0) {
+        return 1;
+    }
+
+    ldap_rules = ph_entry_array_alloc(PH_MAP_RULE_END, 2);
+    if (ldap_rules == NULL) {
+        return 1;
+    }
+
+    ret = mock_ph_rule(ldap_rules[0],
+                       "disabled_allow_all",
+                       "1-2-3-4-",
+                       "false",
+                       NULL, NULL, "all",
+                       NULL, NULL, "all",
+                       NULL, NULL, "all",
+                       NULL);
+    if (ret != 0) {
+        return 1;
+    }
+
+    ret = mock_ph_rule(ldap_rules[1],
+                       "tgroup_sshd",
+                       "5-6-7-8-",
+                       "true",
+                       NULL, member_user_groups, NULL,
+                       member_service, NULL, NULL,
+                       NULL, NULL, "all",
+                       NULL);
+    if (ret != 0) {
+        return 1;
+    }
+
+    mock_ph_search(0, ldap_rules);
+    ret = ph_get_hbac_rules(&test_ctx->ctx,
+                            test_ctx->targethost,
+                            NULL,
+                            &test_ctx->rules);
+    if (ret != 0) {
+        return 1;
+    }
+
+    *state = test_ctx;
+    return 0;
+}
+
+static int
+test_snapshot_teardown(void **state)
+{
+    struct snapshot_test_ctx *test_ctx = *state;
+
+    hbac_free_info(test_ctx->info);
+    ph_snapshot_close(test_ctx->snap);
+    ph_free_hbac_eval_req(test_ctx->req);
+    ph_free_hbac_rules(test_ctx->rules);
+    ph_entry_free(test_ctx->targethost);
+    ph_entry_free(test_ctx->service);
+    test_tmpdir_free(test_ctx->cache_dir);
+    free(test_ctx);
+    return 0;
+}
+
+static char *
+snapshot_file(struct snapshot_test_ctx *test_ctx)
+{
+    DIR *dir;
+    struct dirent *de;
+    char *file = NULL;
+
+    dir = opendir(test_ctx->cache_dir);
+    if (dir == NULL) {
+        return NULL;
+    }
+
+    while ((de = readdir(dir)) != NULL) {
+        if (strncmp(de->d_name, "rules-", 6) == 0) {
+            file = test_tmpdir_file(test_ctx->cache_dir, de->d_name);
+            break;
+        }
+    }
+
+    closedir(dir);
+    return file;
+}
+
+static void
+write_snapshot(struct snapshot_test_ctx *test_ctx, struct ph_user *user)
+{
+    int ret;
+
+    ret = ph_create_hbac_eval_req(NULL,
+                                  user,
+                                  test_ctx->targethost,
+                                  test_ctx->service,
+                                  NULL,
+                                  TEST_BASEDN,
+                                  &test_ctx->req);
+    assert_int_equal(ret, 0);
+
+    ret = ph_snapshot_write(NULL, &test_ctx->pc, "sshd",
+                            test_ctx->rules, test_ctx->req);
+    assert_int_equal(ret, 0);
+}
+
+static enum hbac_eval_result
+eval_user(struct snapshot_test_ctx *test_ctx, struct ph_user *user)
+{
+    enum hbac_eval_result res;
+
+    hbac_free_info(test_ctx->info);
+    test_ctx->info = NULL;
+
+    res = hbac_evaluate(ph_snapshot_rules(test_ctx->snap),
+                        ph_snapshot_eval_req(test_ctx->snap, user),
+                        &test_ctx->info);
+    assert_non_null(test_ctx->info);
+    return res;
+}
+
+static void
+test_snapshot_evaluate(void **state)
+{
+    struct snapshot_test_ctx *test_ctx = *state;
+    struct ph_user *allowed;
+    struct ph_user *denied;
+    enum hbac_eval_result res;
+
+    allowed = mock_user_obj("tuser", "TGroup", NULL);
+    assert_non_null(allowed);
+    denied = mock_user_obj("otheruser", "othergroup", NULL);
+    assert_non_null(denied);
+
+    write_snapshot(test_ctx, allowed);
+
+    test_ctx->snap = ph_snapshot_open(NULL, &test_ctx->pc, "sshd");
+    assert_non_null(test_ctx->snap);
+
+    res = eval_user(test_ctx, allowed);
+    assert_int_equal(res, HBAC_EVAL_ALLOW);
+    assert_string_equal(test_ctx->info->rule_name, "tgroup_sshd");
+
+    res = eval_user(test_ctx, denied);
+    assert_int_equal(res, HBAC_EVAL_DENY);
+    assert_null(test_ctx->info->rule_name);
+
+    /* A snapshot written for one service must not be used for another */
+    assert_null(ph_snapshot_open(NULL, &test_ctx->pc, "sudo"));
+
+    ph_free_user(allowed);
+    ph_free_user(denied);
+}
+
+static void
+test_snapshot_user_groups(void **state)
+{
+    struct snapshot_test_ctx *test_ctx = *state;
+    struct ph_user *user;
+    const char **groups;
+    int ret;
+
+    user = mock_user_obj("tuser", NULL);
+    assert_non_null(user);
+
+    /* The disabled rule and rules for all users don't reference groups */
+    ret = ph_hbac_rules_user_groups(test_ctx->rules, &groups);
+    assert_int_equal(ret, 0);
+    assert_string_equal(groups[0], "tgroup");
+    assert_null(groups[1]);
+    free(groups);
+
+    write_snapshot(test_ctx, user);
+    test_ctx->snap = ph_snapshot_open(NULL, &test_ctx->pc, "sshd");
+    assert_non_null(test_ctx->snap);
+
+    ret = ph_hbac_rules_user_groups(ph_snapshot_rules(test_ctx->snap),
+                                    &groups);
+    assert_int_equal(ret, 0);
+    assert_string_equal(groups[0], "tgroup");
+    assert_null(groups[1]);
+    free(groups);
+
+    ph_free_user(user);
+}
+
+static void
+assert_same_strings(const char **a, const char **b)
+{
+    size_t i;
+
+    assert_non_null(a);
+    assert_non_null(b);
+
+    for (i = 0; a[i] != NULL; i++) {
+        assert_non_null(b[i]);
+        assert_string_equal(a[i], b[i]);
+    }
+    assert_null(b[i]);
+}
+
+static void
+assert_same_element(struct hbac_rule_element *a, struct hbac_rule_element *b)
+{
+    assert_int_equal(a->category, b->category);
+    assert_same_strings(a->names, b->names);
+    assert_same_strings(a->groups, b->groups);
+}
+
+static void
+test_snapshot_rules(void **state)
+{
+    struct snapshot_test_ctx *test_ctx = *state;
+    struct hbac_rule **rules;
+    struct hbac_eval_req *req;
+    struct ph_user *user;
+    size_t i;
+
+    user = mock_user_obj("tuser", NULL);
+    assert_non_null(user);
+
+    write_snapshot(test_ctx, user);
+    test_ctx->snap = ph_snapshot_open(NULL, &test_ctx->pc, "sshd");
+    assert_non_null(test_ctx->snap);
+
+    /* The views must look exactly like the rules that were written */
+    rules = ph_snapshot_rules(test_ctx->snap);
+    assert_non_null(rules);
+    for (i = 0; test_ctx->rules[i] != NULL; i++) {
+        assert_non_null(rules[i]);
+        assert_string_equal(rules[i]->name, test_ctx->rules[i]->name);
+        assert_int_equal(rules[i]->enabled, test_ctx->rules[i]->enabled);
+        assert_same_element(rules[i]->services, test_ctx->rules[i]->services);
+        assert_same_element(rules[i]->users, test_ctx->rules[i]->users);
+        assert_same_element(rules[i]->targethosts,
+                            test_ctx->rules[i]->targethosts);
+        assert_same_element(rules[i]->srchosts, test_ctx->rules[i]->srchosts);
+    }
+    assert_null(rules[i]);
+
+    req = ph_snapshot_eval_req(test_ctx->snap, user);
+    assert_non_null(req);
+    assert_string_equal(req->user->name, "tuser");
+    assert_null(req->user->groups[0]);
+    assert_string_equal(req->targethost->name,
+                        test_ctx->req->targethost->name);
+    assert_same_strings(test_ctx->req->targethost->groups,
+                        req->targethost->groups);
+    assert_string_equal(req->service->name, test_ctx->req->service->name);
+    assert_same_strings(test_ctx->req->service->groups,
+                        req->service->groups);
+
+    ph_free_user(user);
+}
+
+static void
+test_snapshot_disabled(void **state)
+{
+    struct snapshot_test_ctx *test_ctx = *state;
+    struct ph_user *user;
+    char *file;
+
+    user = mock_user_obj("tuser", NULL);
+    assert_non_null(user);
+
+    test_ctx->pc.rules_cache_ttl = 0;
+    write_snapshot(test_ctx, user);
+
+    file = snapshot_file(test_ctx);
+    assert_null(file);
+    assert_null(ph_snapshot_open(NULL, &test_ctx->pc, "sshd"));
+
+    ph_free_user(user);
+}
+
+static void
+test_snapshot_key_mismatch(void **state)
+{
+    struct snapshot_test_ctx *test_ctx = *state;
+    struct ph_user *user;
+
+    user = mock_user_obj("tuser", NULL);
+    assert_non_null(user);
+
+    write_snapshot(test_ctx, user);
+
+    test_ctx->pc.hostname = discard_const("other.ipa.test");
+    assert_null(ph_snapshot_open(NULL, &test_ctx->pc, "sshd"));
+
+    test_ctx->pc.hostname = discard_const("client.ipa.test");
+    test_ctx->pc.search_base = "dc=other,dc=test";
+    assert_null(ph_snapshot_open(NULL, &test_ctx->pc, "sshd"));
+
+    ph_free_user(user);
+}
+
+static void
+test_snapshot_bad_perms(void **state)
+{
+    struct snapshot_test_ctx *test_ctx = *state;
+    struct ph_user *user;
+    char *file;
+    int ret;
+
+    user = mock_user_obj("tuser", NULL);
+    assert_non_null(user);
+
+    write_snapshot(test_ctx, user);
+
+    file = snapshot_file(test_ctx);
+    assert_non_null(file);
+
+    ret = chmod(file, 0666);
+    assert_int_equal(ret, 0);
+    assert_null(ph_snapshot_open(NULL, &test_ctx->pc, "sshd"));
+
+    ret = chmod(file, 0600);
+    assert_int_equal(ret, 0);
+    test_ctx->snap = ph_snapshot_open(NULL, &test_ctx->pc, "sshd");
+    assert_non_null(test_ctx->snap);
+
+    free(file);
+    ph_free_user(user);
+}
+
+static void
+test_snapshot_truncated(void **state)
+{
+    struct snapshot_test_ctx *test_ctx = *state;
+    struct ph_user *user;
+    struct stat st;
+    char *file;
+    int ret;
+
+    user = mock_user_obj("tuser", NULL);
+    assert_non_null(user);
+
+    write_snapshot(test_ctx, user);
+
+    file = snapshot_file(test_ctx);
+    assert_non_null(file);
+
+    ret = stat(file, &st);
+    assert_int_equal(ret, 0);
+
+    ret = truncate(file, st.st_size - 1);
+    assert_int_equal(ret, 0);
+    assert_null(ph_snapshot_open(NULL, &test_ctx->pc, "sshd"));
+
+    ret = truncate(file, 16);
+    assert_int_equal(ret, 0);
+    assert_null(ph_snapshot_open(NULL, &test_ctx->pc, "sshd"));
+
+    free(file);
+    ph_free_user(user);
+}
+
+int
+main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_snapshot_evaluate,
+                                        test_snapshot_setup,
+                                        test_snapshot_teardown),
+        cmocka_unit_test_setup_teardown(test_snapshot_user_groups,
+                                        test_snapshot_setup,
+                                        test_snapshot_teardown),
+        cmocka_unit_test_setup_teardown(test_snapshot_rules,
+                                        test_snapshot_setup,
+                                        test_snapshot_teardown),
+        cmocka_unit_test_setup_teardown(test_snapshot_disabled,
+                                        test_snapshot_setup,
+                                        test_snapshot_teardown),
+        cmocka_unit_test_setup_teardown(test_snapshot_key_mismatch,
+                                        test_snapshot_setup,
+                                        test_snapshot_teardown),
+        cmocka_unit_test_setup_teardown(test_snapshot_bad_perms,
+                                        test_snapshot_setup,
+                                        test_snapshot_teardown),
+        cmocka_unit_test_setup_teardown(test_snapshot_truncated,
+                                        test_snapshot_setup,
+                                        test_snapshot_teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -15,6 +15,8 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -24,6 +26,11 @@
 #include <cmocka.h>
 
 #include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
 #include "common_mock.h"
 
 void
@@ -43,4 +50,117 @@ assert_string_list_matches(const char *list[],
     }
 }
 
+char *
+test_tmpdir_new(const char *prefix)
+{
+    char *dir;
+
+    if (asprintf(&dir, "%s_XXXXXX", prefix) < 0) {
+        return NULL;
+    }
+
+    if (mkdtemp(dir) == NULL) {
+        free(dir);
+        return NULL;
+    }
+
+    return dir;
+}
+
+char *
+test_tmpdir_file(const char *dir, const char *name)
+{
+    char *path;
+
+    if (asprintf(&path, "%s/%s", dir, name) < 0) {
+        return NULL;
+    }
+
+    return path;
+}
+
+void
+test_tmpdir_free(char *dir)
+{
+    DIR *d;
+    struct dirent *de;
+    char *file;
+
+    if (dir == NULL) {
+        return;
+    }
 
+    d = opendir(dir);
+    if (d != NULL) {
+        while ((de = readdir(d)) != NULL) {
+            if (strcmp(de->d_name, ".") == 0
+                    || strcmp(de->d_name, "..") == 0) {
+                continue;
+            }
+
+            file = test_tmpdir_file(dir, de->d_name);
+            if (file != NULL) {
+                unlink(file);
+                free(file);
+            }
+        }
+        closedir(d);
+    }
+
+    rmdir(dir);
+    free(dir);
+}
+
+pid_t
+hold_lock(const char *path, int *_release)
+{
+    struct flock fl;
+    int locked[2];
+    int release[2];
+    pid_t pid;
+    char c;
+    int fd;
+
+    assert_int_equal(pipe(locked), 0);
+    assert_int_equal(pipe(release), 0);
+
+    pid = fork();
+    assert_true(pid != -1);
+    if (pid == 0) {
+        close(locked[0]);
+        close(release[1]);
+
+        fd = open(path, O_RDWR);
+        memset(&fl, 0, sizeof(fl));
+        fl.l_type = F_WRLCK;
+        fl.l_whence = SEEK_SET;
+        if (fd == -1 || fcntl(fd, F_SETLKW, &fl) == -1) {
+            _exit(1);
+        }
+
+        c = 'l';
+        if (write(locked[1], &c, 1) != 1 || read(release[0], &c, 1) < 0) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+
+    close(locked[1]);
+    close(release[0]);
+    assert_int_equal(read(locked[0], &c, 1), 1);
+    close(locked[0]);
+
+    *_release = release[1];
+    return pid;
+}
+
+void
+release_lock(pid_t pid, int release)
+{
+    int status;
+
+    close(release);
+    assert_int_equal(waitpid(pid, &status, 0), pid);
+    assert_true(WIFEXITED(status));
+    assert_int_equal(WEXITSTATUS(status), 0);
+}